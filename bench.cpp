@@ -0,0 +1,41 @@
+#include <cstdlib>
+#include <new>
+
+#include "bench.hpp"
+
+// the benchmarks are a program of their own, so that only they pay for counting allocations
+// replacing the global operator new is the only way to see the ones made inside the standard library
+// the nothrow forms call these ones by default, and the deletes stay out of line since gcc takes an inlined free for a mismatched one
+auto operator new(const size_t size) -> void* {
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    heap_bytes.fetch_add(size, std::memory_order_relaxed);
+    if(const auto p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+auto operator new[](const size_t size) -> void* {
+    return operator new(size);
+}
+
+[[gnu::noinline]] auto operator delete(void* const p) noexcept -> void {
+    std::free(p);
+}
+
+[[gnu::noinline]] auto operator delete[](void* const p) noexcept -> void {
+    operator delete(p);
+}
+
+[[gnu::noinline]] auto operator delete(void* const p, const size_t size) noexcept -> void {
+    operator delete(p);
+}
+
+[[gnu::noinline]] auto operator delete[](void* const p, const size_t size) noexcept -> void {
+    operator delete(p);
+}
+
+auto main() -> int {
+    bench();
+    return 0;
+}
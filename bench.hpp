@@ -0,0 +1,647 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <thread>
+#include <vector>
+
+#include "encoding.hpp"
+#include "fs/control.hpp"
+#include "fs/drivers/fat/cluster.hpp"
+#include "fs/drivers/fat/entry-scan.hpp"
+#include "fs/drivers/tmp.hpp"
+#include "memory-manager.hpp"
+
+// returns nanoseconds per call
+template <class F>
+inline auto measure(const size_t iterations, F&& fn) -> double {
+    const auto begin = std::chrono::steady_clock::now();
+    for(auto i = size_t(0); i < iterations; i += 1) {
+        fn();
+    }
+    const auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - begin).count() / iterations;
+}
+
+// heap allocations made by the program so far and their bytes, counted by the operator new of bench.cpp
+inline auto heap_allocations = std::atomic<size_t>(0);
+inline auto heap_bytes       = std::atomic<size_t>(0);
+
+// returns heap allocations per call
+template <class F>
+inline auto count_allocations(const size_t iterations, F&& fn) -> double {
+    const auto begin = heap_allocations.load(std::memory_order_relaxed);
+    for(auto i = size_t(0); i < iterations; i += 1) {
+        fn();
+    }
+    return double(heap_allocations.load(std::memory_order_relaxed) - begin) / iterations;
+}
+
+// keeps the compiler from removing benchmarked code
+template <class T>
+inline auto keep(const T& value) -> void {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+inline auto bench_fat_entry_scan() -> void {
+    constexpr auto entries_per_cluster = 128; // 4KiB cluster
+    constexpr auto clusters            = 256;
+
+    // two long name entries per file, with some deleted files
+    auto entries = std::vector<fs::fat::DirectoryEntry>(entries_per_cluster * clusters);
+    for(auto i = size_t(0); i < entries.size(); i += 1) {
+        auto& e = entries[i];
+        std::memcpy(e.name, "FILE    TXT", 11);
+        e.name[7] = '0' + i % 10;
+        e.attr    = i % 3 == 2 ? fs::fat::Attribute::Archive : fs::fat::Attribute::LongName;
+        if(i % 7 == 0) {
+            e.name[0] = 0xE5;
+        }
+    }
+    const auto key = *fs::fat::to_short_name("FILE7.TXT");
+
+    const auto run = [&](const auto& classify, const auto& match) -> double {
+        return measure(200, [&]() {
+            for(auto c = 0; c < clusters; c += 1) {
+                for(auto g = 0; g < entries_per_cluster; g += 64) {
+                    const auto group = entries.data() + c * entries_per_cluster + g;
+                    keep(classify(group));
+                    keep(match(group));
+                }
+            }
+        }) / clusters;
+    };
+    const auto scalar = run(
+        [](const fs::fat::DirectoryEntry* const group) {
+            auto masks = fs::fat::EntryMasks{0, 0, 0, 0};
+            fs::fat::impl::classify_entries_scalar(group, 0, 64, masks);
+            return masks;
+        },
+        [&key](const fs::fat::DirectoryEntry* const group) { return fs::fat::impl::match_short_name_scalar(group, 0, 64, key); });
+    const auto vectorized = run(
+        [](const fs::fat::DirectoryEntry* const group) { return fs::fat::classify_entries(group, 64); },
+        [&key](const fs::fat::DirectoryEntry* const group) { return fs::fat::match_short_name(group, 64, key); });
+
+    printf("fat entry scan(classify + short name match): scalar %.1fns/cluster, %s %.1fns/cluster\n", scalar, simd::has_avx2() ? "avx2" : "sse2", vectorized);
+}
+
+inline auto bench_encoding() -> void {
+    // typical long names, one ascii only and one with a non-ascii tail
+    const auto ascii = std::u16string_view(u"2024-01-01 holiday photos from the beach (edited).jpeg");
+    const auto mixed = std::u16string_view(u"2024-01-01 holiday photos \u5199\u771f\u30d5\u30a9\u30eb\u30c0.jpeg");
+
+    auto       buffer = std::array<char, u8_capacity_for_u16(64)>();
+    const auto run    = [&buffer](const std::u16string_view name) -> double {
+        return measure(1000000, [&]() { keep(u16tou8(name, buffer)); });
+    };
+    printf("u16tou8: ascii %.1fns/name, mixed %.1fns/name\n", run(ascii), run(mixed));
+}
+
+// address arithmetic done for every cluster of a sequential read
+// fat entry location, cluster to sector, and position of the offset in the cluster
+inline auto bench_geometry() -> void {
+    constexpr auto clusters = size_t(64 * 1024);
+
+    // the compiler must not see the sizes, as they come from a volume at runtime
+    auto geometry = fs::fat::make_geometry(512, 8, 32, 16384, size_t(1) << 24);
+    keep(geometry);
+
+    const auto run = [&geometry](const auto shift) -> double {
+        constexpr auto s = decltype(shift)::value;
+        return measure(100, [&]() {
+            for(auto c = size_t(2); c < clusters + 2; c += 1) {
+                const auto offset = c * 4096 + 100;
+                keep(geometry.fat_start + geometry.sector_index<s>(c * 4));
+                keep(geometry.sector_offset<s>(c * 4));
+                keep(geometry.cluster_to_sector<s>(c));
+                keep(geometry.cluster_index<s>(offset));
+                keep(geometry.cluster_offset<s>(offset));
+            }
+        }) / clusters;
+    };
+    printf("cluster geometry: division %.2fns/cluster, shift %.2fns/cluster\n", run(std::false_type()), run(std::true_type()));
+}
+
+// the arena is filled with single frames and every 1024th is freed again,
+// so that a run request skips the whole bitmap and fails
+inline auto bench_frame_allocator() -> void {
+    constexpr auto frames = size_t(256 * 1024); // 1GiB
+
+    auto mm    = BitmapMemoryManager(frames * bytes_per_frame);
+    auto owned = std::vector<FrameID>();
+    for(auto i = size_t(0); i < frames; i += 1) {
+        owned.push_back(mm.allocate(1).as_value());
+    }
+    for(auto i = size_t(0); i < frames; i += 1024) {
+        mm.deallocate(owned[i], 1);
+    }
+
+    const auto single = measure(100000, [&]() {
+        const auto frame = mm.allocate(1).as_value();
+        keep(frame);
+        mm.deallocate(frame, 1);
+    });
+    const auto heap = measure(100000, [&]() {
+        const auto frame = new uint8_t[bytes_per_frame];
+        keep(frame);
+        delete[] frame;
+    });
+    const auto run = measure(100, [&]() { keep(mm.allocate(2)); });
+
+    auto bitmap = std::vector<uint64_t>(frames / 64, ~uint64_t(0));
+    const auto scan = [&bitmap](const auto& find) -> double {
+        return measure(1000, [&]() { keep(find(bitmap.data(), bitmap.size(), ~uint64_t(0))); }) / bitmap.size();
+    };
+    printf("frame allocator: 1 frame %.1fns(new[] %.1fns), failed 2 frame search over 1GiB %.1fus\n", single, heap, run / 1000);
+    printf("bitmap word skip: scalar %.2fns/word, %s %.2fns/word\n", scan(simd::impl::find_not_equal64_scalar), simd::has_avx2() ? "avx2" : "sse2", scan(simd::find_not_equal64));
+}
+
+// every writer fills small files of its own and truncates them again, so that each round trips single frames through the allocator
+inline auto bench_tmpfs_writers() -> void {
+    constexpr auto files  = 256;
+    constexpr auto rounds = 200;
+
+    // returns millions of frames per second
+    const auto run = [](BitmapMemoryManager& mm, const int threads) -> double {
+        const auto saved = allocator;
+        allocator        = &mm;
+
+        const auto begin   = std::chrono::steady_clock::now();
+        auto       workers = std::vector<std::thread>();
+        for(auto t = 0; t < threads; t += 1) {
+            workers.emplace_back([]() {
+                auto small = std::vector<fs::tmp::File>();
+                for(auto i = 0; i < files; i += 1) {
+                    small.emplace_back("bench");
+                }
+                for(auto r = 0; r < rounds; r += 1) {
+                    for(auto& file : small) {
+                        file.resize(bytes_per_frame);
+                        file.write(0, 1, "x");
+                    }
+                    for(auto& file : small) {
+                        file.resize(0);
+                    }
+                }
+            });
+        }
+        for(auto& worker : workers) {
+            worker.join();
+        }
+        const auto end = std::chrono::steady_clock::now();
+
+        allocator         = saved;
+        const auto frames = double(threads) * rounds * files;
+        return frames / std::chrono::duration<double, std::micro>(end - begin).count();
+    };
+
+    for(const auto threads : {1, 2, 4, 8}) {
+        auto cached = BitmapMemoryManager(1_GiB);
+        auto direct = BitmapMemoryManager(1_GiB, false, false);
+        printf("tmpfs writers: %d threads, magazines %.1fM frames/s, bitmap only %.1fM frames/s\n", threads, run(cached, threads), run(direct, threads));
+    }
+}
+
+// large sequential copies, each touching a few extents
+inline auto bench_tmpfs_sequential() -> void {
+    constexpr auto file_bytes  = size_t(256_MiB);
+    constexpr auto chunk_bytes = size_t(1_MiB);
+
+    auto file   = fs::tmp::File("bench");
+    auto buffer = std::vector<uint8_t>(chunk_bytes, 0xAA);
+    file.resize(file_bytes);
+
+    const auto run = [&](const auto& fn) -> double {
+        const auto ns = measure(4, [&]() {
+            for(auto offset = size_t(0); offset < file_bytes; offset += chunk_bytes) {
+                fn(offset);
+            }
+        });
+        return double(file_bytes) / ns;
+    };
+    const auto write = run([&](const size_t offset) { file.write(offset, chunk_bytes, buffer.data()); });
+    const auto read  = run([&](const size_t offset) { file.read(offset, chunk_bytes, buffer.data()); });
+    printf("tmpfs sequential: %lu extents for 256MiB, write %.1fGB/s, read %.1fGB/s\n", file.get_extent_count(), write, read);
+}
+
+// many tiny files written and read back once, memory is the file object plus what the frame allocator and the heap report
+inline auto bench_tmpfs_small_files() -> void {
+    constexpr auto files = 100000;
+
+    const auto text = std::string_view("{\"pid\": 12345, \"owner\": \"scheduler\"}");
+    const auto run  = [&text](const size_t inline_limit) -> std::pair<double, double> {
+        auto       mm    = BitmapMemoryManager(1_GiB);
+        const auto saved = allocator;
+        allocator        = &mm;
+
+        auto small  = std::vector<fs::tmp::File>();
+        auto buffer = std::array<uint8_t, 64>();
+        small.reserve(files);
+        const auto heap  = heap_bytes.load(std::memory_order_relaxed);
+        const auto begin = std::chrono::steady_clock::now();
+        for(auto i = 0; i < files; i += 1) {
+            auto& file = small.emplace_back("lock", inline_limit);
+            file.resize(text.size());
+            file.write(0, text.size(), text.data());
+            file.read(0, text.size(), buffer.data());
+            keep(buffer);
+        }
+        const auto end = std::chrono::steady_clock::now();
+
+        const auto bytes = sizeof(fs::tmp::File) + double(mm.get_statistics().used_frames * bytes_per_frame + heap_bytes.load(std::memory_order_relaxed) - heap) / files;
+        small.clear();
+        allocator = saved;
+        return {std::chrono::duration<double, std::nano>(end - begin).count() / files, bytes};
+    };
+
+    const auto [inline_ns, inline_bytes] = run(fs::tmp::default_inline_limit);
+    const auto [framed_ns, framed_bytes] = run(0);
+    printf("tmpfs small files: inline %.0fns %.0fB/file, framed %.0fns %.0fB/file\n", inline_ns, inline_bytes, framed_ns, framed_bytes);
+}
+
+// a clone against a full copy through a buffer, then a sparse write to every 1MiB of the clone
+inline auto bench_tmpfs_clone() -> void {
+    constexpr auto file_bytes  = size_t(512_MiB);
+    constexpr auto chunk_bytes = size_t(1_MiB);
+
+    auto source = fs::tmp::File("source");
+    auto buffer = std::vector<uint8_t>(chunk_bytes, 0xAA);
+    source.resize(file_bytes);
+    for(auto offset = size_t(0); offset < file_bytes; offset += chunk_bytes) {
+        source.write(offset, chunk_bytes, buffer.data());
+    }
+
+    const auto used = allocator->get_statistics().used_frames;
+    auto       copy = fs::tmp::File("copy");
+    const auto full = measure(1, [&]() {
+        copy.resize(file_bytes);
+        for(auto offset = size_t(0); offset < file_bytes; offset += chunk_bytes) {
+            source.read(offset, chunk_bytes, buffer.data());
+            copy.write(offset, chunk_bytes, buffer.data());
+        }
+    });
+    copy.resize(0);
+
+    auto       clone  = fs::tmp::File("clone");
+    const auto cloned = measure(1, [&]() { clone.clone_from(source); });
+    const auto cow    = measure(1, [&]() {
+        for(auto offset = size_t(0); offset < file_bytes; offset += chunk_bytes) {
+            clone.write(offset, 1, "x");
+        }
+    });
+    const auto grown = allocator->get_statistics().used_frames - used;
+    printf("tmpfs clone: 512MiB copy %.1fms, clone %.3fms, 512 cow writes %.2fms, %lu frames added\n", full / 1e6, cloned / 1e6, cow / 1e6, grown);
+}
+
+// packs a whole file of text, then compares reads of resident frames with reads which decompress one
+inline auto bench_tmpfs_compression() -> void {
+    constexpr auto file_bytes = size_t(64_MiB);
+    constexpr auto words      = std::array{"frame ", "extent ", "file ", "directory ", "the ", "of ", "and ", "mount ", "driver ", "cluster ", "read ", "write "};
+
+    auto text = std::vector<uint8_t>();
+    auto seed = uint32_t(1);
+    while(text.size() < file_bytes) {
+        seed            = seed * 1103515245 + 12345;
+        const auto word = std::string_view(words[(seed >> 16) % words.size()]);
+        text.insert(text.end(), word.begin(), word.end());
+    }
+
+    auto pool = fs::tmp::Pool();
+    auto file = fs::tmp::File("file", fs::tmp::default_inline_limit, &pool);
+    file.resize(file_bytes);
+    file.write(0, file_bytes, text.data());
+
+    const auto pack_all = [&file]() {
+        auto offsets = std::vector<size_t>();
+        file.for_each_packable([&offsets](const size_t offset, uint64_t) { offsets.push_back(offset); });
+        for(const auto offset : offsets) {
+            file.pack(offset);
+        }
+    };
+    const auto packing = measure(1, pack_all);
+    const auto ratio   = double(pool.packed_frames * bytes_per_frame) / pool.packed_bytes;
+
+    constexpr auto reads        = size_t(1024);
+    auto           buffer       = std::array<uint8_t, 64>();
+    const auto     random_reads = [&]() {
+        for(auto i = size_t(0); i < reads; i += 1) {
+            seed = seed * 1103515245 + 12345;
+            file.read(size_t(seed % (file_bytes / bytes_per_frame)) * bytes_per_frame, buffer.size(), buffer.data());
+        }
+    };
+    const auto cold = measure(1, random_reads) / reads;
+    file.read(0, file_bytes, text.data());
+    const auto hot = measure(1, random_reads) / reads;
+    printf("tmpfs compression: ratio %.2f, packing %.0fMiB/s, hot read %.0fns, cold read %.0fns\n", ratio, file_bytes / (packing / 1e9) / 1_MiB, hot, cold);
+}
+
+// a tree of many files rebuilt by writing every file again against one restored from a snapshot image
+// restoring reads only the tree, so the first read of a file pays for the pages it touches
+inline auto bench_tmpfs_snapshot() -> void {
+    constexpr auto files      = 1024;
+    constexpr auto file_bytes = size_t(256_KiB);
+
+    const auto path = (std::filesystem::temp_directory_path() / "klee-tmpfs-bench").string();
+    auto       data = std::vector<uint8_t>(file_bytes, 0xAA);
+    const auto fill = [&](fs::Controller& controller) {
+        auto dir = controller.open("/", fs::OpenMode::Write).as_value();
+        for(auto i = 0; i < files; i += 1) {
+            dir.create("file" + std::to_string(i), fs::FileType::Regular);
+        }
+        controller.close(dir);
+        for(auto i = 0; i < files; i += 1) {
+            auto file = controller.open("/file" + std::to_string(i), fs::OpenMode::Write).as_value();
+            file.write(0, file_bytes, data.data());
+            controller.close(file);
+        }
+    };
+
+    auto controller = fs::Controller();
+    auto tmpfs      = fs::tmp::new_driver();
+    controller.mount("/", tmpfs);
+    const auto replay   = measure(1, [&]() { fill(controller); });
+    const auto snapshot = measure(1, [&]() { tmpfs.snapshot(path); });
+
+    auto       target   = fs::Controller();
+    auto       restored = fs::tmp::new_driver();
+    const auto restore  = measure(1, [&]() { restored.restore(path); });
+    target.mount("/", restored);
+    const auto first_read = measure(1, [&]() {
+        auto file = target.open("/file" + std::to_string(files / 2), fs::OpenMode::Read).as_value();
+        file.read(0, file_bytes, data.data());
+        target.close(file);
+    });
+    std::filesystem::remove(path);
+    printf("tmpfs snapshot: %luMiB in %d files, replay %.1fms, snapshot %.1fms, restore %.2fms, first read of a file %.1fus\n",
+           size_t(files * file_bytes / 1_MiB), files, replay / 1e6, snapshot / 1e6, restore / 1e6, first_read / 1e3);
+}
+
+// open and close of a file 8 directories deep, the lookups of which stay in the dentry cache, and of a missing one
+inline auto bench_dentry_cache() -> void {
+    const auto run = [](const size_t capacity) -> std::pair<double, double> {
+        auto controller = fs::Controller(capacity);
+        auto tmpfs      = fs::tmp::new_driver();
+        controller.mount("/", tmpfs);
+        auto path = std::string();
+        for(auto i = 0; i < 8; i += 1) {
+            auto dir = controller.open(path.empty() ? "/" : path, fs::OpenMode::Write).as_value();
+            dir.create("directory", fs::FileType::Directory);
+            controller.close(dir);
+            path += "/directory";
+        }
+        auto dir = controller.open(path, fs::OpenMode::Write).as_value();
+        dir.create("file", fs::FileType::Regular);
+        controller.close(dir);
+
+        const auto file    = path + "/file";
+        const auto missing = path + "/missing";
+        const auto hit     = measure(100000, [&]() { controller.close(controller.open(file, fs::OpenMode::Read).as_value()); });
+        const auto miss    = measure(100000, [&]() { keep(controller.open(missing, fs::OpenMode::Read)); });
+        return {hit, miss};
+    };
+    const auto [cached_hit, cached_miss]     = run(fs::DentryCache::default_capacity);
+    const auto [uncached_hit, uncached_miss] = run(0);
+    printf("dentry cache: open depth 9 %.0fns(uncached %.0fns), missing %.0fns(uncached %.0fns)\n", cached_hit, uncached_hit, cached_miss, uncached_miss);
+}
+
+// open and close of a file 9 levels deep with long names, while another handle keeps the path open and once it is only in the dentry cache
+inline auto bench_path_walk() -> void {
+    constexpr auto iterations = 100000;
+
+    auto controller = fs::Controller();
+    auto tmpfs      = fs::tmp::new_driver();
+    controller.mount("/", tmpfs);
+    auto path = std::string();
+    for(auto i = 0; i < 8; i += 1) {
+        auto dir = controller.open(path.empty() ? "/" : path, fs::OpenMode::Write).as_value();
+        dir.create("directory-with-a-long-name", fs::FileType::Directory);
+        controller.close(dir);
+        path += "/directory-with-a-long-name";
+    }
+    auto dir = controller.open(path, fs::OpenMode::Write).as_value();
+    dir.create("file-with-a-long-name", fs::FileType::Regular);
+    controller.close(dir);
+    const auto file      = path + "/file-with-a-long-name";
+    const auto open_file = [&]() { controller.close(controller.open(file, fs::OpenMode::Read).as_value()); };
+
+    open_file();
+    const auto cached_ns     = measure(iterations, open_file);
+    const auto cached_allocs = count_allocations(iterations, open_file);
+
+    const auto held        = controller.open(file, fs::OpenMode::Read).as_value();
+    const auto open_ns     = measure(iterations, open_file);
+    const auto open_allocs = count_allocations(iterations, open_file);
+    controller.close(held);
+    printf("path walk: open depth 9 %.0fns %.1f allocations(not open %.0fns %.1f allocations)\n", open_ns, open_allocs, cached_ns, cached_allocs);
+}
+
+// files of one directory opened all at once and closed again, and the heap bytes taken while they are open
+inline auto bench_open_tree() -> void {
+    constexpr auto files  = 10000;
+    constexpr auto rounds = 20;
+
+    auto controller = fs::Controller();
+    auto tmpfs      = fs::tmp::new_driver();
+    controller.mount("/", tmpfs);
+    auto dir = controller.open("/", fs::OpenMode::Write).as_value();
+    dir.create("dir", fs::FileType::Directory);
+    controller.close(dir);
+    dir = controller.open("/dir", fs::OpenMode::Write).as_value();
+    auto paths = std::vector<std::string>();
+    for(auto i = 0; i < files; i += 1) {
+        dir.create(std::to_string(i), fs::FileType::Regular);
+        paths.push_back("/dir/" + std::to_string(i));
+    }
+    controller.close(dir);
+
+    auto       handles = std::vector<fs::Handle>();
+    auto       bytes   = size_t(0);
+    const auto ns      = measure(rounds, [&]() {
+        handles.clear();
+        const auto begin = heap_bytes.load(std::memory_order_relaxed);
+        for(const auto& path : paths) {
+            handles.push_back(controller.open(path, fs::OpenMode::Read).as_value());
+        }
+        bytes = heap_bytes.load(std::memory_order_relaxed) - begin;
+        for(const auto& handle : handles) {
+            controller.close(handle);
+        }
+    });
+    printf("open tree: %d files open and close %.0fns per file, %lu heap bytes per open file\n", files, ns / files, bytes / files);
+}
+
+// open and close of files 3 levels deep from several threads, each in a directory of its own and all on one file
+inline auto bench_controller_threads() -> void {
+    constexpr auto iterations = 200000;
+
+    const auto max_threads = std::max(4u, std::thread::hardware_concurrency());
+    auto       controller  = fs::Controller();
+    auto       tmpfs       = fs::tmp::new_driver();
+    controller.mount("/", tmpfs);
+    auto dir = controller.open("/", fs::OpenMode::Write).as_value();
+    dir.create("bench", fs::FileType::Directory);
+    controller.close(dir);
+    dir = controller.open("/bench", fs::OpenMode::Write).as_value();
+    for(auto t = 0u; t < max_threads; t += 1) {
+        dir.create(std::to_string(t), fs::FileType::Directory);
+    }
+    controller.close(dir);
+    for(auto t = 0u; t < max_threads; t += 1) {
+        dir = controller.open("/bench/" + std::to_string(t), fs::OpenMode::Write).as_value();
+        dir.create("file", fs::FileType::Regular);
+        controller.close(dir);
+    }
+
+    // returns millions of opens per second, the files are kept open by the main thread so that every open takes the fast path
+    const auto run = [&controller](const unsigned threads, const bool same) -> double {
+        auto held  = std::vector<fs::Handle>();
+        auto paths = std::vector<std::string>();
+        for(auto t = 0u; t < threads; t += 1) {
+            paths.push_back("/bench/" + std::to_string(same ? 0 : t) + "/file");
+            held.push_back(controller.open(paths.back(), fs::OpenMode::Read).as_value());
+        }
+        const auto begin   = std::chrono::steady_clock::now();
+        auto       workers = std::vector<std::thread>();
+        for(auto t = 0u; t < threads; t += 1) {
+            workers.emplace_back([&controller, &path = paths[t]]() {
+                for(auto i = 0; i < iterations; i += 1) {
+                    controller.close(controller.open(path, fs::OpenMode::Read).as_value());
+                }
+            });
+        }
+        for(auto& worker : workers) {
+            worker.join();
+        }
+        const auto end = std::chrono::steady_clock::now();
+        for(const auto& handle : held) {
+            controller.close(handle);
+        }
+        return double(threads) * iterations / std::chrono::duration<double, std::micro>(end - begin).count();
+    };
+    // returns millions of creates and removes per second, in directories and under names of each thread's own, so that the threads only meet in the name table
+    const auto churn = [&controller](const unsigned threads) -> double {
+        const auto begin   = std::chrono::steady_clock::now();
+        auto       workers = std::vector<std::thread>();
+        for(auto t = 0u; t < threads; t += 1) {
+            workers.emplace_back([&controller, t]() {
+                const auto name = "churn" + std::to_string(t);
+                auto       dir  = controller.open("/bench/" + std::to_string(t), fs::OpenMode::Write).as_value();
+                for(auto i = 0; i < iterations; i += 1) {
+                    dir.create(name, fs::FileType::Regular);
+                    dir.remove(name);
+                }
+                controller.close(dir);
+            });
+        }
+        for(auto& worker : workers) {
+            worker.join();
+        }
+        const auto end = std::chrono::steady_clock::now();
+        return double(threads) * iterations / std::chrono::duration<double, std::micro>(end - begin).count();
+    };
+    for(auto threads = 1u; threads <= max_threads; threads *= 2) {
+        printf("controller threads: %u threads, own directories %.2fM opens/s, one file %.2fM opens/s, own names %.2fM creates and removes/s\n",
+               threads, run(threads, false), run(threads, true), churn(threads));
+    }
+}
+
+// copies of one dataset loaded side by side, each with a few bytes of its own, with and without dedup
+inline auto bench_tmpfs_dedup() -> void {
+    constexpr auto copies     = 8;
+    constexpr auto file_bytes = size_t(32_MiB);
+
+    auto data = std::vector<uint8_t>(file_bytes);
+    auto seed = uint32_t(1);
+    for(auto& b : data) {
+        seed = seed * 1103515245 + 12345;
+        b    = seed >> 24;
+    }
+
+    // returns write throughput in GB/s and frames in use
+    const auto run = [&data](const bool dedup) -> std::pair<double, size_t> {
+        auto       mm    = BitmapMemoryManager(1_GiB);
+        const auto saved = allocator;
+        allocator        = &mm;
+
+        auto pool  = fs::tmp::Pool();
+        auto table = fs::tmp::ContentTable();
+        auto files = std::vector<fs::tmp::File>();
+        pool.contents = dedup ? &table : nullptr;
+        for(auto i = 0; i < copies; i += 1) {
+            files.emplace_back("copy", fs::tmp::default_inline_limit, &pool);
+        }
+        const auto ns = measure(1, [&]() {
+            for(auto i = 0; i < copies; i += 1) {
+                auto& file = files[i];
+                file.resize(file_bytes);
+                for(auto offset = size_t(0); offset < file_bytes; offset += 1_MiB) {
+                    file.write(offset, 1_MiB, data.data() + offset);
+                }
+                file.write(size_t(i) * 1_MiB, 4, "copy");
+            }
+        });
+        mm.trim();
+        const auto frames = mm.get_statistics().used_frames;
+        files.clear();
+        allocator = saved;
+        return {double(copies * file_bytes) / ns, frames};
+    };
+
+    const auto [plain_speed, plain_frames] = run(false);
+    const auto [dedup_speed, dedup_frames] = run(true);
+    printf("tmpfs dedup: %d copies of 32MiB, plain %.2fGB/s %luMiB, dedup %.2fGB/s %luMiB\n",
+           copies, plain_speed, size_t(plain_frames * bytes_per_frame / 1_MiB), dedup_speed, size_t(dedup_frames * bytes_per_frame / 1_MiB));
+}
+
+// listing cost per entry should not depend on the directory size
+inline auto bench_tmpfs_listing() -> void {
+    for(const auto count : {10000, 100000, 1000000}) {
+        auto dir = fs::tmp::Directory("dir");
+        for(auto i = 0; i < count; i += 1) {
+            dir.create<fs::tmp::File>("file" + std::to_string(i));
+        }
+        // a tenth removed, so that the listing steps over tombstones
+        for(auto i = 0; i < count; i += 10) {
+            dir.remove("file" + std::to_string(i));
+        }
+
+        const auto ns = measure(3, [&dir]() {
+            auto cursor = fs::DirectoryCursor();
+            auto seen   = size_t(0);
+            while(!cursor.end) {
+                auto batch = size_t(0);
+                dir.list(cursor, [&batch](const auto& child) {
+                    if(batch == 256) {
+                        return false;
+                    }
+                    keep(child);
+                    batch += 1;
+                    return true;
+                });
+                seen += batch;
+            }
+            keep(seen);
+        });
+        printf("tmpfs listing: %d entries, %.1fns/entry\n", count, ns / dir.get_child_count());
+    }
+}
+
+inline auto bench() -> void {
+    bench_fat_entry_scan();
+    bench_encoding();
+    bench_geometry();
+    bench_frame_allocator();
+    bench_tmpfs_writers();
+    bench_tmpfs_sequential();
+    bench_tmpfs_small_files();
+    bench_tmpfs_listing();
+    bench_tmpfs_clone();
+    bench_tmpfs_compression();
+    bench_tmpfs_snapshot();
+    bench_tmpfs_dedup();
+    bench_dentry_cache();
+    bench_path_walk();
+    bench_open_tree();
+    bench_controller_threads();
+}
@@ -7,6 +7,7 @@ namespace block {
 struct DeviceInfo {
     size_t bytes_per_sector;
     size_t total_sectors;
+    bool   concurrent_reads = false; // read_sector may be called from several threads at once
 };
 
 class BlockDevice {
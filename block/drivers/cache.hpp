@@ -1,5 +1,8 @@
 #pragma once
 #include <concepts>
+#include <cstdint>
+#include <cstring>
+#include <memory>
 #include <unordered_map>
 
 #include "../../macro.hpp"
@@ -13,8 +16,8 @@ template <Parent P>
 class Device : public BlockDevice {
   private:
     struct SectorCache {
-        bool                     dirty = false;
-        std::unique_ptr<uint8_t> data;
+        bool                       dirty = false;
+        std::unique_ptr<uint8_t[]> data;
 
         SectorCache(const size_t sector_size) {
             data.reset(new uint8_t[sector_size]);
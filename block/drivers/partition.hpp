@@ -9,10 +9,11 @@ class PartitionBlockDevice : public BlockDevice {
     size_t first_sector;
     size_t sector_size;
     size_t total_sectors;
+    bool   concurrent_reads;
 
   public:
     auto get_info() -> DeviceInfo override {
-        return DeviceInfo{sector_size, total_sectors};
+        return DeviceInfo{sector_size, total_sectors, concurrent_reads};
     }
 
     auto read_sector(const size_t sector, const size_t count, void* const buffer) -> Error override {
@@ -26,6 +27,7 @@ class PartitionBlockDevice : public BlockDevice {
     PartitionBlockDevice(BlockDevice& parent, const size_t first_sector, const size_t total_sectors) : parent(&parent),
                                                                                                        first_sector(first_sector),
                                                                                                        sector_size(parent.get_info().bytes_per_sector),
-                                                                                                       total_sectors(total_sectors) {}
+                                                                                                       total_sectors(total_sectors),
+                                                                                                       concurrent_reads(parent.get_info().concurrent_reads) {}
 };
 } // namespace block::partition
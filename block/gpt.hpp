@@ -43,8 +43,9 @@ struct GUID {
 } __attribute__((packed));
 
 namespace partition_type {
-constexpr auto esp = GUID{0xC12A7328, 0xF81F, 0x11D2, {0xBA, 0x4B, 0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B}};
-}
+constexpr auto esp        = GUID{0xC12A7328, 0xF81F, 0x11D2, {0xBA, 0x4B, 0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B}};
+constexpr auto basic_data = GUID{0xEBD0A0A2, 0xB9E5, 0x4433, {0x87, 0xC0, 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7}}; // fat, exfat or ntfs
+} // namespace partition_type
 
 struct PartitionTableHeader {
     char     signature[8];
@@ -71,10 +72,18 @@ struct PartitionEntry {
     uint64_t attribute;
     char16_t name[36];
 
-    auto get_u8name() const -> std::array<char, 36> {
-        auto buffer = std::array<char, 36>();
-        auto u8     = u16tou8(name);
-        std::memcpy(buffer.data(), u8.data(), buffer.size());
+    // null terminated
+    auto get_u8name() const -> std::array<char, u8_capacity_for_u16(36) + 1> {
+        // name is not aligned in a packed struct
+        auto u16 = std::array<char16_t, 36>();
+        std::memcpy(u16.data(), name, sizeof(name));
+        auto len = size_t(0);
+        while(len < u16.size() && u16[len] != u'\0') {
+            len += 1;
+        }
+
+        auto buffer = std::array<char, u8_capacity_for_u16(36) + 1>();
+        buffer[*u16tou8(std::u16string_view(u16.data(), len), std::span(buffer.data(), buffer.size() - 1))] = '\0';
         return buffer;
     }
 } __attribute__((packed));
@@ -82,6 +91,7 @@ struct PartitionEntry {
 enum class Filesystem {
     Unknown,
     FAT32,
+    exFAT,
 };
 
 struct Partition {
@@ -89,6 +99,22 @@ struct Partition {
     std::unique_ptr<BlockDevice> device;
 };
 
+// basic data partitions do not tell the filesystem, look at the boot sector
+inline auto probe_filesystem(BlockDevice& device) -> Filesystem {
+    auto buffer = std::vector<uint8_t>(device.get_info().bytes_per_sector);
+    if(device.read_sector(0, 1, buffer.data()) || buffer.size() < 512 || buffer[510] != 0x55 || buffer[511] != 0xAA) {
+        return Filesystem::Unknown;
+    }
+    const auto data = reinterpret_cast<const char*>(buffer.data());
+    if(std::string_view(data + 3, 8) == "EXFAT   ") {
+        return Filesystem::exFAT;
+    }
+    if(std::string_view(data + 82, 8) == "FAT32   ") {
+        return Filesystem::FAT32;
+    }
+    return Filesystem::Unknown;
+}
+
 inline auto find_partitions(BlockDevice& device) -> Result<std::vector<Partition>> {
     auto info   = device.get_info();
     auto buffer = std::vector<uint8_t>(info.bytes_per_sector);
@@ -123,11 +149,13 @@ inline auto find_partitions(BlockDevice& device) -> Result<std::vector<Partition
         if(entry.type == GUID{0, 0}) {
             continue;
         }
-        auto fs = Filesystem::Unknown;
+        auto dev = new block::partition::PartitionBlockDevice(device, entry.lba_start, entry.lba_last - entry.lba_start + 1);
+        auto fs  = Filesystem::Unknown;
         if(entry.type == partition_type::esp) {
             fs = Filesystem::FAT32;
+        } else if(entry.type == partition_type::basic_data) {
+            fs = probe_filesystem(*dev);
         }
-        auto dev = new block::partition::PartitionBlockDevice(device, entry.lba_start, entry.lba_last - entry.lba_start + 1);
         result.emplace_back(Partition{fs, std::unique_ptr<block::partition::PartitionBlockDevice>(dev)});
     }
     return result;
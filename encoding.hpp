@@ -1,13 +1,213 @@
 #pragma once
+#include <array>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <string>
 #include <string_view>
-#include <vector>
 
-inline auto u16tou8(const std::u16string_view str) -> std::vector<char> {
-    // TODO
-    // proper encoding conversion
-    auto buffer = std::vector<char>(str.size() / 2);
-    for(auto i = 0; i < str.size(); i += 1) {
-        buffer[i] = str[i];
+#include "simd.hpp"
+
+// upper bound of the converted size, a surrogate pair(2 units) never exceeds 4 bytes
+constexpr auto u8_capacity_for_u16(const size_t units) -> size_t {
+    return units * 3;
+}
+
+constexpr auto u16_capacity_for_u8(const size_t bytes) -> size_t {
+    return bytes;
+}
+
+namespace encoding {
+constexpr auto replacement_character = char32_t(0xFFFD);
+
+inline auto is_high_surrogate(const char16_t c) -> bool {
+    return c >= 0xD800 && c <= 0xDBFF;
+}
+
+inline auto is_low_surrogate(const char16_t c) -> bool {
+    return c >= 0xDC00 && c <= 0xDFFF;
+}
+
+// returns the number of bytes written
+inline auto put_u8(const char32_t c, char* const out) -> size_t {
+    if(c < 0x80) {
+        out[0] = c;
+        return 1;
+    } else if(c < 0x800) {
+        out[0] = 0xC0 | (c >> 6);
+        out[1] = 0x80 | (c & 0x3F);
+        return 2;
+    } else if(c < 0x10000) {
+        out[0] = 0xE0 | (c >> 12);
+        out[1] = 0x80 | ((c >> 6) & 0x3F);
+        out[2] = 0x80 | (c & 0x3F);
+        return 3;
+    } else {
+        out[0] = 0xF0 | (c >> 18);
+        out[1] = 0x80 | ((c >> 12) & 0x3F);
+        out[2] = 0x80 | ((c >> 6) & 0x3F);
+        out[3] = 0x80 | (c & 0x3F);
+        return 4;
+    }
+}
+
+// ascii fast paths
+// convert as many leading ascii characters as possible in blocks and return the count
+#if defined(__x86_64__)
+inline auto narrow_ascii_sse2(const char16_t* const src, const size_t len, char* const dest) -> size_t {
+    const auto mask = _mm_set1_epi16(static_cast<short>(0xFF80));
+    auto       i    = size_t(0);
+    for(; i + 16 <= len; i += 16) {
+        const auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        const auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 8));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(_mm_or_si128(a, b), mask), _mm_setzero_si128())) != 0xFFFF) {
+            break;
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), _mm_packus_epi16(a, b));
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) inline auto narrow_ascii_avx2(const char16_t* const src, const size_t len, char* const dest) -> size_t {
+    const auto mask = _mm256_set1_epi16(static_cast<short>(0xFF80));
+    auto       i    = size_t(0);
+    for(; i + 32 <= len; i += 32) {
+        const auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        const auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 16));
+        if(!_mm256_testz_si256(_mm256_or_si256(a, b), mask)) {
+            break;
+        }
+        // packus works per 128 bit lane, restore the order afterwards
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0b11011000));
+    }
+    return i;
+}
+
+inline auto widen_ascii_sse2(const char* const src, const size_t len, char16_t* const dest) -> size_t {
+    auto i = size_t(0);
+    for(; i + 16 <= len; i += 16) {
+        const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        if(_mm_movemask_epi8(v) != 0) {
+            break;
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), _mm_unpacklo_epi8(v, _mm_setzero_si128()));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i + 8), _mm_unpackhi_epi8(v, _mm_setzero_si128()));
     }
+    return i;
+}
+#endif
+
+inline auto narrow_ascii(const char16_t* const src, const size_t len, char* const dest) -> size_t {
+#if defined(__x86_64__)
+    const auto done = simd::has_avx2() ? narrow_ascii_avx2(src, len, dest) : size_t(0);
+    return done + narrow_ascii_sse2(src + done, len - done, dest + done);
+#else
+    return 0;
+#endif
+}
+
+inline auto widen_ascii(const char* const src, const size_t len, char16_t* const dest) -> size_t {
+#if defined(__x86_64__)
+    return widen_ascii_sse2(src, len, dest);
+#else
+    return 0;
+#endif
+}
+} // namespace encoding
+
+// converts str into buffer and returns the number of bytes written
+// unpaired surrogates are replaced with U+FFFD
+// returns nullopt if buffer is too small, u8_capacity_for_u16(str.size()) bytes are always enough
+inline auto u16tou8(const std::u16string_view str, const std::span<char> buffer) -> std::optional<size_t> {
+    using namespace encoding;
+
+    auto src  = size_t(0);
+    auto dest = size_t(0);
+    while(src < str.size()) {
+        // fast path is taken only when the output surely fits
+        if(const auto fits = std::min(str.size() - src, buffer.size() - dest); fits >= 16 && str[src] < 0x80) {
+            const auto done = narrow_ascii(str.data() + src, fits, buffer.data() + dest);
+            src += done;
+            dest += done;
+            if(src == str.size()) {
+                break;
+            }
+        }
+
+        auto c = char32_t(str[src]);
+        src += 1;
+        if(is_high_surrogate(c) && src < str.size() && is_low_surrogate(str[src])) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (str[src] - 0xDC00);
+            src += 1;
+        } else if(is_high_surrogate(c) || is_low_surrogate(c)) {
+            c = replacement_character;
+        }
+
+        auto       encoded = std::array<char, 4>();
+        const auto len     = put_u8(c, encoded.data());
+        if(buffer.size() - dest < len) {
+            return std::nullopt;
+        }
+        std::memcpy(buffer.data() + dest, encoded.data(), len);
+        dest += len;
+    }
+    return dest;
+}
+
+inline auto u16tou8(const std::u16string_view str) -> std::string {
+    auto buffer = std::string(u8_capacity_for_u16(str.size()), '\0');
+    buffer.resize(*u16tou8(str, buffer));
     return buffer;
 }
+
+// converts str into buffer and returns the number of units written
+// malformed sequences are replaced with U+FFFD
+// returns nullopt if buffer is too small, u16_capacity_for_u8(str.size()) units are always enough
+inline auto u8tou16(const std::string_view str, const std::span<char16_t> buffer) -> std::optional<size_t> {
+    using namespace encoding;
+
+    auto src  = size_t(0);
+    auto dest = size_t(0);
+    while(src < str.size()) {
+        if(const auto fits = std::min(str.size() - src, buffer.size() - dest); fits >= 16 && static_cast<uint8_t>(str[src]) < 0x80) {
+            const auto done = widen_ascii(str.data() + src, fits, buffer.data() + dest);
+            src += done;
+            dest += done;
+            if(src == str.size()) {
+                break;
+            }
+        }
+
+        const auto lead   = static_cast<uint8_t>(str[src]);
+        const auto length = lead < 0x80 ? 1 : (lead >> 5) == 0x06 ? 2 : (lead >> 4) == 0x0E ? 3 : (lead >> 3) == 0x1E ? 4 : 0;
+        auto       c      = char32_t(length == 1 ? lead : length == 2 ? lead & 0x1F : length == 3 ? lead & 0x0F : lead & 0x07);
+        auto       valid  = length != 0 && src + length <= str.size();
+        for(auto i = 1; valid && i < length; i += 1) {
+            const auto trail = static_cast<uint8_t>(str[src + i]);
+            valid            = (trail & 0xC0) == 0x80;
+            c                = (c << 6) | (trail & 0x3F);
+        }
+        // reject overlong forms, surrogates and out of range values
+        constexpr auto minimum = std::array<char32_t, 5>{0, 0, 0x80, 0x800, 0x10000};
+        if(valid && (c < minimum[length] || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))) {
+            valid = false;
+        }
+        src += valid ? length : 1;
+        if(!valid) {
+            c = replacement_character;
+        }
+
+        const auto units = c >= 0x10000 ? 2 : 1;
+        if(buffer.size() - dest < size_t(units)) {
+            return std::nullopt;
+        }
+        if(units == 2) {
+            buffer[dest]     = 0xD800 + ((c - 0x10000) >> 10);
+            buffer[dest + 1] = 0xDC00 + ((c - 0x10000) & 0x3FF);
+        } else {
+            buffer[dest] = c;
+        }
+        dest += units;
+    }
+    return dest;
+}
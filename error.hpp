@@ -8,6 +8,7 @@ class Error {
         IndexOutOfRange,
         NotImplemented,
         BadChecksum,
+        BufferTooSmall,
         // filesystem
         IOError,
         InvalidData,
@@ -22,12 +23,16 @@ class Error {
         VolumeBusy,
         NotMounted,
         EndOfFile,
+        CrossDevice,
         // FAT
         NotFAT,
+        NotExFAT,
         // block
         NotMBR,
         NotGPT,
         UnsupportedGPT,
+        // memory
+        OutOfMemory,
     };
 
   private:
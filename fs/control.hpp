@@ -1,41 +1,104 @@
 #pragma once
+#include <thread>
+
 #include "../path.hpp"
+#include "../slab.hpp"
+#include "dentry.hpp"
 #include "drivers/basic.hpp"
 #include "drivers/tmp.hpp"
 
 namespace fs {
+// the nodes of a controller, shared by every thread opening through it
+class NodeSlab {
+  private:
+    mutable std::mutex mutex;
+    Slab<OpenInfo>     slab;
+
+  public:
+    auto create(OpenInfo&& info) -> OpenInfo* {
+        const auto lock = std::lock_guard(mutex);
+        return slab.create(std::move(info));
+    }
+
+    auto destroy(OpenInfo* const node) -> void {
+        const auto lock = std::lock_guard(mutex);
+        slab.destroy(node);
+    }
+
+    auto get_live_count() const -> size_t {
+        const auto lock = std::lock_guard(mutex);
+        return slab.get_live_count();
+    }
+};
+
 enum class OpenMode {
     Read,
     Write,
 };
 
-inline auto follow_mountpoints(fs::OpenInfo* info) -> fs::OpenInfo* {
-    while(info->mount != nullptr) {
-        info = info->mount;
+inline auto unit_of(const OpenMode mode) -> uint64_t {
+    return mode == OpenMode::Read ? OpenInfo::read_unit : OpenInfo::write_bit;
+}
+
+inline auto follow_mountpoints(fs::OpenInfo* info, const std::memory_order order = std::memory_order_acquire) -> fs::OpenInfo* {
+    while(const auto mount = info->mount.load(order)) {
+        info = mount;
     }
     return info;
 }
 
+// a node which is leaving the tree cannot be opened, and is reported as NoSuchFile
+// a volume root being unmounted cannot be opened either, and is reported as NotMounted
 inline auto try_open(fs::OpenInfo* const info, const OpenMode mode) -> Error {
-    // the file is already write opened
-    if(info->write_count >= 1) {
-        return Error::Code::FileOpened;
-    }
+    auto state = info->state.load(std::memory_order_relaxed);
+    while(true) {
+        if(state == 0 && !info->is_persistent()) {
+            return Error::Code::NoSuchFile;
+        }
 
-    // cannot modify read opened file
-    if(info->read_count >= 1 && mode != OpenMode::Read) {
-        return Error::Code::FileOpened;
-    }
+        if(state & OpenInfo::unmount_bit) {
+            return Error::Code::NotMounted;
+        }
+
+        // the file is already write opened
+        if(state & OpenInfo::write_bit) {
+            return Error::Code::FileOpened;
+        }
+
+        // cannot modify read opened file
+        if((state & OpenInfo::read_mask) != 0 && mode != OpenMode::Read) {
+            return Error::Code::FileOpened;
+        }
 
-    switch(mode) {
-    case OpenMode::Read:
-        info->read_count += 1;
-        break;
-    case OpenMode::Write:
-        info->write_count += 1;
+        if(info->state.compare_exchange_weak(state, state + unit_of(mode), std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return Error();
+        }
     }
+}
 
-    return Error();
+// opens the file node stands for, which is the root of the volume mounted on it if there is one
+// a volume being unmounted is waited for, and one unmounted between following the mountpoint and opening its root is let go
+// node is followed again in both cases
+inline auto open_node(OpenInfo* const node, const OpenMode mode) -> Result<OpenInfo*> {
+    while(true) {
+        auto target = follow_mountpoints(node);
+        if(const auto e = try_open(target, mode)) {
+            if(e == Error::Code::NotMounted && target != node) {
+                std::this_thread::yield();
+                continue;
+            }
+            return e;
+        }
+        if(target == node) {
+            return target;
+        }
+        // try_open and this are sequentially consistent, which pairs them with clearing the mountpoint in Controller::unmount_at
+        if(follow_mountpoints(node, std::memory_order_seq_cst) == target) {
+            return target;
+        }
+        // volume roots never leave the tree, dropping the count is enough
+        target->state.fetch_sub(unit_of(mode), std::memory_order_release);
+    }
 }
 
 class Controller;
@@ -44,8 +107,10 @@ class Handle {
     friend class Controller;
 
   private:
-    OpenInfo* data;
-    OpenMode  mode;
+    OpenInfo*    data;
+    OpenMode     mode;
+    NodeSlab*    nodes;
+    DentryCache* dentries;
 
     auto is_write_opened() -> bool {
         if(mode != OpenMode::Write) {
@@ -67,33 +132,85 @@ class Handle {
         return data->write(offset, size, buffer);
     }
 
-    auto open(const std::string_view name, const OpenMode mode) -> Result<Handle> {
-        auto& children     = data->children;
-        auto  created_info = std::optional<OpenInfo>();
-        auto  result       = (OpenInfo*)(nullptr);
-        if(const auto p = children.find(std::string(name)); p != children.end()) {
-            result = follow_mountpoints(&p->second);
-        } else {
-            auto find_result = data->find(name);
-            if(!find_result) {
-                return find_result.as_error();
-            }
-            result = &created_info.emplace(find_result.as_value());
+    auto seek(const size_t offset, const SeekMode mode) -> Result<size_t> {
+        return data->seek(offset, mode);
+    }
+
+    auto punch_hole(const size_t offset, const size_t size) -> Error {
+        if(!is_write_opened()) {
+            return Error::Code::FileNotOpened;
         }
+        return data->punch_hole(offset, size);
+    }
 
-        if(const auto e = try_open(result, mode)) {
-            return e;
+    // makes this file a copy of source, which must be on the same volume
+    auto clone_from(const Handle& source) -> Error {
+        if(!is_write_opened()) {
+            return Error::Code::FileNotOpened;
         }
+        return data->clone_from(*source.data);
+    }
 
-        if(created_info) {
-            auto& v = created_info.value();
-            result  = &children.emplace(v.name, v).first->second;
+    // children which are already open are found and opened without taking a lock
+    // other names are looked up with the lock of the children held, in the dentry cache before the driver
+    auto open(const std::string_view name, const OpenMode mode) -> Result<Handle> {
+        auto&      children = data->children;
+        const auto dispose  = [nodes = nodes](OpenInfo* const node) { nodes->destroy(node); };
+
+        children.begin_read();
+        const auto open   = children.find(name);
+        auto       result = open != nullptr ? open_node(open, mode) : Result<OpenInfo*>(Error::Code::NoSuchFile);
+        children.end_read(dispose);
+        if(result) {
+            return Handle(result.as_value(), mode, nodes, dentries);
+        }
+        // NoSuchFile from an open node means that it is leaving the tree, the lock settles that
+        if(result.as_error() != Error::Code::NoSuchFile) {
+            return result.as_error();
         }
 
-        return Handle(result, mode);
+        const auto lock  = children.lock();
+        auto       child = children.find(name);
+        if(child == nullptr) {
+            auto found = std::optional<OpenInfo>();
+            if(dentries != nullptr && dentries->find(*data, name, found)) {
+                if(!found) {
+                    return Error::Code::NoSuchFile;
+                }
+                found->parent = data;
+            } else {
+                auto find_result = data->find(name);
+                if(!find_result) {
+                    if(dentries != nullptr && find_result.as_error() == Error::Code::NoSuchFile) {
+                        dentries->insert(*data, name, std::nullopt);
+                    }
+                    return find_result.as_error();
+                }
+                found.emplace(std::move(find_result.as_value()));
+                if(dentries != nullptr) {
+                    auto entry   = *found;
+                    entry.parent = nullptr;
+                    dentries->insert(*data, name, std::move(entry));
+                }
+            }
+            // drivers may return a canonical name which differs from the requested one(e.g. case-insensitive filesystems)
+            child = children.find(found->name);
+            if(child == nullptr) {
+                // the new node is open by this handle before anyone can find it
+                const auto node = nodes->create(std::move(*found));
+                node->state.store(unit_of(mode), std::memory_order_relaxed);
+                data->state.fetch_add(OpenInfo::child_unit, std::memory_order_relaxed);
+                children.insert(node, dispose);
+                return Handle(node, mode, nodes, dentries);
+            }
+        }
+        value_or(node, open_node(child, mode));
+        return Handle(node, mode, nodes, dentries);
     }
 
+    // the driver is asked with the lock of the children held, so that it never races with a create or a remove in the directory
     auto find(const std::string_view name) -> Result<OpenInfo> {
+        const auto lock = data->children.lock();
         return data->find(name);
     }
 
@@ -101,61 +218,106 @@ class Handle {
         if(!is_write_opened()) {
             return Error::Code::FileNotOpened;
         }
-        const auto r = data->create(name, type);
+        const auto lock = data->children.lock();
+        const auto r    = data->create(name, type);
+        if(r && dentries != nullptr) {
+            dentries->forget(*data);
+        }
         return r ? Error() : r.as_error();
     }
 
+    // drivers may reorganize the directory on an indexed read(e.g. tmpfs drops its tombstones), so it is exclusive too
     auto readdir(const size_t index) -> Result<OpenInfo> {
+        const auto lock = data->children.lock();
         return data->readdir(index);
     }
 
+    // reads entries in batches, names are stored in names
+    // returns the number of records filled, 0 with cursor.end set when the directory is exhausted
+    auto readdir(DirectoryCursor& cursor, const std::span<DirectoryRecord> records, const std::span<char> names) -> Result<size_t> {
+        const auto lock = data->children.lock();
+        return data->readdir(cursor, records, names);
+    }
+
     auto remove(const std::string_view name) -> Error {
-        return data->remove(name);
+        const auto lock = data->children.lock();
+        const auto e    = data->remove(name);
+        if(!e && dentries != nullptr) {
+            dentries->clear();
+        }
+        return e;
     }
 
     auto get_size() const -> size_t {
         return data->size;
     }
 
-    Handle(OpenInfo* const data, const OpenMode mode) : data(data), mode(mode) {}
+    // children opened through the handle are allocated from nodes
+    Handle(OpenInfo* const data, const OpenMode mode, NodeSlab* const nodes, DentryCache* const dentries = nullptr) : data(data), mode(mode), nodes(nodes), dentries(dentries) {}
 };
 
 class Controller {
   private:
     basic::Driver       basic_driver;
     OpenInfo&           root;
+    std::mutex          mountpoints_mutex;
     std::vector<Handle> mountpoints;
+    NodeSlab            nodes;
+    DentryCache         dentries;
 
     auto open_root(const OpenMode mode) -> Result<Handle> {
-        auto info = follow_mountpoints(&root);
-        if(const auto e = try_open(info, mode)) {
-            return e;
-        }
-        return Handle(info, mode);
+        value_or(info, open_node(&root, mode));
+        return Handle(info, mode, &nodes, &dentries);
     }
 
     static auto find_top_mountpoint(OpenInfo* node) -> Result<OpenInfo*> {
-        if(node->mount == nullptr) {
+        if(node->mount.load() == nullptr) {
             return Error::Code::NotMounted;
         }
-        while(node->mount->mount != nullptr) {
-            node = node->mount;
+        while(node->mount.load()->mount.load() != nullptr) {
+            node = node->mount.load();
         }
         return node;
     }
 
-    auto open_parent_directory(std::vector<std::string_view>& elms, const OpenMode mode) -> Result<Handle> {
-        if(elms.empty()) {
-            return open_root(mode);
+    // with mountpoints_mutex held
+    // the volume root is marked only while nothing is open in it, walkers reaching it from then on wait in open_node
+    // the mountpoint is cleared after that, so that a busy volume stays visible and walkers never pass into the covered directory early
+    auto unmount_at(OpenInfo* const mountpoint) -> Result<const Driver*> {
+        for(auto m = mountpoints.begin(); m != mountpoints.end(); m += 1) {
+            if(m->data != mountpoint) {
+                continue;
+            }
+
+            const auto volume_root = mountpoint->mount.load();
+            auto       idle        = uint64_t(0);
+            if(volume_root->mount.load() != nullptr || !volume_root->state.compare_exchange_strong(idle, OpenInfo::unmount_bit)) {
+                return Error::Code::VolumeBusy;
+            }
+            // a walker which followed the mountpoint before this and opens the root once the mark is gone lets it go again, see open_node
+            mountpoint->mount.store(nullptr);
+            volume_root->state.fetch_sub(OpenInfo::unmount_bit);
+
+            if(const auto e = close(*m)) {
+                logger(LogLevel::Error, "failed to close mountpoint, this is kernel bug: %d\n", e.as_int());
+                mountpoints.erase(m);
+                return e;
+            }
+            mountpoints.erase(m);
+            dentries.clear();
+            return volume_root->read_driver();
         }
+        return Error::Code::NotMounted;
+    }
 
-        auto dirname = std::span<std::string_view>(elms.begin(), elms.size() - 1);
-        auto result  = open_root(OpenMode::Read);
+    // opens dirname for reading, walking it in place
+    auto open_parent_directory(const std::string_view dirname) -> Result<Handle> {
+        auto result = open_root(OpenMode::Read);
         if(!result) {
             return result.as_error();
         }
 
-        for(const auto& d : dirname) {
+        for(const auto d : PathElements(dirname)) {
             auto handle = result.as_value();
             result      = handle.open(d, OpenMode::Read);
             close(handle);
@@ -168,44 +330,47 @@ class Controller {
 
   public:
     auto open(const std::string_view path, const OpenMode mode) -> Result<Handle> {
-        auto elms = split_path(path);
-        if(elms.empty()) {
+        const auto [dirname, filename] = split_last(path);
+        if(filename.empty()) {
             return open_root(mode);
         }
 
-        auto filename = elms.back();
-        value_or(handle, open_parent_directory(elms, mode));
+        value_or(handle, open_parent_directory(dirname));
 
         auto result = handle.open(filename, mode);
         close(handle);
         return result;
     }
 
+    // the last count of a node is dropped with the lock of its parent's children held, so that nobody opens it in between
+    // a parent which loses its last child goes the same way
     auto close(Handle handle) -> Error {
         auto node = handle.data;
-        switch(handle.mode) {
-        case OpenMode::Read:
-            node->read_count -= 1;
-            break;
-        case OpenMode::Write:
-            node->write_count -= 1;
-            break;
+        if(handle.mode == OpenMode::Write && node->type == FileType::Regular && node->parent != nullptr) {
+            dentries.forget(*node->parent);
         }
-        while(node->parent != nullptr) {
-            if(node->is_busy() || node->is_volume_root()) {
-                break;
-            }
 
-            if(node->parent == nullptr) {
-                // bug
-                // this node should be a volume root
-                break;
+        const auto dispose = [this](OpenInfo* const node) { nodes.destroy(node); };
+        auto       unit    = unit_of(handle.mode);
+        while(true) {
+            auto state = node->state.load(std::memory_order_relaxed);
+            while(node->is_persistent() || state != unit) {
+                if(node->state.compare_exchange_weak(state, state - unit, std::memory_order_release, std::memory_order_relaxed)) {
+                    return Error();
+                }
             }
 
-            node->parent->children.erase(node->name);
-            node = node->parent;
+            const auto parent = node->parent;
+            {
+                const auto lock = parent->children.lock();
+                if(node->state.fetch_sub(unit, std::memory_order_acq_rel) != unit) {
+                    return Error();
+                }
+                parent->children.erase(node, dispose);
+            }
+            node = parent;
+            unit = OpenInfo::child_unit;
         }
-        return Error();
     }
 
     auto mount(const std::string_view path, Driver& driver) -> Error {
@@ -215,56 +380,57 @@ class Controller {
         if(!open_result) {
             return open_result.as_error();
         }
-        const auto handle  = open_result.as_value();
-        handle.data->mount = volume_root;
-        mountpoints.emplace_back(handle);
+        const auto handle = open_result.as_value();
+        {
+            const auto lock = std::lock_guard(mountpoints_mutex);
+            handle.data->mount.store(volume_root, std::memory_order_release);
+            mountpoints.emplace_back(handle);
+        }
+        dentries.clear();
         return Error();
     }
 
     auto unmount(const std::string_view path) -> Result<const Driver*> {
-        auto mountpoint = (OpenInfo*)(nullptr);
-        auto elms       = split_path(path);
-        if(elms.empty()) {
-            value_or(node, find_top_mountpoint(&root));
-            mountpoint = node;
-        } else {
-            value_or(parent, open_parent_directory(elms, OpenMode::Read));
-            error_or(close(parent));
-            auto& children = parent.data->children;
-            if(const auto p = children.find(std::string(elms.back())); p == children.end()) {
-                return Error::Code::NoSuchFile;
-            } else {
-                value_or(node, find_top_mountpoint(&p->second));
-                mountpoint = node;
-            }
+        const auto [dirname, filename] = split_last(path);
+        if(filename.empty()) {
+            const auto lock = std::lock_guard(mountpoints_mutex);
+            value_or(mountpoint, find_top_mountpoint(&root));
+            return unmount_at(mountpoint);
         }
 
-        for(auto m = mountpoints.begin(); m != mountpoints.end(); m += 1) {
-            if(m->data != mountpoint) {
-                continue;
-            }
-
-            const auto volume_root = mountpoint->mount;
-            if(volume_root->is_busy()) {
-                return Error::Code::VolumeBusy;
-            }
-            mountpoint->mount = nullptr;
-
-            if(const auto e = close(*m)) {
-                logger(LogLevel::Error, "failed to close mountpoint, this is kernel bug: %d\n", e.as_int());
-                mountpoints.erase(m);
-                return e;
+        // the parent stays open until the mountpoint is closed, the child is looked at with the lock of the children held
+        value_or(parent, open_parent_directory(dirname));
+        auto result = Result<const Driver*>(Error::Code::NoSuchFile);
+        {
+            const auto lock       = std::lock_guard(mountpoints_mutex);
+            auto       mountpoint = Result<OpenInfo*>(Error::Code::NoSuchFile);
+            {
+                const auto children_lock = parent.data->children.lock();
+                if(const auto child = parent.data->children.find(filename); child != nullptr) {
+                    mountpoint = find_top_mountpoint(child);
+                }
             }
-            mountpoints.erase(m);
-            return volume_root->read_driver();
+            result = mountpoint ? unmount_at(mountpoint.as_value()) : Result<const Driver*>(mountpoint.as_error());
         }
-        return Error::Code::NotMounted;
+        error_or(close(parent));
+        return result;
     }
 
     auto _compare_root(const OpenInfo::Testdata& data) -> bool {
         return root.test_compare(data);
     }
 
-    Controller() : root(basic_driver.get_root()) {}
+    auto get_dentry_statistics() const -> DentryStatistics {
+        return dentries.get_statistics();
+    }
+
+    // nodes of the open tree, the roots of the drivers are not counted
+    auto get_open_node_count() const -> size_t {
+        return nodes.get_live_count();
+    }
+
+    // dentry_capacity of 0 disables the dentry cache
+    Controller(const size_t dentry_capacity = DentryCache::default_capacity) : root(basic_driver.get_root()),
+                                                                               dentries(dentry_capacity) {}
 };
 } // namespace fs
@@ -0,0 +1,140 @@
+#pragma once
+#include <functional>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#include "fs.hpp"
+
+namespace fs {
+struct DentryStatistics {
+    size_t hits;
+    size_t negative_hits;
+    size_t misses;
+    size_t entries;
+};
+
+// results of Driver::find by directory and name, kept after the nodes are closed
+// a directory is identified by its driver and driver data, a negative entry remembers that the name does not exist
+// entries are dropped in least recently used order once there are more than capacity of them
+//
+// the controller invalidates entries on the changes it sees:
+//  create in a directory drops the entries of that directory
+//  closing a file opened for writing drops the entries of its directory, as its size may have changed
+//  remove, mount and unmount drop everything, since a removed directory may be recreated under the same driver data
+// changes made to a driver behind the controller are not seen
+// every operation takes the lock, lookups of open nodes do not get here
+class DentryCache {
+  private:
+    using DirectoryKey = std::pair<const Driver*, uintptr_t>;
+
+    struct DirectoryKeyHash {
+        auto operator()(const DirectoryKey& key) const -> size_t {
+            return std::hash<const void*>()(key.first) ^ (std::hash<uintptr_t>()(key.second) * 31);
+        }
+    };
+
+    struct Entry {
+        std::optional<OpenInfo>                                  info; // empty for a negative entry
+        std::list<std::pair<DirectoryKey, std::string>>::iterator use;
+    };
+
+    using Names = std::unordered_map<std::string, Entry, NameHash, std::equal_to<>>;
+
+    mutable std::mutex                                        mutex;
+    size_t                                                    capacity;
+    std::unordered_map<DirectoryKey, Names, DirectoryKeyHash> directories;
+    std::list<std::pair<DirectoryKey, std::string>>           uses; // most recently used first
+    size_t                                                    hits          = 0;
+    size_t                                                    negative_hits = 0;
+    size_t                                                    misses        = 0;
+
+    static auto key_of(const OpenInfo& directory) -> DirectoryKey {
+        return {directory.read_driver(), directory.read_driver_data()};
+    }
+
+    auto evict() -> void {
+        const auto& [key, name] = uses.back();
+        const auto  p           = directories.find(key);
+        p->second.erase(name);
+        if(p->second.empty()) {
+            directories.erase(p);
+        }
+        uses.pop_back();
+    }
+
+  public:
+    constexpr static auto default_capacity = size_t(4096);
+
+    // false if name is not cached in directory, otherwise info is set to the result of the lookup, empty if the name does not exist
+    auto find(const OpenInfo& directory, const std::string_view name, std::optional<OpenInfo>& info) -> bool {
+        const auto lock = std::lock_guard(mutex);
+        const auto p    = directories.find(key_of(directory));
+        if(p == directories.end()) {
+            misses += 1;
+            return false;
+        }
+        const auto q = p->second.find(name);
+        if(q == p->second.end()) {
+            misses += 1;
+            return false;
+        }
+        auto& entry = q->second;
+        uses.splice(uses.begin(), uses, entry.use);
+        (entry.info ? hits : negative_hits) += 1;
+        info = entry.info;
+        return true;
+    }
+
+    // info is the result of Driver::find with no parent, or empty if the name does not exist
+    auto insert(const OpenInfo& directory, const std::string_view name, std::optional<OpenInfo> info) -> void {
+        if(capacity == 0) {
+            return;
+        }
+        const auto lock       = std::lock_guard(mutex);
+        const auto key        = key_of(directory);
+        auto&      names      = directories[key];
+        const auto [p, added] = names.try_emplace(std::string(name));
+        p->second.info        = std::move(info);
+        if(!added) {
+            uses.splice(uses.begin(), uses, p->second.use);
+            return;
+        }
+        uses.emplace_front(key, p->first);
+        p->second.use = uses.begin();
+        if(uses.size() > capacity) {
+            evict();
+        }
+    }
+
+    // drops the entries of directory
+    auto forget(const OpenInfo& directory) -> void {
+        const auto lock = std::lock_guard(mutex);
+        const auto p    = directories.find(key_of(directory));
+        if(p == directories.end()) {
+            return;
+        }
+        for(const auto& [name, entry] : p->second) {
+            uses.erase(entry.use);
+        }
+        directories.erase(p);
+    }
+
+    auto clear() -> void {
+        const auto lock = std::lock_guard(mutex);
+        directories.clear();
+        uses.clear();
+    }
+
+    auto get_statistics() const -> DentryStatistics {
+        const auto lock = std::lock_guard(mutex);
+        return DentryStatistics{hits, negative_hits, misses, uses.size()};
+    }
+
+    DentryCache(const size_t capacity = default_capacity) : capacity(capacity) {}
+};
+} // namespace fs
@@ -0,0 +1,678 @@
+#pragma once
+#include <array>
+#include <bit>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "../../../block/block.hpp"
+#include "../../../encoding.hpp"
+#include "../../../macro.hpp"
+#include "../../fs.hpp"
+#include "../fat/cluster.hpp"
+#include "exfat.hpp"
+
+namespace fs::exfat {
+
+#define assert(c, e) \
+    if(!(c)) {       \
+        return e;    \
+    }
+
+// macro.hpp defines it only once and fat/driver.hpp undefines it, so it is left defined
+#define error_or(c)        \
+    if(const auto e = c) { \
+        return e;          \
+    }
+
+using fat::ClusterOperator;
+using fat::Geometry;
+using fat::make_geometry;
+
+static_assert(sizeof(uintptr_t) >= sizeof(uint64_t));
+
+// clusters of a file or a directory
+struct Extent {
+    uint32_t first_cluster;
+    uint32_t contiguous; // length in clusters if the data is contiguous(NoFatChain), 0 if the fat chain must be followed
+
+    // DriverData::num holds first_cluster in the lower half and contiguous in the upper half
+    auto pack() const -> uintptr_t {
+        return (uintptr_t(contiguous) << 32) | first_cluster;
+    }
+
+    static auto unpack(const uintptr_t num) -> Extent {
+        return Extent{uint32_t(num), uint32_t(uint64_t(num) >> 32)};
+    }
+};
+
+// place of an entry in a directory
+struct Position {
+    uint32_t cluster;
+    uint32_t index; // may be equal to the entries per cluster, then the next cluster follows
+};
+
+// name is a view of a buffer owned by the producer
+struct DirectoryInfo {
+    Extent           extent;
+    uint64_t         size;
+    uint64_t         valid_size;
+    std::string_view name;
+    uint16_t         attributes;
+    Position         position; // of the file entry which starts the set
+};
+
+// DriverData::num of a regular file whose valid data length is shorter than its size
+// the length does not fit next to the extent, so num locates the entry set instead, which read looks up again
+// extents of regular files never set the upper bit, the length of a contiguous one follows from the size
+struct Locator {
+    constexpr static auto located_bit   = uintptr_t(1) << 63;
+    constexpr static auto contiguous_bit = uintptr_t(1) << 62;
+
+    Position entry;
+    bool     contiguous_directory; // the set continues in the next cluster instead of following the fat
+
+    auto pack() const -> uintptr_t {
+        return located_bit | (contiguous_directory ? contiguous_bit : 0) | (uintptr_t(entry.index) << 32) | entry.cluster;
+    }
+
+    static auto is_located(const uintptr_t num) -> bool {
+        return (num & located_bit) != 0;
+    }
+
+    static auto unpack(const uintptr_t num) -> Locator {
+        return Locator{Position{uint32_t(num), uint32_t((num & (contiguous_bit - 1)) >> 32)}, (num & contiguous_bit) != 0};
+    }
+};
+
+// up-cased name to look for
+struct Key {
+    std::array<char16_t, max_name_length> name;
+    size_t                                length;
+    uint16_t                              hash;
+};
+
+// returns nullopt if the name cannot exist
+inline auto make_key(const std::string_view name, const UpcaseTable& upcase) -> std::optional<Key> {
+    auto       key    = Key();
+    const auto length = u8tou16(name, key.name);
+    if(!length || *length == 0) {
+        return std::nullopt;
+    }
+    key.length = *length;
+    for(auto i = size_t(0); i < key.length; i += 1) {
+        key.name[i] = upcase.upcase(key.name[i]);
+    }
+    key.hash = calc_name_hash(key.name.data(), key.length);
+    return key;
+}
+
+// sizes are powers of two by definition, so the shift paths of Geometry are always taken
+inline auto geometry_from_boot_sector(const BootSector::Summary& boot) -> Geometry {
+    return make_geometry(boot.bytes_per_sector, boot.sectors_per_cluster, boot.fat_offset, boot.cluster_heap_offset, boot.cluster_heap_offset + size_t(boot.cluster_count) * boot.sectors_per_cluster - 1);
+}
+
+inline auto is_cluster(const uint32_t cluster, const BootSector::Summary& boot) -> bool {
+    return cluster >= 2 && cluster - 2 < boot.cluster_count;
+}
+
+inline auto read_fat_for_cluster(const uint32_t cluster, const BootSector::Summary& boot, block::BlockDevice& block) -> Result<uint32_t> {
+    // fat[0] and fat[1] are reserved
+    const auto sector = boot.fat_offset + (size_t(cluster) * 4 >> boot.bytes_per_sector_shift);
+    const auto offset = size_t(cluster) * 4 & (boot.bytes_per_sector - 1);
+
+    auto buffer = std::vector<uint8_t>(boot.bytes_per_sector);
+    error_or(block.read_sector(sector, 1, buffer.data()));
+    return uint32_t(*reinterpret_cast<uint32_t*>(buffer.data() + offset));
+}
+
+// advances cluster by one within the extent
+// contiguous extents never touch the fat
+// returns EndOfFile past the last cluster
+inline auto next_cluster(const Extent extent, uint32_t& cluster, const BootSector::Summary& boot, block::BlockDevice& block) -> Error {
+    if(extent.contiguous != 0) {
+        assert(cluster + 1 - extent.first_cluster < extent.contiguous, Error::Code::EndOfFile);
+        cluster += 1;
+        return Error();
+    }
+    value_or(next, read_fat_for_cluster(cluster, boot, block));
+    assert(next != end_of_cluster_chain, Error::Code::EndOfFile);
+    assert(is_cluster(next, boot), Error::Code::InvalidData);
+    cluster = next;
+    return Error();
+}
+
+// walks the entry sets of a directory
+class DirectoryIterator {
+  public:
+    using Position = exfat::Position;
+
+  private:
+    Extent                     extent;
+    uint32_t                   cluster;
+    uint32_t                   index;
+    const BootSector::Summary& boot;
+    const UpcaseTable&         upcase;
+    block::BlockDevice&        block;
+    ClusterOperator            op;
+    std::vector<uint8_t>       buffer;
+    uint32_t                   loaded_cluster = 0; // cluster currently held in buffer, 0 if none
+
+    // raw entries and the decoded name of the last read set, DirectoryInfo refers to them
+    std::array<uint8_t, 256 * sizeof(FileEntry)>           set;
+    std::array<char16_t, max_name_length>                  name16;
+    std::array<char, u8_capacity_for_u16(max_name_length)> name_buffer;
+    size_t                                                 broken_sets = 0; // skipped since their checksum or names are wrong
+
+    auto get_entries_per_cluster() const -> size_t {
+        return op.get_cluster_size_bytes() / sizeof(FileEntry);
+    }
+
+    auto load_cluster() -> Error {
+        if(loaded_cluster == cluster) {
+            return Error();
+        }
+        buffer.resize(op.get_cluster_size_bytes());
+        loaded_cluster = 0;
+        error_or(op.read_cluster(cluster, buffer.data()));
+        loaded_cluster = cluster;
+        return Error();
+    }
+
+    // reads the secondaries of the file entry in set[0]
+    // if key is given, sets of other names are skipped without decoding
+    // returns true if the set is complete and valid
+    auto read_secondaries(const Key* const key) -> Result<bool> {
+        const auto& file  = *reinterpret_cast<const FileEntry*>(set.data());
+        const auto  count = size_t(file.secondary_count);
+        for(auto i = size_t(1); i <= count; i += 1) {
+            if(const auto e = read_entry(set.data() + i * sizeof(FileEntry))) {
+                // the directory ends in the middle of the set
+                return e == Error::Code::EndOfFile ? Error(Error::Code::InvalidData) : e;
+            }
+            if(i != 1 || key == nullptr || set[sizeof(FileEntry)] != Stream) {
+                continue;
+            }
+            const auto& stream = *reinterpret_cast<const StreamEntry*>(set.data() + sizeof(FileEntry));
+            if(stream.name_length != key->length || stream.name_hash != key->hash) {
+                // skip the rest of the set
+                for(i += 1; i <= count; i += 1) {
+                    auto entry = std::array<uint8_t, sizeof(FileEntry)>();
+                    error_or(read_entry(entry.data()));
+                }
+                return false;
+            }
+        }
+
+        const auto& stream = *reinterpret_cast<const StreamEntry*>(set.data() + sizeof(FileEntry));
+        const auto  names  = (size_t(stream.name_length) + NameEntry::chars_per_entry - 1) / NameEntry::chars_per_entry;
+        if(count < 2 || stream.type != Stream || stream.name_length == 0 || names > count - 1) {
+            return false;
+        }
+        for(auto i = size_t(0); i < names; i += 1) {
+            const auto& name = *reinterpret_cast<const NameEntry*>(set.data() + (i + 2) * sizeof(FileEntry));
+            if(name.type != FileName) {
+                return false;
+            }
+            const auto units = std::min(size_t(NameEntry::chars_per_entry), stream.name_length - i * NameEntry::chars_per_entry);
+            std::memcpy(name16.data() + i * NameEntry::chars_per_entry, name.name, units * sizeof(char16_t));
+        }
+        return calc_set_checksum(set.data(), count + 1) == file.set_checksum;
+    }
+
+    auto read_set(const Key* const key) -> Result<DirectoryInfo> {
+        while(true) {
+            error_or(read_entry(set.data()));
+            if(set[0] == EndOfDirectory) {
+                // stay at the end
+                index -= 1;
+                return Error::Code::EndOfFile;
+            }
+            if(set[0] != File) {
+                // deleted entries, orphaned secondaries and other primaries
+                continue;
+            }
+
+            // read_entry moved to the cluster of the file entry before copying it
+            const auto position = Position{cluster, index - 1};
+            value_or(valid, read_secondaries(key));
+            if(!valid) {
+                if(key == nullptr) {
+                    broken_sets += 1;
+                }
+                continue;
+            }
+
+            const auto& file   = *reinterpret_cast<const FileEntry*>(set.data());
+            const auto& stream = *reinterpret_cast<const StreamEntry*>(set.data() + sizeof(FileEntry));
+            if(key != nullptr) {
+                auto equal = true;
+                for(auto i = size_t(0); i < key->length && equal; i += 1) {
+                    equal = upcase.upcase(name16[i]) == key->name[i];
+                }
+                if(!equal) {
+                    continue;
+                }
+            }
+
+            const auto name_len          = *u16tou8(std::u16string_view(name16.data(), stream.name_length), name_buffer);
+            const auto bytes_per_cluster = op.get_cluster_size_bytes();
+            auto       extent            = Extent{0, 0};
+            if(stream.flags & StreamEntry::AllocationPossible) {
+                extent.first_cluster = stream.first_cluster;
+                if(stream.flags & StreamEntry::NoFatChain) {
+                    extent.contiguous = (stream.data_length + bytes_per_cluster - 1) / bytes_per_cluster;
+                }
+            }
+            return DirectoryInfo{extent, stream.data_length, std::min(stream.valid_data_length, stream.data_length), std::string_view(name_buffer.data(), name_len), file.attributes, position};
+        }
+    }
+
+  public:
+    // copies the next raw entry and advances
+    // returns EndOfFile past the last cluster
+    auto read_entry(uint8_t* const entry) -> Error {
+        if(index == get_entries_per_cluster()) {
+            error_or(next_cluster(extent, cluster, boot, block));
+            index = 0;
+        }
+        error_or(load_cluster());
+        std::memcpy(entry, buffer.data() + index * sizeof(FileEntry), sizeof(FileEntry));
+        index += 1;
+        return Error();
+    }
+
+    // broken sets are skipped, as find does, so that one of them does not hide the rest of the directory
+    auto read() -> Result<DirectoryInfo> {
+        return read_set(nullptr);
+    }
+
+    auto find(const Key& key) -> Result<DirectoryInfo> {
+        return read_set(&key);
+    }
+
+    auto get_broken_sets() const -> size_t {
+        return broken_sets;
+    }
+
+    // returns EndOfFile if there are less than count sets
+    auto skip(const size_t count) -> Error {
+        for(auto i = size_t(0); i < count; i += 1) {
+            const auto r = read();
+            if(!r) {
+                return r.as_error();
+            }
+        }
+        return Error();
+    }
+
+    auto get_position() const -> Position {
+        return Position{cluster, index};
+    }
+
+    DirectoryIterator(const Extent extent, const BootSector::Summary& boot, const UpcaseTable& upcase, block::BlockDevice& block) : extent(extent),
+                                                                                                                                      cluster(extent.first_cluster),
+                                                                                                                                      index(0),
+                                                                                                                                      boot(boot),
+                                                                                                                                      upcase(upcase),
+                                                                                                                                      block(block),
+                                                                                                                                      op(geometry_from_boot_sector(boot), block) {}
+
+    DirectoryIterator(const Extent extent, const Position position, const BootSector::Summary& boot, const UpcaseTable& upcase, block::BlockDevice& block) : extent(extent),
+                                                                                                                                                               cluster(position.cluster),
+                                                                                                                                                               index(position.index),
+                                                                                                                                                               boot(boot),
+                                                                                                                                                               upcase(upcase),
+                                                                                                                                                               block(block),
+                                                                                                                                                               op(geometry_from_boot_sector(boot), block) {}
+};
+
+struct VolumeStatistics {
+    size_t   bytes_per_cluster;
+    uint32_t total_clusters;
+    uint32_t free_clusters; // counted in the allocation bitmap
+};
+
+class Driver : public fs::Driver {
+  private:
+    block::BlockDevice* block;
+    BootSector::Summary boot;
+    Geometry            geometry;
+    UpcaseTable         upcase;
+    Extent              bitmap;
+    uint64_t            bitmap_size = 0;
+
+    OpenInfo root;
+
+    struct FileExtent {
+        Extent   extent;
+        uint64_t valid_size;
+    };
+
+    // sets of located files read last, one slot per hash of the locator
+    struct LocatedFile {
+        uintptr_t  locator = 0; // 0 while the slot is empty
+        FileExtent file;
+    };
+
+    std::array<LocatedFile, 64> located_files;
+    std::mutex                  located_files_mutex;
+
+    // copies bytes from skip in consecutive clusters starting from cluster
+    // whole clusters are read straight into buffer, partial ones through bounce
+    auto read_run(ClusterOperator& op, uint32_t cluster, const size_t skip, size_t size, uint8_t* buffer, std::vector<uint8_t>& bounce) -> Error {
+        const auto bytes_per_cluster = geometry.bytes_per_cluster;
+        if(skip != 0 || size < bytes_per_cluster) {
+            bounce.resize(bytes_per_cluster);
+            error_or(op.read_cluster(cluster, bounce.data()));
+            const auto copy_len = std::min(size, bytes_per_cluster - skip);
+            std::memcpy(buffer, bounce.data() + skip, copy_len);
+            buffer += copy_len;
+            size -= copy_len;
+            cluster += 1;
+        }
+        if(const auto whole = geometry.cluster_index<true>(size); whole != 0) {
+            error_or(op.read_clusters(cluster, whole, buffer));
+            buffer += whole * bytes_per_cluster;
+            size -= whole * bytes_per_cluster;
+            cluster += whole;
+        }
+        if(size != 0) {
+            bounce.resize(bytes_per_cluster);
+            error_or(op.read_cluster(cluster, bounce.data()));
+            std::memcpy(buffer, bounce.data(), size);
+        }
+        return Error();
+    }
+
+    // reads size bytes from offset of the extent
+    // a contiguous extent is read in one request without consulting the fat
+    // a chain is read in runs of consecutive clusters
+    auto read_extent(const Extent extent, const size_t offset, size_t size, uint8_t* buffer) -> Error {
+        if(size == 0) {
+            return Error();
+        }
+
+        auto       op                = ClusterOperator(geometry, *block);
+        const auto bytes_per_cluster = geometry.bytes_per_cluster;
+        auto       cluster           = extent.first_cluster;
+        assert(is_cluster(cluster, boot), Error::Code::InvalidData);
+        if(extent.contiguous != 0) {
+            assert(offset + size <= size_t(extent.contiguous) * bytes_per_cluster, Error::Code::EndOfFile);
+            cluster += geometry.cluster_index<true>(offset);
+        } else {
+            for(auto i = size_t(0); i < geometry.cluster_index<true>(offset); i += 1) {
+                error_or(next_cluster(extent, cluster, boot, *block));
+            }
+        }
+
+        auto bounce = std::vector<uint8_t>();
+        auto skip   = geometry.cluster_offset<true>(offset);
+        while(size != 0) {
+            const auto needed = geometry.cluster_index<true>(skip + size + bytes_per_cluster - 1);
+            auto       run    = size_t(1);
+            auto       next   = cluster; // the cluster after the run
+            if(extent.contiguous != 0) {
+                run = needed;
+            } else {
+                for(auto last = cluster; run < needed; last = next, run += 1) {
+                    next = last;
+                    error_or(next_cluster(extent, next, boot, *block));
+                    if(next != last + 1) {
+                        break;
+                    }
+                }
+            }
+
+            const auto copy_len = std::min(size, run * bytes_per_cluster - skip);
+            error_or(read_run(op, cluster, skip, copy_len, buffer, bounce));
+            buffer += copy_len;
+            size -= copy_len;
+            skip    = 0;
+            cluster = next;
+        }
+        return Error();
+    }
+
+    // extent and valid data length of a regular file, see Locator
+    auto get_file_extent(const DriverData data) -> Result<FileExtent> {
+        if(!Locator::is_located(data.num)) {
+            auto extent = Extent::unpack(data.num);
+            if(extent.contiguous != 0) {
+                extent.contiguous = geometry.cluster_index<true>(data.size + geometry.bytes_per_cluster - 1);
+            }
+            return FileExtent{extent, data.size};
+        }
+
+        auto& slot = located_files[(data.num ^ (data.num >> 32)) % located_files.size()];
+        {
+            const auto lock = std::lock_guard(located_files_mutex);
+            if(slot.locator == data.num) {
+                return FileExtent(slot.file);
+            }
+        }
+        // the set was read whole when the locator was made, so a contiguous directory needs no bound here
+        const auto locator   = Locator::unpack(data.num);
+        const auto directory = Extent{locator.entry.cluster, locator.contiguous_directory ? std::numeric_limits<uint32_t>::max() : 0};
+        auto       iterator  = DirectoryIterator(directory, locator.entry, boot, upcase, *block);
+        value_or(dinfo, iterator.read());
+        assert(dinfo.position.cluster == locator.entry.cluster && dinfo.position.index == locator.entry.index && dinfo.size == data.size, Error::Code::InvalidData);
+
+        auto       file = FileExtent{dinfo.extent, dinfo.valid_size};
+        const auto lock = std::lock_guard(located_files_mutex);
+        slot            = LocatedFile{data.num, file};
+        return file;
+    }
+
+    static auto filetype_from_dinfo(const DirectoryInfo& d) -> FileType {
+        return d.attributes & Attribute::Directory ? FileType::Directory : FileType::Regular;
+    }
+
+    // directory is the extent d was read from
+    auto openinfo_from_dinfo(const DirectoryInfo& d, const Extent directory) -> OpenInfo {
+        const auto type = filetype_from_dinfo(d);
+        if(type == FileType::Directory) {
+            return OpenInfo(d.name, *this, d.extent.pack(), type, 0);
+        }
+        if(d.valid_size < d.size) {
+            return OpenInfo(d.name, *this, Locator{d.position, directory.contiguous != 0}.pack(), type, d.size);
+        }
+        return OpenInfo(d.name, *this, Extent{d.extent.first_cluster, d.extent.contiguous != 0}.pack(), type, d.size);
+    }
+
+    // the root directory holds the allocation bitmap and the up-case table
+    auto load_system_entries() -> Error {
+        auto upcase_entry = std::optional<SystemEntry>();
+        auto iterator     = DirectoryIterator(Extent{boot.root_cluster, 0}, boot, upcase, *block);
+        auto entry        = SystemEntry();
+        while(true) {
+            if(const auto e = iterator.read_entry(reinterpret_cast<uint8_t*>(&entry))) {
+                if(e == Error::Code::EndOfFile) {
+                    break;
+                }
+                return e;
+            }
+            if(entry.type == EndOfDirectory) {
+                break;
+            }
+            // the second bitmap of texfat volumes is not used
+            if(entry.type == Bitmap && (entry.flags & 0x01) == 0) {
+                bitmap      = Extent{entry.first_cluster, 0};
+                bitmap_size = entry.data_length;
+            } else if(entry.type == Upcase) {
+                upcase_entry = entry;
+            }
+        }
+        assert(bitmap_size != 0, Error::Code::InvalidData);
+
+        if(!upcase_entry || upcase_entry->data_length > 0x10000 * sizeof(char16_t)) {
+            logger(LogLevel::Warn, "exfat: up-case table is missing, only ascii names are folded\n");
+            return Error();
+        }
+        auto table = std::vector<char16_t>(upcase_entry->data_length / sizeof(char16_t));
+        error_or(read_extent(Extent{upcase_entry->first_cluster, 0}, 0, upcase_entry->data_length, reinterpret_cast<uint8_t*>(table.data())));
+        if(calc_table_checksum(reinterpret_cast<uint8_t*>(table.data()), upcase_entry->data_length) != upcase_entry->table_checksum || !upcase.load(table.data(), table.size())) {
+            logger(LogLevel::Warn, "exfat: up-case table is broken, only ascii names are folded\n");
+        }
+        return Error();
+    }
+
+  public:
+    auto init() -> Error {
+        auto buffer = std::vector<uint8_t>(block->get_info().bytes_per_sector);
+        error_or(block->read_sector(0, 1, buffer.data()));
+        const auto& boot_sector = *reinterpret_cast<BootSector*>(buffer.data());
+        assert(boot_sector.is_valid(), Error::Code::NotExFAT);
+        assert(boot_sector.summary().bytes_per_sector == block->get_info().bytes_per_sector, Error::Code::NotImplemented);
+
+        boot     = boot_sector.summary();
+        geometry = geometry_from_boot_sector(boot);
+        assert(is_cluster(boot.root_cluster, boot), Error::Code::InvalidData);
+        root = OpenInfo("/", *this, Extent{boot.root_cluster, 0}.pack(), FileType::Directory, 0, true);
+        return load_system_entries();
+    }
+
+    auto get_boot_sector() const -> const BootSector::Summary& {
+        return boot;
+    }
+
+    auto get_upcase_table() const -> const UpcaseTable& {
+        return upcase;
+    }
+
+    // counts clear bits of the allocation bitmap
+    auto statfs() -> Result<VolumeStatistics> {
+        constexpr auto batch_bytes = size_t(64 * 1024);
+
+        auto stat              = VolumeStatistics();
+        stat.bytes_per_cluster = size_t(boot.bytes_per_sector) * boot.sectors_per_cluster;
+        stat.total_clusters    = boot.cluster_count;
+
+        const auto bitmap_bytes = std::min(bitmap_size, (uint64_t(boot.cluster_count) + 7) / 8);
+        auto       buffer       = std::vector<uint64_t>(batch_bytes / sizeof(uint64_t));
+        auto       used         = size_t(0);
+        for(auto first = size_t(0); first < bitmap_bytes; first += batch_bytes) {
+            const auto count = std::min(batch_bytes, bitmap_bytes - first);
+            std::fill(buffer.begin(), buffer.end(), 0);
+            error_or(read_extent(bitmap, first, count, reinterpret_cast<uint8_t*>(buffer.data())));
+            // bits past the last cluster are not counted
+            if(first + count == bitmap_bytes && boot.cluster_count % 8 != 0) {
+                reinterpret_cast<uint8_t*>(buffer.data())[count - 1] &= (1u << (boot.cluster_count % 8)) - 1;
+            }
+            for(const auto word : buffer) {
+                used += std::popcount(word);
+            }
+        }
+        stat.free_clusters = boot.cluster_count - used;
+        return stat;
+    }
+
+    auto read(const DriverData data, const size_t offset, const size_t size, void* const buffer) -> Error override {
+        if(data.type != FileType::Regular) {
+            return Error::Code::InvalidData;
+        }
+        if(offset + size > data.size) {
+            return Error::Code::EndOfFile;
+        }
+
+        // bytes past the valid length are not initialized on disk
+        value_or(file, get_file_extent(data));
+        const auto readable = offset < file.valid_size ? std::min(size, size_t(file.valid_size - offset)) : size_t(0);
+        error_or(read_extent(file.extent, offset, readable, static_cast<uint8_t*>(buffer)));
+        std::memset(static_cast<uint8_t*>(buffer) + readable, 0, size - readable);
+        return Error();
+    }
+
+    auto write(const DriverData data, const size_t offset, const size_t size, const void* const buffer) -> Error override {
+        return Error::Code::NotImplemented;
+    }
+
+    // the name length and hash in the stream entry are compared before decoding names
+    auto find(const DriverData data, const std::string_view name) -> Result<OpenInfo> override {
+        if(data.type != FileType::Directory) {
+            return Error::Code::InvalidData;
+        }
+        const auto key = make_key(name, upcase);
+        if(!key) {
+            return Error::Code::NoSuchFile;
+        }
+        const auto directory = Extent::unpack(data.num);
+        auto       iterator  = DirectoryIterator(directory, boot, upcase, *block);
+        const auto r         = iterator.find(*key);
+        if(!r) {
+            return r.as_error() == Error::Code::EndOfFile ? Error::Code::NoSuchFile : r.as_error();
+        }
+        return openinfo_from_dinfo(r.as_value(), directory);
+    }
+
+    auto create(const DriverData data, const std::string_view name, const FileType type) -> Result<OpenInfo> override {
+        return Error::Code::NotImplemented;
+    }
+
+    auto readdir(const DriverData data, const size_t index) -> Result<OpenInfo> override {
+        if(data.type != FileType::Directory) {
+            return Error::Code::InvalidData;
+        }
+        const auto directory = Extent::unpack(data.num);
+        auto       iterator  = DirectoryIterator(directory, boot, upcase, *block);
+        if(iterator.skip(index)) {
+            return Error::Code::IndexOutOfRange;
+        }
+        value_or(dinfo, iterator.read());
+
+        return openinfo_from_dinfo(dinfo, directory);
+    }
+
+    // cursor.position holds the iterator position, cluster in the upper half and entry index in the lower half
+    auto readdir_batch(const DriverData data, DirectoryCursor& cursor, DirectoryBatch& batch) -> Error override {
+        if(data.type != FileType::Directory) {
+            return Error::Code::InvalidData;
+        }
+
+        const auto extent   = Extent::unpack(data.num);
+        const auto position = Position{static_cast<uint32_t>(cursor.position >> 32), static_cast<uint32_t>(cursor.position)};
+        auto       iterator = cursor.position == 0 ? DirectoryIterator(extent, boot, upcase, *block) : DirectoryIterator(extent, position, boot, upcase, *block);
+        while(!cursor.end && !batch.is_full()) {
+            const auto dinfo_result = iterator.read();
+            if(!dinfo_result) {
+                const auto e = dinfo_result.as_error();
+                if(e == Error::Code::EndOfFile) {
+                    cursor.end = true;
+                    break;
+                } else {
+                    return e;
+                }
+            }
+            const auto& dinfo = dinfo_result.as_value();
+            const auto  type  = filetype_from_dinfo(dinfo);
+            if(!batch.push(dinfo.name, type, type == FileType::Directory ? 0 : dinfo.size)) {
+                // retry this entry in the next call
+                break;
+            }
+            const auto next = iterator.get_position();
+            cursor.position = (static_cast<uint64_t>(next.cluster) << 32) | next.index;
+        }
+        return Error();
+    }
+
+    auto remove(const DriverData data, const std::string_view name) -> Error override {
+        return Error::Code::NotImplemented;
+    }
+
+    auto get_root() -> OpenInfo& override {
+        return root;
+    }
+
+    Driver(block::BlockDevice& block) : block(&block),
+                                        root("/", *this, nullptr, FileType::Directory, 0, true) {}
+};
+
+inline auto new_driver(block::BlockDevice& block) -> Result<std::unique_ptr<Driver>> {
+    auto driver = std::unique_ptr<Driver>(new Driver(block));
+    error_or(driver->init());
+    return driver;
+}
+
+#undef assert
+} // namespace fs::exfat
@@ -0,0 +1,213 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace fs::exfat {
+struct BootSector {
+    uint8_t  jump_boot[3];
+    char     fs_name[8]; // "EXFAT   "
+    uint8_t  must_be_zero[53];
+    uint64_t partition_offset;
+    uint64_t volume_length;       // in sectors
+    uint32_t fat_offset;          // in sectors
+    uint32_t fat_length;          // sectors per fat
+    uint32_t cluster_heap_offset; // in sectors
+    uint32_t cluster_count;
+    uint32_t root_cluster;
+    uint32_t volume_serial_number;
+    uint16_t fs_revision;
+    uint16_t volume_flags;
+    uint8_t  bytes_per_sector_shift;
+    uint8_t  sectors_per_cluster_shift;
+    uint8_t  num_fats;
+    uint8_t  drive_select;   // unused
+    uint8_t  percent_in_use; // 0xFF: unknown
+    uint8_t  reserved[7];
+    uint8_t  boot_code[390];
+    uint8_t  signature[2];
+
+    struct Summary {
+        uint16_t bytes_per_sector;
+        uint32_t sectors_per_cluster;
+        uint8_t  bytes_per_sector_shift;
+        uint32_t fat_offset;
+        uint32_t cluster_heap_offset;
+        uint32_t cluster_count;
+        uint32_t root_cluster;
+        uint64_t volume_length;
+    };
+
+    auto is_valid() const -> bool {
+        return std::memcmp(fs_name, "EXFAT   ", 8) == 0 && signature[0] == 0x55 && signature[1] == 0xAA &&
+               bytes_per_sector_shift >= 9 && bytes_per_sector_shift <= 12 && bytes_per_sector_shift + sectors_per_cluster_shift <= 25;
+    }
+
+    auto summary() const -> Summary {
+        return Summary{uint16_t(1u << bytes_per_sector_shift), 1u << sectors_per_cluster_shift, bytes_per_sector_shift, fat_offset, cluster_heap_offset, cluster_count, root_cluster, volume_length};
+    }
+} __attribute__((packed));
+
+static_assert(sizeof(BootSector) == 512);
+
+constexpr auto end_of_cluster_chain = uint32_t(0xFFFFFFFF);
+constexpr auto bad_cluster          = uint32_t(0xFFFFFFF7);
+
+enum EntryType : uint8_t {
+    EndOfDirectory = 0x00,
+    InUse          = 0x80, // set in every valid entry
+    Secondary      = 0x40, // set in secondary entries
+    Bitmap         = 0x81,
+    Upcase         = 0x82,
+    VolumeLabel    = 0x83,
+    File           = 0x85,
+    Stream         = 0xC0,
+    FileName       = 0xC1,
+};
+
+enum Attribute : uint16_t {
+    ReadOnly  = 0x01,
+    Hidden    = 0x02,
+    System    = 0x04,
+    Directory = 0x10,
+    Archive   = 0x20,
+};
+
+struct FileEntry {
+    EntryType type;
+    uint8_t   secondary_count;
+    uint16_t  set_checksum;
+    uint16_t  attributes;
+    uint16_t  reserved1;
+    uint32_t  create_timestamp;
+    uint32_t  modify_timestamp;
+    uint32_t  access_timestamp;
+    uint8_t   create_10ms;
+    uint8_t   modify_10ms;
+    uint8_t   create_utc_offset;
+    uint8_t   modify_utc_offset;
+    uint8_t   access_utc_offset;
+    uint8_t   reserved2[7];
+} __attribute__((packed));
+
+static_assert(sizeof(FileEntry) == 32);
+
+struct StreamEntry {
+    enum Flags : uint8_t {
+        AllocationPossible = 0x01,
+        NoFatChain         = 0x02, // the data is contiguous, the fat is not maintained
+    };
+
+    EntryType type;
+    uint8_t   flags;
+    uint8_t   reserved1;
+    uint8_t   name_length; // in utf-16 units
+    uint16_t  name_hash;
+    uint16_t  reserved2;
+    uint64_t  valid_data_length; // bytes past this are read as zero
+    uint32_t  reserved3;
+    uint32_t  first_cluster;
+    uint64_t  data_length;
+} __attribute__((packed));
+
+static_assert(sizeof(StreamEntry) == 32);
+
+struct NameEntry {
+    constexpr static auto chars_per_entry = 15;
+
+    EntryType type;
+    uint8_t   flags;
+    char16_t  name[chars_per_entry];
+} __attribute__((packed));
+
+static_assert(sizeof(NameEntry) == 32);
+
+// allocation bitmap and up-case table
+struct SystemEntry {
+    EntryType type;
+    uint8_t   flags;
+    uint8_t   reserved1[2];
+    uint32_t  table_checksum; // up-case table only
+    uint8_t   reserved2[12];
+    uint32_t  first_cluster;
+    uint64_t  data_length;
+} __attribute__((packed));
+
+static_assert(sizeof(SystemEntry) == 32);
+
+constexpr auto max_name_length = 255;
+constexpr auto max_secondaries = 1 + (max_name_length + NameEntry::chars_per_entry - 1) / NameEntry::chars_per_entry; // stream and names
+
+// over all entries of a set except the checksum field itself
+inline auto calc_set_checksum(const uint8_t* const entries, const size_t count) -> uint16_t {
+    auto sum = uint16_t(0);
+    for(auto i = size_t(0); i < count * 32; i += 1) {
+        if(i == 2 || i == 3) {
+            continue;
+        }
+        sum = ((sum & 1) ? 0x8000 : 0) + (sum >> 1) + entries[i];
+    }
+    return sum;
+}
+
+// name must be up-cased already
+inline auto calc_name_hash(const char16_t* const name, const size_t length) -> uint16_t {
+    auto hash = uint16_t(0);
+    for(auto i = size_t(0); i < length; i += 1) {
+        for(const auto byte : {uint8_t(name[i]), uint8_t(name[i] >> 8)}) {
+            hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + byte;
+        }
+    }
+    return hash;
+}
+
+inline auto calc_table_checksum(const uint8_t* const data, const size_t size) -> uint32_t {
+    auto sum = uint32_t(0);
+    for(auto i = size_t(0); i < size; i += 1) {
+        sum = ((sum & 1) ? 0x80000000 : 0) + (sum >> 1) + data[i];
+    }
+    return sum;
+}
+
+// case folding of the basic multilingual plane
+class UpcaseTable {
+  private:
+    std::vector<char16_t> table; // empty means ascii only
+
+  public:
+    auto upcase(const char16_t c) const -> char16_t {
+        if(table.empty()) {
+            return c >= u'a' && c <= u'z' ? c - u'a' + u'A' : c;
+        }
+        return table[c];
+    }
+
+    // the table on disk is either a plain array or compressed with 0xFFFF followed by a length of identity mappings
+    // returns false if the table is malformed
+    auto load(const char16_t* const data, const size_t units) -> bool {
+        auto decoded = std::vector<char16_t>(0x10000);
+        auto c       = size_t(0);
+        for(auto i = size_t(0); i < units && c < decoded.size(); i += 1) {
+            if(data[i] == 0xFFFF && i + 1 < units) {
+                for(const auto end = std::min(c + data[i + 1], decoded.size()); c < end; c += 1) {
+                    decoded[c] = c;
+                }
+                i += 1;
+                continue;
+            }
+            decoded[c] = data[i];
+            c += 1;
+        }
+        if(c < 128) {
+            return false;
+        }
+        // characters past the table map to themselves
+        for(; c < decoded.size(); c += 1) {
+            decoded[c] = c;
+        }
+        table = std::move(decoded);
+        return true;
+    }
+};
+} // namespace fs::exfat
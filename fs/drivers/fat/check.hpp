@@ -0,0 +1,304 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../../../thread-pool.hpp"
+#include "driver.hpp"
+
+namespace fs::fat {
+struct CheckIssue {
+    enum class Kind {
+        CrossLink,   // the cluster already belongs to another chain, or appears twice in one
+        BrokenChain, // the chain reaches a free, bad or out of range cluster
+        BadSize,     // the file size does not match the chain length
+        LFNChecksum, // a long name does not belong to its short entry
+        ReadError,
+    };
+
+    Kind        kind;
+    std::string path;
+    uint32_t    cluster;
+};
+
+struct CheckReport {
+    std::vector<CheckIssue> issues;
+    uint32_t                files              = 0;
+    uint32_t                directories        = 0;
+    uint32_t                reachable_clusters = 0;
+    uint32_t                lost_clusters      = 0; // allocated but not reachable from the root
+    std::vector<uint32_t>   lost_chains;            // first clusters of the lost chains
+
+    auto is_clean() const -> bool {
+        return issues.empty() && lost_clusters == 0;
+    }
+};
+
+namespace impl {
+// serves a directory to DirectoryIterator from memory
+// the fat comes from the in-memory copy and the clusters of the directory are loaded up front
+class DirectoryImage : public block::BlockDevice {
+  private:
+    block::BlockDevice&                  parent;
+    std::mutex&                          parent_mutex;
+    const block::DeviceInfo              info;
+    const BPB::Summary&                  bpb;
+    const std::vector<uint32_t>&         fat;
+    std::unordered_map<uint32_t, size_t> offsets; // cluster -> offset in data
+    std::vector<uint8_t>                 data;
+
+    auto get_data_start() const -> size_t {
+        return bpb.reserved_sector_count + bpb.fat_size_32 * bpb.num_fats;
+    }
+
+  public:
+    auto get_info() -> block::DeviceInfo override {
+        return info;
+    }
+
+    auto read_sector(const size_t sector, const size_t count, void* const buffer) -> Error override {
+        const auto fat_sectors = fat.size() * sizeof(uint32_t) / bpb.bytes_per_sector;
+        if(sector >= bpb.reserved_sector_count && sector + count <= bpb.reserved_sector_count + fat_sectors) {
+            std::memcpy(buffer, reinterpret_cast<const uint8_t*>(fat.data()) + (sector - bpb.reserved_sector_count) * bpb.bytes_per_sector, count * bpb.bytes_per_sector);
+            return Error();
+        }
+
+        const auto data_start = get_data_start();
+        if(sector >= data_start && (sector - data_start) % bpb.sectors_per_cluster == 0 && count == bpb.sectors_per_cluster) {
+            if(const auto p = offsets.find((sector - data_start) / bpb.sectors_per_cluster + 2); p != offsets.end()) {
+                std::memcpy(buffer, data.data() + p->second, count * bpb.bytes_per_sector);
+                return Error();
+            }
+        }
+
+        const auto lock = std::lock_guard(parent_mutex);
+        return parent.read_sector(sector, count, buffer);
+    }
+
+    auto write_sector(const size_t sector, const size_t count, const void* const buffer) -> Error override {
+        return Error::Code::NotImplemented;
+    }
+
+    // runs of consecutive clusters are read at once
+    auto load(const std::vector<uint32_t>& chain) -> Error {
+        const auto bytes_per_cluster = size_t(bpb.bytes_per_sector) * bpb.sectors_per_cluster;
+        data.resize(chain.size() * bytes_per_cluster);
+        for(auto first = size_t(0); first < chain.size();) {
+            auto last = first + 1;
+            while(last < chain.size() && chain[last] == chain[last - 1] + 1) {
+                last += 1;
+            }
+            const auto sector = get_data_start() + size_t(chain[first] - 2) * bpb.sectors_per_cluster;
+            {
+                const auto lock = std::lock_guard(parent_mutex);
+                if(const auto e = parent.read_sector(sector, (last - first) * bpb.sectors_per_cluster, data.data() + first * bytes_per_cluster)) {
+                    return e;
+                }
+            }
+            for(auto i = first; i < last; i += 1) {
+                offsets.emplace(chain[i], i * bytes_per_cluster);
+            }
+            first = last;
+        }
+        return Error();
+    }
+
+    DirectoryImage(block::BlockDevice& parent, std::mutex& parent_mutex, const block::DeviceInfo info, const BPB::Summary& bpb, const std::vector<uint32_t>& fat) : parent(parent),
+                                                                                                                                                                  parent_mutex(parent_mutex),
+                                                                                                                                                                  info(info),
+                                                                                                                                                                  bpb(bpb),
+                                                                                                                                                                  fat(fat) {}
+};
+
+class Checker {
+  private:
+    struct Task {
+        uint32_t    cluster;
+        std::string path;
+    };
+
+    // merged after the walk, so that workers do not share them
+    struct WorkerResult {
+        std::vector<CheckIssue> issues;
+        uint32_t                files       = 0;
+        uint32_t                directories = 0;
+    };
+
+    Driver&                            driver;
+    const BPB::Summary&                bpb;
+    block::BlockDevice&                block;
+    const block::DeviceInfo            info;
+    std::mutex                         block_mutex;
+    std::vector<uint32_t>              fat;
+    size_t                             entries;
+    size_t                             bytes_per_cluster;
+    std::vector<std::atomic<uint64_t>> reachable;
+    WorkStealingPool<Task>             pool;
+    std::vector<WorkerResult>          results;
+
+    // returns false if the cluster is already marked
+    auto mark(const uint32_t cluster) -> bool {
+        const auto bit = uint64_t(1) << (cluster % 64);
+        return !(reachable[cluster / 64].fetch_or(bit, std::memory_order_relaxed) & bit);
+    }
+
+    auto is_reachable(const uint32_t cluster) const -> bool {
+        return reachable[cluster / 64].load(std::memory_order_relaxed) & (uint64_t(1) << (cluster % 64));
+    }
+
+    // marks the chain starting from head and returns its length
+    // returns nullopt if the chain is broken or cross-linked
+    auto walk_chain(const uint32_t head, const std::string& path, std::vector<CheckIssue>& issues, std::vector<uint32_t>* const chain) -> std::optional<size_t> {
+        auto length  = size_t(0);
+        auto cluster = head;
+        while(true) {
+            const auto next = cluster >= 2 && cluster < entries ? fat[cluster] & fat_entry_mask : 0;
+            if(next == 0 || next == bad_cluster) {
+                issues.push_back(CheckIssue{CheckIssue::Kind::BrokenChain, path, cluster});
+                return std::nullopt;
+            }
+            // the rest of the chain is checked by its other owner
+            if(!mark(cluster)) {
+                issues.push_back(CheckIssue{CheckIssue::Kind::CrossLink, path, cluster});
+                return std::nullopt;
+            }
+            length += 1;
+            if(chain != nullptr) {
+                chain->push_back(cluster);
+            }
+            if(next >= end_of_cluster_chain) {
+                return length;
+            }
+            cluster = next;
+        }
+    }
+
+    auto check_directory(const size_t worker, const Task& task) -> void {
+        auto&      result = results[worker];
+        const auto path   = task.path.empty() ? std::string("/") : task.path;
+
+        auto chain = std::vector<uint32_t>();
+        walk_chain(task.cluster, path, result.issues, &chain);
+        if(chain.empty()) {
+            return;
+        }
+        result.directories += 1;
+
+        auto image = DirectoryImage(block, block_mutex, info, bpb, fat);
+        if(const auto e = image.load(chain)) {
+            result.issues.push_back(CheckIssue{CheckIssue::Kind::ReadError, path, task.cluster});
+            return;
+        }
+
+        // a looped chain would make the iterator run forever
+        const auto limit    = chain.size() * bytes_per_cluster / sizeof(DirectoryEntry);
+        auto       iterator = DirectoryIterator(task.cluster, bpb, image);
+        for(auto n = size_t(0); n < limit; n += 1) {
+            const auto mismatches   = iterator.get_lfn_mismatches();
+            const auto dinfo_result = iterator.read();
+            if(!dinfo_result) {
+                const auto e = dinfo_result.as_error();
+                if(e == Error::Code::BadChecksum) {
+                    result.issues.push_back(CheckIssue{CheckIssue::Kind::LFNChecksum, path, task.cluster});
+                    continue;
+                }
+                if(e != Error::Code::EndOfFile) {
+                    result.issues.push_back(CheckIssue{CheckIssue::Kind::ReadError, path, task.cluster});
+                }
+                break;
+            }
+
+            const auto& dinfo = dinfo_result.as_value();
+            if(dinfo.short_name == "." || dinfo.short_name == "..") {
+                continue;
+            }
+            auto child = task.path + "/" + std::string(dinfo.name);
+            if(iterator.get_lfn_mismatches() != mismatches) {
+                result.issues.push_back(CheckIssue{CheckIssue::Kind::LFNChecksum, child, dinfo.cluster});
+            }
+
+            if(dinfo.attribute & Attribute::Directory) {
+                pool.push(worker, Task{dinfo.cluster, std::move(child)});
+                continue;
+            }
+
+            result.files += 1;
+            const auto expected = (dinfo.size + bytes_per_cluster - 1) / bytes_per_cluster;
+            if(dinfo.cluster == 0) {
+                if(expected != 0) {
+                    result.issues.push_back(CheckIssue{CheckIssue::Kind::BadSize, child, 0});
+                }
+                continue;
+            }
+            if(const auto length = walk_chain(dinfo.cluster, child, result.issues, nullptr); length && *length != expected) {
+                result.issues.push_back(CheckIssue{CheckIssue::Kind::BadSize, child, dinfo.cluster});
+            }
+        }
+    }
+
+    auto find_lost_clusters(CheckReport& report) const -> void {
+        const auto is_lost = [this](const uint32_t cluster) -> bool {
+            const auto entry = fat[cluster] & fat_entry_mask;
+            return entry != 0 && entry != bad_cluster && !is_reachable(cluster);
+        };
+
+        // a lost chain starts at a lost cluster which no other lost cluster points to
+        auto has_predecessor = std::vector<bool>(entries);
+        for(auto c = uint32_t(2); c < entries; c += 1) {
+            if(!is_lost(c)) {
+                continue;
+            }
+            report.lost_clusters += 1;
+            if(const auto next = fat[c] & fat_entry_mask; next >= 2 && next < entries) {
+                has_predecessor[next] = true;
+            }
+        }
+        for(auto c = uint32_t(2); c < entries && report.lost_chains.size() < report.lost_clusters; c += 1) {
+            if(is_lost(c) && !has_predecessor[c]) {
+                report.lost_chains.push_back(c);
+            }
+        }
+    }
+
+  public:
+    auto run() -> Result<CheckReport> {
+        value_or(loaded, driver.load_fat());
+        fat               = std::move(loaded);
+        entries           = std::min(driver.get_fat_entry_count(), fat.size());
+        bytes_per_cluster = size_t(bpb.bytes_per_sector) * bpb.sectors_per_cluster;
+        reachable         = std::vector<std::atomic<uint64_t>>((entries + 63) / 64);
+        results           = std::vector<WorkerResult>(pool.get_workers());
+
+        pool.push(0, Task{bpb.root_cluster, ""});
+        pool.run([this](const size_t worker, const Task& task) { check_directory(worker, task); });
+
+        auto report = CheckReport();
+        for(auto& r : results) {
+            report.files += r.files;
+            report.directories += r.directories;
+            report.issues.insert(report.issues.end(), std::make_move_iterator(r.issues.begin()), std::make_move_iterator(r.issues.end()));
+        }
+        for(const auto& word : reachable) {
+            report.reachable_clusters += std::popcount(word.load(std::memory_order_relaxed));
+        }
+        find_lost_clusters(report);
+        return report;
+    }
+
+    Checker(Driver& driver, const size_t threads) : driver(driver),
+                                                    bpb(driver.get_bpb()),
+                                                    block(driver.get_block_device()),
+                                                    info(block.get_info()),
+                                                    pool(threads) {}
+};
+} // namespace impl
+
+// verifies the whole volume, walking directories in parallel
+// threads == 0 means one per hardware thread
+// block device accesses are serialized, directory parsing and chain validation run concurrently
+inline auto check(Driver& driver, const size_t threads = 0) -> Result<CheckReport> {
+    return impl::Checker(driver, threads).run();
+}
+} // namespace fs::fat
@@ -0,0 +1,132 @@
+#pragma once
+#include <bit>
+#include <cstddef>
+#include <type_traits>
+
+#include "../../../block/block.hpp"
+
+namespace fs::fat {
+// sizes and regions of a volume, computed once at mount and shared by fat and exfat
+// the specifications only allow power-of-two sector and cluster sizes, so hot paths are specialized for them
+// and use shifts and masks instead of divisions, chosen once with specialize()
+struct Geometry {
+    size_t bytes_per_sector;
+    size_t sectors_per_cluster;
+    size_t bytes_per_cluster;
+    size_t fat_start;  // first sector of the first fat
+    size_t data_start; // first sector of cluster 2
+    size_t data_last;  // last sector of the volume
+
+    // valid if power_of_two is set
+    uint32_t sector_shift;
+    uint32_t cluster_shift;
+    uint32_t sectors_per_cluster_shift;
+    bool     power_of_two;
+
+    template <bool shift>
+    auto sector_index(const size_t bytes) const -> size_t {
+        if constexpr(shift) {
+            return bytes >> sector_shift;
+        } else {
+            return bytes / bytes_per_sector;
+        }
+    }
+
+    template <bool shift>
+    auto sector_offset(const size_t bytes) const -> size_t {
+        if constexpr(shift) {
+            return bytes & (bytes_per_sector - 1);
+        } else {
+            return bytes % bytes_per_sector;
+        }
+    }
+
+    template <bool shift>
+    auto cluster_index(const size_t bytes) const -> size_t {
+        if constexpr(shift) {
+            return bytes >> cluster_shift;
+        } else {
+            return bytes / bytes_per_cluster;
+        }
+    }
+
+    template <bool shift>
+    auto cluster_offset(const size_t bytes) const -> size_t {
+        if constexpr(shift) {
+            return bytes & (bytes_per_cluster - 1);
+        } else {
+            return bytes % bytes_per_cluster;
+        }
+    }
+
+    template <bool shift>
+    auto cluster_to_sector(const size_t cluster) const -> size_t {
+        if constexpr(shift) {
+            return data_start + ((cluster - 2) << sectors_per_cluster_shift);
+        } else {
+            return data_start + (cluster - 2) * sectors_per_cluster;
+        }
+    }
+
+    // calls fn(std::true_type()) if the shift paths apply, fn(std::false_type()) otherwise
+    template <class F>
+    auto specialize(F&& fn) const -> decltype(auto) {
+        return power_of_two ? fn(std::true_type()) : fn(std::false_type());
+    }
+};
+
+inline auto make_geometry(const size_t bytes_per_sector, const size_t sectors_per_cluster, const size_t fat_start, const size_t data_start, const size_t data_last) -> Geometry {
+    auto g                      = Geometry();
+    g.bytes_per_sector          = bytes_per_sector;
+    g.sectors_per_cluster       = sectors_per_cluster;
+    g.bytes_per_cluster         = bytes_per_sector * sectors_per_cluster;
+    g.fat_start                 = fat_start;
+    g.data_start                = data_start;
+    g.data_last                 = data_last;
+    g.power_of_two              = std::has_single_bit(bytes_per_sector) && std::has_single_bit(sectors_per_cluster);
+    g.sector_shift              = std::countr_zero(bytes_per_sector);
+    g.cluster_shift             = std::countr_zero(g.bytes_per_cluster);
+    g.sectors_per_cluster_shift = std::countr_zero(sectors_per_cluster);
+    return g;
+}
+
+class ClusterOperator {
+  private:
+    Geometry            geometry;
+    block::BlockDevice& block;
+
+    template <bool write>
+    auto cluster_operation(const size_t cluster, const size_t count, std::conditional_t<write, const uint8_t*, uint8_t*> buffer) -> Error {
+        const auto sector = geometry.cluster_to_sector<false>(cluster);
+        const auto length = count * geometry.sectors_per_cluster;
+        if(cluster < 2 || (sector + length - 1) > geometry.data_last) {
+            return Error::Code::IndexOutOfRange;
+        }
+        if constexpr(write) {
+            return block.write_sector(sector, length, buffer);
+        } else {
+            return block.read_sector(sector, length, buffer);
+        }
+    }
+
+  public:
+    auto read_cluster(const size_t cluster, uint8_t* const buffer) -> Error {
+        return cluster_operation<false>(cluster, 1, buffer);
+    }
+
+    auto write_cluster(const size_t cluster, const uint8_t* const buffer) -> Error {
+        return cluster_operation<true>(cluster, 1, buffer);
+    }
+
+    // consecutive clusters in one request
+    auto read_clusters(const size_t cluster, const size_t count, uint8_t* const buffer) -> Error {
+        return cluster_operation<false>(cluster, count, buffer);
+    }
+
+    auto get_cluster_size_bytes() const -> size_t {
+        return geometry.bytes_per_cluster;
+    }
+
+    ClusterOperator(const Geometry& geometry, block::BlockDevice& block) : geometry(geometry), block(block) {}
+};
+} // namespace fs::fat
@@ -0,0 +1,321 @@
+#pragma once
+#include <algorithm>
+#include <optional>
+#include <vector>
+
+#include "check.hpp"
+#include "driver.hpp"
+
+namespace fs::fat {
+#define error_or(c)        \
+    if(const auto e = c) { \
+        return e;          \
+    }
+
+struct DefragReport {
+    uint32_t files             = 0;
+    uint32_t directories       = 0; // except the root
+    size_t   extents_before    = 0;
+    size_t   extents_after     = 0;
+    uint32_t fragmented_before = 0; // chains made of more than one extent
+    uint32_t fragmented_after  = 0;
+    uint32_t moved             = 0;
+    uint32_t skipped           = 0; // no free run was large enough
+    size_t   clusters_moved    = 0;
+};
+
+namespace impl {
+// relocates every fragmented chain into a free run of clusters
+//
+// a move is ordered so that a crash at any point leaves a consistent volume, at worst with lost clusters
+//  1. copy the data into the free run
+//  2. link the new chain in every fat, it is unreachable so far
+//  3. point the directory entry(and "." and ".." entries for directories) to the new chain
+//  4. free the old chain in every fat
+class Defragmenter {
+  private:
+    struct Chain {
+        uint32_t                    first;
+        uint32_t                    length; // in clusters
+        uint32_t                    depth;
+        bool                        directory;
+        DirectoryIterator::Position entry; // short entry in the parent directory
+    };
+
+    Driver&               driver;
+    const BPB::Summary&   bpb;
+    block::BlockDevice&   block;
+    size_t                bytes_per_cluster;
+    size_t                data_start;
+    size_t                entries;
+    std::vector<uint32_t> fat;
+    std::vector<Chain>    chains;
+    uint32_t              search_hint = 2;
+
+    auto get_chain(const uint32_t first) const -> std::vector<uint32_t> {
+        auto r = std::vector<uint32_t>();
+        for(auto cluster = first; r.size() < entries;) {
+            r.push_back(cluster);
+            const auto next = fat[cluster] & fat_entry_mask;
+            if(is_end_of_chain(next) || next >= entries) {
+                break;
+            }
+            cluster = next;
+        }
+        return r;
+    }
+
+    auto count_extents(const uint32_t first) const -> size_t {
+        const auto chain = get_chain(first);
+        auto       r     = size_t(1);
+        for(auto i = size_t(1); i < chain.size(); i += 1) {
+            if(chain[i] != chain[i - 1] + 1) {
+                r += 1;
+            }
+        }
+        return r;
+    }
+
+    auto cluster_to_sector(const uint32_t cluster) const -> size_t {
+        return data_start + size_t(cluster - 2) * bpb.sectors_per_cluster;
+    }
+
+    // walks the tree from the root
+    auto collect() -> Error {
+        auto directories = std::vector<std::pair<uint32_t, uint32_t>>{{bpb.root_cluster, 0}}; // first cluster, depth
+        while(!directories.empty()) {
+            const auto [cluster, depth] = directories.back();
+            directories.pop_back();
+
+            auto iterator = DirectoryIterator(cluster, bpb, block);
+            while(true) {
+                const auto dinfo_result = iterator.read();
+                if(!dinfo_result) {
+                    const auto e = dinfo_result.as_error();
+                    if(e == Error::Code::EndOfFile) {
+                        break;
+                    }
+                    return e;
+                }
+                const auto& dinfo = dinfo_result.as_value();
+                if(dinfo.short_name == "." || dinfo.short_name == ".." || dinfo.cluster == 0) {
+                    continue;
+                }
+
+                // the iterator stops right after the short entry
+                auto position = iterator.get_position();
+                position.index -= 1;
+
+                const auto directory = (dinfo.attribute & Attribute::Directory) != 0;
+                chains.push_back(Chain{dinfo.cluster, uint32_t(get_chain(dinfo.cluster).size()), depth + 1, directory, position});
+                if(directory) {
+                    directories.emplace_back(dinfo.cluster, depth + 1);
+                }
+            }
+        }
+        return Error();
+    }
+
+    // first fit, continuing from the previous allocation
+    auto find_free_run(const uint32_t length) -> std::optional<uint32_t> {
+        for(const auto& [begin, end] : {std::pair<size_t, size_t>(search_hint, entries), std::pair<size_t, size_t>(2, std::min(size_t(search_hint) + length, entries))}) {
+            auto run = size_t(0);
+            for(auto c = begin; c < end; c += 1) {
+                run = (fat[c] & fat_entry_mask) == 0 ? run + 1 : 0;
+                if(run == length) {
+                    search_hint = c + 1;
+                    return uint32_t(c + 1 - length);
+                }
+            }
+        }
+        return std::nullopt;
+    }
+
+    auto set_fat(const uint32_t cluster, const uint32_t value) -> void {
+        // upper 4 bits are reserved
+        fat[cluster] = (fat[cluster] & ~uint32_t(fat_entry_mask)) | value;
+    }
+
+    // writes the sectors holding the entries of clusters to every fat
+    auto write_fat(std::vector<uint32_t> clusters) -> Error {
+        const auto entries_per_sector = bpb.bytes_per_sector / sizeof(uint32_t);
+        std::sort(clusters.begin(), clusters.end());
+
+        auto sectors = std::vector<size_t>();
+        for(const auto c : clusters) {
+            if(sectors.empty() || sectors.back() != c / entries_per_sector) {
+                sectors.push_back(c / entries_per_sector);
+            }
+        }
+        for(auto copy = size_t(0); copy < bpb.num_fats; copy += 1) {
+            const auto fat_start = bpb.reserved_sector_count + copy * bpb.fat_size_32;
+            for(auto first = size_t(0); first < sectors.size();) {
+                auto last = first + 1;
+                while(last < sectors.size() && sectors[last] == sectors[last - 1] + 1) {
+                    last += 1;
+                }
+                error_or(block.write_sector(fat_start + sectors[first], last - first, fat.data() + sectors[first] * entries_per_sector));
+                first = last;
+            }
+        }
+        return Error();
+    }
+
+    // rewrites the first cluster of the short entry at position
+    // if expected_name is given, the entry is updated only if it has the name
+    auto update_entry(const DirectoryIterator::Position position, const uint32_t cluster, const char* const expected_name = nullptr) -> Error {
+        const auto offset = size_t(position.index) * sizeof(DirectoryEntry);
+        const auto sector = cluster_to_sector(position.cluster) + offset / bpb.bytes_per_sector;
+
+        auto buffer = std::vector<uint8_t>(bpb.bytes_per_sector);
+        error_or(block.read_sector(sector, 1, buffer.data()));
+        auto& entry = *reinterpret_cast<DirectoryEntry*>(buffer.data() + offset % bpb.bytes_per_sector);
+        if(expected_name != nullptr && std::memcmp(entry.name, expected_name, sizeof(entry.name)) != 0) {
+            return Error();
+        }
+        entry.set_first_cluster(cluster);
+        return block.write_sector(sector, 1, buffer.data());
+    }
+
+    // copies old clusters to the run starting at destination
+    // reads are grouped by runs of consecutive clusters, writes are sequential
+    auto copy_chain(const std::vector<uint32_t>& from, const uint32_t destination, const bool directory) -> Error {
+        constexpr auto batch_bytes = size_t(1024 * 1024);
+
+        const auto batch_clusters = std::max(batch_bytes / bytes_per_cluster, size_t(1));
+
+        auto buffer = std::vector<uint8_t>(std::min(batch_clusters, from.size()) * bytes_per_cluster);
+        for(auto base = size_t(0); base < from.size(); base += batch_clusters) {
+            const auto count = std::min(batch_clusters, from.size() - base);
+            for(auto first = base; first < base + count;) {
+                auto last = first + 1;
+                while(last < base + count && from[last] == from[last - 1] + 1) {
+                    last += 1;
+                }
+                error_or(block.read_sector(cluster_to_sector(from[first]), (last - first) * bpb.sectors_per_cluster, buffer.data() + (first - base) * bytes_per_cluster));
+                first = last;
+            }
+
+            // "." of a directory refers to itself
+            if(directory && base == 0) {
+                auto& dot = *reinterpret_cast<DirectoryEntry*>(buffer.data());
+                if(std::memcmp(dot.name, ".          ", sizeof(dot.name)) == 0) {
+                    dot.set_first_cluster(destination);
+                }
+            }
+            error_or(block.write_sector(cluster_to_sector(destination + base), count * bpb.sectors_per_cluster, buffer.data()));
+        }
+        return Error();
+    }
+
+    // returns false if there is no room for the chain
+    auto move(Chain& chain) -> Result<bool> {
+        const auto destination_result = find_free_run(chain.length);
+        if(!destination_result) {
+            return false;
+        }
+        const auto destination = *destination_result;
+        const auto old_chain   = get_chain(chain.first);
+        error_or(copy_chain(old_chain, destination, chain.directory));
+
+        auto new_chain = std::vector<uint32_t>(chain.length);
+        for(auto i = uint32_t(0); i < chain.length; i += 1) {
+            new_chain[i] = destination + i;
+            set_fat(destination + i, i + 1 == chain.length ? fat_entry_mask : destination + i + 1);
+        }
+        error_or(write_fat(new_chain));
+
+        error_or(update_entry(chain.entry, destination));
+        // entries in this directory have moved along with it
+        for(auto& child : chains) {
+            const auto i = chain.directory ? std::find(old_chain.begin(), old_chain.end(), child.entry.cluster) : old_chain.end();
+            if(i == old_chain.end()) {
+                continue;
+            }
+            child.entry.cluster = destination + (i - old_chain.begin());
+            // ".." of subdirectories refers to the parent
+            if(child.directory) {
+                error_or(update_entry(DirectoryIterator::Position{child.first, 1}, destination, "..         "));
+            }
+        }
+
+        for(const auto c : old_chain) {
+            set_fat(c, 0);
+        }
+        error_or(write_fat(old_chain));
+        chain.first = destination;
+        return true;
+    }
+
+  public:
+    auto run() -> Result<DefragReport> {
+        value_or(loaded, driver.load_fat());
+        fat               = std::move(loaded);
+        entries           = std::min(driver.get_fat_entry_count(), fat.size());
+        bytes_per_cluster = size_t(bpb.bytes_per_sector) * bpb.sectors_per_cluster;
+        data_start        = bpb.reserved_sector_count + bpb.fat_size_32 * bpb.num_fats;
+        error_or(collect());
+
+        auto report = DefragReport();
+        for(const auto& chain : chains) {
+            const auto extents = count_extents(chain.first);
+            if(chain.directory) {
+                report.directories += 1;
+            } else {
+                report.files += 1;
+            }
+            report.extents_before += extents;
+            report.fragmented_before += extents > 1 ? 1 : 0;
+        }
+
+        // entries of a chain live in its parent, so files go first and then directories from the deepest
+        // a parent is never moved before its children
+        std::stable_sort(chains.begin(), chains.end(), [](const Chain& a, const Chain& b) {
+            return a.directory != b.directory ? !a.directory : a.depth > b.depth;
+        });
+        for(auto& chain : chains) {
+            if(count_extents(chain.first) == 1) {
+                continue;
+            }
+            // chains moved before a failure are already on disk, so the driver forgets what it read of the old ones
+            const auto moved = move(chain);
+            if(!moved) {
+                driver.invalidate_directory_index();
+                return moved.as_error();
+            }
+            if(moved.as_value()) {
+                report.moved += 1;
+                report.clusters_moved += chain.length;
+            } else {
+                report.skipped += 1;
+            }
+        }
+
+        for(const auto& chain : chains) {
+            const auto extents = count_extents(chain.first);
+            report.extents_after += extents;
+            report.fragmented_after += extents > 1 ? 1 : 0;
+        }
+        driver.invalidate_directory_index();
+        return report;
+    }
+
+    Defragmenter(Driver& driver) : driver(driver),
+                                   bpb(driver.get_bpb()),
+                                   block(driver.get_block_device()) {}
+};
+} // namespace impl
+
+// makes every file and directory except the root contiguous, where free space allows
+// the volume must not be in use, refuses to run on a volume with cross-linked or broken chains
+inline auto defragment(Driver& driver) -> Result<DefragReport> {
+    value_or(check_report, check(driver));
+    if(!check_report.issues.empty()) {
+        logger(LogLevel::Error, "fat: refusing to defragment a volume with %lu issues\n", check_report.issues.size());
+        return Error::Code::InvalidData;
+    }
+    return impl::Defragmenter(driver).run();
+}
+
+#undef error_or
+} // namespace fs::fat
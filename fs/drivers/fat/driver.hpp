@@ -1,10 +1,24 @@
 #pragma once
+#include <condition_variable>
+#include <mutex>
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "../../../block/block.hpp"
+#include "../../../encoding.hpp"
 #include "../../../macro.hpp"
+#include "../../../simd.hpp"
 #include "../../fs.hpp"
+#include "cluster.hpp"
+#include "entry-scan.hpp"
+#include "fat-cache.hpp"
 #include "fat.hpp"
+#include "prefetch.hpp"
 
 namespace fs::fat {
 
@@ -13,82 +27,125 @@ namespace fs::fat {
         return e;    \
     }
 
+// names are views of a buffer owned by the producer
 struct DirectoryInfo {
-    uint32_t    cluster;
-    uint32_t    size;
-    std::string name;
-    Attribute   attribute;
+    uint32_t         cluster;
+    uint32_t         size;
+    std::string_view name;
+    std::string_view short_name;
+    Attribute        attribute;
 };
 
-class ClusterOperator {
+inline auto geometry_from_bpb(const BPB::Summary& bpb) -> Geometry {
+    const auto data_start = size_t(bpb.reserved_sector_count) + size_t(bpb.fat_size_32) * bpb.num_fats;
+    return make_geometry(bpb.bytes_per_sector, bpb.sectors_per_cluster, bpb.reserved_sector_count, data_start, size_t(bpb.total_sectors_32) - 1);
+}
+
+constexpr auto end_of_cluster_chain = 0x0FFFFFF8;
+constexpr auto bad_cluster          = 0x0FFFFFF7;
+constexpr auto fat_entry_mask       = 0x0FFFFFFF;
+
+template <bool shift>
+inline auto read_fat_for_cluster(const uint32_t cluster, const Geometry& geometry, block::BlockDevice& block) -> Result<uint32_t> {
+    // fat[0] and fat[1] are reserved
+
+    const auto sector = geometry.fat_start + geometry.sector_index<shift>(size_t(cluster) * 4);
+    const auto offset = geometry.sector_offset<shift>(size_t(cluster) * 4);
+
+    thread_local auto buffer = std::vector<uint8_t>();
+    buffer.resize(geometry.bytes_per_sector);
+    error_or(block.read_sector(sector, 1, buffer.data()));
+    return uint32_t(*reinterpret_cast<uint32_t*>(buffer.data() + offset));
+}
+
+inline auto read_fat_for_cluster(const uint32_t cluster, const BPB::Summary& bpb, block::BlockDevice& block) -> Result<uint32_t> {
+    const auto geometry = geometry_from_bpb(bpb);
+    return geometry.specialize([&](const auto shift) { return read_fat_for_cluster<decltype(shift)::value>(cluster, geometry, block); });
+}
+
+inline auto is_end_of_chain(const uint32_t entry) -> bool {
+    const auto cluster = entry & fat_entry_mask;
+    return cluster < 2 || cluster >= bad_cluster;
+}
+
+class DirectoryIterator {
+  public:
+    struct Position {
+        uint32_t cluster;
+        uint32_t index;
+    };
+
   private:
-    const BPB::Summary& bpb;
-    block::BlockDevice& block;
-
-    template <bool write>
-    auto cluster_operation(const size_t cluster, std::conditional_t<write, const uint8_t*, uint8_t*> buffer) -> Error {
-        const auto fat_start  = bpb.reserved_sector_count;
-        const auto fat_last   = fat_start + bpb.fat_size_32 * bpb.num_fats - 1;
-        const auto data_start = fat_last + 1;
-        const auto data_last  = bpb.total_sectors_32 - 1;
-
-        const auto sector = data_start + (cluster - 2) * bpb.sectors_per_cluster;
-        if((sector + bpb.sectors_per_cluster - 1) > data_last) {
-            return Error::Code::IndexOutOfRange;
+    uint32_t                cluster;
+    uint32_t                index;
+    const BPB::Summary&     bpb;
+    block::BlockDevice&     block;
+    FatCache*               fat; // chains are followed through it if given, otherwise the fat is read from block
+    ClusterOperator         op;
+    std::vector<uint8_t>    buffer;
+    std::vector<EntryMasks> masks;              // classification of buffer, 64 entries per element
+    uint32_t                loaded_cluster = 0; // cluster currently held in buffer, 0 if none
+    size_t                  lfn_mismatches = 0; // long names dropped since they do not belong to the short entry
+
+    // decoding buffers of the last read entry, DirectoryInfo refers to them
+    std::array<char16_t, LFNEntry::max_entries * LFNEntry::chars_per_entry>                  lfn_buffer;
+    std::array<char, u8_capacity_for_u16(LFNEntry::max_entries * LFNEntry::chars_per_entry)> name_buffer;
+    std::array<char, 12>                                                                     short_name_buffer;
+
+    auto load_cluster() -> Error {
+        if(loaded_cluster == cluster) {
+            return Error();
         }
-        if constexpr(write) {
-            return block.write_sector(sector, bpb.sectors_per_cluster, buffer);
-        } else {
-            return block.read_sector(sector, bpb.sectors_per_cluster, buffer);
+        if(buffer.empty()) {
+            buffer.resize(op.get_cluster_size_bytes());
+            masks.resize((get_entries_per_cluster() + 63) / 64);
         }
-    }
+        loaded_cluster = 0;
+        error_or(op.read_cluster(cluster, buffer.data()));
+        loaded_cluster = cluster;
 
-  public:
-    auto read_cluster(const size_t cluster, uint8_t* const buffer) -> Error {
-        return cluster_operation<false>(cluster, buffer);
+        const auto entries = get_entries_per_cluster();
+        for(auto i = size_t(0); i < masks.size(); i += 1) {
+            masks[i] = classify_entries(entry_at(i * 64), std::min(entries - i * 64, size_t(64)));
+        }
+        return Error();
     }
 
-    auto write_cluster(const size_t cluster, const uint8_t* const buffer) -> Error {
-        return cluster_operation<true>(cluster, buffer);
+    auto get_entries_per_cluster() const -> size_t {
+        return op.get_cluster_size_bytes() / sizeof(DirectoryEntry);
     }
 
-    auto get_cluster_size_bytes() const -> size_t {
-        return block.get_info().bytes_per_sector * bpb.sectors_per_cluster;
+    auto entry_at(const size_t i) -> DirectoryEntry* {
+        return reinterpret_cast<DirectoryEntry*>(buffer.data()) + i;
     }
 
-    ClusterOperator(const BPB::Summary& bpb, block::BlockDevice& block) : bpb(bpb), block(block) {}
-};
-
-constexpr auto end_of_cluster_chain = 0x0FFFFFF8;
-
-inline auto read_fat_for_cluster(const uint32_t cluster, const BPB::Summary& bpb, block::BlockDevice& block) -> uint32_t {
-    // fat[0] and fat[1] are reserved
-
-    const auto sector = bpb.reserved_sector_count + (cluster * 4 / bpb.bytes_per_sector);
-    const auto offset = cluster * 4 % bpb.bytes_per_sector;
+    // the first entry at or after i which is not deleted nor a volume label
+    // returns the number of entries in the cluster if there are none
+    auto next_live_entry(const size_t i) const -> size_t {
+        for(auto group = i / 64; group < masks.size(); group += 1) {
+            const auto& m    = masks[group];
+            const auto  from = group == i / 64 ? i % 64 : 0;
+            const auto  live = (m.free | m.lfn | m.short_name) & (~uint64_t(0) << from);
+            if(live != 0) {
+                return group * 64 + std::countr_zero(live);
+            }
+        }
+        return get_entries_per_cluster();
+    }
 
-    auto buffer = std::vector<uint8_t>(block.get_info().bytes_per_sector);
-    block.read_sector(sector, 1, buffer.data());
-    return *reinterpret_cast<uint32_t*>(buffer.data() + offset);
-}
+    auto is_lfn(const size_t i) const -> bool {
+        return masks[i / 64].lfn & (uint64_t(1) << (i % 64));
+    }
 
-inline auto increment_fat(uint32_t& cluster, const uint32_t count, const BPB::Summary& bpb, block::BlockDevice& block) -> bool {
-    for(auto i = size_t(0); i < count; i += 1) {
-        if(cluster == end_of_cluster_chain) {
-            return false;
+    auto next_cluster() -> Error {
+        value_or(next, fat != nullptr ? fat->get(cluster) : read_fat_for_cluster(cluster, bpb, block));
+        if(is_end_of_chain(next)) {
+            return Error::Code::EndOfFile;
         }
-        cluster = read_fat_for_cluster(cluster, bpb, block);
+        cluster = next & fat_entry_mask;
+        index   = 0;
+        return Error();
     }
-    return true;
-}
-
-class DirectoryIterator {
-  private:
-    uint32_t            cluster;
-    uint32_t            index;
-    const BPB::Summary& bpb;
-    block::BlockDevice& block;
-    ClusterOperator     op;
 
   public:
     auto skip(const size_t count) -> Error {
@@ -96,157 +153,574 @@ class DirectoryIterator {
             return Error();
         }
 
-        const auto cluster_size_bytes         = op.get_cluster_size_bytes();
-        const auto directory_entry_table_size = cluster_size_bytes / sizeof(DirectoryEntry);
+        const auto directory_entry_table_size = get_entries_per_cluster();
 
-        auto count_current = 0;
-        auto buffer        = std::vector<uint8_t>(cluster_size_bytes);
+        auto count_current = size_t(0);
 
         while(true) { // iterate over clusters(fats)
-            error_or(op.read_cluster(cluster, buffer.data()));
-
-            while(index < directory_entry_table_size) { // iterate over directory entries
-                auto& entry = *reinterpret_cast<DirectoryEntry*>(buffer.data() + sizeof(DirectoryEntry) * (index % directory_entry_table_size));
-                index += 1;
-                if(entry.name[0] == 0xE5) {
-                    continue;
-                } else if(entry.name[0] == 0x00) {
-                    return Error::Code::EndOfFile;
-                }
-                if(entry.attr & Attribute::LongName) {
-                    continue;
-                }
-
-                count_current += 1;
-                if(count_current == count) {
+            error_or(load_cluster());
+
+            while(index < directory_entry_table_size) { // iterate over groups of 64 entries
+                const auto& m     = masks[index / 64];
+                const auto  valid = ~uint64_t(0) << (index % 64);
+                const auto  end   = m.free & valid;
+                // entries after the first free one are garbage
+                const auto shorts = m.short_name & valid & (end != 0 ? (end & -end) - 1 : ~uint64_t(0));
+                const auto found  = size_t(std::popcount(shorts));
+                if(count_current + found >= count) {
+                    auto rest = shorts;
+                    for(auto i = count_current + 1; i < count; i += 1) {
+                        rest &= rest - 1;
+                    }
+                    index = index / 64 * 64 + std::countr_zero(rest) + 1;
                     return Error();
                 }
+                count_current += found;
+                if(end != 0) {
+                    return Error::Code::EndOfFile;
+                }
+                index = (index / 64 + 1) * 64;
             }
 
-            if(!increment_fat(cluster, 1, bpb, block)) {
-                return Error::Code::EndOfFile;
-            }
+            error_or(next_cluster());
         }
         return Error::Code::EndOfFile;
     }
 
+    // the returned names are valid until the next read
     auto read() -> Result<DirectoryInfo> {
-        const auto cluster_size_bytes         = op.get_cluster_size_bytes();
-        const auto directory_entry_table_size = cluster_size_bytes / sizeof(DirectoryEntry);
+        const auto directory_entry_table_size = get_entries_per_cluster();
 
         auto lfn_checksum = 0;
-        auto lfn          = std::u16string();
-        auto buffer       = std::vector<uint8_t>(cluster_size_bytes);
+        auto lfn_length   = size_t(0); // in utf-16 units
+        auto lfn_next     = -1;        // index of the next expected long name entry
+        auto lfn_complete = false;
 
         while(true) { // iterate over clusters(fats)
-            error_or(op.read_cluster(cluster, buffer.data()));
+            error_or(load_cluster());
 
-            while(index < directory_entry_table_size) { // iterate over directory entries
-                auto& entry = *reinterpret_cast<DirectoryEntry*>(buffer.data() + sizeof(DirectoryEntry) * (index % directory_entry_table_size));
+            while((index = next_live_entry(index)) < directory_entry_table_size) { // iterate over directory entries
+                const auto  current = index;
+                const auto& entry   = *entry_at(index);
                 index += 1;
-                if(entry.name[0] == 0xE5) {
-                    continue;
-                } else if(entry.name[0] == 0x00) {
+                if(masks[current / 64].free & (uint64_t(1) << (current % 64))) {
                     return Error::Code::EndOfFile;
                 }
-                if(entry.attr & Attribute::LongName) {
-                    auto& lfn_entry = *reinterpret_cast<LFNEntry*>(&entry);
-                    if(lfn_entry.number & 0x40) {
+                if(is_lfn(current)) {
+                    const auto& lfn_entry = *reinterpret_cast<const LFNEntry*>(&entry);
+                    const auto  lfn_index = lfn_entry.get_index();
+                    if(lfn_entry.is_last()) {
+                        if(lfn_index < 0 || lfn_index >= LFNEntry::max_entries) {
+                            lfn_next = -1;
+                            continue;
+                        }
                         lfn_checksum = lfn_entry.checksum;
-                        lfn.clear();
+                        lfn_next     = lfn_index;
+                        lfn_complete = false;
+                    } else if(lfn_next < 0 || lfn_index != lfn_next) {
+                        // orphaned or out of order
+                        lfn_next     = -1;
+                        lfn_complete = false;
+                        continue;
                     }
                     assert(lfn_checksum == lfn_entry.checksum, Error::Code::BadChecksum);
-                    lfn = lfn_entry.to_string() + lfn;
+
+                    const auto part = lfn_buffer.data() + lfn_index * LFNEntry::chars_per_entry;
+                    lfn_entry.copy_name(part);
+                    if(lfn_entry.is_last()) {
+                        // the name is terminated by 0x0000 unless it fills the entry
+                        auto len = 0;
+                        while(len < LFNEntry::chars_per_entry && part[len] != u'\0') {
+                            len += 1;
+                        }
+                        lfn_length = lfn_index * LFNEntry::chars_per_entry + len;
+                    }
+                    lfn_next -= 1;
+                    lfn_complete = lfn_next < 0;
                     continue;
                 }
 
-                auto r      = DirectoryInfo();
-                r.cluster   = (static_cast<uint32_t>(entry.first_cluster_high) << 16) | entry.first_cluster_low;
-                r.size      = entry.file_size;
-                r.attribute = entry.attr;
-                if(lfn_checksum == entry.calc_checksum()) {
-                    auto name = std::string();
-                    name.resize(lfn.size());
-                    for(auto i = size_t(0); i < lfn.size(); i += 1) {
-                        name[i] = static_cast<char>(lfn[i]);
-                    }
-                    r.name = std::move(name);
+                auto r       = DirectoryInfo();
+                r.cluster    = (static_cast<uint32_t>(entry.first_cluster_high) << 16) | entry.first_cluster_low;
+                r.size       = entry.file_size;
+                r.attribute  = entry.attr;
+                r.short_name = std::string_view(short_name_buffer.data(), entry.copy_name(short_name_buffer));
+                if(lfn_complete && lfn_length != 0 && lfn_checksum == entry.calc_checksum()) {
+                    // name_buffer is large enough for any long name
+                    const auto len = u16tou8(std::u16string_view(lfn_buffer.data(), lfn_length), name_buffer);
+                    r.name         = std::string_view(name_buffer.data(), *len);
                 } else {
-                    r.name = entry.to_string();
+                    if(lfn_complete) {
+                        lfn_mismatches += 1;
+                    }
+                    r.name = r.short_name;
                 }
                 return r;
             }
 
-            if(!increment_fat(cluster, 1, bpb, block)) {
-                return Error::Code::EndOfFile;
+            error_or(next_cluster());
+        }
+        return Error::Code::EndOfFile;
+    }
+
+    // searches a short name without decoding other entries
+    // the long name of the found entry is still read
+    auto find(const ShortName& key) -> Result<DirectoryInfo> {
+        const auto directory_entry_table_size = get_entries_per_cluster();
+
+        // start of a long name sequence which reaches the end of the previous cluster, valid if has_trailing_lfn
+        auto trailing_lfn     = Position{0, 0};
+        auto has_trailing_lfn = false;
+
+        while(true) { // iterate over clusters(fats)
+            error_or(load_cluster());
+
+            while(index < directory_entry_table_size) { // iterate over groups of 64 entries
+                const auto group = index / 64;
+                const auto first = group * 64;
+                const auto count = std::min(directory_entry_table_size - first, size_t(64));
+                const auto& m    = masks[group];
+                const auto valid = ~uint64_t(0) << (index % 64);
+                const auto end   = m.free & valid;
+                const auto hits  = match_short_name(entry_at(first), count, key) & m.short_name & valid & (end != 0 ? (end & -end) - 1 : ~uint64_t(0));
+                if(hits != 0) {
+                    // rewind to the long name entries of the hit
+                    auto head = first + std::countr_zero(hits);
+                    while(head > 0 && is_lfn(head - 1)) {
+                        head -= 1;
+                    }
+                    set_position(head == 0 && has_trailing_lfn ? trailing_lfn : Position{cluster, uint32_t(head)});
+                    return read();
+                }
+                if(end != 0) {
+                    return Error::Code::EndOfFile;
+                }
+                index = first + 64;
+            }
+
+            auto tail = directory_entry_table_size;
+            while(tail > 0 && is_lfn(tail - 1)) {
+                tail -= 1;
             }
+            if(tail == directory_entry_table_size) {
+                has_trailing_lfn = false;
+            } else if(tail != 0 || !has_trailing_lfn) {
+                trailing_lfn     = Position{cluster, uint32_t(tail)};
+                has_trailing_lfn = true;
+            }
+
+            error_or(next_cluster());
         }
         return Error::Code::EndOfFile;
     }
 
-    DirectoryIterator(const uint32_t first_cluster, const BPB::Summary& bpb, block::BlockDevice& block) : cluster(first_cluster),
-                                                                                                          index(0),
-                                                                                                          bpb(bpb),
-                                                                                                          block(block),
-                                                                                                          op(bpb, block) {}
+    auto get_lfn_mismatches() const -> size_t {
+        return lfn_mismatches;
+    }
+
+    // the entry read next
+    auto get_position() const -> Position {
+        return Position{cluster, index};
+    }
+
+    auto set_position(const Position position) -> void {
+        cluster = position.cluster;
+        index   = position.index;
+    }
+
+    DirectoryIterator(const uint32_t first_cluster, const BPB::Summary& bpb, block::BlockDevice& block, FatCache* const fat = nullptr) : cluster(first_cluster),
+                                                                                                                                         index(0),
+                                                                                                                                         bpb(bpb),
+                                                                                                                                         block(block),
+                                                                                                                                         fat(fat),
+                                                                                                                                         op(geometry_from_bpb(bpb), block) {}
+
+    DirectoryIterator(const Position position, const BPB::Summary& bpb, block::BlockDevice& block, FatCache* const fat = nullptr) : cluster(position.cluster),
+                                                                                                                                    index(position.index),
+                                                                                                                                    bpb(bpb),
+                                                                                                                                    block(block),
+                                                                                                                                    fat(fat),
+                                                                                                                                    op(geometry_from_bpb(bpb), block) {}
+};
+
+// fat names are case-insensitive
+// only ascii letters are folded, other bytes of utf-8 names are compared as is
+inline auto fold_ascii(const char c) -> char {
+    return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+}
+
+struct FoldedHash {
+    using is_transparent = void;
+
+    auto operator()(const std::string_view name) const -> size_t {
+        // fnv-1a
+        auto hash = size_t(0xcbf29ce484222325);
+        for(const auto c : name) {
+            hash ^= static_cast<uint8_t>(fold_ascii(c));
+            hash *= size_t(0x100000001b3);
+        }
+        return hash;
+    }
+};
+
+struct FoldedEqual {
+    using is_transparent = void;
+
+    auto operator()(const std::string_view a, const std::string_view b) const -> bool {
+        if(a.size() != b.size()) {
+            return false;
+        }
+        for(auto i = size_t(0); i < a.size(); i += 1) {
+            if(fold_ascii(a[i]) != fold_ascii(b[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// in-memory name lookup table of a directory
+// both long names and short names are registered
+class DirectoryIndex {
+  private:
+    struct Entry {
+        uint32_t    cluster;
+        uint32_t    size;
+        Attribute   attribute;
+        std::string name;
+        std::string short_name;
+    };
+
+    std::unordered_map<std::string, Entry, FoldedHash, FoldedEqual> entries;
+
+  public:
+    // the returned names are valid until the index is modified
+    auto find(const std::string_view name) const -> std::optional<DirectoryInfo> {
+        const auto p = entries.find(name);
+        if(p == entries.end()) {
+            return std::nullopt;
+        }
+        const auto& e = p->second;
+        return DirectoryInfo{e.cluster, e.size, e.name, e.short_name, e.attribute};
+    }
+
+    // the first entry wins if a broken directory contains duplicated names
+    auto insert(const DirectoryInfo& dinfo) -> void {
+        const auto entry = Entry{dinfo.cluster, dinfo.size, dinfo.attribute, std::string(dinfo.name), std::string(dinfo.short_name)};
+        if(!dinfo.short_name.empty() && dinfo.short_name != dinfo.name) {
+            entries.emplace(dinfo.short_name, entry);
+        }
+        entries.emplace(dinfo.name, std::move(entry));
+    }
+
+    // first clusters of the subdirectories except "." and ".."
+    auto get_subdirectories() const -> std::vector<uint32_t> {
+        auto r = std::vector<uint32_t>();
+        for(const auto& [key, e] : entries) {
+            // short name aliases of long names are skipped
+            if(key == e.name && (e.attribute & Attribute::Directory) && e.cluster != 0 && e.short_name != "." && e.short_name != "..") {
+                r.push_back(e.cluster);
+            }
+        }
+        return r;
+    }
+
+    auto erase(const DirectoryInfo& dinfo) -> void {
+        // dinfo may refer to the names in the table
+        const auto name       = std::string(dinfo.name);
+        const auto short_name = std::string(dinfo.short_name);
+        entries.erase(name);
+        entries.erase(short_name);
+    }
+};
+
+struct VolumeStatistics {
+    size_t   bytes_per_cluster;
+    uint32_t total_clusters;
+    uint32_t free_clusters;
+    uint32_t bad_clusters;
+    uint32_t free_runs;        // number of contiguous free extents
+    uint32_t largest_free_run; // in clusters
+
+    std::optional<uint32_t> fsinfo_free_clusters; // nullopt if fsinfo is missing or the count is unknown
+    bool                    fsinfo_consistent;
+
+    // filled only if requested
+    // fragment_histogram[n] is the number of chains(files and directories) made of n fragments
+    uint32_t              chains            = 0;
+    uint32_t              fragmented_chains = 0;
+    std::vector<uint32_t> fragment_histogram;
+};
+
+struct MountOptions {
+    bool   prefetch       = false;           // read metadata in the background after mount
+    size_t prefetch_depth = 1;               // directory levels to index, 0 is the root only
+    size_t prefetch_bytes = 4 * 1024 * 1024; // directory data kept in memory, prefetching stops there and indexing goes on
 };
 
 class Driver : public fs::Driver {
   private:
+    PrefetchDevice      device; // wraps the device given at construction
     block::BlockDevice* block;
     BPB::Summary        bpb;
+    Geometry            geometry;
 
     OpenInfo root;
 
+    // directory first cluster -> index
+    // an index is immutable once published, readers keep it alive while they use it
+    std::unordered_map<uint32_t, std::shared_ptr<const DirectoryIndex>> indices;
+    std::unordered_set<uint32_t>                                        indexing; // indices being built
+    std::shared_mutex                                                   indices_mutex;
+    std::condition_variable_any                                         index_ready;
+
+    FatCache fat_cache;
+
+    std::thread       prefetcher;
+    std::atomic<bool> stop_prefetch = false;
+
+    auto read_fat(const uint32_t cluster) -> Result<uint32_t> {
+        return fat_cache.get(cluster);
+    }
+
+    // returns false if the chain ends before advancing count clusters
+    auto increment_fat(uint32_t& cluster, const size_t count) -> Result<bool> {
+        for(auto i = size_t(0); i < count; i += 1) {
+            value_or(next, read_fat(cluster));
+            if(is_end_of_chain(next)) {
+                return false;
+            }
+            cluster = next & fat_entry_mask;
+        }
+        return true;
+    }
+
+    // advances cluster by one, EndOfFile if the chain ends
+    auto next_cluster(uint32_t& cluster) -> Error {
+        value_or(reached, increment_fat(cluster, 1));
+        return reached ? Error() : Error(Error::Code::EndOfFile);
+    }
+
+    auto is_indexed(const uint32_t cluster) -> bool {
+        const auto lock = std::shared_lock(indices_mutex);
+        return indices.contains(cluster) || indexing.contains(cluster);
+    }
+
+    // published indices are found under the shared lock
+    // waits if another thread is building the same index
+    auto get_directory_index(const uint32_t cluster) -> Result<std::shared_ptr<const DirectoryIndex>> {
+        {
+            const auto lock = std::shared_lock(indices_mutex);
+            if(const auto p = indices.find(cluster); p != indices.end()) {
+                return std::shared_ptr(p->second);
+            }
+        }
+        {
+            auto lock = std::unique_lock(indices_mutex);
+            index_ready.wait(lock, [this, cluster]() { return !indexing.contains(cluster); });
+            if(const auto p = indices.find(cluster); p != indices.end()) {
+                return std::shared_ptr(p->second);
+            }
+            indexing.insert(cluster);
+        }
+
+        auto index    = std::make_shared<DirectoryIndex>();
+        auto error    = Error();
+        auto iterator = DirectoryIterator(cluster, bpb, *block, &fat_cache);
+        while(true) {
+            auto dinfo_result = iterator.read();
+            if(!dinfo_result) {
+                const auto e = dinfo_result.as_error();
+                if(e != Error::Code::EndOfFile) {
+                    error = e;
+                }
+                break;
+            }
+            index->insert(dinfo_result.as_value());
+        }
+
+        const auto lock = std::lock_guard(indices_mutex);
+        indexing.erase(cluster);
+        index_ready.notify_all();
+        if(error) {
+            return error;
+        }
+        return std::shared_ptr(indices.emplace(cluster, std::move(index)).first->second);
+    }
+
+    // reads the chain in runs of consecutive clusters, keeping at most bytes of prefetched data
+    auto prefetch_chain(uint32_t cluster, const size_t batch_sectors, const size_t bytes) -> Error {
+        const auto limit = get_fat_entry_count();
+
+        auto first  = cluster;
+        auto length = size_t(1);
+        for(auto steps = size_t(0); steps < limit; steps += 1) {
+            value_or(entry, read_fat(cluster));
+            const auto next = entry & fat_entry_mask;
+            const auto end  = is_end_of_chain(next) || next >= limit;
+            if(!end && next == cluster + 1) {
+                length += 1;
+                cluster = next;
+                continue;
+            }
+            error_or(device.prefetch(geometry.cluster_to_sector<false>(first), length * bpb.sectors_per_cluster, batch_sectors, bytes, stop_prefetch));
+            if(end) {
+                break;
+            }
+            first   = next;
+            length  = 1;
+            cluster = next;
+        }
+        return Error();
+    }
+
+    // the fat first since every lookup needs it, then directories level by level
+    // the fat goes straight into the fat cache, only directory data is kept as extents
+    auto prefetch(const size_t depth, const size_t bytes) -> Error {
+        constexpr auto batch_bytes = size_t(256 * 1024);
+
+        const auto batch_sectors = std::max(batch_bytes / bpb.bytes_per_sector, size_t(1));
+        error_or(fat_cache.load_all(stop_prefetch));
+
+        auto level = std::vector<uint32_t>{bpb.root_cluster};
+        for(auto d = size_t(0); d <= depth && !level.empty(); d += 1) {
+            auto next = std::vector<uint32_t>();
+            for(const auto cluster : level) {
+                if(stop_prefetch.load()) {
+                    return Error();
+                }
+                error_or(prefetch_chain(cluster, batch_sectors, bytes));
+                value_or(index, get_directory_index(cluster));
+                if(d < depth) {
+                    const auto subdirs = index->get_subdirectories();
+                    next.insert(next.end(), subdirs.begin(), subdirs.end());
+                }
+            }
+            level = std::move(next);
+        }
+        return Error();
+    }
+
+    auto scan_directory(const uint32_t cluster, const std::string_view name) -> Result<OpenInfo> {
+        const auto not_found = [](const Error e) -> Error {
+            return e == Error::Code::EndOfFile ? Error::Code::NoSuchFile : e;
+        };
+
+        auto iterator = DirectoryIterator(cluster, bpb, *block, &fat_cache);
+        if(const auto key = to_short_name(name)) {
+            const auto r = iterator.find(*key);
+            if(r) {
+                return openinfo_from_dinfo(r.as_value());
+            }
+            if(r.as_error() != Error::Code::EndOfFile) {
+                return not_found(r.as_error());
+            }
+            // a long name may still match
+            iterator.set_position({cluster, 0});
+        }
+
+        const auto equal = FoldedEqual();
+        while(true) {
+            auto dinfo_result = iterator.read();
+            if(!dinfo_result) {
+                return not_found(dinfo_result.as_error());
+            }
+            const auto& dinfo = dinfo_result.as_value();
+            if(equal(dinfo.name, name) || equal(dinfo.short_name, name)) {
+                return openinfo_from_dinfo(dinfo);
+            }
+        }
+    }
+
+    static auto filetype_from_dinfo(const DirectoryInfo& d) -> FileType {
+        return d.attribute & Attribute::Directory ? FileType::Directory : FileType::Regular;
+    }
+
     auto openinfo_from_dinfo(const DirectoryInfo& d) -> OpenInfo {
-        const auto type    = d.attribute & Attribute::Directory ? FileType::Directory : FileType::Regular;
+        const auto type    = filetype_from_dinfo(d);
         const auto cluster = d.cluster == 0 ? bpb.root_cluster : d.cluster;
         const auto size    = type == FileType::Directory ? 0 : d.size;
         return OpenInfo(d.name, *this, cluster, type, size);
     }
 
-  public:
-    auto init() -> Error {
-        auto buffer = std::vector<uint8_t>(block->get_info().bytes_per_sector);
-        error_or(block->read_sector(0, 1, buffer.data()));
-        const auto& bpb = *reinterpret_cast<BPB*>(buffer.data());
-        assert(bpb.signature[0] == 0x55 && bpb.signature[1] == 0xAA, Error::Code::NotFAT);
-        assert(bpb.bytes_per_sector == block->get_info().bytes_per_sector, Error::Code::NotImplemented);
-
-        this->bpb  = bpb.summary();
-        this->root = OpenInfo("/", *this, this->bpb.root_cluster, FileType::Directory, true);
-
-        return Error();
+    auto read_fsinfo() -> std::optional<FSInfo> {
+        if(bpb.fs_info == 0 || bpb.fs_info == 0xFFFF) {
+            return std::nullopt;
+        }
+        auto buffer = std::vector<uint8_t>(bpb.bytes_per_sector);
+        if(block->read_sector(bpb.fs_info, 1, buffer.data())) {
+            return std::nullopt;
+        }
+        const auto& fsinfo = *reinterpret_cast<FSInfo*>(buffer.data());
+        return fsinfo.is_valid() ? std::optional(fsinfo) : std::nullopt;
     }
 
-    auto read(const DriverData data, const size_t offset, size_t size, void* const buffer_) -> Error override {
-        if(data.type != FileType::Regular) {
-            return Error::Code::InvalidData;
+    // fat must hold entries of all clusters
+    static auto build_fragment_histogram(const std::vector<uint32_t>& fat, VolumeStatistics& stat) -> void {
+        const auto last_cluster = uint32_t(fat.size() - 1);
+        const auto is_cluster   = [last_cluster](const uint32_t c) -> bool { return c >= 2 && c <= last_cluster; };
+
+        // a chain head is an allocated cluster which no other entry points to
+        auto has_predecessor = std::vector<bool>(fat.size());
+        for(auto c = uint32_t(2); c <= last_cluster; c += 1) {
+            if(const auto next = fat[c] & fat_entry_mask; is_cluster(next)) {
+                has_predecessor[next] = true;
+            }
         }
 
-        if(offset + size > data.size) {
-            return Error::Code::EndOfFile;
+        for(auto head = uint32_t(2); head <= last_cluster; head += 1) {
+            const auto entry = fat[head] & fat_entry_mask;
+            if(entry == 0 || entry == bad_cluster || has_predecessor[head]) {
+                continue;
+            }
+
+            auto fragments = size_t(1);
+            auto cluster   = head;
+            // a broken fat may contain loops, never walk longer than the volume
+            for(auto steps = uint32_t(0); steps < last_cluster; steps += 1) {
+                const auto next = fat[cluster] & fat_entry_mask;
+                if(!is_cluster(next)) {
+                    break;
+                }
+                if(next != cluster + 1) {
+                    fragments += 1;
+                }
+                cluster = next;
+            }
+
+            if(stat.fragment_histogram.size() <= fragments) {
+                stat.fragment_histogram.resize(fragments + 1);
+            }
+            stat.fragment_histogram[fragments] += 1;
+            stat.chains += 1;
+            if(fragments > 1) {
+                stat.fragmented_chains += 1;
+            }
         }
+    }
 
-        auto       op                = ClusterOperator(bpb, *block);
-        auto       buffer            = static_cast<uint8_t*>(buffer_);
-        const auto bytes_per_cluster = op.get_cluster_size_bytes();
-        auto       cluster           = static_cast<uint32_t>(data.num);
-        if(!increment_fat(cluster, offset / bytes_per_cluster, bpb, *block)) {
+    // the bounce buffer is per thread so that concurrent reads neither share nor reallocate it
+    template <bool shift>
+    auto read_chain(uint32_t cluster, const size_t offset, size_t size, uint8_t* buffer) -> Error {
+        auto       op                = ClusterOperator(geometry, *block);
+        const auto bytes_per_cluster = geometry.bytes_per_cluster;
+        value_or(reached, increment_fat(cluster, geometry.cluster_index<shift>(offset)));
+        if(!reached) {
             return Error::Code::EndOfFile;
         }
-        auto read_buffer = std::vector<uint8_t>(bytes_per_cluster);
+        thread_local auto read_buffer = std::vector<uint8_t>();
+        read_buffer.resize(bytes_per_cluster);
 
         {
-            const auto offset_in_cluster = offset % bytes_per_cluster;
+            const auto offset_in_cluster = geometry.cluster_offset<shift>(offset);
             const auto size_in_cluster   = bytes_per_cluster - offset_in_cluster;
             const auto copy_len          = size < size_in_cluster ? size : size_in_cluster;
             error_or(op.read_cluster(cluster, read_buffer.data()));
             memcpy(buffer, read_buffer.data() + offset_in_cluster, copy_len);
             buffer += copy_len;
             size -= copy_len;
-            if(!increment_fat(cluster, 1, bpb, *block)) {
-                return Error::Code::EndOfFile;
+            if(size != 0) {
+                error_or(next_cluster(cluster));
             }
         }
 
@@ -255,8 +729,8 @@ class Driver : public fs::Driver {
             memcpy(buffer, read_buffer.data(), bytes_per_cluster);
             buffer += bytes_per_cluster;
             size -= bytes_per_cluster;
-            if(size != 0 && !increment_fat(cluster, 1, bpb, *block)) {
-                return Error::Code::EndOfFile;
+            if(size != 0) {
+                error_or(next_cluster(cluster));
             }
         }
 
@@ -268,6 +742,145 @@ class Driver : public fs::Driver {
         return Error();
     }
 
+  public:
+    auto start_prefetch(const size_t depth, const size_t bytes) -> void {
+        prefetcher = std::thread([this, depth, bytes]() {
+            if(const auto e = prefetch(depth, bytes)) {
+                logger(LogLevel::Warn, "fat: prefetch failed: %d\n", e.as_int());
+            }
+        });
+    }
+
+    // blocks until the mount-time prefetch finishes
+    auto wait_prefetch() -> void {
+        if(prefetcher.joinable()) {
+            prefetcher.join();
+        }
+    }
+
+    auto init() -> Error {
+        auto buffer = std::vector<uint8_t>(block->get_info().bytes_per_sector);
+        error_or(block->read_sector(0, 1, buffer.data()));
+        const auto& bpb = *reinterpret_cast<BPB*>(buffer.data());
+        assert(bpb.signature[0] == 0x55 && bpb.signature[1] == 0xAA, Error::Code::NotFAT);
+        assert(bpb.bytes_per_sector == block->get_info().bytes_per_sector, Error::Code::NotImplemented);
+
+        this->bpb      = bpb.summary();
+        this->geometry = geometry_from_bpb(this->bpb);
+        this->root     = OpenInfo("/", *this, this->bpb.root_cluster, FileType::Directory, true);
+        fat_cache.init(*block, geometry.fat_start, geometry.bytes_per_sector, get_fat_entry_count());
+
+        return Error();
+    }
+
+    auto get_bpb() const -> const BPB::Summary& {
+        return bpb;
+    }
+
+    auto get_block_device() -> block::BlockDevice& {
+        return *block;
+    }
+
+    // number of fat entries including the two reserved ones
+    auto get_fat_entry_count() const -> size_t {
+        const auto data_start     = bpb.reserved_sector_count + bpb.fat_size_32 * bpb.num_fats;
+        const auto total_clusters = (bpb.total_sectors_32 - data_start) / bpb.sectors_per_cluster;
+        const auto fat_capacity   = size_t(bpb.fat_size_32) * bpb.bytes_per_sector / sizeof(uint32_t);
+        return std::min(size_t(total_clusters) + 2, fat_capacity);
+    }
+
+    // reads the first fat in large sequential batches
+    // the result is padded to whole sectors
+    auto load_fat() -> Result<std::vector<uint32_t>> {
+        constexpr auto batch_bytes = size_t(1024 * 1024);
+
+        const auto entries       = get_fat_entry_count();
+        const auto sectors       = (entries * sizeof(uint32_t) + bpb.bytes_per_sector - 1) / bpb.bytes_per_sector;
+        const auto batch_sectors = std::max(batch_bytes / bpb.bytes_per_sector, size_t(1));
+
+        auto fat = std::vector<uint32_t>(sectors * bpb.bytes_per_sector / sizeof(uint32_t));
+        for(auto first = size_t(0); first < sectors; first += batch_sectors) {
+            const auto buffer = reinterpret_cast<uint8_t*>(fat.data()) + first * bpb.bytes_per_sector;
+            error_or(block->read_sector(bpb.reserved_sector_count + first, std::min(batch_sectors, sectors - first), buffer));
+        }
+        return fat;
+    }
+
+    // scans the whole fat in one sequential pass
+    // if fragmentation is true, the fat is kept in memory to build a per-chain fragment histogram
+    auto statfs(const bool fragmentation = false) -> Result<VolumeStatistics> {
+        constexpr auto batch_bytes = size_t(64 * 1024);
+
+        const auto entries           = get_fat_entry_count();
+        const auto sectors_per_batch = std::max(batch_bytes / bpb.bytes_per_sector, size_t(1));
+        const auto entries_per_batch = sectors_per_batch * bpb.bytes_per_sector / sizeof(uint32_t);
+        assert(entries > 2, Error::Code::InvalidData);
+
+        auto stat              = VolumeStatistics();
+        stat.bytes_per_cluster = size_t(bpb.bytes_per_sector) * bpb.sectors_per_cluster;
+        stat.total_clusters    = entries - 2;
+
+        // either the whole fat or a single batch
+        auto fat       = std::vector<uint32_t>(fragmentation ? (entries + entries_per_batch - 1) / entries_per_batch * entries_per_batch : entries_per_batch);
+        auto free_runs = simd::RunCounter();
+        for(auto first = size_t(0); first < entries; first += entries_per_batch) {
+            const auto count   = std::min(entries_per_batch, entries - first);
+            const auto sectors = (count * sizeof(uint32_t) + bpb.bytes_per_sector - 1) / bpb.bytes_per_sector;
+            const auto batch   = fragmentation ? fat.data() + first : fat.data();
+            error_or(block->read_sector(bpb.reserved_sector_count + first * sizeof(uint32_t) / bpb.bytes_per_sector, sectors, batch));
+
+            for(auto i = size_t(0); i < count; i += 64) {
+                const auto n = std::min(size_t(64), count - i);
+
+                auto free = simd::equal_mask64(batch + i, n, fat_entry_mask, 0);
+                auto bad  = simd::equal_mask64(batch + i, n, fat_entry_mask, bad_cluster);
+                if(first + i == 0) {
+                    // fat[0] and fat[1] are reserved
+                    free &= ~uint64_t(0b11);
+                    bad &= ~uint64_t(0b11);
+                }
+                stat.free_clusters += std::popcount(free);
+                stat.bad_clusters += std::popcount(bad);
+                free_runs.feed(first + i == 0 ? free >> 2 : free, first + i == 0 ? n - 2 : n);
+            }
+        }
+        stat.free_runs        = free_runs.runs;
+        stat.largest_free_run = free_runs.longest;
+
+        if(const auto fsinfo = read_fsinfo(); fsinfo && fsinfo->free_count != 0xFFFFFFFF) {
+            stat.fsinfo_free_clusters = fsinfo->free_count;
+            stat.fsinfo_consistent    = fsinfo->free_count == stat.free_clusters;
+            if(!stat.fsinfo_consistent) {
+                logger(LogLevel::Warn, "fat: fsinfo reports %u free clusters, but fat has %u\n", fsinfo->free_count, stat.free_clusters);
+            }
+        } else {
+            stat.fsinfo_consistent = false;
+        }
+
+        if(fragmentation) {
+            fat.resize(entries);
+            build_fragment_histogram(fat, stat);
+        }
+
+        return stat;
+    }
+
+    auto read(const DriverData data, const size_t offset, const size_t size, void* const buffer) -> Error override {
+        if(data.type != FileType::Regular) {
+            return Error::Code::InvalidData;
+        }
+
+        if(offset + size > data.size) {
+            return Error::Code::EndOfFile;
+        }
+        // an empty file has no chain to walk
+        if(size == 0) {
+            return Error();
+        }
+
+        return geometry.specialize([&](const auto shift) { return read_chain<decltype(shift)::value>(static_cast<uint32_t>(data.num), offset, size, static_cast<uint8_t*>(buffer)); });
+    }
+
     auto write(const DriverData data, const size_t offset, const size_t size, const void* const buffer) -> Error override {
         return Error::Code::NotImplemented;
     }
@@ -276,23 +889,23 @@ class Driver : public fs::Driver {
         if(data.type != FileType::Directory) {
             return Error::Code::InvalidData;
         }
-        auto iterator = DirectoryIterator(static_cast<size_t>(data.num), bpb, *block);
-        while(true) {
-            const auto dinfo_result = iterator.read();
-            if(!dinfo_result) {
-                const auto e = dinfo_result.as_error();
-                if(e == Error::Code::EndOfFile) {
-                    return Error::Code::NoSuchFile;
-                } else {
-                    return e;
-                }
-            }
-            const auto& dinfo = dinfo_result.as_value();
-            if(dinfo.name == name) {
-                return openinfo_from_dinfo(dinfo);
+        const auto cluster   = static_cast<uint32_t>(data.num);
+        auto       use_index = is_indexed(cluster);
+        if(!use_index) {
+            value_or(next, read_fat(cluster));
+            use_index = !is_end_of_chain(next);
+        }
+        if(use_index) {
+            value_or(index, get_directory_index(cluster));
+            const auto dinfo = index->find(name);
+            if(!dinfo) {
+                return Error::Code::NoSuchFile;
             }
+            return openinfo_from_dinfo(*dinfo);
         }
-        return Error::Code::NoSuchFile;
+
+        // single cluster directories are cheaper to scan than to index
+        return scan_directory(cluster, name);
     }
 
     auto create(const DriverData data, const std::string_view name, const FileType type) -> Result<OpenInfo> override {
@@ -303,7 +916,7 @@ class Driver : public fs::Driver {
         if(data.type != FileType::Directory) {
             return Error::Code::InvalidData;
         }
-        auto iterator = DirectoryIterator(static_cast<size_t>(data.num), bpb, *block);
+        auto iterator = DirectoryIterator(static_cast<size_t>(data.num), bpb, *block, &fat_cache);
         if(iterator.skip(index)) {
             return Error::Code::IndexOutOfRange;
         }
@@ -312,6 +925,37 @@ class Driver : public fs::Driver {
         return openinfo_from_dinfo(dinfo);
     }
 
+    // cursor.position holds the iterator position, cluster in the upper half and entry index in the lower half
+    auto readdir_batch(const DriverData data, DirectoryCursor& cursor, DirectoryBatch& batch) -> Error override {
+        if(data.type != FileType::Directory) {
+            return Error::Code::InvalidData;
+        }
+
+        const auto position = DirectoryIterator::Position{static_cast<uint32_t>(cursor.position >> 32), static_cast<uint32_t>(cursor.position)};
+        auto       iterator = cursor.position == 0 ? DirectoryIterator(static_cast<uint32_t>(data.num), bpb, *block, &fat_cache) : DirectoryIterator(position, bpb, *block, &fat_cache);
+        while(!cursor.end && !batch.is_full()) {
+            const auto dinfo_result = iterator.read();
+            if(!dinfo_result) {
+                const auto e = dinfo_result.as_error();
+                if(e == Error::Code::EndOfFile) {
+                    cursor.end = true;
+                    break;
+                } else {
+                    return e;
+                }
+            }
+            const auto& dinfo = dinfo_result.as_value();
+            const auto  type  = filetype_from_dinfo(dinfo);
+            if(!batch.push(dinfo.name, type, type == FileType::Directory ? 0 : dinfo.size)) {
+                // retry this entry in the next call
+                break;
+            }
+            const auto next = iterator.get_position();
+            cursor.position = (static_cast<uint64_t>(next.cluster) << 32) | next.index;
+        }
+        return Error();
+    }
+
     auto remove(const DriverData data, const std::string_view name) -> Error override {
         return Error::Code::NotImplemented;
     }
@@ -320,13 +964,43 @@ class Driver : public fs::Driver {
         return root;
     }
 
-    Driver(block::BlockDevice& block) : block(&block),
+    // must be called when a directory is modified behind the driver
+    // prefetched sectors and cached fat entries are dropped as well
+    // readers still holding the dropped index or fat keep seeing the old contents
+    auto invalidate_directory_index(const uint32_t cluster) -> void {
+        {
+            const auto lock = std::lock_guard(indices_mutex);
+            indices.erase(cluster);
+        }
+        device.drop_extents();
+        fat_cache.invalidate();
+    }
+
+    auto invalidate_directory_index() -> void {
+        {
+            const auto lock = std::lock_guard(indices_mutex);
+            indices.clear();
+        }
+        device.drop_extents();
+        fat_cache.invalidate();
+    }
+
+    Driver(block::BlockDevice& block) : device(block),
+                                        block(&device),
                                         root("/", *this, nullptr, FileType::Directory, 0, true) {}
+
+    ~Driver() {
+        stop_prefetch.store(true);
+        wait_prefetch();
+    }
 };
 
-inline auto new_driver(block::BlockDevice& block) -> Result<std::unique_ptr<Driver>> {
+inline auto new_driver(block::BlockDevice& block, const MountOptions& options = {}) -> Result<std::unique_ptr<Driver>> {
     auto driver = std::unique_ptr<Driver>(new Driver(block));
     error_or(driver->init());
+    if(options.prefetch) {
+        driver->start_prefetch(options.prefetch_depth, options.prefetch_bytes);
+    }
     return driver;
 }
 
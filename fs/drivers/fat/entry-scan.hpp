@@ -0,0 +1,235 @@
+#pragma once
+#include <array>
+#include <bit>
+#include <cstring>
+#include <optional>
+#include <string_view>
+
+#include "../../../simd.hpp"
+#include "fat.hpp"
+
+namespace fs::fat {
+// classification of up to 64 consecutive directory entries, bit i corresponds to entry i
+struct EntryMasks {
+    uint64_t free;       // name[0] == 0x00, no more entries follow
+    uint64_t deleted;    // name[0] == 0xE5
+    uint64_t lfn;        // long name entries
+    uint64_t short_name; // short entries except volume labels
+};
+
+// space padded, upper cased 8.3 name as stored in DirectoryEntry::name
+using ShortName = std::array<unsigned char, 11>;
+
+namespace impl {
+inline auto classify_entry(const DirectoryEntry& entry) -> int {
+    if(entry.name[0] == 0x00) {
+        return 0;
+    } else if(entry.name[0] == 0xE5) {
+        return 1;
+    } else if((entry.attr & 0x3F) == Attribute::LongName) {
+        return 2;
+    } else if(!(entry.attr & Attribute::VolumeID)) {
+        return 3;
+    }
+    return -1;
+}
+
+inline auto classify_entries_scalar(const DirectoryEntry* const entries, const size_t first, const size_t last, EntryMasks& masks) -> void {
+    for(auto i = first; i < last; i += 1) {
+        const auto bit = uint64_t(1) << i;
+        switch(classify_entry(entries[i])) {
+        case 0:
+            masks.free |= bit;
+            break;
+        case 1:
+            masks.deleted |= bit;
+            break;
+        case 2:
+            masks.lfn |= bit;
+            break;
+        case 3:
+            masks.short_name |= bit;
+            break;
+        }
+    }
+}
+
+inline auto match_short_name_scalar(const DirectoryEntry* const entries, const size_t first, const size_t last, const ShortName& key) -> uint64_t {
+    auto r = uint64_t(0);
+    for(auto i = first; i < last; i += 1) {
+        r |= uint64_t(std::memcmp(entries[i].name, key.data(), key.size()) == 0) << i;
+    }
+    return r;
+}
+
+#if defined(__x86_64__)
+// name[0] lives in the first dword of an entry and attr in the highest byte of the third one
+// v0 and v2 hold these dwords of four entries
+inline auto classify_vectors(const __m128i v0, const __m128i v2) -> std::array<uint32_t, 4> {
+    const auto name0   = _mm_and_si128(v0, _mm_set1_epi32(0xFF));
+    const auto attr    = _mm_and_si128(_mm_srli_epi32(v2, 24), _mm_set1_epi32(0x3F));
+    const auto free    = _mm_cmpeq_epi32(name0, _mm_setzero_si128());
+    const auto deleted = _mm_cmpeq_epi32(name0, _mm_set1_epi32(0xE5));
+    const auto lfnattr = _mm_cmpeq_epi32(attr, _mm_set1_epi32(Attribute::LongName));
+    const auto volume  = _mm_cmpeq_epi32(_mm_and_si128(attr, _mm_set1_epi32(Attribute::VolumeID)), _mm_set1_epi32(Attribute::VolumeID));
+    const auto invalid = _mm_or_si128(free, deleted);
+    const auto lfn     = _mm_andnot_si128(invalid, lfnattr);
+    const auto other   = _mm_or_si128(invalid, _mm_or_si128(lfnattr, volume));
+    return {
+        uint32_t(_mm_movemask_ps(_mm_castsi128_ps(free))),
+        uint32_t(_mm_movemask_ps(_mm_castsi128_ps(deleted))),
+        uint32_t(_mm_movemask_ps(_mm_castsi128_ps(lfn))),
+        uint32_t(~_mm_movemask_ps(_mm_castsi128_ps(other)) & 0x0F),
+    };
+}
+
+inline auto classify_entries_sse2(const DirectoryEntry* const entries, const size_t count, EntryMasks& masks) -> size_t {
+    auto i = size_t(0);
+    for(; i + 4 <= count; i += 4) {
+        const auto e  = reinterpret_cast<const __m128i*>(entries + i);
+        const auto a  = _mm_loadu_si128(e + 0);
+        const auto b  = _mm_loadu_si128(e + 2);
+        const auto c  = _mm_loadu_si128(e + 4);
+        const auto d  = _mm_loadu_si128(e + 6);
+        const auto lo = _mm_unpacklo_epi64(_mm_unpacklo_epi32(a, b), _mm_unpacklo_epi32(c, d));
+        const auto hi = _mm_unpacklo_epi64(_mm_unpackhi_epi32(a, b), _mm_unpackhi_epi32(c, d));
+        const auto m  = classify_vectors(lo, hi);
+        masks.free |= uint64_t(m[0]) << i;
+        masks.deleted |= uint64_t(m[1]) << i;
+        masks.lfn |= uint64_t(m[2]) << i;
+        masks.short_name |= uint64_t(m[3]) << i;
+    }
+    return i;
+}
+
+// first halves of entries[0] and entries[distance]
+__attribute__((target("avx2"))) inline auto load_entry_pair(const DirectoryEntry* const entries, const size_t distance) -> __m256i {
+    const auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(entries));
+    const auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(entries + distance));
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(a), b, 1);
+}
+
+__attribute__((target("avx2"))) inline auto classify_entries_avx2(const DirectoryEntry* const entries, const size_t count, EntryMasks& masks) -> size_t {
+    auto i = size_t(0);
+    for(; i + 8 <= count; i += 8) {
+        // lanes hold entries i+n and i+n+4
+        const auto a       = load_entry_pair(entries + i + 0, 4);
+        const auto b       = load_entry_pair(entries + i + 1, 4);
+        const auto c       = load_entry_pair(entries + i + 2, 4);
+        const auto d       = load_entry_pair(entries + i + 3, 4);
+        const auto v0      = _mm256_unpacklo_epi64(_mm256_unpacklo_epi32(a, b), _mm256_unpacklo_epi32(c, d));
+        const auto v2      = _mm256_unpacklo_epi64(_mm256_unpackhi_epi32(a, b), _mm256_unpackhi_epi32(c, d));
+        const auto name0   = _mm256_and_si256(v0, _mm256_set1_epi32(0xFF));
+        const auto attr    = _mm256_and_si256(_mm256_srli_epi32(v2, 24), _mm256_set1_epi32(0x3F));
+        const auto free    = _mm256_cmpeq_epi32(name0, _mm256_setzero_si256());
+        const auto deleted = _mm256_cmpeq_epi32(name0, _mm256_set1_epi32(0xE5));
+        const auto lfnattr = _mm256_cmpeq_epi32(attr, _mm256_set1_epi32(Attribute::LongName));
+        const auto volume  = _mm256_cmpeq_epi32(_mm256_and_si256(attr, _mm256_set1_epi32(Attribute::VolumeID)), _mm256_set1_epi32(Attribute::VolumeID));
+        const auto invalid = _mm256_or_si256(free, deleted);
+        const auto lfn     = _mm256_andnot_si256(invalid, lfnattr);
+        const auto other   = _mm256_or_si256(invalid, _mm256_or_si256(lfnattr, volume));
+        masks.free |= uint64_t(_mm256_movemask_ps(_mm256_castsi256_ps(free))) << i;
+        masks.deleted |= uint64_t(_mm256_movemask_ps(_mm256_castsi256_ps(deleted))) << i;
+        masks.lfn |= uint64_t(_mm256_movemask_ps(_mm256_castsi256_ps(lfn))) << i;
+        masks.short_name |= uint64_t(~_mm256_movemask_ps(_mm256_castsi256_ps(other)) & 0xFF) << i;
+    }
+    return i;
+}
+
+inline auto match_short_name_sse2(const DirectoryEntry* const entries, const size_t count, const ShortName& key) -> uint64_t {
+    auto k = std::array<unsigned char, 16>();
+    std::memcpy(k.data(), key.data(), key.size());
+    const auto kv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(k.data()));
+
+    auto r = uint64_t(0);
+    for(auto i = size_t(0); i < count; i += 1) {
+        const auto e = _mm_loadu_si128(reinterpret_cast<const __m128i*>(entries + i));
+        r |= uint64_t((_mm_movemask_epi8(_mm_cmpeq_epi8(e, kv)) & 0x7FF) == 0x7FF) << i;
+    }
+    return r;
+}
+
+__attribute__((target("avx2"))) inline auto match_short_name_avx2(const DirectoryEntry* const entries, const size_t count, const ShortName& key) -> uint64_t {
+    auto k = std::array<unsigned char, 32>();
+    std::memcpy(k.data(), key.data(), key.size());
+    std::memcpy(k.data() + 16, key.data(), key.size());
+    const auto kv = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(k.data()));
+
+    auto r = uint64_t(0);
+    auto i = size_t(0);
+    for(; i + 2 <= count; i += 2) {
+        const auto v  = load_entry_pair(entries + i, 1);
+        const auto eq = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, kv)));
+        r |= uint64_t((eq & 0x7FF) == 0x7FF) << i;
+        r |= uint64_t((eq & 0x7FF0000) == 0x7FF0000) << (i + 1);
+    }
+    return r | match_short_name_scalar(entries, i, count, key);
+}
+#endif
+} // namespace impl
+
+// count must be <= 64
+inline auto classify_entries(const DirectoryEntry* const entries, const size_t count) -> EntryMasks {
+    auto masks = EntryMasks{0, 0, 0, 0};
+    auto done  = size_t(0);
+#if defined(__x86_64__)
+    done = simd::has_avx2() ? impl::classify_entries_avx2(entries, count, masks) : impl::classify_entries_sse2(entries, count, masks);
+#endif
+    impl::classify_entries_scalar(entries, done, count, masks);
+    return masks;
+}
+
+// bit i is set if the name of entries[i] equals key
+// the result is meaningful only for short entries
+inline auto match_short_name(const DirectoryEntry* const entries, const size_t count, const ShortName& key) -> uint64_t {
+#if defined(__x86_64__)
+    return simd::has_avx2() ? impl::match_short_name_avx2(entries, count, key) : impl::match_short_name_sse2(entries, count, key);
+#else
+    return impl::match_short_name_scalar(entries, 0, count, key);
+#endif
+}
+
+// converts name to the on-disk short name form, if it is a valid 8.3 name
+// lower case letters are accepted since names are case-insensitive
+inline auto to_short_name(const std::string_view name) -> std::optional<ShortName> {
+    auto r = ShortName();
+    r.fill(' ');
+    if(name == "." || name == "..") {
+        std::memcpy(r.data(), name.data(), name.size());
+        return r;
+    }
+
+    const auto dot  = name.find('.');
+    const auto base = name.substr(0, dot);
+    const auto ext  = dot == std::string_view::npos ? std::string_view() : name.substr(dot + 1);
+    if(base.empty() || base.size() > 8 || ext.size() > 3 || (dot != std::string_view::npos && ext.empty())) {
+        return std::nullopt;
+    }
+
+    const auto convert = [](const char c) -> std::optional<unsigned char> {
+        constexpr auto specials = std::string_view("!#$%&'()-@^_`{}~");
+        if(c >= 'a' && c <= 'z') {
+            return c - 'a' + 'A';
+        }
+        if((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || specials.find(c) != std::string_view::npos) {
+            return c;
+        }
+        return std::nullopt;
+    };
+    for(auto i = size_t(0); i < base.size(); i += 1) {
+        const auto c = convert(base[i]);
+        if(!c) {
+            return std::nullopt;
+        }
+        r[i] = *c;
+    }
+    for(auto i = size_t(0); i < ext.size(); i += 1) {
+        const auto c = convert(ext[i]);
+        if(!c) {
+            return std::nullopt;
+        }
+        r[8 + i] = *c;
+    }
+    return r;
+}
+} // namespace fs::fat
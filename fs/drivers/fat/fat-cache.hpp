@@ -0,0 +1,134 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "../../../block/block.hpp"
+
+namespace fs::fat {
+// the first fat shared by concurrent readers
+// the fat is loaded in chunks on first use and a loaded chunk is never modified, so lookups take no lock
+// invalidated chunks are unpublished and retired, and freed once no lookup is left which may still be reading them
+class FatCache {
+  private:
+    constexpr static auto chunk_bytes = size_t(64 * 1024);
+
+    block::BlockDevice*                             block             = nullptr;
+    size_t                                          fat_start         = 0;
+    size_t                                          fat_sectors       = 0;
+    size_t                                          sectors_per_chunk = 0;
+    size_t                                          entries_per_chunk = 0;
+    size_t                                          chunk_count       = 0;
+    std::unique_ptr<std::atomic<const uint32_t*>[]> chunks;                    // published for lookups
+    std::unique_ptr<std::unique_ptr<uint32_t[]>[]>  loaded;                    // the owners of chunks
+    std::mutex                                      mutex;                     // serializes loading, invalidation and draining
+    std::atomic<uint32_t>                           readers           = 0;     // lookups in progress
+    std::atomic<bool>                               pending           = false; // something is retired
+    std::vector<std::unique_ptr<uint32_t[]>>        retired;
+
+    // with the mutex held
+    auto load(const size_t index, const uint32_t*& chunk) -> Error {
+        if((chunk = chunks[index].load(std::memory_order_acquire)) != nullptr) {
+            return Error();
+        }
+
+        const auto first        = index * sectors_per_chunk;
+        auto       loaded_chunk = std::unique_ptr<uint32_t[]>(new uint32_t[entries_per_chunk]());
+        if(const auto e = block->read_sector(fat_start + first, std::min(sectors_per_chunk, fat_sectors - first), loaded_chunk.get())) {
+            return e;
+        }
+        chunk         = loaded_chunk.get();
+        loaded[index] = std::move(loaded_chunk);
+        chunks[index].store(chunk, std::memory_order_seq_cst);
+        return Error();
+    }
+
+    // with the mutex held
+    auto drain() -> void {
+        retired.clear();
+        pending.store(false, std::memory_order_relaxed);
+    }
+
+    // the last lookup to leave frees the retired chunks, as fs::Children does with its retired nodes
+    auto end_read() -> void {
+        if(readers.fetch_sub(1, std::memory_order_seq_cst) != 1 || !pending.load(std::memory_order_seq_cst)) {
+            return;
+        }
+        const auto lock = std::lock_guard(mutex);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(readers.load(std::memory_order_acquire) == 0) {
+            drain();
+        }
+    }
+
+  public:
+    // clusters past the fat read as 0, which ends every chain walk
+    auto get(const uint32_t cluster) -> Result<uint32_t> {
+        const auto index = cluster / entries_per_chunk;
+        if(index >= chunk_count) {
+            return uint32_t(0);
+        }
+        readers.fetch_add(1, std::memory_order_seq_cst);
+        auto chunk = chunks[index].load(std::memory_order_seq_cst);
+        auto error = Error();
+        if(chunk == nullptr) {
+            const auto lock = std::lock_guard(mutex);
+            error           = load(index, chunk);
+        }
+        auto entry = error ? uint32_t(0) : chunk[cluster % entries_per_chunk];
+        end_read();
+        if(error) {
+            return error;
+        }
+        return entry;
+    }
+
+    // loads every chunk which is not loaded yet, gives up if stop is set
+    auto load_all(const std::atomic<bool>& stop) -> Error {
+        for(auto i = size_t(0); i < chunk_count && !stop.load(); i += 1) {
+            const auto lock  = std::lock_guard(mutex);
+            auto       chunk = (const uint32_t*)nullptr;
+            if(const auto e = load(i, chunk)) {
+                return e;
+            }
+        }
+        return Error();
+    }
+
+    // must be called when the fat is modified behind the cache
+    // the unpublished chunks are freed at once if no lookup is inside, otherwise the last one to leave frees them
+    // the fences pair with the sequentially consistent accesses of the lookups, so that either side sees the other
+    auto invalidate() -> void {
+        const auto lock = std::lock_guard(mutex);
+        for(auto i = size_t(0); i < chunk_count; i += 1) {
+            chunks[i].store(nullptr, std::memory_order_seq_cst);
+            if(loaded[i]) {
+                retired.push_back(std::move(loaded[i]));
+            }
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(readers.load(std::memory_order_acquire) == 0) {
+            drain();
+            return;
+        }
+        pending.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(readers.load(std::memory_order_acquire) == 0) {
+            drain();
+        }
+    }
+
+    auto init(block::BlockDevice& block, const size_t fat_start, const size_t bytes_per_sector, const size_t entries) -> void {
+        this->block       = &block;
+        this->fat_start   = fat_start;
+        fat_sectors       = (entries * sizeof(uint32_t) + bytes_per_sector - 1) / bytes_per_sector;
+        sectors_per_chunk = std::max(chunk_bytes / bytes_per_sector, size_t(1));
+        entries_per_chunk = sectors_per_chunk * bytes_per_sector / sizeof(uint32_t);
+        chunk_count       = (fat_sectors + sectors_per_chunk - 1) / sectors_per_chunk;
+        chunks            = std::unique_ptr<std::atomic<const uint32_t*>[]>(new std::atomic<const uint32_t*>[chunk_count]());
+        loaded            = std::unique_ptr<std::unique_ptr<uint32_t[]>[]>(new std::unique_ptr<uint32_t[]>[chunk_count]());
+    }
+};
+} // namespace fs::fat
@@ -1,3 +1,7 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <cstring>
 #include <string>
 
 namespace fs::fat {
@@ -45,15 +49,32 @@ struct BPB {
         uint32_t total_sectors_32;
         uint32_t fat_size_32;
         uint32_t root_cluster;
+        uint16_t fs_info;
     };
 
     auto summary() const -> Summary {
-        return Summary{bytes_per_sector, sectors_per_cluster, reserved_sector_count, num_fats, total_sectors_32, fat_size_32, root_cluster};
+        return Summary{bytes_per_sector, sectors_per_cluster, reserved_sector_count, num_fats, total_sectors_32, fat_size_32, root_cluster, fs_info};
     }
 } __attribute__((packed));
 
 static_assert(sizeof(BPB) == 512);
 
+struct FSInfo {
+    uint32_t lead_signature; // 0x41615252
+    uint8_t  reserved1[480];
+    uint32_t struct_signature; // 0x61417272
+    uint32_t free_count;       // 0xFFFFFFFF: unknown
+    uint32_t next_free;        // 0xFFFFFFFF: unknown
+    uint8_t  reserved2[12];
+    uint32_t trail_signature; // 0xAA550000
+
+    auto is_valid() const -> bool {
+        return lead_signature == 0x41615252 && struct_signature == 0x61417272 && trail_signature == 0xAA550000;
+    }
+} __attribute__((packed));
+
+static_assert(sizeof(FSInfo) == 512);
+
 enum Attribute : uint8_t {
     ReadOnly  = 0x01,
     Hidden    = 0x02,
@@ -82,6 +103,11 @@ struct DirectoryEntry {
         return first_cluster_low | (static_cast<uint32_t>(first_cluster_high) << 16);
     }
 
+    auto set_first_cluster(const uint32_t cluster) -> void {
+        first_cluster_low  = cluster & 0xFFFF;
+        first_cluster_high = cluster >> 16;
+    }
+
     auto calc_checksum() const -> uint8_t {
         auto sum = uint8_t(0);
         for(auto i = 0; i < 11; i += 1) {
@@ -90,27 +116,27 @@ struct DirectoryEntry {
         return sum;
     }
 
-    auto to_string() const -> std::string {
-        auto base = std::string();
-        for(auto i = 0; i < 8; i += 1) {
-            if(name[i] == 0x20) {
-                break;
-            }
-            base += name[i];
+    // formats "BASE.EXT" into buffer and returns the length
+    auto copy_name(std::array<char, 12>& buffer) const -> size_t {
+        auto len = size_t(0);
+        for(auto i = 0; i < 8 && name[i] != 0x20; i += 1) {
+            buffer[len] = name[i];
+            len += 1;
         }
-        auto ext = std::string();
-        for(auto i = 8; i < 11; i += 1) {
-            if(name[i] == 0x20) {
-                break;
+        if(name[8] != 0x20) {
+            buffer[len] = '.';
+            len += 1;
+            for(auto i = 8; i < 11 && name[i] != 0x20; i += 1) {
+                buffer[len] = name[i];
+                len += 1;
             }
-            ext += name[i];
-        }
-        auto name = base;
-        if(!ext.empty()) {
-            name += "." + ext;
         }
+        return len;
+    }
 
-        return name;
+    auto to_string() const -> std::string {
+        auto buffer = std::array<char, 12>();
+        return std::string(buffer.data(), copy_name(buffer));
     }
 } __attribute__((packed));
 
@@ -124,30 +150,23 @@ struct LFNEntry {
     uint16_t  first_cluster_low; // 0
     char16_t  name3[2];
 
-    auto to_string() -> std::u16string {
-        auto r = std::u16string();
+    static constexpr auto chars_per_entry = 13;
+    static constexpr auto max_entries     = 20;
 
-        const auto helper = [&r](const int len, char16_t* const data) -> bool {
-            for(auto i = 0; i < len; i += 1) {
-                if(data[i] != u'\0') {
-                    r += data[i];
-                } else {
-                    return true;
-                }
-            }
-            return false;
-        };
+    // position of this entry in the name, 0 is the first
+    auto get_index() const -> int {
+        return (number & 0x1F) - 1;
+    }
 
-        if(helper(5, name1)) {
-            return r;
-        }
-        if(helper(6, name2)) {
-            return r;
-        }
-        if(helper(2, name3)) {
-            return r;
-        }
-        return r;
+    auto is_last() const -> bool {
+        return number & 0x40;
+    }
+
+    // copies all 13 characters including the terminator and paddings
+    auto copy_name(char16_t* const buffer) const -> void {
+        std::memcpy(buffer, name1, sizeof(name1));
+        std::memcpy(buffer + 5, name2, sizeof(name2));
+        std::memcpy(buffer + 11, name3, sizeof(name3));
     }
 } __attribute__((packed));
 } // namespace fs::fat
@@ -0,0 +1,126 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+
+#include "../../../block/block.hpp"
+
+namespace fs::fat {
+// block device shared by foreground requests and the background prefetcher
+// prefetched extents are served from memory
+// foreground requests take priority, the prefetcher waits for them between batches
+// foreground reads run in parallel if the parent allows concurrent reads, otherwise they are serialized
+class PrefetchDevice : public block::BlockDevice {
+  private:
+    block::BlockDevice&                    parent;
+    size_t                                 bytes_per_sector;
+    bool                                   concurrent;
+    std::shared_mutex                      mutex; // guards parent and extents, shared only by concurrent reads
+    std::condition_variable_any            idle;
+    std::atomic<size_t>                    foreground = 0; // foreground requests waiting or running
+    std::map<size_t, std::vector<uint8_t>> extents;        // first sector -> data
+    size_t                                 extent_bytes = 0;
+
+    // the extent which contains the whole range, or nullptr
+    auto find_extent(const size_t sector, const size_t count) -> std::pair<const size_t, std::vector<uint8_t>>* {
+        auto p = extents.upper_bound(sector);
+        if(p == extents.begin()) {
+            return nullptr;
+        }
+        p = std::prev(p);
+        return sector + count <= p->first + p->second.size() / bytes_per_sector ? &*p : nullptr;
+    }
+
+    // the count drops while the lock is held, so that the prefetcher cannot miss the wakeup
+    template <class Lock>
+    auto end_foreground(Lock& lock) -> void {
+        const auto last = foreground.fetch_sub(1) == 1;
+        lock.unlock();
+        if(last) {
+            idle.notify_all();
+        }
+    }
+
+  public:
+    auto get_info() -> block::DeviceInfo override {
+        auto info             = parent.get_info();
+        info.concurrent_reads = true;
+        return info;
+    }
+
+    auto read_sector(const size_t sector, const size_t count, void* const buffer) -> Error override {
+        const auto read = [&](auto lock) -> Error {
+            auto e = Error();
+            if(const auto extent = find_extent(sector, count)) {
+                std::memcpy(buffer, extent->second.data() + (sector - extent->first) * bytes_per_sector, count * bytes_per_sector);
+            } else {
+                e = parent.read_sector(sector, count, buffer);
+            }
+            end_foreground(lock);
+            return e;
+        };
+
+        foreground.fetch_add(1);
+        return concurrent ? read(std::shared_lock(mutex)) : read(std::unique_lock(mutex));
+    }
+
+    auto write_sector(const size_t sector, const size_t count, const void* const buffer) -> Error override {
+        foreground.fetch_add(1);
+        auto lock = std::unique_lock(mutex);
+        // keep overlapping extents up to date
+        for(auto& [first, data] : extents) {
+            const auto last  = first + data.size() / bytes_per_sector;
+            const auto begin = std::max(first, sector);
+            const auto end   = std::min(last, sector + count);
+            if(begin < end) {
+                std::memcpy(data.data() + (begin - first) * bytes_per_sector, static_cast<const uint8_t*>(buffer) + (begin - sector) * bytes_per_sector, (end - begin) * bytes_per_sector);
+            }
+        }
+        const auto e = parent.write_sector(sector, count, buffer);
+        end_foreground(lock);
+        return e;
+    }
+
+    // reads the range into memory in batches of batch_sectors
+    // waits for foreground requests before each batch, and gives up if stop is set or the extents would grow past limit bytes
+    auto prefetch(const size_t sector, const size_t count, const size_t batch_sectors, const size_t limit, const std::atomic<bool>& stop) -> Error {
+        for(auto first = sector; first < sector + count; first += batch_sectors) {
+            const auto n    = std::min(batch_sectors, sector + count - first);
+            auto       data = std::vector<uint8_t>(n * bytes_per_sector);
+
+            auto lock = std::unique_lock(mutex);
+            idle.wait(lock, [this]() { return foreground.load() == 0; });
+            if(stop.load()) {
+                return Error();
+            }
+            if(find_extent(first, n) != nullptr) {
+                continue;
+            }
+            if(extent_bytes + data.size() > limit) {
+                return Error();
+            }
+            if(const auto e = parent.read_sector(first, n, data.data())) {
+                return e;
+            }
+            extent_bytes += data.size();
+            extents.insert_or_assign(first, std::move(data));
+        }
+        return Error();
+    }
+
+    auto drop_extents() -> void {
+        const auto lock = std::unique_lock(mutex);
+        extents.clear();
+        extent_bytes = 0;
+    }
+
+    PrefetchDevice(block::BlockDevice& parent) : parent(parent),
+                                                 bytes_per_sector(parent.get_info().bytes_per_sector),
+                                                 concurrent(parent.get_info().concurrent_reads) {}
+};
+} // namespace fs::fat
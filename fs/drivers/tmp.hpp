@@ -1,9 +1,31 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <condition_variable>
 #include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <span>
 #include <string>
+#include <thread>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <variant>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../../hash.hpp"
+#include "../../lz.hpp"
 #include "../../macro.hpp"
 #include "../../memory-manager.hpp"
 #include "../fs.hpp"
@@ -11,13 +33,13 @@
 namespace fs::tmp {
 class Object {
   private:
-    std::string name;
+    Name name;
 
   protected:
-    Object(std::string name) : name(std::move(name)) {}
+    Object(Name name) : name(std::move(name)) {}
 
   public:
-    auto get_name() const -> const std::string& {
+    auto get_name() const -> const Name& {
         return name;
     }
 };
@@ -25,16 +47,303 @@ class Object {
 class File;
 class Directory;
 
+// files up to this size keep their bytes in the file object instead of frames
+// the buffer is part of every file, so larger limits are clamped to it
+constexpr auto max_inline_limit     = size_t(64);
+constexpr auto default_inline_limit = max_inline_limit;
+
+// frames of a mount by the hash of their bytes, so that files holding the same bytes share one frame
+// the table is an owner of every frame in it, so their bytes never change, a file writing to one copies it first
+// frames held by the table alone are dropped by a sweep whenever the table has doubled since the last one
+// files of a mount use it concurrently, so every call takes its lock
+class ContentTable {
+  private:
+    constexpr static auto min_sweep = size_t(1024);
+
+    std::mutex                                 mutex;
+    std::unordered_map<uint64_t, SmartFrameID> frames;
+    size_t                                     sweep_at = min_sweep;
+
+    auto sweep() -> void {
+        std::erase_if(frames, [](auto& p) { return allocator->get_owners(*p.second) == 1; });
+        sweep_at = std::max(min_sweep, frames.size() * 2);
+    }
+
+  public:
+    // another owner of a frame holding the same bytes as frame
+    // if there is none, frame is added to the table and nothing is returned
+    auto find_or_add(void* const frame) -> std::optional<SmartFrameID> {
+        const auto lock = std::lock_guard(mutex);
+        if(frames.size() >= sweep_at) {
+            sweep();
+        }
+        const auto bytes      = static_cast<const uint8_t*>(frame);
+        const auto [p, added] = frames.try_emplace(hash::hash64({bytes, bytes_per_frame}));
+        if(added) {
+            if(allocator->share(FrameID(frame), 1)) {
+                frames.erase(p);
+                return std::nullopt;
+            }
+            p->second = SmartFrameID(FrameID(frame), 1);
+            return std::nullopt;
+        }
+        // a different frame with the same hash is left in the table
+        const auto found = (*p->second).get_frame();
+        if(found == frame || std::memcmp(found, bytes, bytes_per_frame) != 0) {
+            return std::nullopt;
+        }
+        auto r = p->second.share();
+        if(!r) {
+            return std::nullopt;
+        }
+        return std::move(r.as_value());
+    }
+
+    template <class F>
+    auto for_each(F&& fn) -> void {
+        const auto lock = std::lock_guard(mutex);
+        for(auto& [hash, frame] : frames) {
+            fn((*frame).get_frame());
+        }
+    }
+};
+
+// frames of one mount, counted so that cold ones can be compressed when the mount goes over its memory limit
+// the counters are updated by files under their own locks
+struct Pool {
+    std::atomic<size_t>   resident_frames = 0;       // uncompressed frames of every file, shared frames are counted by each of them
+    std::atomic<size_t>   added_frames    = 0;       // frames ever added to resident_frames, so that any new one shows
+    std::atomic<size_t>   packed_frames   = 0;       // frames held compressed
+    std::atomic<size_t>   packed_bytes    = 0;
+    std::atomic<uint64_t> clock           = 0;       // advances on every access to file data
+    bool                  recency         = false;   // set when the mount has a memory limit, accesses are only recorded then
+    ContentTable*         contents        = nullptr; // set in dedup mode
+};
+
+// snapshot image of a whole mount, see Driver::snapshot
+// a header frame, then file data in whole frames, then the tree: nodes, extents and a blob of names and inline bytes
+// integers are in host byte order, an image is meant to be restored on the machine which wrote it
+namespace image {
+constexpr auto magic   = std::array<char, 8>{'k', 'l', 'e', 'e', 't', 'm', 'p', '\0'};
+constexpr auto version = uint32_t(1);
+
+struct Header {
+    std::array<char, 8> magic;
+    uint32_t            version;
+    uint32_t            bytes_per_frame;
+    uint64_t            tree_offset;
+    uint64_t            node_count;
+    uint64_t            extent_count;
+    uint64_t            blob_bytes;
+};
+
+// a directory comes before its children, which are in insertion order
+// node 0 is the root
+struct Node {
+    uint64_t parent;
+    uint64_t size;
+    uint64_t first; // index of the first extent, or where the inline bytes start in the blob
+    uint64_t count; // extents of the file
+    uint64_t name;  // where the name starts in the blob
+    uint32_t name_length;
+    FileType type;
+    uint32_t inlined;
+    uint32_t reserved;
+};
+
+struct Extent {
+    uint64_t offset; // in the file
+    uint64_t frames;
+    uint64_t data;   // in the image, frame aligned
+};
+
+// an image mapped read only
+// pages are read in by the os as they are touched, and the file data is used in place until written
+struct Mapping {
+    uint8_t* data  = nullptr;
+    size_t   bytes = 0;
+
+    ~Mapping() {
+        if(data != nullptr) {
+            munmap(data, bytes);
+        }
+    }
+};
+
+inline auto map(const std::string_view path) -> Result<std::shared_ptr<const Mapping>> {
+    const auto fd = ::open(std::string(path).data(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return Error::Code::NoSuchFile;
+    }
+    struct stat st = {};
+    if(fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(Header)) {
+        ::close(fd);
+        return Error::Code::InvalidData;
+    }
+    const auto data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(data == MAP_FAILED) {
+        return Error::Code::IOError;
+    }
+    auto mapping   = std::make_shared<Mapping>();
+    mapping->data  = static_cast<uint8_t*>(data);
+    mapping->bytes = st.st_size;
+    return std::shared_ptr<const Mapping>(std::move(mapping));
+}
+
+// extents of one file, sorted, frame aligned, inside the data part of the image and starting before the end of the file
+inline auto check_extents(const std::span<const Extent> extents, const size_t filesize, const size_t tree_offset) -> bool {
+    auto end = size_t(0);
+    for(const auto& e : extents) {
+        if(e.offset < end || e.offset >= filesize || e.offset % bytes_per_frame != 0 || e.frames == 0 || e.frames > tree_offset / bytes_per_frame ||
+           e.data % bytes_per_frame != 0 || e.data < bytes_per_frame || e.data > tree_offset - e.frames * bytes_per_frame) {
+            return false;
+        }
+        end = e.offset + e.frames * bytes_per_frame;
+    }
+    return true;
+}
+} // namespace image
+
 template <class T>
 concept FileObject = std::is_same_v<T, File> || std::is_same_v<T, Directory>;
 
+// the lock of a file, a moved file starts with a new one
+class FileMutex : public std::mutex {
+  public:
+    FileMutex() = default;
+
+    FileMutex(FileMutex&&) {}
+};
+
 class File : public Object {
   private:
-    size_t                    filesize = 0;
-    std::vector<SmartFrameID> data;
+    // frames compressed one by one, each one either an lz block or stored raw if it did not shrink
+    // shared by the extents split from one packed extent and freed along with the last of them
+    struct Packed {
+        Pool*                 pool = nullptr; // set once the frames are counted in it
+        std::vector<uint32_t> ends;           // end of each frame in bytes
+        std::vector<uint8_t>  bytes;
+
+        auto unpack(const size_t frame, uint8_t* const dest) const -> bool {
+            const auto begin = frame == 0 ? uint32_t(0) : ends[frame - 1];
+            const auto size  = ends[frame] - begin;
+            if(size == bytes_per_frame) {
+                memcpy(dest, bytes.data() + begin, size);
+                return true;
+            }
+            return lz::decompress({bytes.data() + begin, size}, {dest, bytes_per_frame});
+        }
+
+        ~Packed() {
+            if(pool != nullptr) {
+                pool->packed_frames -= ends.size();
+                pool->packed_bytes -= bytes.size();
+            }
+        }
+    };
+
+    // contiguous frames holding file bytes [offset, offset + frames * bytes_per_frame)
+    struct Extent {
+        size_t                                offset;
+        size_t                                frames;
+        SmartFrameID                          data;                   // empty while packed or mapped
+        std::shared_ptr<const Packed>         packed;                 // set while the frames are compressed
+        size_t                                packed_first   = 0;     // index of the first frame in packed
+        std::shared_ptr<const image::Mapping> mapping;                // set while the bytes are read from a restored image
+        size_t                                mapped_offset  = 0;     // where the bytes start in mapping
+        uint64_t                              last_access    = 0;
+        bool                                  incompressible = false; // not tried again until written
+
+        auto get_end() const -> size_t {
+            return offset + frames * bytes_per_frame;
+        }
+
+        auto is_packed() const -> bool {
+            return packed != nullptr;
+        }
+
+        auto is_mapped() const -> bool {
+            return mapping != nullptr;
+        }
+
+        // backed by frames of the allocator
+        auto is_resident() const -> bool {
+            return !is_packed() && !is_mapped();
+        }
+
+        // a mapped extent is read only
+        auto data_at(const size_t file_offset) -> uint8_t* {
+            const auto base = is_mapped() ? mapping->data + mapped_offset : static_cast<uint8_t*>(data->get_frame());
+            return base + (file_offset - offset);
+        }
+    };
+
+    // uncompressed frames of a file counted in the pool of its mount, if there is one
+    class Charge {
+      private:
+        Pool*  pool;
+        size_t frames = 0;
+
+      public:
+        auto add(const size_t n) -> void {
+            frames += n;
+            if(pool != nullptr) {
+                pool->resident_frames += n;
+                pool->added_frames += n;
+            }
+        }
+
+        auto remove(const size_t n) -> void {
+            frames -= n;
+            if(pool != nullptr) {
+                pool->resident_frames -= n;
+            }
+        }
+
+        auto get_pool() const -> Pool* {
+            return pool;
+        }
 
-    auto data_at(const size_t index) -> uint8_t* {
-        return static_cast<uint8_t*>(data[index]->get_frame());
+        Charge(Charge&& o) : pool(o.pool),
+                             frames(std::exchange(o.frames, 0)) {}
+
+        Charge(Pool* const pool) : pool(pool) {}
+
+        ~Charge() {
+            remove(frames);
+        }
+    };
+
+    constexpr static auto max_extent_frames = size_t(bytes_per_huge_frame / bytes_per_frame);
+
+    // bytes of extents past filesize are kept zero, so that growing the file never exposes stale data
+    size_t                                filesize = 0;
+    size_t                                inline_limit;
+    bool                                  inlined     = true; // bytes live in inline_data instead of extents
+    std::array<uint8_t, max_inline_limit> inline_data = {};   // the first filesize bytes while inlined, the rest is zero
+    std::vector<Extent>                   extents;            // sorted by offset, gaps between them are holes
+    Charge                                resident;
+    mutable FileMutex                     mutex; // taken by the driver, see Driver
+
+    static auto round_up(const size_t offset) -> size_t {
+        return (offset + bytes_per_frame - 1) / bytes_per_frame * bytes_per_frame;
+    }
+
+    static auto round_down(const size_t offset) -> size_t {
+        return offset / bytes_per_frame * bytes_per_frame;
+    }
+
+    // index of the first extent ending after offset, extents.size() if there is none
+    auto find_extent(const size_t offset) const -> size_t {
+        const auto p = std::partition_point(extents.begin(), extents.end(), [offset](const Extent& e) { return e.get_end() <= offset; });
+        return size_t(p - extents.begin());
+    }
+
+    auto touch(Extent& extent) -> void {
+        if(const auto pool = resident.get_pool(); pool != nullptr && pool->recency) {
+            extent.last_access = pool->clock.fetch_add(1, std::memory_order_relaxed) + 1;
+        }
     }
 
     template <bool reverse>
@@ -46,113 +355,736 @@ class File : public Object {
         }
     }
 
+    // one memcpy per extent touched, holes read as zeros
+    // the range must be unpacked, and a write must be preceded by allocate() and unshare()
     template <bool write>
-    auto copy(const size_t offset, size_t size, std::conditional_t<write, const uint8_t*, uint8_t*> buffer) -> Error {
+    auto copy(size_t offset, size_t size, std::conditional_t<write, const uint8_t*, uint8_t*> buffer) -> Error {
         if(offset + size > filesize) {
             return Error::Code::EndOfFile;
         }
 
-        auto frame_index = offset / bytes_per_frame;
-
-        {
-            const auto offset_in_frame = offset % bytes_per_frame;
-            const auto size_in_frame   = bytes_per_frame - offset_in_frame;
-            const auto copy_len        = size < size_in_frame ? size : size_in_frame;
-            memory_copy<write>(buffer, data_at(frame_index) + offset_in_frame, copy_len);
+        for(auto i = find_extent(offset); size != 0;) {
+            if(i == extents.size() || extents[i].offset > offset) {
+                const auto hole_len = std::min(size, i == extents.size() ? size : extents[i].offset - offset);
+                if constexpr(!write) {
+                    memset(buffer, 0, hole_len);
+                }
+                buffer += hole_len;
+                offset += hole_len;
+                size -= hole_len;
+                continue;
+            }
+            auto&      extent   = extents[i];
+            const auto copy_len = std::min(size, extent.get_end() - offset);
+            memory_copy<write>(buffer, extent.data_at(offset), copy_len);
+            touch(extent);
+            if constexpr(write) {
+                extent.incompressible = false;
+            }
             buffer += copy_len;
+            offset += copy_len;
             size -= copy_len;
-            frame_index += 1;
+            i += 1;
+        }
+        return Error();
+    }
+
+    // fills the holes in [begin, end) with extents
+    // an extent appended right after another one doubles it up to a huge frame and may reach past end, an isolated write gets only what it touches
+    // an aligned run is preferred so that huge frames can be backed by huge pages, smaller ones are tried if memory is fragmented
+    // the new bytes outside [begin, end) are zeroed, the caller overwrites the rest
+    auto allocate(const size_t begin, const size_t end) -> Error {
+        const auto last = round_up(end);
+        for(auto position = round_down(begin), i = find_extent(position); position < last;) {
+            if(i < extents.size() && extents[i].offset <= position) {
+                position = extents[i].get_end();
+                i += 1;
+                continue;
+            }
+
+            const auto hole_frames = i < extents.size() ? size_t((extents[i].offset - position) / bytes_per_frame) : max_extent_frames;
+            const auto needed      = size_t((last - position) / bytes_per_frame);
+            const auto following   = i != 0 && extents[i - 1].get_end() == position ? extents[i - 1].frames * 2 : size_t(0);
+            auto       frames      = std::min({max_extent_frames, hole_frames, std::max(needed, following)});
+            while(true) {
+                const auto r = allocator->allocate(frames, frames >= 64 ? std::bit_floor(frames) : 1);
+                if(r) {
+                    extents.insert(extents.begin() + i, Extent{position, frames, SmartFrameID(r.as_value(), frames)});
+                    resident.add(frames);
+                    break;
+                }
+                if(frames == 1) {
+                    return r.as_error();
+                }
+                frames /= 2;
+            }
+
+            auto&      extent = extents[i];
+            const auto head   = std::clamp(begin, extent.offset, extent.get_end());
+            const auto tail   = std::clamp(end, extent.offset, extent.get_end());
+            memset(extent.data_at(extent.offset), 0, head - extent.offset);
+            memset(extent.data_at(tail), 0, extent.get_end() - tail);
+            position = extent.get_end();
+            i += 1;
+        }
+        return Error();
+    }
+
+    // splits the extent containing offset, which must be frame aligned, so that an extent starts there
+    auto split(const size_t offset) -> void {
+        const auto i = find_extent(offset);
+        if(i == extents.size() || extents[i].offset >= offset) {
+            return;
+        }
+        auto&      extent = extents[i];
+        const auto head   = size_t((offset - extent.offset) / bytes_per_frame);
+        auto       tail   = extent.is_packed() ? Extent{offset, extent.frames - head, SmartFrameID(), extent.packed, extent.packed_first + head}
+                            : extent.is_mapped() ? Extent{offset, extent.frames - head, SmartFrameID(), nullptr, 0, extent.mapping, extent.mapped_offset + head * bytes_per_frame}
+                                                 : Extent{offset, extent.frames - head, extent.data.split(head)};
+        tail.last_access  = extent.last_access;
+        extent.frames     = head;
+        extents.insert(extents.begin() + i + 1, std::move(tail));
+    }
+
+    // frees the frames in [begin, end), which must be frame aligned
+    auto release(const size_t begin, const size_t end) -> void {
+        split(begin);
+        split(end);
+        const auto first = extents.begin() + find_extent(begin);
+        const auto last  = extents.begin() + find_extent(end);
+        auto       n     = size_t(0);
+        for(auto i = first; i != last; i += 1) {
+            n += i->is_resident() ? i->frames : 0;
+        }
+        extents.erase(first, last);
+        resident.remove(n);
+    }
+
+    // decompresses the packed frames in [begin, end), the rest of their extents stays packed
+    auto unpack(const size_t begin, const size_t end) -> Error {
+        const auto first = round_down(begin);
+        const auto last  = round_up(end);
+        for(auto i = find_extent(first); i < extents.size() && extents[i].offset < last; i += 1) {
+            if(!extents[i].is_packed()) {
+                continue;
+            }
+            const auto from   = std::max(first, extents[i].offset);
+            const auto to     = std::min(last, extents[i].get_end());
+            const auto frames = size_t((to - from) / bytes_per_frame);
+            const auto r      = allocator->allocate(frames);
+            if(!r) {
+                return r.as_error();
+            }
+            auto data = SmartFrameID(r.as_value(), frames);
+            split(from);
+            split(to);
+            i = find_extent(from);
+
+            auto&      extent = extents[i];
+            const auto dest   = static_cast<uint8_t*>(data->get_frame());
+            for(auto k = size_t(0); k < frames; k += 1) {
+                if(!extent.packed->unpack(extent.packed_first + k, dest + k * bytes_per_frame)) {
+                    return Error::Code::InvalidData;
+                }
+            }
+            extent.data         = std::move(data);
+            extent.packed       = nullptr;
+            extent.packed_first = 0;
+            resident.add(frames);
+        }
+        return Error();
+    }
+
+    // moves the inline bytes to frames, the file stays inline if that fails
+    auto promote() -> Error {
+        if(filesize != 0) {
+            if(const auto e = allocate(0, filesize)) {
+                release(0, std::numeric_limits<size_t>::max());
+                return e;
+            }
+            copy<true>(0, filesize, inline_data.data());
         }
+        inlined = false;
+        inline_data.fill(0);
+        return Error();
+    }
+
+    // mapped bytes are shared with the image
+    auto is_shared(Extent& extent, const size_t offset) const -> bool {
+        return extent.is_mapped() || allocator->get_owners(FrameID(extent.data_at(offset))) > 1;
+    }
+
+    // gives this file its own copy of the shared frames in [begin, end), before the caller overwrites that range
+    // bytes outside the range are copied, a frame the caller overwrites completely is not
+    auto unshare(const size_t begin, const size_t end) -> Error {
+        const auto last = round_up(end);
+        for(auto position = round_down(begin); position < last;) {
+            const auto i = find_extent(position);
+            if(i == extents.size() || extents[i].offset >= last) {
+                break;
+            }
+            const auto stop = std::min(last, extents[i].get_end());
+            position        = std::max(position, extents[i].offset);
+            while(position < stop && !is_shared(extents[i], position)) {
+                position += bytes_per_frame;
+            }
+            if(position == stop) {
+                continue;
+            }
+            auto run_end = size_t(position + bytes_per_frame);
+            while(run_end < stop && is_shared(extents[i], run_end)) {
+                run_end += bytes_per_frame;
+            }
 
-        while(size >= bytes_per_frame) {
-            memory_copy<write>(buffer, data_at(frame_index), bytes_per_frame);
-            buffer += bytes_per_frame;
-            size -= bytes_per_frame;
-            frame_index += 1;
+            const auto frames = size_t((run_end - position) / bytes_per_frame);
+            const auto r      = allocator->allocate(frames);
+            if(!r) {
+                return r.as_error();
+            }
+            auto copy = SmartFrameID(r.as_value(), frames);
+            split(position);
+            split(run_end);
+            auto&      extent = extents[find_extent(position)];
+            const auto dest   = static_cast<uint8_t*>(copy->get_frame());
+            const auto head   = std::clamp(begin, position, run_end);
+            const auto tail   = std::clamp(end, position, run_end);
+            memcpy(dest, extent.data_at(position), head - position);
+            memcpy(dest + (tail - position), extent.data_at(tail), run_end - tail);
+            if(extent.is_mapped()) {
+                extent.mapping       = nullptr;
+                extent.mapped_offset = 0;
+                resident.add(frames);
+            }
+            extent.data = std::move(copy);
+            position    = run_end;
         }
+        return Error();
+    }
 
-        if(size != 0) {
-            memory_copy<write>(buffer, data_at(frame_index), size);
+    // in dedup mode, replaces the frames a write to [begin, end) completed with shared frames holding the same bytes
+    // a frame is complete when its last byte was written, so that streaming writes of any size are caught
+    // a partial last frame of the file is left alone, as an append growing it piece by piece would leave a stale copy in the table for every piece
+    auto deduplicate(const size_t begin, const size_t end) -> void {
+        const auto pool = resident.get_pool();
+        if(pool == nullptr || pool->contents == nullptr) {
+            return;
+        }
+        for(auto position = round_down(begin); position < round_down(end); position += bytes_per_frame) {
+            const auto i = find_extent(position);
+            if(i == extents.size() || extents[i].offset > position || !extents[i].is_resident() || is_shared(extents[i], position)) {
+                continue;
+            }
+            auto shared = pool->contents->find_or_add(extents[i].data_at(position));
+            if(!shared) {
+                continue;
+            }
+            split(position);
+            split(position + bytes_per_frame);
+            extents[find_extent(position)].data = std::move(*shared);
         }
+    }
 
+    // zeroes the allocated bytes in [begin, end)
+    auto zero(const size_t begin, const size_t end) -> Error {
+        if(begin >= end) {
+            return Error();
+        }
+        if(const auto e = unpack(begin, end)) {
+            return e;
+        }
+        if(const auto e = unshare(begin, end)) {
+            return e;
+        }
+        for(auto i = find_extent(begin); i < extents.size() && extents[i].offset < end; i += 1) {
+            auto&      extent = extents[i];
+            const auto first  = std::max(begin, extent.offset);
+            const auto last   = std::min(end, extent.get_end());
+            memset(extent.data_at(first), 0, last - first);
+        }
         return Error();
     }
 
   public:
     auto read(const size_t offset, const size_t size, uint8_t* const buffer) -> Error {
+        if(offset + size > filesize) {
+            return Error::Code::EndOfFile;
+        }
+        if(inlined) {
+            std::copy_n(inline_data.begin() + offset, size, buffer);
+            return Error();
+        }
+        if(const auto e = unpack(offset, offset + size)) {
+            return e;
+        }
         return copy<false>(offset, size, static_cast<uint8_t*>(buffer));
     }
 
     auto write(const size_t offset, const size_t size, const void* const buffer) -> Error {
-        return copy<true>(offset, size, static_cast<const uint8_t*>(buffer));
+        if(offset + size > filesize) {
+            return Error::Code::EndOfFile;
+        }
+        if(inlined) {
+            std::copy_n(static_cast<const uint8_t*>(buffer), size, inline_data.begin() + offset);
+            return Error();
+        }
+        if(const auto e = allocate(offset, offset + size)) {
+            return e;
+        }
+        if(const auto e = unpack(offset, offset + size)) {
+            return e;
+        }
+        if(const auto e = unshare(offset, offset + size)) {
+            return e;
+        }
+        if(const auto e = copy<true>(offset, size, static_cast<const uint8_t*>(buffer))) {
+            return e;
+        }
+        deduplicate(offset, offset + size);
+        return Error();
     }
 
+    // growing only moves the end, the new range is a hole
+    // shrinking releases the frames past the new end
+    // an inline file moves to frames when it grows past the inline limit, and truncating to zero makes it inline again
     auto resize(const size_t new_size) -> Error {
-        const auto new_data_size = (new_size + bytes_per_frame - 1) / bytes_per_frame;
-        const auto old_data_size = data.size();
-        if(new_data_size > old_data_size) {
-            auto new_frames = std::vector<SmartFrameID>(new_data_size - old_data_size);
-            for(auto& f : new_frames) {
-                auto frame = allocator->allocate(1);
-                if(!frame) {
-                    return frame.as_error();
-                }
-                f = SmartFrameID(frame.as_value(), 1);
-            }
-            data.reserve(new_data_size);
-            std::move(std::begin(new_frames), std::end(new_frames), std::back_inserter(data));
-        } else if(new_data_size < old_data_size) {
-            data.resize(new_data_size);
+        if(new_size == 0) {
+            release(0, std::numeric_limits<size_t>::max());
+            inline_data.fill(0);
+            inlined = true;
+        } else if(inlined) {
+            if(new_size <= inline_limit) {
+                if(new_size < filesize) {
+                    std::fill(inline_data.begin() + new_size, inline_data.begin() + filesize, 0);
+                }
+                filesize = new_size;
+                return Error();
+            }
+            if(const auto e = promote()) {
+                return e;
+            }
+        }
+        if(new_size < filesize) {
+            if(const auto e = zero(new_size, round_up(new_size))) {
+                return e;
+            }
+            release(round_up(new_size), std::numeric_limits<size_t>::max());
         }
         filesize = new_size;
         return Error();
     }
 
+    // like lseek with SEEK_DATA, the first offset at or after offset which is not in a hole
+    // EndOfFile if there is none
+    auto seek_data(const size_t offset) const -> Result<size_t> {
+        if(offset >= filesize) {
+            return Error::Code::EndOfFile;
+        }
+        if(inlined) {
+            return size_t(offset);
+        }
+        const auto i = find_extent(offset);
+        if(i == extents.size() || extents[i].offset >= filesize) {
+            return Error::Code::EndOfFile;
+        }
+        return size_t(std::max(offset, extents[i].offset));
+    }
+
+    // like lseek with SEEK_HOLE, the first offset at or after offset which is in a hole
+    // the end of the file counts as a hole, EndOfFile if offset is past it
+    auto seek_hole(const size_t offset) const -> Result<size_t> {
+        if(offset >= filesize) {
+            return Error::Code::EndOfFile;
+        }
+        if(inlined) {
+            return size_t(filesize);
+        }
+        auto position = offset;
+        for(auto i = find_extent(offset); i < extents.size() && extents[i].offset <= position; i += 1) {
+            position = extents[i].get_end();
+        }
+        return size_t(std::min(position, filesize));
+    }
+
+    // frees the frames inside the range and zeroes the partially covered ones, the size does not change
+    auto punch_hole(const size_t offset, const size_t size) -> Error {
+        const auto end   = std::min(offset + size, filesize);
+        const auto first = round_up(offset);
+        const auto last  = end == filesize ? round_up(end) : round_down(end); // bytes past the end are zero already
+        if(offset >= end) {
+            return Error();
+        }
+        if(inlined) {
+            memset(inline_data.data() + offset, 0, end - offset);
+            return Error();
+        }
+        if(first >= last) {
+            return zero(offset, end);
+        }
+        if(const auto e = zero(offset, first)) {
+            return e;
+        }
+        if(const auto e = zero(last, end)) {
+            return e;
+        }
+        release(first, last);
+        return Error();
+    }
+
+    // makes this file a copy of source which shares its frames, each file copies a shared frame on its first write to it
+    // packed and mapped extents are shared as they are
+    auto clone_from(const File& source) -> Error {
+        if(&source == this) {
+            return Error();
+        }
+        auto shared = std::vector<Extent>();
+        auto frames = size_t(0);
+        shared.reserve(source.extents.size());
+        for(const auto& e : source.extents) {
+            if(!e.is_resident()) {
+                shared.push_back(Extent{e.offset, e.frames, SmartFrameID(), e.packed, e.packed_first, e.mapping, e.mapped_offset, e.last_access});
+                continue;
+            }
+            auto r = e.data.share();
+            if(!r) {
+                return r.as_error();
+            }
+            shared.push_back(Extent{e.offset, e.frames, std::move(r.as_value()), nullptr, 0, nullptr, 0, e.last_access});
+            frames += e.frames;
+        }
+        release(0, std::numeric_limits<size_t>::max());
+        extents     = std::move(shared);
+        filesize    = source.filesize;
+        inlined     = source.inlined;
+        inline_data = source.inline_data;
+        resident.add(frames);
+        if(inlined && filesize > inline_limit) {
+            return promote();
+        }
+        return Error();
+    }
+
     auto get_size() const -> size_t {
         return filesize;
     }
 
-    File(std::string name) : Object(std::move(name)) {}
+    auto is_inline() const -> bool {
+        return inlined;
+    }
+
+    auto get_extent_count() const -> size_t {
+        return extents.size();
+    }
+
+    // bytes backed by uncompressed frames
+    auto get_allocated_size() const -> size_t {
+        auto r = size_t(0);
+        for(const auto& e : extents) {
+            r += e.is_resident() ? e.frames * bytes_per_frame : 0;
+        }
+        return r;
+    }
+
+    // calls fn(data, frames) for each extent backed by frames of the allocator
+    template <class F>
+    auto for_each_resident(F&& fn) -> void {
+        for(auto& e : extents) {
+            if(e.is_resident()) {
+                fn(e.data_at(e.offset), e.frames);
+            }
+        }
+    }
+
+    // compresses the uncompressed extent starting at offset, an extent with shared frames is left alone
+    // returns false if nothing was compressed, an extent which does not shrink enough is not tried again until written
+    auto pack(const size_t offset) -> Result<bool> {
+        const auto i    = find_extent(offset);
+        const auto pool = resident.get_pool();
+        if(pool == nullptr || i == extents.size() || extents[i].offset != offset || !extents[i].is_resident()) {
+            return false;
+        }
+        auto& extent = extents[i];
+        for(auto f = extent.offset; f < extent.get_end(); f += bytes_per_frame) {
+            if(is_shared(extent, f)) {
+                return false;
+            }
+        }
+
+        auto packed = std::make_shared<Packed>();
+        auto block  = std::array<uint8_t, bytes_per_frame>();
+        packed->ends.reserve(extent.frames);
+        for(auto f = extent.offset; f < extent.get_end(); f += bytes_per_frame) {
+            const auto frame = extent.data_at(f);
+            const auto size  = lz::compress({frame, bytes_per_frame}, {block.data(), bytes_per_frame - 1});
+            if(size == 0) {
+                packed->bytes.insert(packed->bytes.end(), frame, frame + bytes_per_frame);
+            } else {
+                packed->bytes.insert(packed->bytes.end(), block.begin(), block.begin() + size);
+            }
+            packed->ends.push_back(packed->bytes.size());
+        }
+        if(packed->bytes.size() > extent.frames * bytes_per_frame / 8 * 7) {
+            extent.incompressible = true;
+            return false;
+        }
+        packed->bytes.shrink_to_fit();
+        packed->pool = pool;
+        pool->packed_frames += extent.frames;
+        pool->packed_bytes += packed->bytes.size();
+
+        extent.data   = SmartFrameID();
+        extent.packed = std::move(packed);
+        resident.remove(extent.frames);
+        return true;
+    }
+
+    // calls fn(offset, last_access) for each extent pack() may compress
+    template <class F>
+    auto for_each_packable(F&& fn) const -> void {
+        for(const auto& e : extents) {
+            if(e.is_resident() && !e.incompressible) {
+                fn(e.offset, e.last_access);
+            }
+        }
+    }
+
+    auto get_inline_data() const -> std::span<const uint8_t> {
+        return std::span(inline_data.data(), inlined ? filesize : 0);
+    }
+
+    auto get_mutex() const -> std::mutex& {
+        return mutex;
+    }
+
+    // calls fn(offset, frames, data, key) for each extent, and stops at the first error fn returns
+    // key is the same for extents which share their data, and nullptr if the data is not shared
+    // packed extents are decompressed into a buffer first
+    template <class F>
+    auto for_each_extent(F&& fn) -> Error {
+        auto buffer = std::vector<uint8_t>();
+        for(auto& e : extents) {
+            if(!e.is_packed()) {
+                const auto data = const_cast<const uint8_t*>(e.data_at(e.offset));
+                if(const auto r = fn(e.offset, e.frames, data, is_shared(e, e.offset) ? static_cast<const void*>(data) : nullptr)) {
+                    return r;
+                }
+                continue;
+            }
+            buffer.resize(e.frames * bytes_per_frame);
+            for(auto k = size_t(0); k < e.frames; k += 1) {
+                if(!e.packed->unpack(e.packed_first + k, buffer.data() + k * bytes_per_frame)) {
+                    return Error::Code::InvalidData;
+                }
+            }
+            const auto key = e.packed.use_count() > 1 ? static_cast<const void*>(&e.packed->ends[e.packed_first]) : nullptr;
+            if(const auto r = fn(e.offset, e.frames, const_cast<const uint8_t*>(buffer.data()), key)) {
+                return r;
+            }
+        }
+        return Error();
+    }
+
+    // replaces the contents with extents read from a restored image until they are written
+    // the extents must have passed image::check_extents
+    auto map(std::shared_ptr<const image::Mapping> mapping, const size_t size, const std::span<const image::Extent> mapped) -> void {
+        release(0, std::numeric_limits<size_t>::max());
+        extents.reserve(mapped.size());
+        for(const auto& e : mapped) {
+            extents.push_back(Extent{e.offset, e.frames, SmartFrameID(), nullptr, 0, mapping, e.data});
+        }
+        filesize = size;
+        inlined  = false;
+        inline_data.fill(0);
+    }
+
+    // pool is the one of the mount, files without one are never compressed
+    File(Name name, const size_t inline_limit = default_inline_limit, Pool* const pool = nullptr) : Object(std::move(name)),
+                                                                                                          inline_limit(std::min(inline_limit, max_inline_limit)),
+                                                                                                          resident(pool) {}
 };
 
 class Directory : public Object {
   private:
-    std::unordered_map<std::string, std::variant<File, Directory>> children;
+    // sequence numbers grow with every insertion and are never reused, so a cursor holding one stays valid
+    struct Entry {
+        uint64_t                                       sequence;
+        std::unique_ptr<std::variant<File, Directory>> object; // nullptr once removed
+    };
+
+    std::vector<Entry>                           entries; // in insertion order, removed entries are left as tombstones
+    std::unordered_map<std::string_view, size_t> names;   // name -> position in entries, keys point into the objects
+    uint64_t                                     next_sequence = 0;
+    size_t                                       removed       = 0;
+
+    static auto get_name_of(const std::variant<File, Directory>& object) -> const Name& {
+        return std::visit([](const auto& o) -> const Name& { return o.get_name(); }, object);
+    }
+
+    // drops the tombstones, the order and the sequence numbers are kept
+    auto compact() -> void {
+        std::erase_if(entries, [](const Entry& e) { return !e.object; });
+        for(auto i = size_t(0); i < entries.size(); i += 1) {
+            names[get_name_of(*entries[i].object)] = i;
+        }
+        removed = 0;
+    }
 
   public:
     auto find(const std::string_view name) const -> const std::variant<File, Directory>* {
-        // TODO
-        // children.find(name)
-        // https://onihusube.hatenablog.com/entry/2021/12/17/002236
-        const auto p = children.find(std::string(name));
-        return p != children.end() ? &p->second : nullptr;
+        const auto p = names.find(name);
+        return p != names.end() ? entries[p->second].object.get() : nullptr;
     }
 
-    template <FileObject T>
-    auto create(const std::string_view name) -> std::variant<File, Directory>* {
-        return &children.emplace(std::string(name), T(std::string(name))).first->second;
+    template <FileObject T, class... Args>
+    auto create(const std::string_view name, Args&&... args) -> std::variant<File, Directory>* {
+        auto& entry = entries.emplace_back(Entry{next_sequence, std::make_unique<std::variant<File, Directory>>(T(Name(name), std::forward<Args>(args)...))});
+        next_sequence += 1;
+        names.emplace(get_name_of(*entry.object), entries.size() - 1);
+        return entry.object.get();
     }
 
+    // compacts once tombstones outnumber the children
     auto remove(const std::string_view name) -> bool {
-        return children.erase(std::string(name)) != 0;
+        const auto p = names.find(name);
+        if(p == names.end()) {
+            return false;
+        }
+        auto object = std::move(entries[p->second].object);
+        names.erase(p);
+        removed += 1;
+        if(removed > entries.size() / 2) {
+            compact();
+        }
+        return true;
     }
 
-    auto find_nth(const size_t index) const -> Result<const std::variant<File, Directory>*> {
-        if(index >= children.size()) {
+    // indices count children only, so tombstones are dropped first
+    // this writes to the directory, callers hold it exclusively
+    auto find_nth(const size_t index) -> Result<const std::variant<File, Directory>*> {
+        if(removed != 0) {
+            compact();
+        }
+        if(index >= entries.size()) {
             return Error::Code::IndexOutOfRange;
         }
+        return entries[index].object.get();
+    }
+
+    // calls fn on children from cursor in insertion order, and advances cursor past each one fn accepts
+    // stops without advancing when fn returns false
+    template <class F>
+    auto list(DirectoryCursor& cursor, F&& fn) const -> void {
+        const auto first = std::partition_point(entries.begin(), entries.end(), [&cursor](const Entry& e) { return e.sequence < cursor.position; });
+        for(auto i = first; i != entries.end(); i += 1) {
+            if(!i->object) {
+                continue;
+            }
+            if(!fn(*i->object)) {
+                return;
+            }
+            cursor.position = i->sequence + 1;
+        }
+        cursor.end = true;
+    }
+
+    auto get_child_count() const -> size_t {
+        return names.size();
+    }
+
+    template <class F>
+    auto for_each(F&& fn) -> void {
+        for(auto& e : entries) {
+            if(e.object) {
+                fn(*e.object);
+            }
+        }
+    }
 
-        const auto i = std::next(children.begin(), index);
-        return &i->second;
+    Directory(Name name) : Object(std::move(name)) {}
+};
+
+struct Options {
+    size_t inline_limit = default_inline_limit;
+    size_t memory_limit = 0;     // bytes of uncompressed frames kept before cold ones are compressed, 0 never compresses
+    bool   background   = false; // compress in a background thread instead of the call which went over the limit
+    bool   dedup        = false; // share frames with the same bytes between files, see ContentTable
+};
+
+struct CompressionStatistics {
+    size_t resident_bytes;
+    size_t packed_frames;
+    size_t packed_bytes;
+
+    auto get_ratio() const -> double {
+        return packed_bytes == 0 ? 1.0 : double(packed_frames * bytes_per_frame) / packed_bytes;
     }
+};
 
-    Directory(std::string name) : Object(std::move(name)) {}
+struct DedupStatistics {
+    size_t logical_frames;  // frames of every file, shared frames are counted by each of them
+    size_t physical_frames; // distinct frames, including the ones only the content table still holds
+    size_t table_frames;
+
+    auto get_ratio() const -> double {
+        return physical_frames == 0 ? 1.0 : double(logical_frames) / physical_frames;
+    }
 };
 
+// with compression or dedup on, an operation on a file takes the lock of the file and a change to the tree takes the tree lock
+// reclaim shares the tree lock while it packs files one by one, so that none of them is removed under it
+// without either, no lock is taken and the caller serializes operations on a file as with the other drivers
+// locks are taken in the order tree, reclaim, file
 class Driver : public fs::Driver {
   private:
+    constexpr static auto extents_per_slice = size_t(64);                         // background compression drops the locks after this many
+    constexpr static auto unknown_frames    = std::numeric_limits<size_t>::max(); // never equal to the added frames
+
+    // an extent reclaim may compress, ordered by its last access when the tree was scanned
+    struct Candidate {
+        uint64_t last_access;
+        File*    file;
+        size_t   offset;
+    };
+
+    ContentTable                  contents;
+    Pool                          pool; // outlives the files counted in it
     std::variant<File, Directory> data;
     OpenInfo                      root;
+    Options                       options;
+    bool                          locking; // compression or dedup is on
+    std::shared_mutex             tree_mutex;
+    std::mutex                    reclaim_mutex;                   // guards the candidates
+    std::vector<Candidate>        candidates;                      // least recently used first, consumed from next_candidate on
+    size_t                        next_candidate = 0;
+    size_t                        scanned_frames = unknown_frames; // added frames of the pool when the candidates were collected
+    std::atomic<size_t>           idle_frames    = unknown_frames; // added frames of the pool when reclaim ran out of candidates
+    std::mutex                    wakeup_mutex;                    // guards pending
+    std::condition_variable       wakeup;
+    bool                          pending = false;                 // the mount went over its limit since the compressor last woke up
+    std::atomic<bool>             stop    = false;
+    std::thread                   compressor;
+
+    auto lock_tree() -> std::unique_lock<std::shared_mutex> {
+        return locking ? std::unique_lock(tree_mutex) : std::unique_lock<std::shared_mutex>();
+    }
+
+    auto share_tree() -> std::shared_lock<std::shared_mutex> {
+        return locking ? std::shared_lock(tree_mutex) : std::shared_lock<std::shared_mutex>();
+    }
+
+    auto lock_file(const File& file) -> std::unique_lock<std::mutex> {
+        return locking ? std::unique_lock(file.get_mutex()) : std::unique_lock<std::mutex>();
+    }
+
+    // both locks are taken at once, so that two clones between the same files in opposite directions do not deadlock
+    auto lock_files(const File& a, const File& b) -> std::pair<std::unique_lock<std::mutex>, std::unique_lock<std::mutex>> {
+        if(!locking || &a == &b) {
+            return {lock_file(a), std::unique_lock<std::mutex>()};
+        }
+        auto first  = std::unique_lock(a.get_mutex(), std::defer_lock);
+        auto second = std::unique_lock(b.get_mutex(), std::defer_lock);
+        std::lock(first, second);
+        return {std::move(first), std::move(second)};
+    }
 
     template <FileObject T>
     auto data_as(const DriverData& data) -> Result<T*> {
@@ -165,7 +1097,8 @@ class Driver : public fs::Driver {
 
     auto create_openinfo(const std::variant<File, Directory>& variant) -> OpenInfo {
         if(std::holds_alternative<File>(variant)) {
-            auto& o = std::get<File>(variant);
+            auto&      o    = std::get<File>(variant);
+            const auto lock = lock_file(o);
             return OpenInfo(o.get_name(), *this, &variant, FileType::Regular, o.get_size());
         } else {
             auto& o = std::get<Directory>(variant);
@@ -173,25 +1106,324 @@ class Driver : public fs::Driver {
         }
     }
 
+    auto is_over_limit() const -> bool {
+        return options.memory_limit != 0 && pool.resident_frames * bytes_per_frame > options.memory_limit;
+    }
+
+    // with the tree lock shared and the reclaim lock held
+    auto collect_candidates() -> void {
+        candidates.clear();
+        next_candidate = 0;
+        scanned_frames = pool.added_frames;
+        auto directories = std::vector<Directory*>{&std::get<Directory>(data)};
+        while(!directories.empty()) {
+            const auto dir = directories.back();
+            directories.pop_back();
+            dir->for_each([&](std::variant<File, Directory>& child) {
+                if(std::holds_alternative<Directory>(child)) {
+                    directories.push_back(&std::get<Directory>(child));
+                    return;
+                }
+                auto&      file = std::get<File>(child);
+                const auto lock = lock_file(file);
+                file.for_each_packable([&](const size_t offset, const uint64_t last_access) {
+                    candidates.push_back(Candidate{last_access, &file, offset});
+                });
+            });
+        }
+        std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) { return a.last_access < b.last_access; });
+    }
+
+    // with the tree lock held exclusively, after files were destroyed
+    auto forget_candidates() -> void {
+        candidates.clear();
+        next_candidate = 0;
+        scanned_frames = unknown_frames;
+        idle_frames    = unknown_frames;
+    }
+
+    // compresses the least recently used extents until the mount is an eighth below its limit
+    // returns the number of extents compressed, at most max_extents
+    // the candidates are sorted once and consumed across calls, one accessed since the scan may still be compressed and is decompressed on its next access
+    // once they run out, the tree is scanned again only after frames were added, as only new frames can be new candidates
+    auto reclaim(const size_t max_extents) -> size_t {
+        const auto tree = share_tree();
+        const auto lock = std::lock_guard(reclaim_mutex);
+
+        const auto target = options.memory_limit - options.memory_limit / 8;
+        auto       packed = size_t(0);
+        while(packed < max_extents && pool.resident_frames * bytes_per_frame > target) {
+            if(next_candidate == candidates.size()) {
+                if(pool.added_frames == scanned_frames) {
+                    idle_frames = scanned_frames;
+                    break;
+                }
+                collect_candidates();
+                continue;
+            }
+            const auto& c         = candidates[next_candidate];
+            const auto  file_lock = lock_file(*c.file);
+            const auto  r         = c.file->pack(c.offset);
+            packed += r && r.as_value() ? 1 : 0;
+            next_candidate += 1;
+        }
+        return packed;
+    }
+
+    // called without locks after every operation which may have added frames
+    // nothing is done while reclaim has nothing left to compress and no frames were added since
+    auto on_access() -> void {
+        if(!is_over_limit() || pool.added_frames == idle_frames) {
+            return;
+        }
+        if(options.background) {
+            {
+                const auto lock = std::lock_guard(wakeup_mutex);
+                pending         = true;
+            }
+            wakeup.notify_one();
+        } else {
+            reclaim(std::numeric_limits<size_t>::max());
+        }
+    }
+
+    static auto write_all(const int fd, const void* const data, const size_t size, const size_t offset) -> Error {
+        for(auto done = size_t(0); done < size;) {
+            const auto n = pwrite(fd, static_cast<const uint8_t*>(data) + done, size - done, offset + done);
+            if(n <= 0) {
+                return Error::Code::IOError;
+            }
+            done += n;
+        }
+        return Error();
+    }
+
+    // directories are written breadth first, so that a parent always comes before its children
+    // extents whose frames were already written for another file point at the same data
+    auto write_image(const int fd) -> Error {
+        auto nodes   = std::vector<image::Node>{image::Node{0, 0, 0, 0, 0, 0, FileType::Directory, 0, 0}};
+        auto extents = std::vector<image::Extent>();
+        auto blob    = std::vector<uint8_t>();
+        auto written = std::unordered_map<const void*, image::Extent>(); // shared data by its key
+        auto end     = size_t(bytes_per_frame);                              // of the data written so far
+
+        const auto write_extent = [&](const size_t offset, const size_t frames, const uint8_t* const bytes, const void* const key) -> Error {
+            if(key != nullptr) {
+                if(const auto p = written.find(key); p != written.end() && p->second.frames == frames) {
+                    extents.push_back(image::Extent{offset, frames, p->second.data});
+                    return Error();
+                }
+            }
+            if(const auto e = write_all(fd, bytes, frames * bytes_per_frame, end)) {
+                return e;
+            }
+            extents.push_back(image::Extent{offset, frames, end});
+            if(key != nullptr) {
+                written[key] = extents.back();
+            }
+            end += frames * bytes_per_frame;
+            return Error();
+        };
+
+        auto directories = std::vector<std::pair<Directory*, uint64_t>>{{&std::get<Directory>(data), 0}};
+        for(auto i = size_t(0); i < directories.size(); i += 1) {
+            auto e = Error();
+            directories[i].first->for_each([&](std::variant<File, Directory>& child) {
+                if(e) {
+                    return;
+                }
+                const auto  name = std::visit([](const auto& o) -> std::string_view { return o.get_name(); }, child);
+                auto        node = image::Node{directories[i].second, 0, 0, 0, blob.size(), uint32_t(name.size()), FileType::Directory, 0, 0};
+                blob.insert(blob.end(), name.begin(), name.end());
+                if(std::holds_alternative<Directory>(child)) {
+                    directories.emplace_back(&std::get<Directory>(child), nodes.size());
+                    nodes.push_back(node);
+                    return;
+                }
+
+                auto&      file = std::get<File>(child);
+                const auto lock = lock_file(file);
+                node.type       = FileType::Regular;
+                node.size       = file.get_size();
+                if(file.is_inline()) {
+                    const auto bytes = file.get_inline_data();
+                    node.first       = blob.size();
+                    node.inlined     = 1;
+                    blob.insert(blob.end(), bytes.begin(), bytes.end());
+                } else {
+                    node.first = extents.size();
+                    e          = file.for_each_extent(write_extent);
+                    node.count = extents.size() - node.first;
+                }
+                nodes.push_back(node);
+            });
+            if(e) {
+                return e;
+            }
+        }
+
+        const auto header = image::Header{image::magic, image::version, uint32_t(bytes_per_frame), end, nodes.size(), extents.size(), blob.size()};
+        if(const auto e = write_all(fd, nodes.data(), nodes.size() * sizeof(image::Node), end)) {
+            return e;
+        }
+        end += nodes.size() * sizeof(image::Node);
+        if(const auto e = write_all(fd, extents.data(), extents.size() * sizeof(image::Extent), end)) {
+            return e;
+        }
+        end += extents.size() * sizeof(image::Extent);
+        if(const auto e = write_all(fd, blob.data(), blob.size(), end)) {
+            return e;
+        }
+        return write_all(fd, &header, sizeof(header), 0);
+    }
+
+    // builds the tree of an image below the empty root
+    auto restore_tree(const std::shared_ptr<const image::Mapping>& mapping) -> Error {
+        const auto& header = *reinterpret_cast<const image::Header*>(mapping->data);
+        if(header.magic != image::magic || header.version != image::version || header.bytes_per_frame != bytes_per_frame) {
+            return Error::Code::InvalidData;
+        }
+        const auto tree_offset = header.tree_offset;
+        if(tree_offset % bytes_per_frame != 0 || tree_offset > mapping->bytes ||
+           header.node_count == 0 || header.node_count > (mapping->bytes - tree_offset) / sizeof(image::Node)) {
+            return Error::Code::InvalidData;
+        }
+        const auto extents_offset = tree_offset + header.node_count * sizeof(image::Node);
+        if(header.extent_count > (mapping->bytes - extents_offset) / sizeof(image::Extent)) {
+            return Error::Code::InvalidData;
+        }
+        const auto blob_offset = extents_offset + header.extent_count * sizeof(image::Extent);
+        if(header.blob_bytes > mapping->bytes - blob_offset) {
+            return Error::Code::InvalidData;
+        }
+        const auto nodes   = std::span(reinterpret_cast<const image::Node*>(mapping->data + tree_offset), header.node_count);
+        const auto extents = std::span(reinterpret_cast<const image::Extent*>(mapping->data + extents_offset), header.extent_count);
+        const auto blob    = std::span(mapping->data + blob_offset, header.blob_bytes);
+        if(nodes[0].type != FileType::Directory) {
+            return Error::Code::InvalidData;
+        }
+
+        auto directories = std::vector<Directory*>(nodes.size(), nullptr);
+        directories[0]   = &std::get<Directory>(data);
+        for(auto i = size_t(1); i < nodes.size(); i += 1) {
+            const auto& node = nodes[i];
+            if(node.parent >= i || directories[node.parent] == nullptr || node.name_length == 0 || node.name > blob.size() || node.name_length > blob.size() - node.name) {
+                return Error::Code::InvalidData;
+            }
+            const auto dir  = directories[node.parent];
+            const auto name = std::string_view(reinterpret_cast<const char*>(blob.data() + node.name), node.name_length);
+            if(dir->find(name) != nullptr) {
+                return Error::Code::InvalidData;
+            }
+            if(node.type == FileType::Directory) {
+                directories[i] = &std::get<Directory>(*dir->create<Directory>(name));
+                continue;
+            }
+            if(node.type != FileType::Regular) {
+                return Error::Code::InvalidData;
+            }
+
+            auto& file = std::get<File>(*dir->create<File>(name, options.inline_limit, &pool));
+            if(node.inlined != 0) {
+                if(node.first > blob.size() || node.size > blob.size() - node.first) {
+                    return Error::Code::InvalidData;
+                }
+                if(const auto e = file.resize(node.size)) {
+                    return e;
+                }
+                if(const auto e = file.write(0, node.size, blob.data() + node.first)) {
+                    return e;
+                }
+                continue;
+            }
+            if(node.first > extents.size() || node.count > extents.size() - node.first) {
+                return Error::Code::InvalidData;
+            }
+            const auto mapped = extents.subspan(node.first, node.count);
+            if(!image::check_extents(mapped, node.size, tree_offset)) {
+                return Error::Code::InvalidData;
+            }
+            file.map(mapping, node.size, mapped);
+        }
+        return Error();
+    }
+
+    // compresses in slices so that the tree is not locked for long, and sleeps while nothing can be compressed
+    auto run_compressor() -> void {
+        while(true) {
+            {
+                auto lock = std::unique_lock(wakeup_mutex);
+                wakeup.wait(lock, [this]() { return pending || stop; });
+                if(stop) {
+                    return;
+                }
+                pending = false;
+            }
+            while(!stop && reclaim(extents_per_slice) != 0) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
   public:
     auto read(const DriverData data, const size_t offset, const size_t size, void* const buffer) -> Error override {
         value_or(file, data_as<File>(data));
-        return file->read(offset, size, static_cast<uint8_t*>(buffer));
+        auto e = Error();
+        {
+            const auto lock = lock_file(*file);
+            e               = file->read(offset, size, static_cast<uint8_t*>(buffer));
+        }
+        on_access();
+        return e;
     }
 
     auto write(const DriverData data, const size_t offset, const size_t size, const void* const buffer) -> Error override {
         value_or(file, data_as<File>(data));
-        file->resize(offset + size);
-        return file->write(offset, size, static_cast<const uint8_t*>(buffer));
+        auto e = Error();
+        {
+            const auto lock = lock_file(*file);
+            if(offset + size > file->get_size()) {
+                error_or(file->resize(offset + size));
+            }
+            e = file->write(offset, size, static_cast<const uint8_t*>(buffer));
+        }
+        on_access();
+        return e;
+    }
+
+    auto seek(const DriverData data, const size_t offset, const SeekMode mode) -> Result<size_t> override {
+        value_or(file, data_as<File>(data));
+        const auto lock = lock_file(*file);
+        return mode == SeekMode::Data ? file->seek_data(offset) : file->seek_hole(offset);
+    }
+
+    auto punch_hole(const DriverData data, const size_t offset, const size_t size) -> Error override {
+        value_or(file, data_as<File>(data));
+        const auto lock = lock_file(*file);
+        return file->punch_hole(offset, size);
+    }
+
+    auto clone(const DriverData source, const DriverData destination) -> Error override {
+        value_or(from, data_as<File>(source));
+        value_or(to, data_as<File>(destination));
+        auto e = Error();
+        {
+            const auto locks = lock_files(*from, *to);
+            e                = to->clone_from(*from);
+        }
+        on_access();
+        return e;
     }
 
     auto find(const DriverData data, const std::string_view name) -> Result<OpenInfo> override {
+        const auto lock = share_tree();
         value_or(dir, data_as<Directory>(data));
         const auto p = dir->find(name);
         return p != nullptr ? Result(create_openinfo(*p)) : Error::Code::NoSuchFile;
     }
 
     auto create(const DriverData data, const std::string_view name, const FileType type) -> Result<OpenInfo> override {
+        const auto lock = lock_tree();
         value_or(dir, data_as<Directory>(data));
         if(dir->find(name) != nullptr) {
             return Error::Code::FileExists;
@@ -200,7 +1432,7 @@ class Driver : public fs::Driver {
         auto v = (std::variant<File, Directory>*)nullptr;
         switch(type) {
         case FileType::Regular:
-            v = dir->create<File>(name);
+            v = dir->create<File>(name, options.inline_limit, &pool);
             break;
         case FileType::Directory:
             v = dir->create<Directory>(name);
@@ -211,17 +1443,39 @@ class Driver : public fs::Driver {
         return create_openinfo(*v);
     }
 
+    // exclusive, as the tombstones are dropped first
+    // without locking the controller keeps the directory to one caller with the lock of its children
     auto readdir(const DriverData data, const size_t index) -> Result<OpenInfo> override {
+        const auto lock = lock_tree();
         value_or(dir, data_as<Directory>(data));
         value_or(child, dir->find_nth(index));
         return create_openinfo(*child);
     }
 
+    // cursor positions are sequence numbers of the directory, see Directory::list
+    auto readdir_batch(const DriverData data, DirectoryCursor& cursor, DirectoryBatch& batch) -> Error override {
+        const auto lock = share_tree();
+        value_or(dir, data_as<Directory>(data));
+        dir->list(cursor, [this, &batch](const std::variant<File, Directory>& child) -> bool {
+            if(std::holds_alternative<File>(child)) {
+                const auto& o         = std::get<File>(child);
+                const auto  file_lock = lock_file(o);
+                return batch.push(o.get_name(), FileType::Regular, o.get_size());
+            } else {
+                const auto& o = std::get<Directory>(child);
+                return batch.push(o.get_name(), FileType::Directory, 0);
+            }
+        });
+        return Error();
+    }
+
     auto remove(const DriverData data, const std::string_view name) -> Error override {
+        const auto lock = lock_tree();
         value_or(dir, data_as<Directory>(data));
         if(!dir->remove(name)) {
             return Error::Code::NoSuchFile;
         }
+        forget_candidates();
         return Error();
     }
 
@@ -229,11 +1483,97 @@ class Driver : public fs::Driver {
         return root;
     }
 
-    Driver() : data(Directory("/")),
-               root("/", *this, &data, FileType::Directory, 0, true) {}
+    // writes the whole tree with the file data to an image at path
+    // directory order, holes, inline files and data shared between clones are kept
+    auto snapshot(const std::string_view path) -> Error {
+        const auto lock = share_tree();
+        const auto fd   = ::open(std::string(path).data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd < 0) {
+            return Error::Code::IOError;
+        }
+        const auto e = write_image(fd);
+        if(::close(fd) != 0 && !e) {
+            return Error::Code::IOError;
+        }
+        return e;
+    }
+
+    // fills the empty mount with the tree of an image written by snapshot
+    // the image is mapped and file data is read from it in place, a frame is copied out on its first write
+    // only the tree is read up front, data pages are read in by the os as they are accessed
+    auto restore(const std::string_view path) -> Error {
+        const auto lock = lock_tree();
+        auto&      top  = std::get<Directory>(data);
+        if(top.get_child_count() != 0) {
+            return Error::Code::FileExists;
+        }
+        value_or(mapping, image::map(path));
+        if(const auto e = restore_tree(mapping)) {
+            top = Directory("/");
+            forget_candidates();
+            return e;
+        }
+        return Error();
+    }
+
+    auto get_compression_statistics() -> CompressionStatistics {
+        return CompressionStatistics{pool.resident_frames * bytes_per_frame, pool.packed_frames, pool.packed_bytes};
+    }
+
+    // walks every file, so it takes time in proportion to the frames of the mount
+    auto get_dedup_statistics() -> DedupStatistics {
+        const auto lock     = share_tree();
+        auto       distinct = std::unordered_set<const void*>();
+        auto       table    = size_t(0);
+        contents.for_each([&](const void* const frame) {
+            distinct.insert(frame);
+            table += 1;
+        });
+        auto directories = std::vector<Directory*>{&std::get<Directory>(data)};
+        while(!directories.empty()) {
+            const auto dir = directories.back();
+            directories.pop_back();
+            dir->for_each([&](std::variant<File, Directory>& child) {
+                if(std::holds_alternative<Directory>(child)) {
+                    directories.push_back(&std::get<Directory>(child));
+                    return;
+                }
+                auto&      file      = std::get<File>(child);
+                const auto file_lock = lock_file(file);
+                file.for_each_resident([&distinct](const uint8_t* const frames, const size_t count) {
+                    for(auto i = size_t(0); i < count; i += 1) {
+                        distinct.insert(frames + i * bytes_per_frame);
+                    }
+                });
+            });
+        }
+        return DedupStatistics{pool.resident_frames, distinct.size(), table};
+    }
+
+    Driver(const Options& options = Options()) : data(Directory("/")),
+                                                 root("/", *this, &data, FileType::Directory, 0, true),
+                                                 options(options),
+                                                 locking(options.memory_limit != 0 || options.dedup) {
+        pool.recency  = options.memory_limit != 0;
+        pool.contents = options.dedup ? &contents : nullptr;
+        if(options.memory_limit != 0 && options.background) {
+            compressor = std::thread(&Driver::run_compressor, this);
+        }
+    }
+
+    ~Driver() {
+        if(compressor.joinable()) {
+            {
+                const auto lock = std::lock_guard(wakeup_mutex);
+                stop            = true;
+            }
+            wakeup.notify_one();
+            compressor.join();
+        }
+    }
 };
 
-inline auto new_driver() -> Driver {
-    return Driver();
+inline auto new_driver(const Options& options = Options()) -> Driver {
+    return Driver(options);
 }
 } // namespace fs::tmp
@@ -1,6 +1,13 @@
 #pragma once
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
 #include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <span>
 #include <string>
 #include <string_view>
 #include <unordered_map>
@@ -8,6 +15,7 @@
 
 #include "../error.hpp"
 #include "../log.hpp"
+#include "name.hpp"
 
 namespace fs {
 enum class FileType : uint32_t {
@@ -17,6 +25,147 @@ enum class FileType : uint32_t {
 
 class Driver;
 
+// what lseek-style queries look for
+enum class SeekMode : uint32_t {
+    Data,
+    Hole,
+};
+
+// position of a directory stream
+// the meaning of position is up to the driver, 0 is the first entry
+struct DirectoryCursor {
+    uint64_t position = 0;
+    bool     end      = false;
+};
+
+struct DirectoryRecord {
+    std::string_view name; // points into the name buffer of the batch
+    FileType         type;
+    size_t           size;
+};
+
+// caller provided buffers filled by readdir_batch
+struct DirectoryBatch {
+    std::span<DirectoryRecord> records;
+    std::span<char>            names;
+    size_t                     count      = 0;
+    size_t                     names_used = 0;
+
+    auto is_full() const -> bool {
+        return count == records.size();
+    }
+
+    // returns false if the name does not fit in the name buffer
+    auto push(const std::string_view name, const FileType type, const size_t size) -> bool {
+        if(is_full() || names.size() - names_used < name.size()) {
+            return false;
+        }
+        const auto dest = names.data() + names_used;
+        std::memcpy(dest, name.data(), name.size());
+        names_used += name.size();
+        records[count] = DirectoryRecord{std::string_view(dest, name.size()), type, size};
+        count += 1;
+        return true;
+    }
+
+    DirectoryBatch(const std::span<DirectoryRecord> records, const std::span<char> names) : records(records),
+                                                                                            names(names) {}
+};
+
+class OpenInfo;
+
+// an atomic member of a node in the open tree, copies of the node start over from a default value
+template <class T>
+class NodeAtomic : public std::atomic<T> {
+  public:
+    using std::atomic<T>::operator=;
+
+    NodeAtomic(const T value = T()) : std::atomic<T>(value) {}
+
+    NodeAtomic(const NodeAtomic&) : std::atomic<T>(T()) {}
+
+    auto operator=(const NodeAtomic&) -> NodeAtomic& {
+        this->store(T());
+        return *this;
+    }
+};
+
+// the open children of a directory by name, in a linear probing table of nodes
+// writers hold the lock, readers look names up without it between begin_read and end_read
+// erased nodes and replaced tables are retired until no reader is left, as one may still be looking at them
+// retired nodes are handed to dispose by whichever thread sees the last reader leave
+class Children {
+  private:
+    using Table = std::vector<std::atomic<OpenInfo*>>; // a power of two in size, nullptr for a free slot
+
+    mutable std::mutex                  mutex;
+    std::unique_ptr<Table>              owned;
+    std::atomic<Table*>                 table   = nullptr; // owned, published for readers
+    size_t                              count   = 0;
+    mutable std::atomic<uint32_t>       readers = 0;
+    std::atomic<bool>                   pending = false; // something is retired
+    std::vector<OpenInfo*>              retired_nodes;
+    std::vector<std::unique_ptr<Table>> retired_tables;
+
+    static auto home_of(const std::string_view name, const Table& table) -> size_t {
+        return NameHash()(name) & (table.size() - 1);
+    }
+
+    auto place(Table& table, OpenInfo* node) -> void;
+    auto replace_table(size_t size) -> std::unique_ptr<Table>;
+
+    template <class F>
+    auto drain(F&& dispose) -> void;
+
+    template <class F>
+    auto retire(OpenInfo* node, std::unique_ptr<Table> old_table, F&& dispose) -> void;
+
+  public:
+    auto lock() const -> std::unique_lock<std::mutex> {
+        return std::unique_lock(mutex);
+    }
+
+    auto begin_read() const -> void;
+
+    template <class F>
+    auto end_read(F&& dispose) -> void;
+
+    // inside a read or with the lock held
+    // a reader may miss a name which is being moved by an erase, and has to look again with the lock
+    auto find(std::string_view name) const -> OpenInfo*;
+
+    // with the lock held
+    template <class F>
+    auto insert(OpenInfo* node, F&& dispose) -> void;
+
+    // with the lock held, the last entry of the probe sequence shifts back into the gap
+    template <class F>
+    auto erase(OpenInfo* node, F&& dispose) -> void;
+
+    auto size() const -> size_t {
+        return count;
+    }
+
+    auto empty() const -> bool {
+        return count == 0;
+    }
+
+    // not safe against writers
+    template <class F>
+    auto for_each(F&& fn) const -> void;
+
+    Children() = default;
+
+    // children belong to one node, copies of it start without any
+    Children(const Children&) {}
+
+    auto operator=(const Children&) -> Children& {
+        return *this;
+    }
+};
+
+// nodes of the open tree are owned by the controller, which allocates them from a slab so that they never move
+// copies are made of the results of Driver::find, and start out closed with no children
 class OpenInfo {
   private:
     Driver*   driver;
@@ -24,7 +173,7 @@ class OpenInfo {
     bool      volume_root;
 
     auto check_opened(const bool write) -> bool {
-        if((write && write_count == 0) || (!write && read_count == 0 && write_count == 0)) {
+        if((write && get_write_count() == 0) || (!write && get_read_count() == 0 && get_write_count() == 0)) {
             logger(LogLevel::Error, "file \"%s\" is not %s opened\n", name.data(), write ? "write" : "read");
             return false;
         }
@@ -32,41 +181,70 @@ class OpenInfo {
     }
 
   public:
-    std::string            name;
-    uint32_t               read_count  = 0;
-    uint32_t               write_count = 0;
-    FileType               type;
-    size_t                 size;
-    OpenInfo*              parent = nullptr;
-    OpenInfo*              mount = nullptr;
+    // state packs the open counts with the number of open children, so that opening checks and updates them at once
+    // a node leaves the tree when its state drops to 0, which is only done with the lock of its parent's children held
+    // a volume root being unmounted has unmount_bit set, which it only gets while nothing is open in it
+    constexpr static auto child_unit  = uint64_t(1);
+    constexpr static auto read_unit   = uint64_t(1) << 32;
+    constexpr static auto unmount_bit = uint64_t(1) << 62;
+    constexpr static auto write_bit   = uint64_t(1) << 63;
+    constexpr static auto read_mask   = unmount_bit - read_unit;
+
+    Name                  name;
+    NodeAtomic<uint64_t>  state;
+    FileType              type;
+    size_t                size;
+    OpenInfo*             parent = nullptr;
+    NodeAtomic<OpenInfo*> mount;
 
-    std::unordered_map<std::string, OpenInfo> children;
+    Children children;
 
     auto read(size_t offset, size_t size, void* buffer) -> Error;
     auto write(size_t offset, size_t size, const void* buffer) -> Error;
     auto find(std::string_view name) -> Result<OpenInfo>;
     auto create(std::string_view name, FileType type) -> Result<OpenInfo>;
     auto readdir(size_t index) -> Result<OpenInfo>;
+    auto readdir(DirectoryCursor& cursor, std::span<DirectoryRecord> records, std::span<char> names) -> Result<size_t>;
     auto remove(std::string_view name) -> Error;
+    auto seek(size_t offset, SeekMode mode) -> Result<size_t>;
+    auto punch_hole(size_t offset, size_t size) -> Error;
+    auto clone_from(OpenInfo& source) -> Error;
+
+    auto get_read_count() const -> uint32_t {
+        return (state.load(std::memory_order_relaxed) & read_mask) / read_unit;
+    }
+
+    auto get_write_count() const -> uint32_t {
+        return state.load(std::memory_order_relaxed) / write_bit;
+    }
 
     auto is_busy() const -> bool {
-        return read_count != 0 || write_count != 0 || !children.empty() || mount != nullptr;
+        return state.load() != 0 || mount.load() != nullptr;
     }
 
     auto is_volume_root() const -> bool {
         return volume_root;
     }
 
+    // roots stay in the tree with nothing open, everything else leaves it once its state drops to 0
+    auto is_persistent() const -> bool {
+        return volume_root || parent == nullptr;
+    }
+
     auto read_driver() const -> const Driver* {
         return driver;
     }
 
-    OpenInfo(const std::string_view name, Driver& driver, const auto driver_data, const FileType type, const size_t size, const bool volume_root = false) : driver(&driver),
-                                                                                                                                                            driver_data((uintptr_t)driver_data),
-                                                                                                                                                            volume_root(volume_root),
-                                                                                                                                                            name(name),
-                                                                                                                                                            type(type),
-                                                                                                                                                            size(size) {}
+    auto read_driver_data() const -> uintptr_t {
+        return driver_data;
+    }
+
+    OpenInfo(Name name, Driver& driver, const auto driver_data, const FileType type, const size_t size, const bool volume_root = false) : driver(&driver),
+                                                                                                                                          driver_data((uintptr_t)driver_data),
+                                                                                                                                          volume_root(volume_root),
+                                                                                                                                          name(std::move(name)),
+                                                                                                                                          type(type),
+                                                                                                                                          size(size) {}
 
     // test stuff
     struct Testdata {
@@ -79,40 +257,185 @@ class OpenInfo {
     };
 
     auto test_compare(const Testdata& data) const -> bool {
-        if(name != data.name || read_count != data.read_count || write_count != data.write_count || type != data.type) {
+        if(name != data.name || get_read_count() != data.read_count || get_write_count() != data.write_count || type != data.type) {
             return false;
         }
         if(children.size() != data.children.size()) {
             return false;
         }
-        for(auto [k, v] : children) {
-            if(auto p = data.children.find(k); p == data.children.end()) {
-                return false;
-            } else {
-                v.test_compare(p->second);
-            }
-        }
-        auto i1 = children.begin();
-        auto i2 = data.children.begin();
-        while(i1 != children.end()) {
-            if(!i1->second.test_compare(i2->second)) {
-                return false;
-            }
-            i1 = std::next(i1, 1);
-            i2 = std::next(i2, 1);
+        auto matched = true;
+        children.for_each([&data, &matched](const OpenInfo& child) {
+            const auto p = data.children.find(std::string(child.name));
+            matched      = matched && p != data.children.end() && child.test_compare(p->second);
+        });
+        if(!matched) {
+            return false;
         }
 
         if(mount != nullptr) {
             if(!data.mount) {
                 return false;
             }
-            return mount->test_compare(*data.mount.get());
+            return mount.load()->test_compare(*data.mount.get());
         }
 
         return true;
     }
 };
 
+inline auto Children::place(Table& table, OpenInfo* const node) -> void {
+    const auto mask = table.size() - 1;
+    auto       slot = home_of(node->name, table);
+    while(table[slot].load(std::memory_order_relaxed) != nullptr) {
+        slot = (slot + 1) & mask;
+    }
+    table[slot].store(node, std::memory_order_release);
+}
+
+// moves every child to a new table of size, or drops the table if size is 0, and returns the current one
+inline auto Children::replace_table(const size_t size) -> std::unique_ptr<Table> {
+    auto next = size != 0 ? std::make_unique<Table>(size) : nullptr;
+    if(next && owned) {
+        for(const auto& slot : *owned) {
+            if(const auto node = slot.load(std::memory_order_relaxed)) {
+                place(*next, node);
+            }
+        }
+    }
+    table.store(next.get(), std::memory_order_release);
+    std::swap(owned, next);
+    return next;
+}
+
+template <class F>
+inline auto Children::drain(F&& dispose) -> void {
+    if(!pending.load(std::memory_order_relaxed)) {
+        return;
+    }
+    for(const auto node : retired_nodes) {
+        dispose(node);
+    }
+    retired_nodes.clear();
+    retired_tables.clear();
+    pending.store(false, std::memory_order_relaxed);
+}
+
+// node and old_table are unlinked already, readers which enter from now on cannot find them
+// they are freed at once if no reader is inside, otherwise the last reader to leave drains them
+// the fences here pair with the sequentially consistent accesses of the readers, so that either side sees the other
+template <class F>
+inline auto Children::retire(OpenInfo* const node, std::unique_ptr<Table> old_table, F&& dispose) -> void {
+    if(node == nullptr && !old_table) {
+        return;
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(readers.load(std::memory_order_acquire) == 0) {
+        if(node != nullptr) {
+            dispose(node);
+        }
+        drain(dispose);
+        return;
+    }
+    if(node != nullptr) {
+        retired_nodes.push_back(node);
+    }
+    if(old_table) {
+        retired_tables.push_back(std::move(old_table));
+    }
+    pending.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(readers.load(std::memory_order_acquire) == 0) {
+        drain(dispose);
+    }
+}
+
+inline auto Children::begin_read() const -> void {
+    readers.fetch_add(1, std::memory_order_seq_cst);
+}
+
+template <class F>
+inline auto Children::end_read(F&& dispose) -> void {
+    if(readers.fetch_sub(1, std::memory_order_seq_cst) != 1) {
+        return;
+    }
+    if(!pending.load(std::memory_order_seq_cst)) {
+        return;
+    }
+    const auto lock = std::lock_guard(mutex);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(readers.load(std::memory_order_acquire) == 0) {
+        drain(dispose);
+    }
+}
+
+inline auto Children::find(const std::string_view name) const -> OpenInfo* {
+    const auto current = table.load(std::memory_order_seq_cst);
+    if(current == nullptr) {
+        return nullptr;
+    }
+    const auto mask = current->size() - 1;
+    auto       slot = home_of(name, *current);
+    for(auto i = size_t(0); i <= mask; i += 1, slot = (slot + 1) & mask) {
+        const auto node = (*current)[slot].load(std::memory_order_seq_cst);
+        if(node == nullptr) {
+            return nullptr;
+        }
+        if(node->name == name) {
+            return node;
+        }
+    }
+    return nullptr;
+}
+
+// keeps the load factor at most 1/2
+template <class F>
+inline auto Children::insert(OpenInfo* const node, F&& dispose) -> void {
+    count += 1;
+    if(!owned || count * 2 > owned->size()) {
+        auto old_table = replace_table(std::max(size_t(8), std::bit_ceil(count * 4)));
+        place(*owned, node);
+        retire(nullptr, std::move(old_table), dispose);
+        return;
+    }
+    place(*owned, node);
+}
+
+template <class F>
+inline auto Children::erase(OpenInfo* const node, F&& dispose) -> void {
+    auto&      current = *owned;
+    const auto mask    = current.size() - 1;
+    auto       hole    = home_of(node->name, current);
+    while(current[hole].load(std::memory_order_relaxed) != node) {
+        hole = (hole + 1) & mask;
+    }
+    for(auto next = (hole + 1) & mask;; next = (next + 1) & mask) {
+        const auto moved = current[next].load(std::memory_order_relaxed);
+        if(moved == nullptr) {
+            break;
+        }
+        const auto home = home_of(moved->name, current);
+        if(((next - home) & mask) >= ((next - hole) & mask)) {
+            current[hole].store(moved, std::memory_order_release);
+            hole = next;
+        }
+    }
+    current[hole].store(nullptr, std::memory_order_release);
+    count -= 1;
+    retire(node, count == 0 && current.size() > 8 ? replace_table(0) : nullptr, dispose);
+}
+
+template <class F>
+inline auto Children::for_each(F&& fn) const -> void {
+    if(!owned) {
+        return;
+    }
+    for(const auto& slot : *owned) {
+        if(const auto node = slot.load(std::memory_order_relaxed)) {
+            fn(*node);
+        }
+    }
+}
+
 struct DriverData {
     FileType  type;
     size_t    size;
@@ -129,23 +452,73 @@ class Driver {
     virtual auto readdir(DriverData data, size_t index) -> Result<OpenInfo>                        = 0;
     virtual auto remove(DriverData data, std::string_view name) -> Error                           = 0;
 
+    // fills batch starting at cursor and advances it
+    // drivers without a native stream fall back to readdir(index)
+    virtual auto readdir_batch(DriverData data, DirectoryCursor& cursor, DirectoryBatch& batch) -> Error;
+
+    // like lseek with SEEK_DATA and SEEK_HOLE, EndOfFile if offset is not below the size
+    // drivers without holes report the whole file as data
+    virtual auto seek(DriverData data, size_t offset, SeekMode mode) -> Result<size_t>;
+
+    // deallocates the range, which reads as zeros afterwards
+    virtual auto punch_hole(DriverData data, size_t offset, size_t size) -> Error;
+
+    // replaces the contents of destination with those of source, both on this driver
+    // drivers which can share the storage until either file is modified do so
+    virtual auto clone(DriverData source, DriverData destination) -> Error;
+
     virtual auto get_root() -> OpenInfo& = 0;
 
     virtual ~Driver() = default;
 };
 
+inline auto Driver::readdir_batch(const DriverData data, DirectoryCursor& cursor, DirectoryBatch& batch) -> Error {
+    while(!cursor.end && !batch.is_full()) {
+        const auto r = readdir(data, cursor.position);
+        if(!r) {
+            const auto e = r.as_error();
+            if(e == Error::Code::EndOfFile || e == Error::Code::IndexOutOfRange) {
+                cursor.end = true;
+                break;
+            }
+            return e;
+        }
+        const auto& info = r.as_value();
+        if(!batch.push(info.name, info.type, info.size)) {
+            break;
+        }
+        cursor.position += 1;
+    }
+    return Error();
+}
+
+inline auto Driver::seek(const DriverData data, const size_t offset, const SeekMode mode) -> Result<size_t> {
+    if(offset >= data.size) {
+        return Error::Code::EndOfFile;
+    }
+    return size_t(mode == SeekMode::Data ? offset : data.size);
+}
+
+inline auto Driver::punch_hole(const DriverData data, const size_t offset, const size_t size) -> Error {
+    return Error::Code::NotImplemented;
+}
+
+inline auto Driver::clone(const DriverData source, const DriverData destination) -> Error {
+    return Error::Code::NotImplemented;
+}
+
 inline auto OpenInfo::read(const size_t offset, const size_t size, void* const buffer) -> Error {
     if(!check_opened(false)) {
         return Error::Code::FileNotOpened;
     }
-    return driver->read({type, size, driver_data}, offset, size, buffer);
+    return driver->read({type, this->size, driver_data}, offset, size, buffer);
 }
 
 inline auto OpenInfo::write(const size_t offset, const size_t size, const void* const buffer) -> Error {
     if(!check_opened(true)) {
         return Error::Code::FileNotOpened;
     }
-    return driver->write({type, size, driver_data}, offset, size, buffer);
+    return driver->write({type, this->size, driver_data}, offset, size, buffer);
 }
 
 inline auto OpenInfo::find(const std::string_view name) -> Result<OpenInfo> {
@@ -179,13 +552,53 @@ inline auto OpenInfo::readdir(const size_t index) -> Result<OpenInfo> {
     return r;
 }
 
+inline auto OpenInfo::readdir(DirectoryCursor& cursor, const std::span<DirectoryRecord> records, const std::span<char> names) -> Result<size_t> {
+    if(!check_opened(false)) {
+        return Error::Code::FileNotOpened;
+    }
+
+    auto batch = DirectoryBatch(records, names);
+    if(const auto e = driver->readdir_batch({type, size, driver_data}, cursor, batch)) {
+        return e;
+    }
+    if(batch.count == 0 && !cursor.end && !records.empty()) {
+        return Error::Code::BufferTooSmall;
+    }
+    return size_t(batch.count);
+}
+
+// the caller holds the lock of children, so that name is not opened meanwhile
 inline auto OpenInfo::remove(const std::string_view name) -> Error {
     if(!check_opened(true)) {
         return Error::Code::FileNotOpened;
     }
-    if(children.find(std::string(name)) != children.end()) {
+    if(children.find(name) != nullptr) {
         return Error::Code::FileOpened;
     }
     return driver->remove({type, size, driver_data}, name);
 }
+
+inline auto OpenInfo::seek(const size_t offset, const SeekMode mode) -> Result<size_t> {
+    if(!check_opened(false)) {
+        return Error::Code::FileNotOpened;
+    }
+    return driver->seek({type, size, driver_data}, offset, mode);
+}
+
+inline auto OpenInfo::punch_hole(const size_t offset, const size_t size) -> Error {
+    if(!check_opened(true)) {
+        return Error::Code::FileNotOpened;
+    }
+    return driver->punch_hole({type, this->size, driver_data}, offset, size);
+}
+
+inline auto OpenInfo::clone_from(OpenInfo& source) -> Error {
+    if(!check_opened(true) || !source.check_opened(false)) {
+        return Error::Code::FileNotOpened;
+    }
+    if(source.driver != driver) {
+        return Error::Code::CrossDevice;
+    }
+    return driver->clone({source.type, source.size, source.driver_data}, {type, size, driver_data});
+}
 } // namespace fs
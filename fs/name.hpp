@@ -0,0 +1,160 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace fs {
+// hashes std::string and std::string_view alike, so maps keyed by strings can be probed without building a key
+struct NameHash {
+    using is_transparent = void;
+
+    auto operator()(const std::string_view name) const -> size_t {
+        return std::hash<std::string_view>()(name);
+    }
+};
+
+// an immutable string shared by every name with the same contents while any of them is alive
+// copying one only touches a reference count, so nodes and cache entries carry names without allocating
+class Name {
+  private:
+    struct Buffer {
+        std::atomic<size_t> references;
+        size_t              hash;
+        std::string         string;
+    };
+
+    // never destroyed, names in static objects may outlive it otherwise
+    // split into shards by the hash of the string, so that threads interning different names rarely meet on a lock
+    class Table {
+      private:
+        constexpr static auto shard_count = size_t(64);
+
+        struct alignas(64) Shard {
+            std::mutex                                              mutex;
+            std::unordered_map<std::string_view, Buffer*, NameHash> buffers; // keys point into the buffers
+        };
+
+        std::array<Shard, shard_count> shards;
+
+        auto get_shard(const size_t hash) -> Shard& {
+            return shards[hash % shard_count];
+        }
+
+      public:
+        auto intern(const std::string_view string) -> Buffer* {
+            const auto hash  = NameHash()(string);
+            auto&      shard = get_shard(hash);
+            const auto lock  = std::lock_guard(shard.mutex);
+            if(const auto p = shard.buffers.find(string); p != shard.buffers.end()) {
+                p->second->references.fetch_add(1, std::memory_order_relaxed);
+                return p->second;
+            }
+            const auto buffer = new Buffer{1, hash, std::string(string)};
+            shard.buffers.emplace(buffer->string, buffer);
+            return buffer;
+        }
+
+        // the last reference is dropped under the lock, so that intern cannot revive a buffer being freed
+        auto release(Buffer* const buffer) -> void {
+            auto references = buffer->references.load(std::memory_order_relaxed);
+            while(references > 1) {
+                if(buffer->references.compare_exchange_weak(references, references - 1, std::memory_order_release, std::memory_order_relaxed)) {
+                    return;
+                }
+            }
+            auto&      shard = get_shard(buffer->hash);
+            const auto lock  = std::lock_guard(shard.mutex);
+            if(buffer->references.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+                return;
+            }
+            shard.buffers.erase(buffer->string);
+            delete buffer;
+        }
+    };
+
+    static auto get_table() -> Table& {
+        static auto& table = *new Table();
+        return table;
+    }
+
+    Buffer* buffer = nullptr; // nullptr for the empty name
+
+    auto release() -> void {
+        if(buffer != nullptr) {
+            get_table().release(buffer);
+            buffer = nullptr;
+        }
+    }
+
+  public:
+    auto view() const -> std::string_view {
+        return buffer != nullptr ? std::string_view(buffer->string) : std::string_view();
+    }
+
+    auto data() const -> const char* {
+        return buffer != nullptr ? buffer->string.data() : "";
+    }
+
+    auto size() const -> size_t {
+        return buffer != nullptr ? buffer->string.size() : 0;
+    }
+
+    auto empty() const -> bool {
+        return buffer == nullptr;
+    }
+
+    operator std::string_view() const {
+        return view();
+    }
+
+    friend auto operator==(const Name& a, const std::string_view b) -> bool {
+        return a.view() == b;
+    }
+
+    auto operator=(const Name& o) -> Name& {
+        if(buffer != o.buffer) {
+            release();
+            buffer = o.buffer;
+            if(buffer != nullptr) {
+                buffer->references.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        return *this;
+    }
+
+    auto operator=(Name&& o) -> Name& {
+        if(this != &o) {
+            release();
+            buffer   = o.buffer;
+            o.buffer = nullptr;
+        }
+        return *this;
+    }
+
+    Name() = default;
+
+    Name(const std::string_view string) : buffer(string.empty() ? nullptr : get_table().intern(string)) {}
+
+    Name(const std::string& string) : Name(std::string_view(string)) {}
+
+    Name(const char* const string) : Name(std::string_view(string)) {}
+
+    Name(const Name& o) : buffer(o.buffer) {
+        if(buffer != nullptr) {
+            buffer->references.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    Name(Name&& o) : buffer(o.buffer) {
+        o.buffer = nullptr;
+    }
+
+    ~Name() {
+        release();
+    }
+};
+} // namespace fs
@@ -0,0 +1,90 @@
+#pragma once
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+// xxh64 with seed 0, a fast non-cryptographic hash for whole frames
+// four independent lanes over 32 byte stripes, so that the multiplies overlap
+namespace hash {
+namespace impl {
+constexpr auto prime1 = uint64_t(0x9E3779B185EBCA87);
+constexpr auto prime2 = uint64_t(0xC2B2AE3D27D4EB4F);
+constexpr auto prime3 = uint64_t(0x165667B19E3779F9);
+constexpr auto prime4 = uint64_t(0x85EBCA77C2B2AE63);
+constexpr auto prime5 = uint64_t(0x27D4EB2F165667C5);
+
+inline auto read64(const uint8_t* const p) -> uint64_t {
+    auto r = uint64_t();
+    std::memcpy(&r, p, sizeof(r));
+    return r;
+}
+
+inline auto read32(const uint8_t* const p) -> uint32_t {
+    auto r = uint32_t();
+    std::memcpy(&r, p, sizeof(r));
+    return r;
+}
+
+inline auto round(uint64_t acc, const uint64_t input) -> uint64_t {
+    acc += input * prime2;
+    acc = std::rotl(acc, 31);
+    return acc * prime1;
+}
+
+inline auto merge(uint64_t acc, const uint64_t lane) -> uint64_t {
+    acc ^= round(0, lane);
+    return acc * prime1 + prime4;
+}
+} // namespace impl
+
+inline auto hash64(const std::span<const uint8_t> data) -> uint64_t {
+    using namespace impl;
+
+    auto p   = data.data();
+    auto len = data.size();
+    auto h   = uint64_t();
+    if(len >= 32) {
+        auto v1 = prime1 + prime2;
+        auto v2 = prime2;
+        auto v3 = uint64_t(0);
+        auto v4 = -prime1;
+        for(; len >= 32; p += 32, len -= 32) {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+        }
+        h = std::rotl(v1, 1) + std::rotl(v2, 7) + std::rotl(v3, 12) + std::rotl(v4, 18);
+        h = merge(h, v1);
+        h = merge(h, v2);
+        h = merge(h, v3);
+        h = merge(h, v4);
+    } else {
+        h = prime5;
+    }
+    h += data.size();
+
+    for(; len >= 8; p += 8, len -= 8) {
+        h ^= round(0, read64(p));
+        h = std::rotl(h, 27) * prime1 + prime4;
+    }
+    if(len >= 4) {
+        h ^= uint64_t(read32(p)) * prime1;
+        h = std::rotl(h, 23) * prime2 + prime3;
+        p += 4;
+        len -= 4;
+    }
+    for(; len != 0; p += 1, len -= 1) {
+        h ^= *p * prime5;
+        h = std::rotl(h, 11) * prime1;
+    }
+
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+}
+} // namespace hash
@@ -0,0 +1,185 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+// byte oriented lz77 in the style of lz4, for small blocks such as frames
+// a block is a list of sequences, each of them
+//  token: literal length in the high nibble, match length - min_match in the low nibble, 15 means more bytes follow
+//  literal length bytes, literals
+//  offset(2 bytes, little endian) and match length bytes, absent in the last sequence
+namespace lz {
+constexpr auto min_match  = size_t(4);
+constexpr auto max_offset = size_t(65535);
+
+namespace impl {
+constexpr auto hash_bits = 12;
+
+inline auto read32(const uint8_t* const p) -> uint32_t {
+    auto r = uint32_t();
+    std::memcpy(&r, p, sizeof(r));
+    return r;
+}
+
+inline auto hash(const uint32_t v) -> uint32_t {
+    return (v * 2654435761u) >> (32 - hash_bits);
+}
+
+// returns false if the output is full
+inline auto put_length(uint8_t*& op, const uint8_t* const end, size_t length) -> bool {
+    for(; length >= 255; length -= 255) {
+        if(op == end) {
+            return false;
+        }
+        *op++ = 255;
+    }
+    if(op == end) {
+        return false;
+    }
+    *op++ = length;
+    return true;
+}
+
+// copies in words, writing up to 7 bytes past dest + size
+// also repeats a source which overlaps the destination, as long as it starts at least a word behind
+inline auto wild_copy(uint8_t* dest, const uint8_t* src, const size_t size) -> void {
+    for(const auto end = dest + size; dest < end; dest += 8, src += 8) {
+        std::memcpy(dest, src, 8);
+    }
+}
+
+// returns false if the input ends early
+inline auto get_length(const uint8_t*& ip, const uint8_t* const end, size_t& length) -> bool {
+    while(true) {
+        if(ip == end) {
+            return false;
+        }
+        const auto b = *ip++;
+        length += b;
+        if(b != 255) {
+            return true;
+        }
+    }
+}
+} // namespace impl
+
+// returns the compressed size, 0 if it would not fit in output
+// input must be shorter than 64KiB so that positions fit in the hash table
+inline auto compress(const std::span<const uint8_t> input, const std::span<uint8_t> output) -> size_t {
+    auto table = std::array<uint16_t, 1 << impl::hash_bits>();
+
+    const auto src    = input.data();
+    const auto size   = input.size();
+    auto       op     = output.data();
+    const auto op_end = output.data() + output.size();
+
+    const auto emit = [&](const size_t anchor, const size_t literals, const size_t offset, const size_t match) -> bool {
+        if(op == op_end) {
+            return false;
+        }
+        const auto token = op++;
+        *token           = uint8_t((std::min(literals, size_t(15)) << 4) | (match == 0 ? 0 : std::min(match - min_match, size_t(15))));
+        if(literals >= 15 && !impl::put_length(op, op_end, literals - 15)) {
+            return false;
+        }
+        if(size_t(op_end - op) < literals) {
+            return false;
+        }
+        std::copy_n(src + anchor, literals, op);
+        op += literals;
+        if(match == 0) {
+            return true;
+        }
+        if(op_end - op < 2) {
+            return false;
+        }
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+        return match - min_match < 15 || impl::put_length(op, op_end, match - min_match - 15);
+    };
+
+    auto anchor = size_t(0);
+    for(auto ip = size_t(1); ip + min_match <= size;) {
+        const auto value     = impl::read32(src + ip);
+        const auto slot      = impl::hash(value);
+        const auto candidate = size_t(table[slot]);
+        table[slot]          = ip;
+        if(ip - candidate > max_offset || impl::read32(src + candidate) != value) {
+            // skip faster through data which does not match
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        auto match = min_match;
+        while(ip + match < size && src[candidate + match] == src[ip + match]) {
+            match += 1;
+        }
+        if(!emit(anchor, ip - anchor, ip - candidate, match)) {
+            return 0;
+        }
+        ip += match;
+        anchor = ip;
+    }
+    if(!emit(anchor, size - anchor, 0, 0)) {
+        return 0;
+    }
+    return op - output.data();
+}
+
+// returns false if input is malformed or does not decode to exactly output.size() bytes
+inline auto decompress(const std::span<const uint8_t> input, const std::span<uint8_t> output) -> bool {
+    auto       ip     = input.data();
+    const auto ip_end = input.data() + input.size();
+    auto       op     = output.data();
+    const auto op_end = output.data() + output.size();
+    while(ip != ip_end) {
+        const auto token    = *ip++;
+        auto       literals = size_t(token >> 4);
+        if(literals == 15 && !impl::get_length(ip, ip_end, literals)) {
+            return false;
+        }
+        if(size_t(ip_end - ip) < literals || size_t(op_end - op) < literals) {
+            return false;
+        }
+        if(size_t(ip_end - ip) >= literals + 8 && size_t(op_end - op) >= literals + 8) {
+            impl::wild_copy(op, ip, literals);
+        } else {
+            std::copy_n(ip, literals, op);
+        }
+        ip += literals;
+        op += literals;
+        if(ip == ip_end) {
+            break;
+        }
+
+        if(ip_end - ip < 2) {
+            return false;
+        }
+        const auto offset = size_t(ip[0]) | size_t(ip[1]) << 8;
+        ip += 2;
+        auto match = size_t(token & 15);
+        if(match == 15 && !impl::get_length(ip, ip_end, match)) {
+            return false;
+        }
+        match += min_match;
+        if(offset == 0 || offset > size_t(op - output.data()) || size_t(op_end - op) < match) {
+            return false;
+        }
+        // the source may overlap the destination, which repeats the last offset bytes
+        const auto from = op - offset;
+        if(offset >= 8 && size_t(op_end - op) >= match + 8) {
+            impl::wild_copy(op, from, match);
+        } else if(offset >= match) {
+            std::memcpy(op, from, match);
+        } else {
+            for(auto i = size_t(0); i < match; i += 1) {
+                op[i] = from[i];
+            }
+        }
+        op += match;
+    }
+    return op == op_end;
+}
+} // namespace lz
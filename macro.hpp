@@ -1,4 +1,6 @@
 #pragma once
+// std::optional has a value_or member, its header has to be read before the macro is defined
+#include <optional>
 
 #define value_or(var, expr)                  \
     auto var##_open_result = expr;           \
@@ -1,8 +1,19 @@
 #pragma once
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include <sys/mman.h>
 
 #include "error.hpp"
+#include "log.hpp"
+#include "simd.hpp"
 
 constexpr auto operator""_KiB(const unsigned long long kib) -> unsigned long long {
     return kib * 1024;
@@ -16,7 +27,11 @@ constexpr auto operator""_GiB(const unsigned long long gib) -> unsigned long lon
     return gib * 1024_MiB;
 }
 
-static constexpr auto bytes_per_frame = 4_KiB;
+static constexpr auto bytes_per_frame      = 4_KiB;
+static constexpr auto bytes_per_huge_frame = 2_MiB; // transparent huge page
+
+// divisions by bytes_per_frame in tmpfs compile to shifts and masks
+static_assert(std::has_single_bit(bytes_per_frame));
 
 class FrameID {
   private:
@@ -34,19 +49,492 @@ class FrameID {
     explicit FrameID(void* const id) : id(id) {}
 };
 
+struct MemoryStatistics {
+    size_t total_frames;
+    size_t used_frames;      // including frames cached by threads and the depot
+    size_t depot_frames;     // free frames cached by the depot
+    size_t free_runs;        // number of contiguous free extents
+    size_t largest_free_run; // in frames
+
+    // 0 if every free frame is in one run, close to 1 if free frames are scattered
+    auto get_fragmentation() const -> double {
+        const auto free_frames = total_frames - used_frames;
+        return free_frames == 0 ? 0 : 1 - double(largest_free_run) / free_frames;
+    }
+};
+
+// hands out frames of one arena, tracked by a bitmap
+// the arena is reserved at construction and backed by the os on first touch,
+// so all frames live in one compact region and runs of frames can be allocated contiguously
+// allocation is next-fit, the search continues from the end of the previous allocation
+//
+// a frame may have several owners, see share(), and goes back to the allocator when the last one frees it
+//
+// single frames go through per-thread magazines in front of the bitmap
+// a thread allocates and frees from its own magazines without locking, full and empty magazines
+// are exchanged with a shared depot, which in turn refills from and drains to the bitmap in batches
 class BitmapMemoryManager {
+  private:
+    struct Magazine {
+        constexpr static auto capacity = size_t(64);
+
+        std::array<void*, capacity> frames;
+        size_t                      count = 0;
+    };
+
+    // full magazines shared by every thread
+    struct Depot {
+        constexpr static auto max_magazines = size_t(16);
+
+        BitmapMemoryManager*  manager; // nullptr once the manager is destroyed
+        std::mutex            mutex;   // taken before the bitmap mutex
+        std::vector<Magazine> magazines;
+
+        Depot(BitmapMemoryManager* const manager) : manager(manager) {}
+    };
+
+    // previous is always either empty or full, so that a thread switching between allocation and free
+    // at a magazine boundary does not go to the depot every time
+    // a thread caches frames of one manager at a time
+    struct ThreadCache {
+        std::shared_ptr<Depot> depot;
+        Magazine               loaded;
+        Magazine               previous;
+
+        // frames of a destroyed manager are forgotten
+        auto flush() -> void {
+            if(!depot) {
+                return;
+            }
+            const auto lock = std::lock_guard(depot->mutex);
+            if(depot->manager != nullptr) {
+                depot->manager->release(loaded.frames.data(), loaded.count);
+                depot->manager->release(previous.frames.data(), previous.count);
+            }
+            loaded.count   = 0;
+            previous.count = 0;
+        }
+
+        ~ThreadCache() {
+            flush();
+        }
+    };
+
+    void*                  arena        = nullptr;
+    size_t                 arena_bytes  = 0;
+    uint8_t*               base         = nullptr; // first frame, aligned to huge pages if requested
+    size_t                 total_frames = 0;
+    std::atomic<uint32_t>* shares       = nullptr; // owners besides the first one, per frame
+    size_t                 used_frames  = 0;
+    size_t                 hint         = 0; // word where the next search starts
+    std::vector<uint64_t>  bitmap;           // set bits are allocated frames, bits past the last frame are set
+    std::mutex             mutex;            // guards the bitmap
+    bool                   thread_caches;
+    std::shared_ptr<Depot> depot;
+
+    static auto get_thread_cache() -> ThreadCache& {
+        static thread_local auto cache = ThreadCache();
+        return cache;
+    }
+
+    // the calling thread's cache, rebound to this manager if it caches frames of another one
+    auto bind_thread_cache() -> ThreadCache& {
+        auto& cache = get_thread_cache();
+        if(cache.depot != depot) {
+            cache.flush();
+            cache.depot = depot;
+        }
+        return cache;
+    }
+
+    // bit i of the result is set if bits [i, i + count) of mask are all set
+    static auto find_runs(uint64_t mask, const size_t count) -> uint64_t {
+        for(auto length = size_t(1); length < count;) {
+            const auto shift = std::min(length, count - length);
+            mask &= mask >> shift;
+            length += shift;
+        }
+        return mask;
+    }
+
+    // calls fn(word, mask) for each word overlapping frames [first, first + count)
+    template <class F>
+    auto for_each_word(const size_t first, const size_t count, F&& fn) -> void {
+        for(auto i = first; i < first + count;) {
+            const auto bit = i % 64;
+            const auto n   = std::min(64 - bit, first + count - i);
+            fn(bitmap[i / 64], (n == 64 ? ~uint64_t(0) : (uint64_t(1) << n) - 1) << bit);
+            i += n;
+        }
+    }
+
+    // first frame of the first free run of count frames starting in words [begin, end)
+    // full words are skipped while no run is open and free words while a run grows, both with simd::find_not_equal64
+    auto search(const size_t count, const size_t begin, const size_t end) const -> std::optional<size_t> {
+        auto run = size_t(0); // free frames just before word i
+        for(auto i = begin; i < bitmap.size();) {
+            if(run == 0) {
+                if(i >= end) {
+                    break;
+                }
+                i += simd::find_not_equal64(bitmap.data() + i, end - i, ~uint64_t(0));
+                if(i == end) {
+                    break;
+                }
+            } else if(bitmap[i] == 0) {
+                const auto words = simd::find_not_equal64(bitmap.data() + i, bitmap.size() - i, 0);
+                if(run + words * 64 >= count) {
+                    return i * 64 - run;
+                }
+                run += words * 64;
+                i += words;
+                continue;
+            }
+
+            const auto free = ~bitmap[i];
+            const auto head = size_t(std::countr_one(free));
+            if(run + head >= count) {
+                return i * 64 - run;
+            }
+            if(head == 64) {
+                run += 64;
+                i += 1;
+                continue;
+            }
+            if(count < 64) {
+                if(const auto starts = find_runs(free, count); starts != 0) {
+                    return i * 64 + std::countr_zero(starts);
+                }
+            }
+            run = std::countl_one(free);
+            i += 1;
+        }
+        return std::nullopt;
+    }
+
+    // first frame of a free run of count frames starting at a multiple of alignment, which is a multiple of 64
+    // candidates are whole words, so a used frame rejects a candidate after one comparison
+    auto search_aligned(const size_t count, const size_t alignment, const size_t begin, const size_t end) const -> std::optional<size_t> {
+        const auto step      = alignment / 64;
+        const auto full      = count / 64;
+        const auto tail_mask = (uint64_t(1) << (count % 64)) - 1;
+        for(auto i = (begin + step - 1) / step * step; i < end && i + full <= bitmap.size(); i += step) {
+            if(simd::find_not_equal64(bitmap.data() + i, full, 0) != full) {
+                continue;
+            }
+            if(tail_mask != 0 && (i + full >= bitmap.size() || (bitmap[i + full] & tail_mask) != 0)) {
+                continue;
+            }
+            return i * 64;
+        }
+        return std::nullopt;
+    }
+
+    auto allocate_run(const size_t frames, const size_t alignment) -> std::optional<size_t> {
+        const auto lock   = std::lock_guard(mutex);
+        const auto search = [this, frames, alignment](const size_t begin, const size_t end) {
+            return alignment == 1 ? this->search(frames, begin, end) : search_aligned(frames, alignment, begin, end);
+        };
+        auto first = search(hint, bitmap.size());
+        if(!first) {
+            first = search(0, std::min(hint + 1, bitmap.size()));
+        }
+        if(!first) {
+            return std::nullopt;
+        }
+        for_each_word(*first, frames, [](uint64_t& word, const uint64_t mask) { word |= mask; });
+        used_frames += frames;
+        hint = (*first + frames) / 64;
+        return first;
+    }
+
+    // takes up to count single frames wherever they are free, in one pass over the bitmap
+    // returns the number of frames taken
+    auto take(void** const frames, const size_t count) -> size_t {
+        const auto lock = std::lock_guard(mutex);
+        auto       n    = size_t(0);
+        for(const auto& [begin, end] : {std::pair<size_t, size_t>(hint, bitmap.size()), std::pair<size_t, size_t>(0, hint)}) {
+            for(auto i = begin; i < end && n < count; i += 1) {
+                i += simd::find_not_equal64(bitmap.data() + i, end - i, ~uint64_t(0));
+                if(i == end) {
+                    break;
+                }
+                for(auto free = ~bitmap[i]; free != 0 && n < count; free &= free - 1) {
+                    const auto bit = size_t(std::countr_zero(free));
+                    bitmap[i] |= uint64_t(1) << bit;
+                    frames[n] = base + (i * 64 + bit) * bytes_per_frame;
+                    n += 1;
+                }
+                hint = i;
+            }
+        }
+        used_frames += n;
+        return n;
+    }
+
+    // drops one of the extra owners of frame index, returns false if there was none
+    auto drop_share(const size_t index) -> bool {
+        auto& count = shares[index];
+        for(auto c = count.load(std::memory_order_relaxed); c != 0;) {
+            if(count.compare_exchange_weak(c, c - 1, std::memory_order_acq_rel)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    auto free_run(const size_t first, const size_t frames) -> Error {
+        const auto lock = std::lock_guard(mutex);
+        auto       busy = true;
+        for_each_word(first, frames, [&busy](uint64_t& word, const uint64_t mask) { busy &= (word & mask) == mask; });
+        if(!busy) {
+            // double free
+            return Error::Code::InvalidData;
+        }
+        for_each_word(first, frames, [](uint64_t& word, const uint64_t mask) { word &= ~mask; });
+        used_frames -= frames;
+        return Error();
+    }
+
+    auto get_index(const FrameID frame, const size_t frames) const -> Result<size_t> {
+        const auto p = static_cast<uint8_t*>(frame.get_frame());
+        if(p < base || p >= base + total_frames * bytes_per_frame || size_t(p - base) % bytes_per_frame != 0) {
+            return Error::Code::IndexOutOfRange;
+        }
+        const auto first = size_t(p - base) / bytes_per_frame;
+        if(frames > total_frames - first) {
+            return Error::Code::IndexOutOfRange;
+        }
+        return size_t(first);
+    }
+
+    // returns single frames to the bitmap
+    auto release(void* const* const frames, const size_t count) -> void {
+        const auto lock = std::lock_guard(mutex);
+        for(auto i = size_t(0); i < count; i += 1) {
+            const auto index = size_t(static_cast<uint8_t*>(frames[i]) - base) / bytes_per_frame;
+            bitmap[index / 64] &= ~(uint64_t(1) << (index % 64));
+        }
+        used_frames -= count;
+    }
+
+    // returns full magazines of the depot to the bitmap
+    auto drain_depot() -> void {
+        auto magazines = std::vector<Magazine>();
+        {
+            const auto lock = std::lock_guard(depot->mutex);
+            std::swap(magazines, depot->magazines);
+        }
+        for(const auto& m : magazines) {
+            release(m.frames.data(), m.count);
+        }
+    }
+
+    // makes the loaded magazine non-empty, returns false if the bitmap is exhausted
+    auto refill(ThreadCache& cache) -> bool {
+        if(cache.previous.count != 0) {
+            std::swap(cache.loaded, cache.previous);
+            return true;
+        }
+        {
+            const auto lock = std::lock_guard(depot->mutex);
+            if(!depot->magazines.empty()) {
+                cache.loaded = depot->magazines.back();
+                depot->magazines.pop_back();
+                return true;
+            }
+        }
+        // lowest frames are handed out first
+        cache.loaded.count = take(cache.loaded.frames.data(), Magazine::capacity);
+        std::reverse(cache.loaded.frames.begin(), cache.loaded.frames.begin() + cache.loaded.count);
+        return cache.loaded.count != 0;
+    }
+
+    // makes room in the full loaded magazine
+    auto spill(ThreadCache& cache) -> void {
+        if(cache.previous.count != 0) {
+            auto kept = false;
+            {
+                const auto lock = std::lock_guard(depot->mutex);
+                if(depot->magazines.size() < Depot::max_magazines) {
+                    depot->magazines.push_back(cache.previous);
+                    kept = true;
+                }
+            }
+            if(!kept) {
+                release(cache.previous.frames.data(), cache.previous.count);
+            }
+            cache.previous.count = 0;
+        }
+        std::swap(cache.loaded, cache.previous);
+    }
+
   public:
-    auto allocate(const size_t frames) -> Result<FrameID> {
-        return FrameID(static_cast<void*>(new uint8_t[bytes_per_frame * frames]));
+    constexpr static auto default_arena_bytes = 4_GiB;
+
+    // alignment is in frames, relative to the start of the arena, and must be 1 or a multiple of 64
+    // a run of 2MiB aligned to itself can be backed by a huge page if the arena asked for them
+    auto allocate(const size_t frames, const size_t alignment = 1) -> Result<FrameID> {
+        if(frames == 0 || (alignment != 1 && alignment % 64 != 0)) {
+            return Error::Code::InvalidData;
+        }
+        if(frames == 1 && alignment == 1 && thread_caches) {
+            auto& cache = bind_thread_cache();
+            if(cache.loaded.count == 0 && !refill(cache)) {
+                return Error::Code::OutOfMemory;
+            }
+            cache.loaded.count -= 1;
+            return FrameID(cache.loaded.frames[cache.loaded.count]);
+        }
+
+        auto first = allocate_run(frames, alignment);
+        if(!first) {
+            // the depot may hold the frames which are missing
+            drain_depot();
+            first = allocate_run(frames, alignment);
+        }
+        if(!first) {
+            return Error::Code::OutOfMemory;
+        }
+        return FrameID(base + *first * bytes_per_frame);
     }
 
+    // frames must be the count given to allocate, or a part of it
+    // frames with other owners only lose this one
+    // double frees are detected only for frames which are not cached
     auto deallocate(const FrameID begin, const size_t frames) -> Error {
-        delete[] static_cast<uint8_t*>(begin.get_frame());
+        const auto first_result = get_index(begin, frames);
+        if(!first_result) {
+            return first_result.as_error();
+        }
+        const auto first = first_result.as_value();
+        if(frames == 1 && thread_caches) {
+            if(drop_share(first)) {
+                return Error();
+            }
+            auto& cache = bind_thread_cache();
+            if(cache.loaded.count == Magazine::capacity) {
+                spill(cache);
+            }
+            cache.loaded.frames[cache.loaded.count] = begin.get_frame();
+            cache.loaded.count += 1;
+            return Error();
+        }
+
+        // runs between shared frames are freed
+        auto e = Error();
+        for(auto i = first; i < first + frames;) {
+            auto end = i;
+            while(end < first + frames && !drop_share(end)) {
+                end += 1;
+            }
+            if(end != i) {
+                if(const auto r = free_run(i, end - i)) {
+                    e = r;
+                }
+            }
+            i = end + 1;
+        }
+        return e;
+    }
+
+    // adds an owner to allocated frames, each owner deallocates them once
+    auto share(const FrameID begin, const size_t frames) -> Error {
+        const auto first_result = get_index(begin, frames);
+        if(!first_result) {
+            return first_result.as_error();
+        }
+        for(auto i = first_result.as_value(); i < first_result.as_value() + frames; i += 1) {
+            shares[i].fetch_add(1, std::memory_order_relaxed);
+        }
         return Error();
     }
+
+    // 0 for frames outside the arena
+    auto get_owners(const FrameID frame) const -> size_t {
+        const auto index = get_index(frame, 1);
+        return index ? shares[index.as_value()].load(std::memory_order_acquire) + 1 : 0;
+    }
+
+    // returns the frames cached by the calling thread and the depot to the bitmap
+    // caches of other threads are returned when they exit
+    auto trim() -> void {
+        if(auto& cache = get_thread_cache(); cache.depot == depot) {
+            cache.flush();
+        }
+        drain_depot();
+    }
+
+    auto get_statistics() -> MemoryStatistics {
+        auto depot_frames = size_t(0);
+        {
+            const auto lock = std::lock_guard(depot->mutex);
+            for(const auto& m : depot->magazines) {
+                depot_frames += m.count;
+            }
+        }
+
+        const auto lock = std::lock_guard(mutex);
+        auto       runs = simd::RunCounter();
+        for(auto i = size_t(0); i < bitmap.size(); i += 1) {
+            runs.feed(~bitmap[i], std::min(size_t(64), total_frames - i * 64));
+        }
+        return MemoryStatistics{total_frames, used_frames, depot_frames, runs.runs, runs.longest};
+    }
+
+    // reserves bytes of address space, rounded down to whole frames
+    // huge_pages asks for transparent huge pages, the arena is aligned to them
+    // thread_caches enables the magazines for single frames
+    // if the reservation fails, every allocation fails with OutOfMemory
+    BitmapMemoryManager(const size_t bytes = default_arena_bytes, const bool huge_pages = false, const bool thread_caches = true) : thread_caches(thread_caches),
+                                                                                                                                     depot(std::make_shared<Depot>(this)) {
+        const auto frames    = bytes / bytes_per_frame;
+        const auto alignment = huge_pages ? bytes_per_huge_frame : bytes_per_frame;
+
+        arena_bytes = frames * bytes_per_frame + alignment - bytes_per_frame;
+        arena       = mmap(nullptr, arena_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(arena == MAP_FAILED) {
+            logger(LogLevel::Error, "memory: failed to reserve %lu bytes\n", arena_bytes);
+            arena = nullptr;
+            return;
+        }
+        base = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(arena) + alignment - 1) / alignment * alignment);
+        if(huge_pages) {
+            madvise(base, frames * bytes_per_frame, MADV_HUGEPAGE);
+        }
+
+        // zero pages until a frame is shared
+        const auto shares_map = mmap(nullptr, frames * sizeof(std::atomic<uint32_t>), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(shares_map == MAP_FAILED) {
+            logger(LogLevel::Error, "memory: failed to reserve the share counts\n");
+            munmap(arena, arena_bytes);
+            arena = nullptr;
+            base  = nullptr;
+            return;
+        }
+        shares = static_cast<std::atomic<uint32_t>*>(shares_map);
+
+        total_frames = frames;
+        bitmap.resize((frames + 63) / 64);
+        if(frames % 64 != 0) {
+            bitmap.back() = ~uint64_t(0) << (frames % 64);
+        }
+    }
+
+    ~BitmapMemoryManager() {
+        {
+            const auto lock = std::lock_guard(depot->mutex);
+            depot->manager  = nullptr;
+        }
+        if(arena != nullptr) {
+            munmap(arena, arena_bytes);
+            munmap(shares, total_frames * sizeof(std::atomic<uint32_t>));
+        }
+    }
 };
 
-inline auto allocator = (BitmapMemoryManager*)(nullptr);
+inline auto default_allocator = BitmapMemoryManager();
+inline auto allocator         = &default_allocator;
 
 class SmartFrameID {
   private:
@@ -69,10 +557,25 @@ class SmartFrameID {
         return &id;
     }
 
-    auto operator*() -> FrameID {
+    auto operator*() const -> FrameID {
         return id;
     }
 
+    // another owner of the same frames
+    auto share() const -> Result<SmartFrameID> {
+        if(const auto e = allocator->share(id, frames)) {
+            return e;
+        }
+        return SmartFrameID(id, frames);
+    }
+
+    // keeps the first head frames and hands the rest over to the returned owner
+    auto split(const size_t head) -> SmartFrameID {
+        auto tail = SmartFrameID(FrameID(static_cast<uint8_t*>(id.get_frame()) + head * bytes_per_frame), frames - head);
+        frames    = head;
+        return tail;
+    }
+
     SmartFrameID(SmartFrameID&& o) {
         *this = std::move(o);
     }
@@ -1,15 +1,76 @@
 #pragma once
+#include <iterator>
 #include <string_view>
-#include <vector>
+#include <utility>
 
-inline auto split_path(const std::string_view path) -> std::vector<std::string_view> {
-    auto r = std::vector<std::string_view>();
+// iterates over the elements of a path in place, repeated slashes are skipped
+class PathElements {
+  private:
+    std::string_view path;
 
-    auto end   = size_t(0);
-    auto start = size_t();
-    while((start = path.find_first_not_of('/', end)) != std::string_view::npos) {
-        end = path.find('/', start);
-        r.emplace_back(path.substr(start, end - start));
+  public:
+    class Iterator {
+      private:
+        std::string_view path;
+        size_t           start;
+        size_t           end;
+
+        auto find_next(const size_t from) -> void {
+            start = path.find_first_not_of('/', from);
+            end   = start != std::string_view::npos ? path.find('/', start) : std::string_view::npos;
+        }
+
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type        = std::string_view;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = const std::string_view*;
+        using reference         = std::string_view;
+
+        auto operator*() const -> std::string_view {
+            return path.substr(start, end - start);
+        }
+
+        auto operator++() -> Iterator& {
+            find_next(end);
+            return *this;
+        }
+
+        auto operator++(int) -> Iterator {
+            auto r = *this;
+            ++*this;
+            return r;
+        }
+
+        auto operator==(const Iterator& o) const -> bool {
+            return start == o.start;
+        }
+
+        Iterator() : start(std::string_view::npos), end(std::string_view::npos) {}
+
+        Iterator(const std::string_view path) : path(path) {
+            find_next(0);
+        }
+    };
+
+    auto begin() const -> Iterator {
+        return Iterator(path);
+    }
+
+    auto end() const -> Iterator {
+        return Iterator();
+    }
+
+    PathElements(const std::string_view path) : path(path) {}
+};
+
+// splits path into the part before its last element and the element, which is empty if there is none
+inline auto split_last(const std::string_view path) -> std::pair<std::string_view, std::string_view> {
+    const auto end = path.find_last_not_of('/');
+    if(end == std::string_view::npos) {
+        return {path, {}};
     }
-    return r;
+    const auto slash = path.rfind('/', end);
+    const auto start = slash == std::string_view::npos ? 0 : slash + 1;
+    return {path.substr(0, start), path.substr(start, end + 1 - start)};
 }
@@ -0,0 +1,144 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace simd {
+#if defined(__x86_64__)
+inline auto has_avx2() -> bool {
+    static const auto result = __builtin_cpu_supports("avx2") != 0;
+    return result;
+}
+#else
+inline auto has_avx2() -> bool {
+    return false;
+}
+#endif
+
+namespace impl {
+inline auto equal_mask64_scalar(const uint32_t* const data, const size_t count, const uint32_t mask, const uint32_t value) -> uint64_t {
+    auto r = uint64_t(0);
+    for(auto i = size_t(0); i < count; i += 1) {
+        r |= uint64_t((data[i] & mask) == value) << i;
+    }
+    return r;
+}
+
+#if defined(__x86_64__)
+inline auto equal_mask64_sse2(const uint32_t* const data, const uint32_t mask, const uint32_t value) -> uint64_t {
+    const auto m = _mm_set1_epi32(mask);
+    const auto v = _mm_set1_epi32(value);
+    auto       r = uint64_t(0);
+    for(auto i = 0; i < 64; i += 4) {
+        const auto e = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)), m);
+        r |= uint64_t(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(e, v)))) << i;
+    }
+    return r;
+}
+
+__attribute__((target("avx2"))) inline auto equal_mask64_avx2(const uint32_t* const data, const uint32_t mask, const uint32_t value) -> uint64_t {
+    const auto m = _mm256_set1_epi32(mask);
+    const auto v = _mm256_set1_epi32(value);
+    auto       r = uint64_t(0);
+    for(auto i = 0; i < 64; i += 8) {
+        const auto e = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i)), m);
+        r |= uint64_t(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(e, v)))) << i;
+    }
+    return r;
+}
+#endif
+} // namespace impl
+
+// bit i of the result is set if (data[i] & mask) == value
+// count must be <= 64, bits at and above count are zero
+inline auto equal_mask64(const uint32_t* const data, const size_t count, const uint32_t mask, const uint32_t value) -> uint64_t {
+#if defined(__x86_64__)
+    if(count == 64) {
+        return has_avx2() ? impl::equal_mask64_avx2(data, mask, value) : impl::equal_mask64_sse2(data, mask, value);
+    }
+#endif
+    return impl::equal_mask64_scalar(data, count, mask, value);
+}
+
+namespace impl {
+inline auto find_not_equal64_scalar(const uint64_t* const data, const size_t count, const uint64_t value) -> size_t {
+    for(auto i = size_t(0); i < count; i += 1) {
+        if(data[i] != value) {
+            return i;
+        }
+    }
+    return count;
+}
+
+#if defined(__x86_64__)
+// sse2 has no 64 bit compare, a word is equal if both of its halves are
+inline auto find_not_equal64_sse2(const uint64_t* const data, const size_t count, const uint64_t value) -> size_t {
+    const auto v = _mm_set1_epi64x(value);
+    auto       i = size_t(0);
+    for(; i + 2 <= count; i += 2) {
+        const auto e = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)), v);
+        if(_mm_movemask_epi8(e) != 0xFFFF) {
+            break;
+        }
+    }
+    return i + find_not_equal64_scalar(data + i, count - i, value);
+}
+
+__attribute__((target("avx2"))) inline auto find_not_equal64_avx2(const uint64_t* const data, const size_t count, const uint64_t value) -> size_t {
+    const auto v = _mm256_set1_epi64x(value);
+    auto       i = size_t(0);
+    for(; i + 8 <= count; i += 8) {
+        const auto a = _mm256_cmpeq_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i)), v);
+        const auto b = _mm256_cmpeq_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 4)), v);
+        if(_mm256_movemask_epi8(_mm256_and_si256(a, b)) != -1) {
+            break;
+        }
+    }
+    return i + find_not_equal64_scalar(data + i, count - i, value);
+}
+#endif
+} // namespace impl
+
+// index of the first word which is not value, or count if there is none
+inline auto find_not_equal64(const uint64_t* const data, const size_t count, const uint64_t value) -> size_t {
+#if defined(__x86_64__)
+    return has_avx2() ? impl::find_not_equal64_avx2(data, count, value) : impl::find_not_equal64_sse2(data, count, value);
+#else
+    return impl::find_not_equal64_scalar(data, count, value);
+#endif
+}
+
+// tracks runs of set bits across consecutive 64 bit masks
+struct RunCounter {
+    size_t runs    = 0;
+    size_t current = 0;
+    size_t longest = 0;
+
+    // count: number of valid bits in mask
+    auto feed(uint64_t mask, const size_t count) -> void {
+        auto pos = size_t(0);
+        while(pos < count) {
+            if(mask & 1) {
+                const auto ones = std::min(size_t(std::countr_one(mask)), count - pos);
+                if(current == 0) {
+                    runs += 1;
+                }
+                current += ones;
+                longest = std::max(longest, current);
+                pos += ones;
+                mask = ones == 64 ? 0 : mask >> ones;
+            } else {
+                const auto zeros = std::min(size_t(mask == 0 ? 64 : std::countr_zero(mask)), count - pos);
+                current          = 0;
+                pos += zeros;
+                mask = zeros == 64 ? 0 : mask >> zeros;
+            }
+        }
+    }
+};
+} // namespace simd
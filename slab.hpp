@@ -0,0 +1,83 @@
+#pragma once
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// objects of one type in fixed chunks, so that their addresses never change
+// freed slots are reused before a new chunk is allocated, objects still alive are destroyed with the slab
+template <class T, size_t chunk_size = 64>
+class Slab {
+  private:
+    struct Slot {
+        union {
+            T     value;
+            Slot* next; // while free
+        };
+        bool live = false;
+
+        Slot() : next(nullptr) {}
+        ~Slot() {}
+    };
+
+    std::vector<std::unique_ptr<Slot[]>> chunks;
+    Slot*                                free_slots = nullptr;
+    size_t                               live_count = 0;
+
+    auto grow() -> void {
+        auto& chunk = chunks.emplace_back(new Slot[chunk_size]);
+        for(auto i = chunk_size; i > 0; i -= 1) {
+            chunk[i - 1].next = free_slots;
+            free_slots        = &chunk[i - 1];
+        }
+    }
+
+  public:
+    template <class... Args>
+    auto create(Args&&... args) -> T* {
+        if(free_slots == nullptr) {
+            grow();
+        }
+        const auto slot = free_slots;
+        free_slots      = slot->next;
+        new(&slot->value) T(std::forward<Args>(args)...);
+        slot->live = true;
+        live_count += 1;
+        return &slot->value;
+    }
+
+    // object must have been created by this slab
+    auto destroy(T* const object) -> void {
+        const auto slot = reinterpret_cast<Slot*>(object);
+        slot->value.~T();
+        slot->live = false;
+        slot->next = free_slots;
+        free_slots = slot;
+        live_count -= 1;
+    }
+
+    auto get_live_count() const -> size_t {
+        return live_count;
+    }
+
+    // bytes of the chunks, used or not
+    auto get_capacity_bytes() const -> size_t {
+        return chunks.size() * chunk_size * sizeof(Slot);
+    }
+
+    Slab() = default;
+
+    Slab(const Slab&) = delete;
+
+    auto operator=(const Slab&) -> Slab& = delete;
+
+    ~Slab() {
+        for(const auto& chunk : chunks) {
+            for(auto i = size_t(0); i < chunk_size; i += 1) {
+                if(chunk[i].live) {
+                    chunk[i].value.~T();
+                }
+            }
+        }
+    }
+};
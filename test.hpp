@@ -1,4 +1,11 @@
+#include <filesystem>
+#include <map>
+#include <thread>
+
 #include "fs/control.hpp"
+#include "fs/drivers/exfat/driver.hpp"
+#include "fs/drivers/fat/check.hpp"
+#include "fs/drivers/fat/defrag.hpp"
 #include "fs/drivers/fat/driver.hpp"
 
 #ifdef value_or
@@ -124,6 +131,374 @@ inline auto test_exist_error() -> bool {
     return true;
 }
 
+// a tmpfs which counts the lookups reaching it
+class CountingDriver : public fs::tmp::Driver {
+  public:
+    size_t finds = 0;
+
+    auto find(const fs::DriverData data, const std::string_view name) -> Result<fs::OpenInfo> override {
+        finds += 1;
+        return fs::tmp::Driver::find(data, name);
+    }
+};
+
+inline auto test_dentry_cache() -> bool {
+    auto controller = fs::Controller();
+    auto tmpfs      = CountingDriver();
+    controller.mount("/", tmpfs);
+    assert(create(controller, "/", "a", fs::FileType::Directory));
+    assert(create(controller, "/a", "b", fs::FileType::Directory));
+    assert(create(controller, "/a/b", "c", fs::FileType::Directory));
+    assert(create(controller, "/a/b/c", "file", fs::FileType::Regular));
+
+    // once walked, a deep path never reaches the driver again
+    const auto open_close = [&controller](const std::string_view path, const fs::OpenMode mode) -> Error {
+        auto r = controller.open(path, mode);
+        if(!r) {
+            return r.as_error();
+        }
+        return controller.close(r.as_value());
+    };
+    assert(!open_close("/a/b/c/file", fs::OpenMode::Read));
+    const auto finds = tmpfs.finds;
+    for(auto i = 0; i < 10; i += 1) {
+        assert(!open_close("/a/b/c/file", fs::OpenMode::Read));
+    }
+    assert(tmpfs.finds == finds);
+    assert(controller.get_dentry_statistics().hits >= 40);
+
+    // misses are remembered until a create in the directory
+    assert(open_close("/a/b/missing", fs::OpenMode::Read) == Error::Code::NoSuchFile);
+    assert(open_close("/a/b/missing", fs::OpenMode::Read) == Error::Code::NoSuchFile);
+    assert(tmpfs.finds == finds + 1);
+    assert(controller.get_dentry_statistics().negative_hits == 1);
+    assert(create(controller, "/a/b", "missing", fs::FileType::Regular));
+    assert(!open_close("/a/b/missing", fs::OpenMode::Read));
+
+    // a file written and closed is looked up again, so that its new size is seen
+    {
+        value_or(file, controller.open("/a/b/c/file", fs::OpenMode::Write));
+        assert(!file.write(0, 10, "0123456789"));
+        assert(!controller.close(file));
+        value_or(reopened, controller.open("/a/b/c/file", fs::OpenMode::Read));
+        assert(reopened.get_size() == 10);
+        assert(!controller.close(reopened));
+    }
+
+    // a removed file is gone
+    {
+        value_or(dir, controller.open("/a/b/c", fs::OpenMode::Write));
+        assert(!dir.remove("file"));
+        assert(!controller.close(dir));
+        assert(open_close("/a/b/c/file", fs::OpenMode::Read) == Error::Code::NoSuchFile);
+    }
+
+    // with no capacity, every lookup reaches the driver
+    auto uncached = fs::Controller(0);
+    uncached.mount("/", tmpfs);
+    for(auto i = 0; i < 3; i += 1) {
+        value_or(dir, uncached.open("/a/b", fs::OpenMode::Read));
+        assert(!uncached.close(dir));
+    }
+    assert(uncached.get_dentry_statistics().entries == 0);
+    assert(uncached.get_dentry_statistics().hits == 0);
+    return true;
+}
+
+inline auto test_path_walk() -> bool {
+    // repeated and trailing slashes are skipped
+    const auto elements = std::vector<std::string_view>(PathElements("//a/bc///d/").begin(), PathElements("//a/bc///d/").end());
+    assert((elements == std::vector<std::string_view>{"a", "bc", "d"}));
+    assert(PathElements("///").begin() == PathElements("///").end());
+    using Split = std::pair<std::string_view, std::string_view>;
+    assert(split_last("/a/b//c//") == Split("/a/b//", "c"));
+    assert(split_last("c") == Split("", "c"));
+    assert(split_last("//").second.empty());
+
+    // equal names share one buffer, which goes away with the last of them
+    {
+        auto a = fs::Name("name");
+        auto b = fs::Name(std::string("na") + "me");
+        assert(a == "name" && a.data() == b.data());
+        auto c = std::move(a);
+        a      = b;
+        assert(a.data() == c.data());
+    }
+    assert(fs::Name().empty() && fs::Name("") == "");
+
+    auto controller = fs::Controller();
+    auto tmpfs      = fs::tmp::new_driver();
+    controller.mount("/", tmpfs);
+    assert(create(controller, "/", "a", fs::FileType::Directory));
+    assert(create(controller, "/a", "b", fs::FileType::Regular));
+    value_or(file, controller.open("//a//b", fs::OpenMode::Read));
+    value_or(again, controller.open("a/b/", fs::OpenMode::Read));
+    assert(controller.open("/a/b", fs::OpenMode::Write).as_error() == Error::Code::FileOpened);
+    assert(!controller.close(file));
+    assert(!controller.close(again));
+    assert(controller.open("/a/c", fs::OpenMode::Read).as_error() == Error::Code::NoSuchFile);
+    value_or(a, controller.open("/a", fs::OpenMode::Write));
+    assert(!controller.close(a));
+    assert(controller.unmount("//").as_value() == &tmpfs);
+    return true;
+}
+
+inline auto test_open_tree() -> bool {
+    constexpr auto files = 100;
+
+    auto controller = fs::Controller();
+    auto tmpfs      = fs::tmp::new_driver();
+    controller.mount("/", tmpfs);
+    assert(create(controller, "/", "dir", fs::FileType::Directory));
+    for(auto i = 0; i < files; i += 1) {
+        assert(create(controller, "/dir", std::to_string(i), fs::FileType::Regular));
+    }
+
+    // enough open children to index them, each still found by name
+    auto handles = std::vector<fs::Handle>();
+    for(auto i = 0; i < files; i += 1) {
+        value_or(file, controller.open("/dir/" + std::to_string(i), fs::OpenMode::Read));
+        handles.push_back(file);
+    }
+    assert(controller.get_open_node_count() == files + 1);
+    for(auto i = 0; i < files; i += 1) {
+        assert(controller.open("/dir/" + std::to_string(i), fs::OpenMode::Write).as_error() == Error::Code::FileOpened);
+    }
+
+    // closing every other one moves entries around, the rest must stay reachable
+    for(auto i = 0; i < files; i += 2) {
+        assert(!controller.close(handles[i]));
+    }
+    assert(controller.get_open_node_count() == files / 2 + 1);
+    for(auto i = 0; i < files; i += 1) {
+        const auto r = controller.open("/dir/" + std::to_string(i), fs::OpenMode::Write);
+        assert((i & 1) == 0 ? bool(r) : r.as_error() == Error::Code::FileOpened);
+        if(r) {
+            assert(!controller.close(r.as_value()));
+        }
+    }
+    for(auto i = 1; i < files; i += 2) {
+        assert(!controller.close(handles[i]));
+    }
+    assert(controller.get_open_node_count() == 0);
+
+    // freed nodes are reused
+    value_or(file, controller.open("/dir/0", fs::OpenMode::Read));
+    assert(controller.get_open_node_count() == 2);
+    assert(!controller.close(file));
+    return true;
+}
+
+// several threads open, read, write and close through one controller while another mounts and unmounts under them
+// a busy volume stays mounted while unmount is retried, so a walker never passes into the directory it covers
+inline auto test_busy_unmount() -> bool {
+    constexpr auto iterations = 20000;
+
+    auto controller = fs::Controller();
+    auto tmpfs      = fs::tmp::new_driver();
+    auto extra      = fs::tmp::new_driver();
+    controller.mount("/", tmpfs);
+    assert(create(controller, "/", "mnt", fs::FileType::Directory));
+    assert(!controller.mount("/mnt", extra));
+    assert(create(controller, "/mnt", "file", fs::FileType::Regular));
+    value_or(held, controller.open("/mnt/file", fs::OpenMode::Read));
+
+    auto running = std::atomic<bool>(true);
+    auto found   = true;
+    auto walker  = std::thread([&controller, &running, &found]() {
+        for(auto i = 0; i < iterations && found; i += 1) {
+            const auto r = controller.open("/mnt/file", fs::OpenMode::Read);
+            found        = r && !controller.close(r.as_value());
+        }
+        running = false;
+    });
+    auto busy = true;
+    while(running) {
+        const auto r = controller.unmount("/mnt");
+        busy         = busy && !r && r.as_error() == Error::Code::VolumeBusy;
+        std::this_thread::yield();
+    }
+    walker.join();
+    assert(found && busy);
+
+    assert(!controller.close(held));
+    assert(controller.unmount("/mnt").as_value() == &extra);
+    return true;
+}
+
+inline auto test_controller_threads() -> bool {
+    constexpr auto threads    = 8;
+    constexpr auto iterations = 3000;
+    constexpr auto shared     = 4;
+    constexpr auto listed     = 4;
+
+    auto controller = fs::Controller();
+    auto tmpfs      = fs::tmp::new_driver();
+    auto extra      = fs::tmp::new_driver();
+    controller.mount("/", tmpfs);
+    assert(create(controller, "/", "mnt", fs::FileType::Directory));
+    assert(create(controller, "/", "shared", fs::FileType::Directory));
+    for(auto i = 0; i < shared; i += 1) {
+        const auto dir = "/shared/" + std::to_string(i);
+        assert(create(controller, "/shared", std::to_string(i), fs::FileType::Directory));
+        assert(create(controller, dir, "file", fs::FileType::Regular));
+        value_or(file, controller.open(dir + "/file", fs::OpenMode::Write));
+        assert(!file.write(0, 8, "shared!!"));
+        assert(!controller.close(file));
+    }
+    assert(create(controller, "/", "list", fs::FileType::Directory));
+    for(auto i = 0; i < listed; i += 1) {
+        assert(create(controller, "/list", "f" + std::to_string(i), fs::FileType::Regular));
+    }
+    for(auto t = 0; t < threads; t += 1) {
+        assert(create(controller, "/", "t" + std::to_string(t), fs::FileType::Directory));
+        assert(create(controller, "/t" + std::to_string(t), "file", fs::FileType::Regular));
+    }
+    assert(!controller.mount("/mnt", extra));
+    assert(create(controller, "/mnt", "file", fs::FileType::Regular));
+    {
+        value_or(file, controller.open("/mnt/file", fs::OpenMode::Write));
+        assert(!file.write(0, 8, "extra!!!"));
+        assert(!controller.close(file));
+    }
+    assert(controller.unmount("/mnt").as_value() == &extra);
+
+    auto ok      = std::array<bool, threads + 2>();
+    auto running = std::atomic<bool>(true);
+    auto workers = std::vector<std::thread>();
+    for(auto t = 0; t < threads; t += 1) {
+        workers.emplace_back([&controller, &ok, t]() {
+            const auto own = "/t" + std::to_string(t) + "/file";
+            auto       buffer = std::array<char, 8>();
+            ok[t]             = true;
+            for(auto i = 0; i < iterations && ok[t]; i += 1) {
+                // a shared file is read by many, or written by one which sees no readers
+                const auto path = "/shared/" + std::to_string((t + i) % shared) + "/file";
+                const auto mode = i % 16 == 0 ? fs::OpenMode::Write : fs::OpenMode::Read;
+                if(const auto r = controller.open(path, mode); r) {
+                    auto file = r.as_value();
+                    ok[t]     = !file.read(0, 8, buffer.data()) && std::memcmp(buffer.data(), "shared!!", 8) == 0;
+                    if(mode == fs::OpenMode::Write) {
+                        ok[t] = ok[t] && !file.write(0, 8, "shared!!");
+                    }
+                    ok[t] = !controller.close(file) && ok[t];
+                } else {
+                    ok[t] = r.as_error() == Error::Code::FileOpened;
+                }
+
+                // the own file is never contended
+                const auto stamp = std::to_string(10000000 + t * iterations + i);
+                if(const auto r = controller.open(own, fs::OpenMode::Write); r) {
+                    auto file = r.as_value();
+                    ok[t]     = ok[t] && !file.write(0, 8, stamp.data()) && !controller.close(file);
+                } else {
+                    ok[t] = false;
+                }
+                if(const auto r = controller.open(own, fs::OpenMode::Read); r) {
+                    auto file = r.as_value();
+                    ok[t]     = ok[t] && !file.read(0, 8, buffer.data()) && std::memcmp(buffer.data(), stamp.data(), 8) == 0 && !controller.close(file);
+                } else {
+                    ok[t] = false;
+                }
+
+                // the mounted volume or the directory under it, or the mountpoint held by a mount in progress
+                if(const auto r = controller.open("/mnt/file", fs::OpenMode::Read); r) {
+                    auto file = r.as_value();
+                    ok[t]     = ok[t] && !file.read(0, 8, buffer.data()) && std::memcmp(buffer.data(), "extra!!!", 8) == 0 && !controller.close(file);
+                } else {
+                    ok[t] = ok[t] && (r.as_error() == Error::Code::NoSuchFile || r.as_error() == Error::Code::FileOpened);
+                }
+                ok[t] = ok[t] && controller.open("/shared/missing", fs::OpenMode::Read).as_error() == Error::Code::NoSuchFile;
+
+                // a directory which is listed and searched by many while another creates and removes in it
+                if(const auto r = controller.open("/list", fs::OpenMode::Read); r) {
+                    auto       dir     = r.as_value();
+                    const auto is_item = [](const std::string_view name) { return name == "churn" || (name.size() == 2 && name[0] == 'f'); };
+                    for(auto index = size_t(0);; index += 1) {
+                        const auto o = dir.readdir(index);
+                        if(!o) {
+                            ok[t] = ok[t] && o.as_error() == Error::Code::IndexOutOfRange;
+                            break;
+                        }
+                        ok[t] = ok[t] && is_item(o.as_value().name);
+                    }
+                    // a cursor is not moved by removes, so every fixed file is listed
+                    auto records = std::array<fs::DirectoryRecord, 2>();
+                    auto names   = std::array<char, 16>();
+                    auto cursor  = fs::DirectoryCursor();
+                    auto fixed   = 0;
+                    while(!cursor.end && ok[t]) {
+                        const auto count = dir.readdir(cursor, records, names);
+                        ok[t]            = bool(count);
+                        for(auto n = size_t(0); ok[t] && n < count.as_value(); n += 1) {
+                            ok[t] = is_item(records[n].name);
+                            fixed += records[n].name != "churn" ? 1 : 0;
+                        }
+                    }
+                    ok[t] = ok[t] && fixed == listed && bool(dir.find("f" + std::to_string(i % listed)));
+                    ok[t] = !controller.close(dir) && ok[t];
+                } else {
+                    ok[t] = ok[t] && r.as_error() == Error::Code::FileOpened;
+                }
+            }
+        });
+    }
+    workers.emplace_back([&controller, &extra, &ok, &running]() {
+        ok[threads] = true;
+        while(running && ok[threads]) {
+            // a walker passing through the mountpoint keeps it from being opened for writing
+            if(const auto e = controller.mount("/mnt", extra)) {
+                ok[threads] = e == Error::Code::FileOpened;
+                std::this_thread::yield();
+                continue;
+            }
+            while(true) {
+                const auto r = controller.unmount("/mnt");
+                if(r) {
+                    ok[threads] = r.as_value() == &extra;
+                    break;
+                }
+                if(r.as_error() != Error::Code::VolumeBusy) {
+                    ok[threads] = false;
+                    break;
+                }
+                std::this_thread::yield();
+            }
+        }
+    });
+    workers.emplace_back([&controller, &ok, &running]() {
+        ok[threads + 1] = true;
+        auto present    = false;
+        while(running && ok[threads + 1]) {
+            // changing the directory needs it open for writing, which the listers often hold for reading
+            const auto r = controller.open("/list", fs::OpenMode::Write);
+            if(!r) {
+                ok[threads + 1] = r.as_error() == Error::Code::FileOpened;
+                std::this_thread::yield();
+                continue;
+            }
+            auto       dir  = r.as_value();
+            const auto e    = present ? dir.remove("churn") : dir.create("churn", fs::FileType::Regular);
+            ok[threads + 1] = !e && !controller.close(dir);
+            present         = !present;
+        }
+    });
+    for(auto t = 0; t < threads; t += 1) {
+        workers[t].join();
+    }
+    running = false;
+    workers[threads].join();
+    workers[threads + 1].join();
+    for(const auto o : ok) {
+        assert(o);
+    }
+
+    // everything was closed, so only the roots are left
+    assert(controller.get_open_node_count() == 0);
+    assert(controller._compare_root(tdc("/", 0, 1, Type::Directory, tdc("/", 0, 0, Type::Directory))));
+    return true;
+}
+
 inline auto test_tmpfs_rw() -> bool {
     auto controller = fs::Controller();
     auto tmpfs      = fs::tmp::new_driver();
@@ -158,6 +533,527 @@ inline auto test_tmpfs_rw() -> bool {
     return true;
 }
 
+// a large file is a handful of extents, and copies cross their boundaries
+inline auto test_tmpfs_extents() -> bool {
+    constexpr auto size = size_t(5_MiB + 123);
+
+    auto data = std::vector<uint8_t>(size);
+    for(auto i = size_t(0); i < size; i += 1) {
+        data[i] = i * 7 + i / 4096;
+    }
+
+    auto file = fs::tmp::File("file");
+    assert(!file.resize(1));
+    assert(file.get_extent_count() == 0);
+    // appending in small steps grows the extents geometrically
+    for(auto written = size_t(0); written < size;) {
+        const auto n = std::min(size_t(10000), size - written);
+        assert(!file.resize(written + n));
+        assert(!file.write(written, n, data.data() + written));
+        written += n;
+    }
+    assert(file.get_extent_count() < 16);
+
+    auto buffer = std::vector<uint8_t>(size);
+    assert(!file.read(0, size, buffer.data()));
+    assert(buffer == data);
+    for(const auto& [offset, length] : {std::pair<size_t, size_t>(4095, 2), std::pair<size_t, size_t>(2_MiB - 100, 1_MiB), std::pair<size_t, size_t>(size - 1, 1)}) {
+        assert(!file.read(offset, length, buffer.data()));
+        assert(std::memcmp(buffer.data(), data.data() + offset, length) == 0);
+    }
+    assert(file.read(size - 1, 2, buffer.data()) == Error::Code::EndOfFile);
+
+    // one large write is one extent
+    auto large = fs::tmp::File("large");
+    assert(!large.resize(1_MiB));
+    assert(!large.write(0, 1_MiB, data.data()));
+    assert(large.get_extent_count() == 1);
+
+    assert(!file.resize(10));
+    assert(file.get_extent_count() == 1);
+    assert(!file.read(0, 10, buffer.data()));
+    assert(std::memcmp(buffer.data(), data.data(), 10) == 0);
+    return true;
+}
+
+inline auto test_tmpfs_sparse() -> bool {
+    constexpr auto far = size_t(10) * 1024 * 1024 * 1024;
+
+    auto controller = fs::Controller();
+    auto tmpfs      = fs::tmp::new_driver();
+    controller.mount("/", tmpfs);
+    assert(create(controller, "/", "sparse", fs::FileType::Regular));
+    value_or(handle, controller.open("/sparse", fs::OpenMode::Write));
+
+    // only the written frame is allocated
+    const auto used = allocator->get_statistics().used_frames;
+    assert(!handle.write(far, 1, "x"));
+    assert(allocator->get_statistics().used_frames <= used + 1);
+
+    auto buffer = std::array<char, 101>();
+    buffer.fill('?');
+    assert(!handle.read(far - 100, 101, buffer.data()));
+    assert(std::all_of(buffer.begin(), buffer.end() - 1, [](const char c) { return c == 0; }) && buffer.back() == 'x');
+
+    value_or(data_at_0, handle.seek(0, fs::SeekMode::Data));
+    value_or(hole_at_0, handle.seek(0, fs::SeekMode::Hole));
+    value_or(hole_at_far, handle.seek(far, fs::SeekMode::Hole));
+    assert(data_at_0 == far && hole_at_0 == 0 && hole_at_far == far + 1);
+    assert(handle.seek(far + 1, fs::SeekMode::Data).as_error() == Error::Code::EndOfFile);
+
+    // writing inside the file must not truncate it
+    assert(!handle.write(0, 1, "y"));
+    value_or(hole_at_far2, handle.seek(far, fs::SeekMode::Hole));
+    assert(hole_at_far2 == far + 1);
+    assert(!controller.close(handle));
+
+    // punching frees the frames inside the range and zeroes the edges
+    auto file    = fs::tmp::File("file");
+    auto pattern = std::vector<uint8_t>(4 * bytes_per_frame, 0xAA);
+    assert(!file.resize(pattern.size()));
+    assert(!file.write(0, pattern.size(), pattern.data()));
+    assert(file.get_allocated_size() == pattern.size());
+    assert(!file.punch_hole(bytes_per_frame + 100, 2 * bytes_per_frame));
+    assert(file.get_allocated_size() == 3 * bytes_per_frame && file.get_size() == pattern.size());
+    value_or(hole, file.seek_hole(0));
+    value_or(data, file.seek_data(hole));
+    assert(hole == 2 * bytes_per_frame && data == 3 * bytes_per_frame);
+
+    auto read = std::vector<uint8_t>(pattern.size());
+    assert(!file.read(0, read.size(), read.data()));
+    for(auto i = size_t(0); i < read.size(); i += 1) {
+        const auto punched = i >= bytes_per_frame + 100 && i < 3 * bytes_per_frame + 100;
+        assert(read[i] == (punched ? 0 : 0xAA));
+    }
+
+    // a shrunk range reads as zeros when the file grows again
+    assert(!file.resize(50));
+    assert(file.get_allocated_size() == bytes_per_frame);
+    assert(!file.resize(pattern.size()));
+    assert(!file.read(0, read.size(), read.data()));
+    assert(std::all_of(read.begin(), read.begin() + 50, [](const uint8_t c) { return c == 0xAA; }));
+    assert(std::all_of(read.begin() + 50, read.end(), [](const uint8_t c) { return c == 0; }));
+    return true;
+}
+
+inline auto test_tmpfs_inline() -> bool {
+    const auto text = std::string_view("{\"counter\": 42}");
+
+    auto file = fs::tmp::File("small", 64);
+    assert(!file.resize(text.size()));
+    assert(!file.write(0, text.size(), text.data()));
+    assert(file.is_inline() && file.get_allocated_size() == 0);
+
+    auto buffer = std::array<uint8_t, 128>();
+    assert(!file.read(0, text.size(), buffer.data()));
+    assert(std::memcmp(buffer.data(), text.data(), text.size()) == 0);
+    assert(file.read(1, text.size(), buffer.data()) == Error::Code::EndOfFile);
+
+    // growing past the limit moves the bytes to a frame
+    assert(!file.resize(100));
+    assert(!file.is_inline() && file.get_allocated_size() == bytes_per_frame);
+    assert(!file.read(0, 100, buffer.data()));
+    assert(std::memcmp(buffer.data(), text.data(), text.size()) == 0);
+    assert(std::all_of(buffer.begin() + text.size(), buffer.begin() + 100, [](const uint8_t c) { return c == 0; }));
+
+    assert(!file.resize(0));
+    assert(file.is_inline() && file.get_allocated_size() == 0);
+
+    // bytes cut off by a shrink read back as zero when the file grows again
+    assert(!file.resize(text.size()));
+    assert(!file.write(0, text.size(), text.data()));
+    assert(!file.resize(4));
+    assert(!file.resize(text.size()));
+    assert(!file.read(0, text.size(), buffer.data()));
+    assert(std::memcmp(buffer.data(), text.data(), 4) == 0);
+    assert(std::all_of(buffer.begin() + 4, buffer.begin() + text.size(), [](const uint8_t c) { return c == 0; }));
+
+    // the bytes are kept in the file object, so a larger limit is clamped to its buffer
+    auto large = fs::tmp::File("large", 1000);
+    assert(!large.resize(fs::tmp::max_inline_limit + 1));
+    assert(!large.is_inline());
+
+    // a limit of zero disables inlining
+    auto framed = fs::tmp::File("framed", 0);
+    assert(!framed.resize(1));
+    assert(!framed.is_inline());
+
+    auto controller = fs::Controller();
+    auto tmpfs      = fs::tmp::new_driver({.inline_limit = 0});
+    controller.mount("/", tmpfs);
+    assert(create(controller, "/", "lock", fs::FileType::Regular));
+    value_or(handle, controller.open("/lock", fs::OpenMode::Write));
+    assert(!handle.write(0, text.size(), text.data()));
+    value_or(hole, handle.seek(0, fs::SeekMode::Hole));
+    assert(hole == text.size());
+    assert(!controller.close(handle));
+    return true;
+}
+
+// runs fn with a private allocator without thread caches, so that frame counts are exact
+// fn is given a function returning the frames in use, none of which may be left once it returns
+template <class F>
+inline auto with_private_allocator(F&& fn) -> bool {
+    auto       mm    = BitmapMemoryManager(64_MiB, false, false);
+    const auto saved = allocator;
+    allocator        = &mm;
+    const auto used  = [&mm]() { return mm.get_statistics().used_frames; };
+    const auto ok    = fn(used);
+    allocator        = saved;
+    assert(ok);
+    assert(used() == 0);
+    return true;
+}
+
+inline auto test_tmpfs_clone() -> bool {
+    return with_private_allocator([](const auto used) -> bool {
+        constexpr auto size = size_t(3_MiB + 100);
+
+        auto data = std::vector<uint8_t>(size);
+        for(auto i = size_t(0); i < size; i += 1) {
+            data[i] = i * 13 + i / 4096;
+        }
+
+        auto controller = fs::Controller();
+        auto tmpfs      = fs::tmp::new_driver();
+        controller.mount("/", tmpfs);
+        assert(create(controller, "/", "source", fs::FileType::Regular));
+        assert(create(controller, "/", "copy", fs::FileType::Regular));
+        value_or(source, controller.open("/source", fs::OpenMode::Write));
+        value_or(copy, controller.open("/copy", fs::OpenMode::Write));
+        assert(!source.write(0, size, data.data()));
+
+        // no frame is allocated until a shared one is written
+        const auto frames = used();
+        assert(!copy.clone_from(source));
+        assert(used() == frames);
+        auto buffer = std::vector<uint8_t>(size);
+        assert(!copy.read(0, size, buffer.data()));
+        assert(buffer == data);
+
+        // a write straddling two frames copies both, keeping the bytes around it
+        const auto offset = size_t(2 * bytes_per_frame - 2);
+        assert(!copy.write(offset, 4, "abcd"));
+        assert(used() == frames + 2);
+        assert(!copy.read(0, size, buffer.data()));
+        assert(std::memcmp(buffer.data() + offset, "abcd", 4) == 0);
+        std::memcpy(buffer.data() + offset, data.data() + offset, 4);
+        assert(buffer == data);
+        assert(!source.read(0, size, buffer.data()));
+        assert(buffer == data);
+
+        // frames still shared stay allocated for the other file
+        assert(!source.punch_hole(0, size));
+        assert(used() == frames);
+        assert(!copy.read(bytes_per_frame * 100, 10, buffer.data()));
+        assert(std::memcmp(buffer.data(), data.data() + bytes_per_frame * 100, 10) == 0);
+
+        assert(!controller.close(source));
+        assert(!controller.close(copy));
+        return true;
+    });
+}
+
+// words drawn from a small vocabulary, compressible about as well as ordinary text
+inline auto make_text(const size_t size) -> std::vector<uint8_t> {
+    constexpr auto words = std::array{"frame ", "extent ", "file ", "directory ", "the ", "of ", "and ", "mount ", "driver ", "cluster ", "read ", "write "};
+
+    auto r    = std::vector<uint8_t>();
+    auto seed = uint32_t(1);
+    while(r.size() < size) {
+        seed            = seed * 1103515245 + 12345;
+        const auto word = std::string_view(words[(seed >> 16) % words.size()]);
+        r.insert(r.end(), word.begin(), word.end());
+    }
+    r.resize(size);
+    return r;
+}
+
+inline auto test_lz() -> bool {
+    auto random = std::vector<uint8_t>(10000);
+    auto seed   = uint32_t(7);
+    for(auto& b : random) {
+        seed = seed * 1103515245 + 12345;
+        b    = seed >> 24;
+    }
+    for(const auto& input : {make_text(bytes_per_frame), std::vector<uint8_t>(bytes_per_frame), random, std::vector<uint8_t>(3, 'a')}) {
+        auto       packed = std::vector<uint8_t>(input.size() * 2 + 16);
+        auto       output = std::vector<uint8_t>(input.size());
+        const auto n      = lz::compress(input, packed);
+        assert(n != 0);
+        assert(lz::decompress({packed.data(), n}, output));
+        assert(output == input);
+        // the exact size is required, and a short buffer is reported rather than overrun
+        assert(input.empty() || !lz::decompress({packed.data(), n}, {output.data(), output.size() - 1}));
+        assert(lz::compress(input, {packed.data(), n - 1}) == 0);
+    }
+    const auto zeros = std::vector<uint8_t>(bytes_per_frame);
+    auto       block = std::array<uint8_t, 128>();
+    assert(lz::compress(zeros, block) != 0);
+    return true;
+}
+
+inline auto test_tmpfs_compression() -> bool {
+    constexpr auto limit = size_t(1_MiB);
+    constexpr auto size  = size_t(4_MiB);
+
+    const auto text = make_text(size);
+    auto       data = std::vector<uint8_t>(size);
+    for(const auto background : {false, true}) {
+        auto controller = fs::Controller();
+        auto tmpfs      = fs::tmp::new_driver({.memory_limit = limit, .background = background});
+        controller.mount("/", tmpfs);
+        assert(create(controller, "/", "text", fs::FileType::Regular));
+        assert(create(controller, "/", "random", fs::FileType::Regular));
+        assert(create(controller, "/", "copy", fs::FileType::Regular));
+        value_or(file, controller.open("/text", fs::OpenMode::Write));
+        for(auto offset = size_t(0); offset < size; offset += 64_KiB) {
+            assert(!file.write(offset, 64_KiB, text.data() + offset));
+        }
+        if(background) {
+            for(auto i = 0; i < 1000 && tmpfs.get_compression_statistics().resident_bytes > limit; i += 1) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        const auto stats = tmpfs.get_compression_statistics();
+        assert(stats.resident_bytes <= limit);
+        assert(stats.get_ratio() > 1.5);
+
+        // only the frames touched are decompressed
+        if(!background) {
+            assert(!file.read(3_MiB + 10, 10, data.data()));
+            assert(tmpfs.get_compression_statistics().resident_bytes == stats.resident_bytes + bytes_per_frame);
+        }
+        assert(!file.read(0, size, data.data()));
+        assert(data == text);
+
+        // packed frames are shared by clones, writes stay private
+        value_or(copy, controller.open("/copy", fs::OpenMode::Write));
+        assert(!copy.clone_from(file));
+        assert(!copy.write(100, 4, "abcd"));
+        assert(!file.read(0, size, data.data()));
+        assert(data == text);
+        assert(!copy.read(0, size, data.data()));
+        assert(std::memcmp(data.data() + 100, "abcd", 4) == 0);
+        assert(std::memcmp(data.data() + 104, text.data() + 104, size - 104) == 0);
+
+        // frames which do not compress are left alone
+        value_or(random, controller.open("/random", fs::OpenMode::Write));
+        auto seed = uint32_t(3);
+        for(auto& b : data) {
+            seed = seed * 1103515245 + 12345;
+            b    = seed >> 24;
+        }
+        assert(!random.write(0, 2_MiB, data.data()));
+        auto buffer = std::vector<uint8_t>(2_MiB);
+        assert(!random.read(0, 2_MiB, buffer.data()));
+        assert(std::memcmp(buffer.data(), data.data(), 2_MiB) == 0);
+
+        assert(!controller.close(file));
+        assert(!controller.close(copy));
+        assert(!controller.close(random));
+    }
+    return true;
+}
+
+// files of a mount over its limit are written, read and created from several threads while cold extents are compressed
+inline auto test_tmpfs_compression_threads() -> bool {
+    constexpr auto limit   = size_t(512_KiB);
+    constexpr auto size    = size_t(1_MiB);
+    constexpr auto threads = 4;
+
+    const auto text = make_text(size);
+    for(const auto background : {false, true}) {
+        auto controller = fs::Controller();
+        auto tmpfs      = fs::tmp::new_driver({.memory_limit = limit, .background = background});
+        controller.mount("/", tmpfs);
+        for(auto t = 0; t < threads; t += 1) {
+            assert(create(controller, "/", "t" + std::to_string(t), fs::FileType::Directory));
+            assert(create(controller, "/t" + std::to_string(t), "file", fs::FileType::Regular));
+        }
+        auto ok      = std::array<bool, threads>();
+        auto workers = std::vector<std::thread>();
+        for(auto t = 0; t < threads; t += 1) {
+            workers.emplace_back([&controller, &text, &ok, t]() {
+                const auto dir    = "/t" + std::to_string(t);
+                auto       buffer = std::vector<uint8_t>(size);
+                ok[t]             = true;
+                for(auto round = 0; round < 4 && ok[t]; round += 1) {
+                    // a file created and removed next to the others changes the tree under the compressor
+                    ok[t] = create(controller, dir, "other", fs::FileType::Regular);
+                    if(const auto r = controller.open(dir + "/file", fs::OpenMode::Write); r) {
+                        auto file = r.as_value();
+                        for(auto offset = size_t(0); offset < size && ok[t]; offset += 64_KiB) {
+                            ok[t] = !file.write(offset, 64_KiB, text.data() + offset);
+                        }
+                        ok[t] = ok[t] && !file.read(0, size, buffer.data()) && buffer == text;
+                        ok[t] = !controller.close(file) && ok[t];
+                    } else {
+                        ok[t] = false;
+                    }
+                    if(const auto r = controller.open(dir, fs::OpenMode::Write); r) {
+                        auto parent = r.as_value();
+                        ok[t]       = ok[t] && !parent.remove("other");
+                        ok[t]       = !controller.close(parent) && ok[t];
+                    } else {
+                        ok[t] = false;
+                    }
+                }
+            });
+        }
+        for(auto& w : workers) {
+            w.join();
+        }
+        for(const auto o : ok) {
+            assert(o);
+        }
+        if(background) {
+            for(auto i = 0; i < 1000 && tmpfs.get_compression_statistics().resident_bytes > limit; i += 1) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        assert(tmpfs.get_compression_statistics().resident_bytes <= limit);
+    }
+    return true;
+}
+
+// frames come from one arena, so addresses show where runs were placed
+inline auto test_bitmap_memory_manager() -> bool {
+    auto       mm    = BitmapMemoryManager(200 * bytes_per_frame, false, false);
+    const auto frame = [](const FrameID id) { return static_cast<uint8_t*>(id.get_frame()); };
+
+    value_or(a, mm.allocate(10));
+    value_or(b, mm.allocate(70));
+    value_or(c, mm.allocate(1));
+    assert(frame(b) == frame(a) + 10 * bytes_per_frame && frame(c) == frame(b) + 70 * bytes_per_frame);
+    std::memset(frame(a), 0xFF, 10 * bytes_per_frame);
+
+    assert(!mm.deallocate(b, 70));
+    assert(mm.deallocate(b, 70) == Error::Code::InvalidData);
+    assert(mm.deallocate(FrameID(frame(c) + 1), 1) == Error::Code::IndexOutOfRange);
+    {
+        const auto stat = mm.get_statistics();
+        assert(stat.total_frames == 200 && stat.used_frames == 11 && stat.free_runs == 2 && stat.largest_free_run == 119);
+        assert(stat.get_fragmentation() > 0);
+    }
+
+    // no run is long enough although enough frames are free
+    const auto too_large = mm.allocate(150);
+    assert(!too_large && too_large.as_error() == Error::Code::OutOfMemory);
+
+    // next-fit continues after c, then wraps around into the hole left by b
+    value_or(d, mm.allocate(60));
+    assert(frame(d) == frame(c) + bytes_per_frame);
+    value_or(e, mm.allocate(65));
+    assert(frame(e) == frame(b));
+
+    // the rest can still be handed out frame by frame
+    auto rest = std::vector<FrameID>();
+    while(true) {
+        const auto r = mm.allocate(1);
+        if(!r) {
+            break;
+        }
+        rest.push_back(r.as_value());
+    }
+    assert(rest.size() == 200 - 10 - 1 - 60 - 65);
+    for(const auto f : rest) {
+        assert(!mm.deallocate(f, 1));
+    }
+    assert(!mm.deallocate(a, 10) && !mm.deallocate(c, 1) && !mm.deallocate(d, 60) && !mm.deallocate(e, 65));
+    {
+        const auto stat = mm.get_statistics();
+        assert(stat.used_frames == 0 && stat.free_runs == 1 && stat.largest_free_run == 200);
+    }
+
+    // an aligned run never starts in a partially used word, a holds the first frame of the arena
+    value_or(one, mm.allocate(1));
+    value_or(aligned, mm.allocate(100, 64));
+    const auto misalignment = size_t(frame(aligned) - frame(a)) % (64 * bytes_per_frame);
+    assert(misalignment == 0);
+    assert(frame(one) < frame(aligned) || frame(one) >= frame(aligned) + 100 * bytes_per_frame);
+    assert(mm.allocate(2, 3).as_error() == Error::Code::InvalidData);
+    assert(!mm.allocate(100, 64));
+
+    // word skipping agrees with the scalar scan
+    auto words = std::vector<uint64_t>(37, ~uint64_t(0));
+    for(auto i = size_t(0); i <= words.size(); i += 1) {
+        if(i < words.size()) {
+            words[i] = 1;
+        }
+        assert(simd::find_not_equal64(words.data(), words.size(), ~uint64_t(0)) == simd::impl::find_not_equal64_scalar(words.data(), words.size(), ~uint64_t(0)));
+        if(i < words.size()) {
+            words[i] = ~uint64_t(0);
+        }
+    }
+    return true;
+}
+
+// single frames cycle through the thread caches, and every frame is back in the bitmap once they are trimmed
+inline auto test_frame_magazines() -> bool {
+    constexpr auto frames  = size_t(1024);
+    constexpr auto threads = 4;
+
+    auto mm = BitmapMemoryManager(frames * bytes_per_frame);
+    {
+        value_or(a, mm.allocate(1));
+        assert(!mm.deallocate(a, 1));
+        value_or(b, mm.allocate(1));
+        assert(b.get_frame() == a.get_frame());
+        assert(!mm.deallocate(b, 1));
+    }
+
+    // every frame is handed out once through the caches before the arena runs out
+    auto all = std::vector<void*>();
+    for(auto i = size_t(0); i < frames; i += 1) {
+        value_or(f, mm.allocate(1));
+        all.push_back(f.get_frame());
+    }
+    assert(mm.allocate(1).as_error() == Error::Code::OutOfMemory);
+    std::sort(all.begin(), all.end());
+    assert(std::adjacent_find(all.begin(), all.end()) == all.end());
+    for(const auto f : all) {
+        assert(!mm.deallocate(FrameID(f), 1));
+    }
+
+    // each frame is stamped with its owner, a frame handed out twice would be overwritten
+    auto ok      = std::array<bool, threads>();
+    auto workers = std::vector<std::thread>();
+    for(auto t = 0; t < threads; t += 1) {
+        workers.emplace_back([&mm, &ok, t]() {
+            auto held = std::vector<FrameID>();
+            ok[t]     = true;
+            for(auto i = 0; i < 20000 && ok[t]; i += 1) {
+                if(held.size() < 100 && (i % 3 != 0 || held.empty())) {
+                    const auto r = mm.allocate(1);
+                    ok[t]        = bool(r);
+                    if(ok[t]) {
+                        *static_cast<int*>(r.as_value().get_frame()) = t;
+                        held.push_back(r.as_value());
+                    }
+                } else {
+                    ok[t] = *static_cast<int*>(held.back().get_frame()) == t && !mm.deallocate(held.back(), 1);
+                    held.pop_back();
+                }
+            }
+            for(const auto f : held) {
+                ok[t] = ok[t] && *static_cast<int*>(f.get_frame()) == t && !mm.deallocate(f, 1);
+            }
+        });
+    }
+    for(auto& worker : workers) {
+        worker.join();
+    }
+    for(const auto o : ok) {
+        assert(o);
+    }
+
+    mm.trim();
+    const auto stat = mm.get_statistics();
+    assert(stat.used_frames == 0 && stat.depot_frames == 0 && stat.largest_free_run == frames);
+    return true;
+}
+
 template <size_t size>
 inline auto test_ls(fs::Handle handle, std::array<const char*, size> expected) -> bool {
     for(auto i = 0; i < expected.size(); i += 1) {
@@ -177,6 +1073,255 @@ inline auto test_ls(fs::Handle handle, std::array<const char*, size> expected) -
     return true;
 }
 
+// compares batched listing with readdir(index)
+inline auto test_readdir_batch(fs::Handle handle) -> bool {
+    auto records = std::array<fs::DirectoryRecord, 7>();
+    auto names   = std::array<char, 64>();
+    auto cursor  = fs::DirectoryCursor();
+    auto index   = size_t(0);
+    while(!cursor.end) {
+        value_or(count, handle.readdir(cursor, records, names));
+        for(auto i = size_t(0); i < count; i += 1) {
+            value_or(o, handle.readdir(index));
+            assert(records[i].name == o.name && records[i].type == o.type && records[i].size == o.size);
+            index += 1;
+        }
+    }
+    assert(!handle.readdir(index));
+    return true;
+}
+
+inline auto test_tmpfs_readdir_batch() -> bool {
+    auto controller = fs::Controller();
+    auto tmpfs      = fs::tmp::new_driver();
+    controller.mount("/", tmpfs);
+
+    for(auto i = 0; i < 50; i += 1) {
+        assert(create(controller, "/", "file" + std::to_string(i), fs::FileType::Regular));
+    }
+    value_or(root, controller.open("/", fs::OpenMode::Read));
+    assert(test_readdir_batch(root));
+    assert(!controller.close(root));
+    return true;
+}
+
+// a cursor survives inserts, removes and the compaction they trigger
+inline auto test_tmpfs_directory_cursor() -> bool {
+    using Child = std::variant<fs::tmp::File, fs::tmp::Directory>;
+
+    auto dir = fs::tmp::Directory("dir");
+    for(auto i = 0; i < 100; i += 1) {
+        dir.create<fs::tmp::File>("file" + std::to_string(i));
+    }
+
+    auto listed = std::vector<std::string>();
+    auto cursor = fs::DirectoryCursor();
+    auto step   = [&](const size_t count) {
+        auto n = size_t(0);
+        dir.list(cursor, [&](const Child& child) -> bool {
+            if(n == count) {
+                return false;
+            }
+            listed.emplace_back(std::get<fs::tmp::File>(child).get_name());
+            n += 1;
+            return true;
+        });
+    };
+
+    step(10);
+    assert(listed.size() == 10 && !cursor.end);
+    // both listed and pending children go away, more than half of them to force a compaction
+    for(auto i = 5; i < 65; i += 1) {
+        assert(dir.remove("file" + std::to_string(i)));
+    }
+    dir.create<fs::tmp::File>("late");
+    step(20);
+    step(1000);
+    assert(cursor.end);
+
+    auto expected = std::vector<std::string>();
+    for(auto i = 0; i < 100; i += 1) {
+        if(i < 10 || i >= 65) {
+            expected.push_back("file" + std::to_string(i));
+        }
+    }
+    expected.push_back("late");
+    assert(listed == expected);
+
+    // indices are dense again
+    assert(dir.get_child_count() == 41);
+    value_or(last, dir.find_nth(40));
+    assert(std::get<fs::tmp::File>(*last).get_name() == "late");
+    assert(dir.find("file5") == nullptr && dir.find("file70") != nullptr);
+    return true;
+}
+
+inline auto test_tmpfs_snapshot() -> bool {
+    const auto path = (std::filesystem::temp_directory_path() / "klee-tmpfs-snapshot").string();
+    const auto ok   = with_private_allocator([&path](const auto used) -> bool {
+        constexpr auto size = size_t(3_MiB + 100);
+
+        const auto text = make_text(size);
+        {
+            auto controller = fs::Controller();
+            auto tmpfs      = fs::tmp::new_driver({.memory_limit = 2_MiB});
+            controller.mount("/", tmpfs);
+            assert(create(controller, "/", "z", fs::FileType::Directory));
+            assert(create(controller, "/", "a", fs::FileType::Regular));
+            assert(create(controller, "/z", "source", fs::FileType::Regular));
+            assert(create(controller, "/z", "copy", fs::FileType::Regular));
+            assert(create(controller, "/z", "sparse", fs::FileType::Regular));
+            value_or(a, controller.open("/a", fs::OpenMode::Write));
+            value_or(source, controller.open("/z/source", fs::OpenMode::Write));
+            value_or(copy, controller.open("/z/copy", fs::OpenMode::Write));
+            value_or(sparse, controller.open("/z/sparse", fs::OpenMode::Write));
+            assert(!a.write(0, 5, "small"));
+            // part of the source is packed by the memory limit
+            assert(!source.write(0, size, text.data()));
+            assert(!copy.clone_from(source));
+            assert(!sparse.write(5_MiB, 4, "tail"));
+            assert(!controller.close(a));
+            assert(!controller.close(source));
+            assert(!controller.close(copy));
+            assert(!controller.close(sparse));
+            assert(!tmpfs.snapshot(path));
+        }
+        // the frames of the clone are written once
+        assert(std::filesystem::file_size(path) < 2 * size);
+
+        // nothing is allocated until a frame is written
+        auto controller = fs::Controller();
+        auto tmpfs      = fs::tmp::new_driver();
+        controller.mount("/", tmpfs);
+        assert(!tmpfs.restore(path));
+        assert(used() == 0);
+        value_or(root, controller.open("/", fs::OpenMode::Read));
+        assert(test_ls(root, std::array{"z", "a"}));
+        assert(!controller.close(root));
+        value_or(dir, controller.open("/z", fs::OpenMode::Read));
+        assert(test_ls(dir, std::array{"source", "copy", "sparse"}));
+        assert(!controller.close(dir));
+
+        auto buffer = std::vector<uint8_t>(size);
+        value_or(a, controller.open("/a", fs::OpenMode::Read));
+        assert(a.get_size() == 5);
+        assert(!a.read(0, 5, buffer.data()));
+        assert(std::memcmp(buffer.data(), "small", 5) == 0);
+        assert(!controller.close(a));
+        value_or(sparse, controller.open("/z/sparse", fs::OpenMode::Read));
+        value_or(data, sparse.seek(0, fs::SeekMode::Data));
+        assert(data == 5_MiB);
+        assert(!controller.close(sparse));
+        value_or(source, controller.open("/z/source", fs::OpenMode::Read));
+        assert(!source.read(0, size, buffer.data()));
+        assert(buffer == text);
+        assert(used() == 0);
+
+        // a write copies only the frames it touches, the image and the other files keep the old bytes
+        value_or(copy, controller.open("/z/copy", fs::OpenMode::Write));
+        const auto offset = size_t(2 * bytes_per_frame - 2);
+        assert(!copy.write(offset, 4, "abcd"));
+        assert(used() == 2);
+        assert(!copy.read(0, size, buffer.data()));
+        assert(std::memcmp(buffer.data() + offset, "abcd", 4) == 0);
+        std::memcpy(buffer.data() + offset, text.data() + offset, 4);
+        assert(buffer == text);
+        assert(!source.read(0, size, buffer.data()));
+        assert(buffer == text);
+        assert(!controller.close(copy));
+        assert(!controller.close(source));
+
+        // a mount which is not empty and a broken image are refused, the mount is left empty by the latter
+        assert(tmpfs.restore(path) == Error::Code::FileExists);
+        auto other = fs::tmp::new_driver();
+        std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+        assert(other.restore(path) == Error::Code::InvalidData);
+        assert(other.restore(path + "-missing") == Error::Code::NoSuchFile);
+        return true;
+    });
+
+    std::filesystem::remove(path);
+    return ok;
+}
+
+inline auto test_tmpfs_dedup() -> bool {
+    return with_private_allocator([](const auto used) -> bool {
+        constexpr auto size   = size_t(1_MiB + 100);
+        constexpr auto frames = (size + bytes_per_frame - 1) / bytes_per_frame;
+
+        const auto text       = make_text(size);
+        auto       controller = fs::Controller();
+        auto       tmpfs      = fs::tmp::new_driver({.dedup = true});
+        controller.mount("/", tmpfs);
+        assert(create(controller, "/", "a", fs::FileType::Regular));
+        assert(create(controller, "/", "b", fs::FileType::Regular));
+        value_or(a, controller.open("/a", fs::OpenMode::Write));
+        value_or(b, controller.open("/b", fs::OpenMode::Write));
+
+        // the same bytes written in chunks of different sizes end up in the same frames, except for the partial last one
+        assert(!a.write(0, size, text.data()));
+        const auto once = used();
+        for(auto offset = size_t(0); offset < size; offset += 1000) {
+            assert(!b.write(offset, std::min(size_t(1000), size - offset), text.data() + offset));
+        }
+        assert(used() == once + 1);
+        const auto stats = tmpfs.get_dedup_statistics();
+        assert(stats.logical_frames == frames * 2);
+        assert(stats.physical_frames == frames + 1);
+        assert(stats.get_ratio() > 1.9);
+
+        // a write to a shared frame copies it, the other file keeps the old bytes
+        assert(!b.write(10, 4, "abcd"));
+        assert(used() == once + 2);
+        auto buffer = std::vector<uint8_t>(size);
+        assert(!a.read(0, size, buffer.data()));
+        assert(buffer == text);
+        assert(!b.read(0, size, buffer.data()));
+        assert(std::memcmp(buffer.data() + 10, "abcd", 4) == 0);
+        assert(std::memcmp(buffer.data() + 14, text.data() + 14, size - 14) == 0);
+
+        // equal frames inside one file are shared too
+        assert(create(controller, "/", "zeros", fs::FileType::Regular));
+        value_or(zeros, controller.open("/zeros", fs::OpenMode::Write));
+        const auto before = used();
+        const auto empty  = std::vector<uint8_t>(frames * bytes_per_frame);
+        assert(!zeros.write(0, empty.size(), empty.data()));
+        assert(used() == before + 1);
+        buffer.resize(empty.size(), 1);
+        assert(!zeros.read(0, empty.size(), buffer.data()));
+        assert(buffer == empty);
+
+        assert(!controller.close(a));
+        assert(!controller.close(b));
+        assert(!controller.close(zeros));
+        return true;
+    });
+}
+
+inline auto test_fat_readdir_batch(block::BlockDevice& block) -> bool {
+    auto controller = fs::Controller();
+    value_or(fatfs, fs::fat::new_driver(block));
+    controller.mount("/", *fatfs.get());
+
+    value_or(root, controller.open("/", fs::OpenMode::Read));
+    assert(test_readdir_batch(root));
+    for(auto i = 0;; i += 1) {
+        const auto r = root.readdir(i);
+        if(!r) {
+            break;
+        }
+        const auto& o = r.as_value();
+        if(o.type != fs::FileType::Directory) {
+            continue;
+        }
+        value_or(dir, controller.open("/" + std::string(o.name), fs::OpenMode::Read));
+        assert(test_readdir_batch(dir));
+        assert(!controller.close(dir));
+    }
+    assert(!controller.close(root));
+    return true;
+}
+
 inline auto test_fat_rw(block::BlockDevice& block) -> bool {
     auto controller = fs::Controller();
     value_or(fatfs, fs::fat::new_driver(block));
@@ -197,6 +1342,590 @@ inline auto test_fat_rw(block::BlockDevice& block) -> bool {
     return true;
 }
 
+inline auto test_fat_statfs(block::BlockDevice& block) -> bool {
+    value_or(fatfs, fs::fat::new_driver(block));
+    value_or(stat, fatfs->statfs(true));
+
+    // compare with per-cluster lookups
+    auto bpb    = fs::fat::BPB();
+    auto buffer = std::vector<uint8_t>(block.get_info().bytes_per_sector);
+    assert(!block.read_sector(0, 1, buffer.data()));
+    std::memcpy(&bpb, buffer.data(), sizeof(bpb));
+    const auto summary = bpb.summary();
+    auto       free    = uint32_t(0);
+    for(auto c = uint32_t(2); c < stat.total_clusters + 2; c += 1) {
+        value_or(entry, fs::fat::read_fat_for_cluster(c, summary, block));
+        if((entry & fs::fat::fat_entry_mask) == 0) {
+            free += 1;
+        }
+    }
+    assert(stat.free_clusters == free);
+    assert(stat.largest_free_run <= stat.free_clusters);
+    assert((stat.free_runs == 0) == (stat.free_clusters == 0));
+
+    auto chains = uint32_t(0);
+    for(const auto n : stat.fragment_histogram) {
+        chains += n;
+    }
+    assert(chains == stat.chains);
+    printf("%u/%u clusters free, %u free runs, %u/%u chains fragmented\n", stat.free_clusters, stat.total_clusters, stat.free_runs, stat.fragmented_chains, stat.chains);
+    return true;
+}
+
+// finds every entry of the directory by its name in swapped case
+inline auto test_fat_find_entries(fs::Handle dir) -> bool {
+    for(auto i = 0;; i += 1) {
+        const auto r = dir.readdir(i);
+        if(!r) {
+            break;
+        }
+        const auto& o = r.as_value();
+
+        auto swapped = std::string(o.name);
+        for(auto& c : swapped) {
+            c = std::isupper(c) ? std::tolower(c) : std::toupper(c);
+        }
+        for(const auto& name : {std::string(o.name), swapped}) {
+            value_or(found, dir.find(name));
+            assert(found.type == o.type && found.size == o.size);
+        }
+    }
+    const auto r = dir.find("no such file");
+    assert(!r && r.as_error() == Error::Code::NoSuchFile);
+    return true;
+}
+
+inline auto test_fat_find(block::BlockDevice& block) -> bool {
+    auto controller = fs::Controller();
+    value_or(fatfs, fs::fat::new_driver(block));
+    controller.mount("/", *fatfs.get());
+
+    value_or(root, controller.open("/", fs::OpenMode::Read));
+    assert(test_fat_find_entries(root));
+    for(auto i = 0;; i += 1) {
+        const auto r = root.readdir(i);
+        if(!r) {
+            break;
+        }
+        const auto& o = r.as_value();
+        if(o.type != fs::FileType::Directory) {
+            continue;
+        }
+        value_or(dir, controller.open("/" + std::string(o.name), fs::OpenMode::Read));
+        assert(test_fat_find_entries(dir));
+        assert(!controller.close(dir));
+    }
+
+    // opening a file by another case must share the node
+    value_or(first, root.readdir(0));
+    auto lower = std::string(first.name);
+    for(auto& c : lower) {
+        c = std::tolower(c);
+    }
+    value_or(a, controller.open("/" + std::string(first.name), fs::OpenMode::Read));
+    value_or(b, controller.open("/" + lower, fs::OpenMode::Read));
+    assert(!controller.close(a));
+    assert(!controller.close(b));
+    assert(controller._compare_root(tdc("/", 0, 1, Type::Directory, tdc("/", 1, 0, Type::Directory))));
+
+    assert(!controller.close(root));
+    return true;
+}
+
+// the fat entry of cluster reads as value
+class PatchedFatDevice : public block::BlockDevice {
+  private:
+    block::BlockDevice& parent;
+    size_t              sector;
+    size_t              offset;
+    uint32_t            value;
+
+  public:
+    auto get_info() -> block::DeviceInfo override {
+        return parent.get_info();
+    }
+
+    auto read_sector(const size_t sector, const size_t count, void* const buffer) -> Error override {
+        if(const auto e = parent.read_sector(sector, count, buffer)) {
+            return e;
+        }
+        if(this->sector >= sector && this->sector < sector + count) {
+            std::memcpy(static_cast<uint8_t*>(buffer) + (this->sector - sector) * get_info().bytes_per_sector + offset, &value, sizeof(value));
+        }
+        return Error();
+    }
+
+    auto write_sector(const size_t sector, const size_t count, const void* const buffer) -> Error override {
+        return Error::Code::NotImplemented;
+    }
+
+    PatchedFatDevice(block::BlockDevice& parent, const fs::fat::BPB::Summary& bpb, const uint32_t cluster, const uint32_t value) : parent(parent),
+                                                                                                                                  sector(bpb.reserved_sector_count + cluster * 4 / bpb.bytes_per_sector),
+                                                                                                                                  offset(cluster * 4 % bpb.bytes_per_sector),
+                                                                                                                                  value(value) {}
+};
+
+inline auto test_fat_check(block::BlockDevice& block) -> bool {
+    value_or(fatfs, fs::fat::new_driver(block));
+    value_or(report, fs::fat::check(*fatfs, 4));
+    assert(report.is_clean());
+    assert(report.directories > 0);
+
+    // the results must not depend on the number of threads
+    value_or(single, fs::fat::check(*fatfs, 1));
+    assert(single.files == report.files && single.directories == report.directories && single.reachable_clusters == report.reachable_clusters);
+
+    // an allocated but unreferenced cluster is lost
+    value_or(fat, fatfs->load_fat());
+    auto free = uint32_t(0);
+    for(auto c = uint32_t(fatfs->get_fat_entry_count() - 1); c >= 2 && free == 0; c -= 1) {
+        free = (fat[c] & fs::fat::fat_entry_mask) == 0 ? c : 0;
+    }
+    assert(free != 0);
+    auto patched = PatchedFatDevice(block, fatfs->get_bpb(), free, fs::fat::fat_entry_mask);
+    value_or(patched_fatfs, fs::fat::new_driver(patched));
+    value_or(lost, fs::fat::check(*patched_fatfs));
+    assert(lost.issues.empty() && lost.lost_clusters == 1 && lost.lost_chains.size() == 1 && lost.lost_chains[0] == free);
+    printf("check: %u files, %u directories, %u clusters in use\n", report.files, report.directories, report.reachable_clusters);
+    return true;
+}
+
+class CountingDevice : public block::BlockDevice {
+  private:
+    block::BlockDevice& parent;
+
+  public:
+    std::atomic<size_t> reads = 0;
+
+    // reads overlapping [watch_begin, watch_end)
+    size_t              watch_begin   = 0;
+    size_t              watch_end     = 0;
+    std::atomic<size_t> watched_reads = 0;
+
+    auto get_info() -> block::DeviceInfo override {
+        return parent.get_info();
+    }
+
+    auto read_sector(const size_t sector, const size_t count, void* const buffer) -> Error override {
+        reads.fetch_add(1);
+        if(sector < watch_end && sector + count > watch_begin) {
+            watched_reads.fetch_add(1);
+        }
+        return parent.read_sector(sector, count, buffer);
+    }
+
+    auto write_sector(const size_t sector, const size_t count, const void* const buffer) -> Error override {
+        return parent.write_sector(sector, count, buffer);
+    }
+
+    CountingDevice(block::BlockDevice& parent) : parent(parent) {}
+};
+
+// lookups in prefetched directories must not touch the device
+inline auto test_fat_prefetch(block::BlockDevice& block) -> bool {
+    auto counter    = CountingDevice(block);
+    auto controller = fs::Controller();
+    value_or(fatfs, fs::fat::new_driver(counter, {.prefetch = true, .prefetch_depth = 1}));
+    fatfs->wait_prefetch();
+    controller.mount("/", *fatfs.get());
+
+    const auto reads = counter.reads.load();
+    value_or(root, controller.open("/", fs::OpenMode::Read));
+    assert(test_fat_find_entries(root));
+    for(auto i = 0;; i += 1) {
+        const auto r = root.readdir(i);
+        if(!r) {
+            break;
+        }
+        const auto& o = r.as_value();
+        if(o.type != fs::FileType::Directory) {
+            continue;
+        }
+        value_or(dir, controller.open("/" + std::string(o.name), fs::OpenMode::Read));
+        assert(test_fat_find_entries(dir));
+        assert(!controller.close(dir));
+    }
+    assert(!controller.close(root));
+    assert(counter.reads.load() == reads);
+
+    // past the limit directories are indexed without keeping their data
+    value_or(bounded, fs::fat::new_driver(counter, {.prefetch = true, .prefetch_depth = 1, .prefetch_bytes = 0}));
+    bounded->wait_prefetch();
+    auto bounded_controller = fs::Controller();
+    bounded_controller.mount("/", *bounded.get());
+    value_or(bounded_root, bounded_controller.open("/", fs::OpenMode::Read));
+    assert(test_fat_find_entries(bounded_root));
+    assert(!bounded_controller.close(bounded_root));
+
+    // destroying the driver must stop a prefetch in progress
+    value_or(aborted, fs::fat::new_driver(counter, {.prefetch = true, .prefetch_depth = 8}));
+    aborted.reset();
+    const auto stopped = counter.reads.load();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    assert(counter.reads.load() == stopped);
+    return true;
+}
+
+// writes are kept in memory, the parent is never modified
+class OverlayDevice : public block::BlockDevice {
+  private:
+    block::BlockDevice&                               parent;
+    std::unordered_map<size_t, std::vector<uint8_t>> written;
+
+  public:
+    auto get_info() -> block::DeviceInfo override {
+        return parent.get_info();
+    }
+
+    auto read_sector(const size_t sector, const size_t count, void* const buffer) -> Error override {
+        const auto bytes = get_info().bytes_per_sector;
+        if(const auto e = parent.read_sector(sector, count, buffer)) {
+            return e;
+        }
+        for(auto i = size_t(0); i < count; i += 1) {
+            if(const auto p = written.find(sector + i); p != written.end()) {
+                std::memcpy(static_cast<uint8_t*>(buffer) + i * bytes, p->second.data(), bytes);
+            }
+        }
+        return Error();
+    }
+
+    auto write_sector(const size_t sector, const size_t count, const void* const buffer) -> Error override {
+        const auto bytes = get_info().bytes_per_sector;
+        for(auto i = size_t(0); i < count; i += 1) {
+            const auto data = static_cast<const uint8_t*>(buffer) + i * bytes;
+            written.insert_or_assign(sector + i, std::vector<uint8_t>(data, data + bytes));
+        }
+        return Error();
+    }
+
+    OverlayDevice(block::BlockDevice& parent) : parent(parent) {}
+};
+
+// compares names, types, sizes and contents of two trees
+inline auto test_same_tree(fs::Controller& a, fs::Controller& b, const std::string& path) -> bool {
+    value_or(dir_a, a.open(path.empty() ? "/" : path, fs::OpenMode::Read));
+    value_or(dir_b, b.open(path.empty() ? "/" : path, fs::OpenMode::Read));
+    for(auto i = 0;; i += 1) {
+        const auto ra = dir_a.readdir(i);
+        const auto rb = dir_b.readdir(i);
+        assert(bool(ra) == bool(rb));
+        if(!ra) {
+            break;
+        }
+        const auto& oa = ra.as_value();
+        const auto& ob = rb.as_value();
+        assert(oa.name == ob.name && oa.type == ob.type && oa.size == ob.size);
+        if(oa.name == "." || oa.name == "..") {
+            continue;
+        }
+
+        const auto child = path + "/" + std::string(oa.name);
+        if(oa.type == fs::FileType::Directory) {
+            assert(test_same_tree(a, b, child));
+            continue;
+        }
+        value_or(file_a, a.open(child, fs::OpenMode::Read));
+        value_or(file_b, b.open(child, fs::OpenMode::Read));
+        auto data_a = std::vector<uint8_t>(oa.size);
+        auto data_b = std::vector<uint8_t>(oa.size);
+        assert(!file_a.read(0, oa.size, data_a.data()));
+        assert(!file_b.read(0, oa.size, data_b.data()));
+        assert(data_a == data_b);
+        assert(!a.close(file_a));
+        assert(!b.close(file_b));
+    }
+    assert(!a.close(dir_a));
+    assert(!b.close(dir_b));
+    return true;
+}
+
+inline auto test_fat_defrag(block::BlockDevice& block) -> bool {
+    auto overlay = OverlayDevice(block);
+    {
+        value_or(fatfs, fs::fat::new_driver(overlay));
+        value_or(report, fs::fat::defragment(*fatfs));
+        assert(report.extents_after <= report.extents_before);
+        assert(report.fragmented_after == report.skipped);
+        assert(report.moved + report.skipped == report.fragmented_before);
+        value_or(check, fs::fat::check(*fatfs));
+        assert(check.issues.empty() && check.lost_clusters == 0);
+        printf("defrag: %u/%u chains fragmented, %lu -> %lu extents\n", report.fragmented_before, report.files + report.directories, report.extents_before, report.extents_after);
+    }
+
+    auto original     = fs::Controller();
+    auto defragmented  = fs::Controller();
+    value_or(fatfs, fs::fat::new_driver(block));
+    value_or(defragmented_fatfs, fs::fat::new_driver(overlay));
+    original.mount("/", *fatfs.get());
+    defragmented.mount("/", *defragmented_fatfs.get());
+    assert(test_same_tree(original, defragmented, ""));
+    return true;
+}
+
+// path -> contents, directories are recorded empty
+using TreeContents = std::map<std::string, std::vector<uint8_t>>;
+
+// walks the tree through the driver alone, so that several threads can share it without a controller
+inline auto collect_tree(fs::OpenInfo dir, const std::string& path, TreeContents& contents) -> bool {
+    dir.state = fs::OpenInfo::read_unit;
+    for(auto i = 0;; i += 1) {
+        const auto r = dir.readdir(i);
+        if(!r) {
+            break;
+        }
+        const auto& o = r.as_value();
+        if(o.name == "." || o.name == "..") {
+            continue;
+        }
+        value_or(child, dir.find(o.name));
+        assert(child.type == o.type && child.size == o.size);
+
+        const auto child_path = path + "/" + std::string(o.name);
+        if(child.type == fs::FileType::Directory) {
+            contents.emplace(child_path, std::vector<uint8_t>());
+            assert(collect_tree(child, child_path, contents));
+            continue;
+        }
+        auto data = std::vector<uint8_t>(child.size);
+        child.state = fs::OpenInfo::read_unit;
+        assert(!child.read(0, child.size, data.data()));
+        contents.emplace(child_path, std::move(data));
+    }
+    return true;
+}
+
+// readers sharing one driver must see what a single reader sees, even while the prefetcher runs
+inline auto test_fat_concurrent_read(block::BlockDevice& block) -> bool {
+    constexpr auto threads = 4;
+
+    auto expected = TreeContents();
+    {
+        value_or(fatfs, fs::fat::new_driver(block));
+        assert(collect_tree(fatfs->get_root(), "", expected));
+    }
+
+    value_or(fatfs, fs::fat::new_driver(block, {.prefetch = true, .prefetch_depth = 8}));
+    auto results = std::array<TreeContents, threads>();
+    auto ok      = std::array<bool, threads>();
+    auto workers = std::vector<std::thread>();
+    for(auto i = 0; i < threads; i += 1) {
+        workers.emplace_back([&, i]() { ok[i] = collect_tree(fatfs->get_root(), "", results[i]); });
+    }
+    // dropping what the driver has read under the readers frees it only once they are out
+    auto running = std::atomic<bool>(true);
+    auto dropper = std::thread([&]() {
+        while(running) {
+            fatfs->invalidate_directory_index();
+            std::this_thread::yield();
+        }
+    });
+    for(auto& worker : workers) {
+        worker.join();
+    }
+    running = false;
+    dropper.join();
+    for(auto i = 0; i < threads; i += 1) {
+        assert(ok[i] && results[i] == expected);
+    }
+    printf("concurrent read: %d threads, %lu entries\n", threads, expected.size());
+    return true;
+}
+
+// reads of the fat fail
+class FailingFatDevice : public block::BlockDevice {
+  private:
+    block::BlockDevice& parent;
+    size_t              fat_begin;
+    size_t              fat_end;
+
+  public:
+    auto get_info() -> block::DeviceInfo override {
+        return parent.get_info();
+    }
+
+    auto read_sector(const size_t sector, const size_t count, void* const buffer) -> Error override {
+        if(sector < fat_end && sector + count > fat_begin) {
+            return Error::Code::IOError;
+        }
+        return parent.read_sector(sector, count, buffer);
+    }
+
+    auto write_sector(const size_t sector, const size_t count, const void* const buffer) -> Error override {
+        return Error::Code::NotImplemented;
+    }
+
+    FailingFatDevice(block::BlockDevice& parent, const fs::fat::BPB::Summary& bpb) : parent(parent),
+                                                                                      fat_begin(bpb.reserved_sector_count),
+                                                                                      fat_end(bpb.reserved_sector_count + size_t(bpb.fat_size_32) * bpb.num_fats) {}
+};
+
+// a failed fat read is reported instead of ending the chain
+inline auto test_fat_read_errors(block::BlockDevice& block) -> bool {
+    auto entries = std::vector<std::pair<std::string, size_t>>();
+    auto bpb     = fs::fat::BPB::Summary();
+    {
+        value_or(fatfs, fs::fat::new_driver(block));
+        bpb = fatfs->get_bpb();
+        for(auto i = 0;; i += 1) {
+            const auto r = fatfs->get_root().readdir(i);
+            if(!r) {
+                break;
+            }
+            if(r.as_value().type == fs::FileType::Regular) {
+                entries.emplace_back(std::string(r.as_value().name), r.as_value().size);
+            }
+        }
+    }
+
+    auto failing = FailingFatDevice(block, bpb);
+    assert(fs::fat::read_fat_for_cluster(2, bpb, failing).as_error() == Error::Code::IOError);
+
+    const auto bytes_per_cluster = size_t(bpb.bytes_per_sector) * bpb.sectors_per_cluster;
+    value_or(fatfs, fs::fat::new_driver(failing));
+    for(const auto& [name, size] : entries) {
+        if(size <= bytes_per_cluster) {
+            continue;
+        }
+        value_or(file, fatfs->get_root().find(name));
+        auto buffer = std::vector<uint8_t>(size);
+        assert(file.read(0, size, buffer.data()) == Error::Code::IOError);
+    }
+    return true;
+}
+
+// compares vectorized directory entry kernels with scalar ones
+// reads every file at once and in unaligned pieces
+inline auto test_exfat_tree(fs::Controller& controller, const std::string& path) -> bool {
+    value_or(dir, controller.open(path.empty() ? "/" : path, fs::OpenMode::Read));
+    assert(test_readdir_batch(dir));
+    assert(test_fat_find_entries(dir));
+    for(auto i = 0;; i += 1) {
+        const auto r = dir.readdir(i);
+        if(!r) {
+            break;
+        }
+        const auto& o     = r.as_value();
+        const auto  child = path + "/" + std::string(o.name);
+        if(o.type == fs::FileType::Directory) {
+            assert(test_exfat_tree(controller, child));
+            continue;
+        }
+
+        value_or(file, controller.open(child, fs::OpenMode::Read));
+        auto whole = std::vector<uint8_t>(o.size);
+        assert(!file.read(0, o.size, whole.data()));
+        auto piece = std::vector<uint8_t>(1000);
+        for(auto offset = size_t(0); offset < o.size; offset += 777) {
+            const auto len = std::min(piece.size(), o.size - offset);
+            assert(!file.read(offset, len, piece.data()));
+            assert(std::memcmp(piece.data(), whole.data() + offset, len) == 0);
+        }
+        assert(file.read(o.size, 1, piece.data()) == Error::Code::EndOfFile);
+        assert(!controller.close(file));
+    }
+    assert(!controller.close(dir));
+    return true;
+}
+
+inline auto test_exfat(block::BlockDevice& block) -> bool {
+    auto counter    = CountingDevice(block);
+    auto controller = fs::Controller();
+    value_or(exfatfs, fs::exfat::new_driver(counter));
+    controller.mount("/", *exfatfs.get());
+    assert(test_exfat_tree(controller, ""));
+
+    value_or(stat, exfatfs->statfs());
+    assert(stat.free_clusters < stat.total_clusters);
+
+    // contiguous files are read without touching the fat
+    const auto& boot     = exfatfs->get_boot_sector();
+    auto        iterator = fs::exfat::DirectoryIterator(fs::exfat::Extent{boot.root_cluster, 0}, boot, exfatfs->get_upcase_table(), block);
+    counter.watch_begin  = boot.fat_offset;
+    counter.watch_end    = boot.cluster_heap_offset;
+    while(true) {
+        const auto r = iterator.read();
+        if(!r) {
+            break;
+        }
+        const auto& dinfo = r.as_value();
+        if(dinfo.extent.contiguous == 0 || (dinfo.attributes & fs::exfat::Attribute::Directory)) {
+            continue;
+        }
+        value_or(file, controller.open("/" + std::string(dinfo.name), fs::OpenMode::Read));
+        auto data = std::vector<uint8_t>(file.get_size());
+        counter.watched_reads.store(0);
+        assert(!file.read(0, data.size(), data.data()));
+        assert(counter.watched_reads.load() == 0);
+        assert(!controller.close(file));
+    }
+    return true;
+}
+
+inline auto test_fat_entry_scan() -> bool {
+    auto entries = std::array<fs::fat::DirectoryEntry, 64>();
+    auto seed    = uint32_t(1);
+    for(auto& e : entries) {
+        seed = seed * 1103515245 + 12345;
+        std::memcpy(e.name, "FILE    TXT", 11);
+        e.name[0] = std::array<uint8_t, 4>{0x00, 0xE5, 'F', 'A'}[(seed >> 8) % 4];
+        e.attr    = static_cast<fs::fat::Attribute>(std::array<uint8_t, 5>{0x0F, 0x10, 0x20, 0x08, 0x21}[(seed >> 16) % 5]);
+    }
+    const auto key = fs::fat::to_short_name("file.txt");
+    assert(key);
+    for(const auto count : {size_t(64), size_t(16), size_t(13)}) {
+        auto       expected = fs::fat::EntryMasks{0, 0, 0, 0};
+        const auto masks    = fs::fat::classify_entries(entries.data(), count);
+        fs::fat::impl::classify_entries_scalar(entries.data(), 0, count, expected);
+        assert(masks.free == expected.free && masks.deleted == expected.deleted && masks.lfn == expected.lfn && masks.short_name == expected.short_name);
+        assert(fs::fat::match_short_name(entries.data(), count, *key) == fs::fat::impl::match_short_name_scalar(entries.data(), 0, count, *key));
+    }
+    assert(!fs::fat::to_short_name("long name.txt"));
+    assert(!fs::fat::to_short_name("a.text"));
+    return true;
+}
+
+// shift paths must agree with divisions
+inline auto test_geometry() -> bool {
+    const auto geometry = fs::fat::make_geometry(512, 8, 32, 16384, size_t(1) << 24);
+    assert(geometry.power_of_two);
+    for(auto bytes = size_t(0); bytes < (size_t(1) << 20); bytes += 4091) {
+        assert(geometry.sector_index<true>(bytes) == geometry.sector_index<false>(bytes));
+        assert(geometry.sector_offset<true>(bytes) == geometry.sector_offset<false>(bytes));
+        assert(geometry.cluster_index<true>(bytes) == geometry.cluster_index<false>(bytes));
+        assert(geometry.cluster_offset<true>(bytes) == geometry.cluster_offset<false>(bytes));
+        assert(geometry.cluster_to_sector<true>(bytes + 2) == geometry.cluster_to_sector<false>(bytes + 2));
+    }
+    assert(!fs::fat::make_geometry(512, 3, 32, 16384, size_t(1) << 24).power_of_two);
+    return true;
+}
+
+inline auto test_encoding() -> bool {
+    const auto roundtrip = [](const std::u16string_view u16, const std::string_view u8) -> bool {
+        auto       narrow = std::array<char, 256>();
+        auto       wide   = std::array<char16_t, 256>();
+        const auto n      = u16tou8(u16, narrow);
+        const auto w      = u8tou16(u8, wide);
+        return n && std::string_view(narrow.data(), *n) == u8 && w && std::u16string_view(wide.data(), *w) == u16;
+    };
+    // long enough to take the vectorized path, with a non-ascii tail
+    assert(roundtrip(u"the quick brown fox jumps over the lazy dog.txt", "the quick brown fox jumps over the lazy dog.txt"));
+    assert(roundtrip(u"0123456789abcdef0123456789abcdef\u00e9", "0123456789abcdef0123456789abcdef\u00e9"));
+    assert(roundtrip(u"\u00dcn\u00efc\u00f8d\u00e9-\u540d\u524d.txt", "\u00dcn\u00efc\u00f8d\u00e9-\u540d\u524d.txt"));
+    assert(roundtrip(u"\U0001F600 smile", "\U0001F600 smile"));
+
+    // unpaired surrogates and malformed sequences become U+FFFD
+    const auto unpaired = std::array<char16_t, 3>{u'a', 0xD800, u'b'};
+    assert(u16tou8(std::u16string_view(unpaired.data(), unpaired.size())) == "a\uFFFDb");
+    auto       wide = std::array<char16_t, 8>();
+    const auto w    = u8tou16("\xC0\xAFx\xE2\x82", wide);
+    assert(w && std::u16string_view(wide.data(), *w) == u"\uFFFD\uFFFDx\uFFFD\uFFFD");
+
+    auto small = std::array<char, 2>();
+    assert(!u16tou8(u"\u540d", small));
+    return true;
+}
+
 inline auto test_duplicated_mount() -> bool {
     constexpr auto d = Type::Directory;
 
@@ -230,18 +1959,53 @@ inline auto test_duplicated_mount() -> bool {
     return true;
 }
 
-inline auto test(block::BlockDevice* const fat_volume) -> bool {
+inline auto test(block::BlockDevice* const fat_volume, block::BlockDevice* const exfat_volume = nullptr) -> bool {
     assert(test_nested_mount());
     assert(test_nested_open_close());
     assert(test_open_error());
     assert(test_exist_error());
+    assert(test_dentry_cache());
+    assert(test_path_walk());
+    assert(test_open_tree());
+    assert(test_controller_threads());
+    assert(test_busy_unmount());
     assert(test_tmpfs_rw());
+    assert(test_tmpfs_extents());
+    assert(test_tmpfs_sparse());
+    assert(test_tmpfs_inline());
+    assert(test_tmpfs_clone());
+    assert(test_lz());
+    assert(test_tmpfs_compression());
+    assert(test_tmpfs_compression_threads());
+    assert(test_tmpfs_snapshot());
+    assert(test_tmpfs_dedup());
+    assert(test_bitmap_memory_manager());
+    assert(test_frame_magazines());
     assert(test_duplicated_mount());
+    assert(test_tmpfs_readdir_batch());
+    assert(test_tmpfs_directory_cursor());
+    assert(test_fat_entry_scan());
+    assert(test_encoding());
+    assert(test_geometry());
 
     if(fat_volume == nullptr) {
         puts("fat volume not found, skipping test");
     } else {
         assert(test_fat_rw(*fat_volume));
+        assert(test_fat_statfs(*fat_volume));
+        assert(test_fat_find(*fat_volume));
+        assert(test_fat_check(*fat_volume));
+        assert(test_fat_prefetch(*fat_volume));
+        assert(test_fat_defrag(*fat_volume));
+        assert(test_fat_readdir_batch(*fat_volume));
+        assert(test_fat_concurrent_read(*fat_volume));
+        assert(test_fat_read_errors(*fat_volume));
+    }
+
+    if(exfat_volume == nullptr) {
+        puts("exfat volume not found, skipping test");
+    } else {
+        assert(test_exfat(*exfat_volume));
     }
 
     puts("all tests passed\n");
@@ -0,0 +1,88 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// runs tasks which may spawn more tasks
+// every worker owns a queue and steals from the others when it runs dry
+template <class Task>
+class WorkStealingPool {
+  private:
+    struct Queue {
+        std::mutex       mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<Queue>  queues;
+    std::atomic<size_t> pending = 0; // pushed but not finished
+
+    auto pop(const size_t worker) -> std::optional<Task> {
+        {
+            auto& queue = queues[worker];
+            auto  lock  = std::lock_guard(queue.mutex);
+            if(!queue.tasks.empty()) {
+                auto task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+                return task;
+            }
+        }
+        for(auto i = size_t(1); i < queues.size(); i += 1) {
+            auto& victim = queues[(worker + i) % queues.size()];
+            auto  lock   = std::lock_guard(victim.mutex);
+            if(!victim.tasks.empty()) {
+                auto task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return task;
+            }
+        }
+        return std::nullopt;
+    }
+
+  public:
+    auto get_workers() const -> size_t {
+        return queues.size();
+    }
+
+    auto push(const size_t worker, Task task) -> void {
+        pending.fetch_add(1);
+        auto& queue = queues[worker];
+        auto  lock  = std::lock_guard(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+
+    // fn(worker, task) is called until all tasks including spawned ones are done
+    // the calling thread works as worker 0
+    template <class F>
+    auto run(F&& fn) -> void {
+        const auto work = [this, &fn](const size_t worker) -> void {
+            while(true) {
+                auto task = pop(worker);
+                if(!task) {
+                    if(pending.load() == 0) {
+                        return;
+                    }
+                    std::this_thread::yield();
+                    continue;
+                }
+                fn(worker, std::move(*task));
+                pending.fetch_sub(1);
+            }
+        };
+
+        auto threads = std::vector<std::thread>();
+        for(auto i = size_t(1); i < queues.size(); i += 1) {
+            threads.emplace_back(work, i);
+        }
+        work(0);
+        for(auto& t : threads) {
+            t.join();
+        }
+    }
+
+    // workers == 0 means one per hardware thread
+    WorkStealingPool(const size_t workers = 0) : queues(workers != 0 ? workers : std::max(std::thread::hardware_concurrency(), 1u)) {}
+};